@@ -9,10 +9,12 @@ include_directories(${Qt5Gui_PRIVATE_INCLUDE_DIRS})
 add_definitions(${Qt5Gui_DEFINITIONS})
 set(QT_LIBRARIES ${QT_LIBRARIES} ${Qt5Gui_LIBRARIES})
 
-find_package(Qt5Widgets REQUIRED)
-include_directories(${Qt5Widgets_INCLUDE_DIRS})
-add_definitions(${Qt5Widgets_DEFINITIONS})
-set(QT_LIBRARIES ${QT_LIBRARIES} ${Qt5Widgets_LIBRARIES})
+if (RASPERI_BUILD_GUI)
+    find_package(Qt5Widgets REQUIRED)
+    include_directories(${Qt5Widgets_INCLUDE_DIRS})
+    add_definitions(${Qt5Widgets_DEFINITIONS})
+    set(QT_LIBRARIES ${QT_LIBRARIES} ${Qt5Widgets_LIBRARIES})
+endif(RASPERI_BUILD_GUI)
 
 set(CMAKE_INCLUDE_CURRENT_DIR ON)
 set(CMAKE_AUTOMOC ON)
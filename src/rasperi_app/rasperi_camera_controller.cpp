@@ -143,7 +143,7 @@ void CameraController::setMouseMove(QMouseEvent* e)
         rotation = glm::angleAxis(yaw,   yawAxis)   * rotation;
         rotation = glm::angleAxis(pitch, pitchAxis) * rotation;
         impl->controller->camera()->rotation = rotation;
-        impl->controller->rasterize(true);
+        impl->controller->rasterize(true, true);
     }
 }
 
@@ -164,7 +164,7 @@ void CameraController::setWheel(QWheelEvent* e)
 {
     double amount = e->delta() > 0 ? -impl->zoomAmount : impl->zoomAmount;
     impl->controller->camera()->viewDistance += amount;
-    impl->controller->rasterize(true);
+    impl->controller->rasterize(true, true);
 }
 
 /* -----------------------------------------------------------------*
@@ -193,7 +193,7 @@ void CameraController::setKeyPress(QKeyEvent* e)
     moveDir = glm::dvec3(glm::inverse(camera->viewMatrix()) * glm::dvec4(moveDir, 0.0));
 
     camera->position += moveDir * 0.5;
-    impl->controller->rasterize(true);
+    impl->controller->rasterize(true, true);
 }
 
 /* -----------------------------------------------------------------*
@@ -4,19 +4,30 @@
  * ---------------------------------------------------------------- */
 
 #include "rasperi_controller.h"
+#include <atomic>
+#include <condition_variable>
 #include <future>
+#include <mutex>
+#include <thread>
 #include <QtWidgets/QApplication>
+#include <QtWidgets/QMessageBox>
 #include <QtWidgets/QProgressDialog>
 #include <QtCore/QDebug>
+#include <QtCore/QFileInfo>
 #include <QtCore/QTime>
+#include <QtCore/QTimer>
 #include "rasperi_lib/rasperi_camera.h"
 #include "rasperi_lib/rasperi_equirectangular_to_cubemap.h"
+#include "rasperi_lib/rasperi_image_sequence_writer.h"
 #include "rasperi_lib/rasperi_model_importer.h"
 #include "rasperi_lib/rasperi_model.h"
+#include "rasperi_lib/rasperi_pbr_ibl_baker.h"
 #include "rasperi_lib/rasperi_pbr_ibl_irradiance.h"
 #include "rasperi_lib/rasperi_pbr_ibl_prefilter.h"
 #include "rasperi_lib/rasperi_pbr_ibl_brdf_integration.h"
 #include "rasperi_lib/rasperi_rasterizer.h"
+#include "rasperi_lib/rasperi_resolution_scaler.h"
+#include "rasperi_lib/rasperi_texture_manager.h"
 #include "rasperi_opengl_reference_rasterizer/rasperi_opengl_reference_rasterizer.h"
 #include "rasperi_camera_controller.h"
 #include "rasperi_image_widget.h"
@@ -210,6 +221,32 @@ struct Controller::Impl
         glm::dvec3 max;
     };
 
+    /* ------------------------------------------------------------ *
+       The state of a frame. It is captured on the GUI thread so
+       that the render thread does not read the camera or the models
+       while the user is changing them.
+     * ------------------------------------------------------------ */
+    struct FrameRequest
+    {
+        struct Draw
+        {
+            std::shared_ptr<Mesh> mesh;
+            glm::dmat4 modelMatrix;
+            std::shared_ptr<const Material> material;
+        };
+
+        int width  = 0;
+        int height = 0;
+        bool filled = true;
+        bool interactive = false;
+        double frameTimeTarget = 0.0; // ms, of the interactive frames
+        glm::dmat4 viewMatrix;
+        glm::dmat4 projectionMatrix;
+        std::vector<Draw> draws;
+        // Latest IBL maps, kept alive until the frame is done.
+        std::shared_ptr<const PbrIblBaker::Maps> pbrIbl;
+    };
+
     /* ------------------------------------------------------------ *
      * ------------------------------------------------------------ */
     Impl(Controller* self)
@@ -217,13 +254,48 @@ struct Controller::Impl
         , mainWindow(self)
         , camera(std::make_shared<Camera>())
         , cameraController(std::make_shared<CameraController>(self))
-        , rasterizer(720, 576)
         //, pbrIblIrradiance(512)
         //, pbrIblPrefilter(512)
         //, pbrIblBrdfIntegration(512)
     {
         //skyTexture = readHdr("/temp/syferfontein_1d_clear_1k.hdr");
         //skyCube = EquirectangularToCubemap(512).run(skyTexture);
+
+        refineTimer.setSingleShot(true);
+        refineTimer.setInterval(200);
+        QObject::connect(&refineTimer, &QTimer::timeout, &mainWindow, [this]()
+        {
+            rasterize(refineFilled, false);
+        });
+
+        // Images are saved in the background, a failure is reported
+        // on the GUI thread.
+        imageWriter.setCallback([this](const QString& filepath, bool ok)
+        {
+            if (ok)
+                return;
+            QMetaObject::invokeMethod(&mainWindow, [this, filepath]()
+            {
+                QMessageBox::critical(&mainWindow, "Image Save Failed",
+                                      "Failed to save image to " + filepath);
+            }, Qt::QueuedConnection);
+        });
+
+        renderThread = std::thread(&Impl::renderLoop, this);
+    }
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    ~Impl()
+    {
+        cancelEnvironmentMap();
+        {
+            std::lock_guard<std::mutex> lock(requestMutex);
+            quit   = true;
+            cancel = true;
+        }
+        requestCondition.notify_one();
+        renderThread.join();
     }
 
 #if 0
@@ -289,36 +361,61 @@ struct Controller::Impl
 #endif
 
    /* ------------------------------------------------------------- *
+      Requests a frame of the current camera and models. Returns
+      immediately, the frame is rendered on the render thread and
+      presented once done. A newer request replaces the pending one
+      and cancels the frame in flight at the next tile.
+
+      Interactive frames are previews, each one restarts the refine
+      timer that requests the full quality frame of the same view.
     * ------------------------------------------------------------- */
-    void rasterize(bool filled)
+    void rasterize(bool filled, bool interactive)
     {
-        QTime timer;
-        timer.start();
-
-        //skyCube.toQImage().save("/temp/skycube.bmp");
+        if (interactive)
+        {
+            refineFilled = filled;
+            refineTimer.start();
+        }
+        else
+        {
+            refineTimer.stop();
+        }
 
-        rasterizer.clear();
-        rasterizer.setNormalMode(Rasterizer::NormalMode::Smooth);
-        rasterizer.setViewMatrix(camera->viewMatrix());
-        rasterizer.setProjectionMatrix(camera->projectionMatrix());
-        //rasterizer.drawSky(skyCube);
-        for (Model& model : models)
+        FrameRequest request;
+        request.width            = width;
+        request.height           = height;
+        request.filled           = filled;
+        request.interactive      = interactive;
+        request.frameTimeTarget  = frameTimeTarget;
+        request.viewMatrix       = camera->viewMatrix();
+        request.projectionMatrix = camera->projectionMatrix();
+        request.pbrIbl           = pbrIblBaker.maps();
+
+        // The rasterizer state carries over from the previous model
+        // when the model does not have a transform or a material.
+        glm::dmat4 modelMatrix(1.0);
+        std::shared_ptr<const Material> material;
+        for (const Model& model : models)
         {
             if (model.transform)
-                rasterizer.setModelMatrix(model.transform->matrix());
+                modelMatrix = model.transform->matrix();
             if (model.material)
-                rasterizer.setMaterial(*model.material);
-            if (filled)
-                rasterizer.drawFilledTriangleMesh(model.mesh.get());
-            else
-                rasterizer.drawEdgeLineTriangleMesh(model.mesh.get());
+            {
+                auto m = std::make_shared<Material>(*model.material);
+                if (m->model == Material::Model::Pbr)
+                    setPbrIbl(*m, request.pbrIbl);
+                material = m;
+            }
+            request.draws.push_back({ model.mesh, modelMatrix, material });
         }
 
-        Framebuffer& framebuffer = rasterizer.framebuffer();
-        image = framebuffer.colorTex.toQImage();
-        mainWindow.imageWidget().setImage(image);
-
-        qDebug() << __FUNCTION__ << timer.elapsed() << "ms";
+        {
+            std::lock_guard<std::mutex> lock(requestMutex);
+            pendingRequest = std::move(request);
+            hasRequest     = true;
+            cancel         = true;
+        }
+        requestCondition.notify_one();
 
         if (mainWindow.isReferenceEnabled())
         {
@@ -335,6 +432,117 @@ struct Controller::Impl
         }
     }
 
+    /* ------------------------------------------------------------- *
+       Render thread. Takes the latest request, renders it and posts
+       the image to the GUI thread. The cancel flag is reset under
+       the same lock that the requests are made so that it always
+       refers to the frame in flight.
+     * ------------------------------------------------------------- */
+    void renderLoop()
+    {
+        // Triple buffered, one frame can be displayed and another
+        // one queued for the display while the next one is rendered.
+        // The previews reuse the memory of the full size frames.
+        Rasterizer rasterizer(1, 1);
+        rasterizer.setSwapChainLength(3);
+        rasterizer.setCancelFlag(&cancel);
+        // Half of the depth bandwidth of the doubles, reverse-Z keeps
+        // the precision over the view depth.
+        rasterizer.setDepthFormat(Rasterizer::DepthFormat::Float32, true);
+
+        // Interactive frames are scaled to meet the frame time target.
+        ResolutionScaler resolutionScaler;
+        for (;;)
+        {
+            FrameRequest request;
+            {
+                std::unique_lock<std::mutex> lock(requestMutex);
+                requestCondition.wait(lock, [this]()
+                {
+                    return quit || hasRequest;
+                });
+                if (quit)
+                    return;
+
+                request    = std::move(pendingRequest);
+                hasRequest = false;
+                cancel     = false;
+            }
+
+            QTime timer;
+            timer.start();
+
+            double scale = 1.0;
+            if (request.interactive)
+            {
+                resolutionScaler.setTarget(request.frameTimeTarget);
+                scale = resolutionScaler.scale();
+            }
+            const int w = std::max(1, int(request.width  * scale + 0.5));
+            const int h = std::max(1, int(request.height * scale + 0.5));
+
+            rasterizer.resize(w, h);
+            rasterizer.clear();
+            rasterizer.setNormalMode(Rasterizer::NormalMode::Smooth);
+            rasterizer.setShadingQuality(request.interactive
+                                         ? Rasterizer::ShadingQuality::Preview
+                                         : Rasterizer::ShadingQuality::Full);
+            rasterizer.setViewMatrix(request.viewMatrix);
+            rasterizer.setProjectionMatrix(request.projectionMatrix);
+
+            for (const FrameRequest::Draw& draw : request.draws)
+            {
+                if (rasterizer.isCancelled())
+                    break;
+
+                rasterizer.setModelMatrix(draw.modelMatrix);
+                if (draw.material)
+                    rasterizer.setMaterial(*draw.material);
+                if (request.filled)
+                    rasterizer.drawFilledTriangleMesh(draw.mesh.get());
+                else
+                    rasterizer.drawEdgeLineTriangleMesh(draw.mesh.get());
+            }
+            //rasterizer.drawSky(skyCube);
+
+            // A cancelled frame that already took long still tells that
+            // the scale is too high.
+            const bool cancelled = rasterizer.isCancelled();
+            if (request.interactive)
+                resolutionScaler.addFrame(timer.elapsed(), scale, !cancelled);
+            if (cancelled)
+                continue;
+
+            // The image shares the pixels with the framebuffer. Previews
+            // are stretched to the full size when painted.
+            const QImage frame = rasterizer.present();
+            const QSize size(request.width, request.height);
+            const bool finalQuality = !request.interactive;
+            QMetaObject::invokeMethod(&mainWindow, [this, frame, size, finalQuality]()
+            {
+                if (finalQuality)
+                    image = frame;
+                mainWindow.imageWidget().setImage(frame, size);
+            }, Qt::QueuedConnection);
+
+            if (finalQuality)
+                qDebug() << __FUNCTION__ << timer.elapsed() << "ms";
+            else
+                qDebug() << __FUNCTION__ << timer.elapsed() << "ms, preview"
+                         << w << "x" << h;
+        }
+    }
+
+    /* ------------------------------------------------------------- *
+     * ------------------------------------------------------------- */
+    static void setPbrIbl(Material& material,
+                          const std::shared_ptr<const PbrIblBaker::Maps>& pbrIbl)
+    {
+        material.pbr.irradiance      = pbrIbl ? &pbrIbl->irradiance      : nullptr;
+        material.pbr.prefilter       = pbrIbl ? &pbrIbl->prefilter       : nullptr;
+        material.pbr.brdfIntegration = pbrIbl ? &pbrIbl->brdfIntegration : nullptr;
+    }
+
     /* ------------------------------------------------------------- *
      * ------------------------------------------------------------- */
     double fittingDistance(
@@ -361,8 +569,23 @@ struct Controller::Impl
 
     /* ------------------------------------------------------------- *
      * ------------------------------------------------------------- */
-    void createPbrIbl()
+    void createPbrIbl(bool restart = false)
     {
+        // Bake in the background, the preview maps are published
+        // first and the image is updated after each published set.
+        if (skyCube.isNull())
+            return;
+        if (!restart && (pbrIblBaker.isRunning() || pbrIblBaker.maps()))
+            return;
+
+        pbrIblBaker.start(skyCube, [this]()
+        {
+            QMetaObject::invokeMethod(&mainWindow, [this]()
+            {
+                rasterize(true, false);
+            }, Qt::QueuedConnection);
+        });
+
 //        QDir dir = QDir::current();
 
 //        if (!pbrIblIrradiance.read(dir))
@@ -384,18 +607,104 @@ struct Controller::Impl
 //        }
     }
 
+    /* ------------------------------------------------------------- *
+       Loads the environment map in a background thread. The map is
+       read in bands straight into the cubemap so that only one band
+       of the equirectangular map is in the memory. The cubemap is
+       set and the bake restarted on the GUI thread, unless a newer
+       load has been started meanwhile.
+     * ------------------------------------------------------------- */
+    void loadEnvironmentMap(const QString& filepath)
+    {
+        cancelEnvironmentMap();
+
+        const int load = ++environmentLoad;
+        environmentThread = std::thread([this, filepath, load]()
+        {
+            // 64 rows of an 8K map are 16 MB.
+            const int bandHeight = 64;
+
+            EquirectangularToCubemap converter(512);
+            bool converted = true;
+            const bool read = readHdr(filepath, bandHeight,
+                [&](const Texture2D<double, 4>& band, int row, int height)
+            {
+                // The file is read to the end, only the conversion
+                // is skipped.
+                if (!converted || environmentCancelled)
+                    return;
+                if (row == 0)
+                    converter.begin(band.width(), height);
+                converted = converter.addBand(band);
+            });
+            if (environmentCancelled)
+                return;
+
+            TextureCube<double, 4> cube;
+            if (read && converted)
+                cube = converter.end();
+
+            QMetaObject::invokeMethod(&mainWindow, [this, filepath, load, cube]()
+            {
+                if (load != environmentLoad)
+                    return;
+                if (cube.isNull())
+                {
+                    QMessageBox::critical(&mainWindow, "Environment Map Load Failed",
+                                          "Failed to load environment map from " + filepath);
+                    return;
+                }
+                skyCube = cube;
+                createPbrIbl(true);
+            }, Qt::QueuedConnection);
+        });
+    }
+
+    /* ------------------------------------------------------------- *
+     * ------------------------------------------------------------- */
+    void cancelEnvironmentMap()
+    {
+        environmentCancelled = true;
+        if (environmentThread.joinable())
+            environmentThread.join();
+        environmentCancelled = false;
+    }
+
     Controller* self = nullptr;
     QImage image;
     MainWindow mainWindow;
+    ImageSequenceWriter imageWriter { 1 };
     std::shared_ptr<Camera> camera;
     std::shared_ptr<CameraController> cameraController;
-    Rasterizer rasterizer;
+    int width  = 720;
+    int height = 576;
+    double frameTimeTarget = 33.0;
+    QTimer refineTimer;
+    bool refineFilled = true;
     std::vector<Model> models;
     //PbrIblIrradiance pbrIblIrradiance;
     //PbrIblPrefilter pbrIblPrefilter;
     //PbrIblBrdfIntegration pbrIblBrdfIntegration;
     //Texture2D<double, 4> skyTexture;
-    //TextureCube<double, 4> skyCube;
+    TextureCube<double, 4> skyCube;
+    PbrIblBaker pbrIblBaker;
+    TextureManager textures;
+
+    // Environment map load, the count identifies the latest load on
+    // the GUI thread.
+    std::thread environmentThread;
+    std::atomic<bool> environmentCancelled { false };
+    int environmentLoad = 0;
+
+    // Render thread, the pending request is replaced by the newer
+    // ones so only the latest camera state is rendered.
+    std::mutex requestMutex;
+    std::condition_variable requestCondition;
+    FrameRequest pendingRequest;
+    bool hasRequest = false;
+    bool quit = false;
+    std::atomic<bool> cancel { false };
+    std::thread renderThread;
 };
 
 /* ---------------------------------------------------------------- *
@@ -424,14 +733,20 @@ MainWindow& Controller::mainWindow() const
 void Controller::setImageSize(int w, int h)
 {
     impl->camera->aspectRatio = w / double(h);
-    impl->rasterizer = Rasterizer(w, h);
-    impl->rasterize(true);
+    impl->width  = w;
+    impl->height = h;
+    impl->rasterize(true, false);
 }
 
 /* ---------------------------------------------------------------- *
  * ---------------------------------------------------------------- */
-void Controller::rasterize(bool filled)
-{ impl->rasterize(filled); }
+void Controller::rasterize(bool filled, bool interactive)
+{ impl->rasterize(filled, interactive); }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+void Controller::setFrameTimeTarget(double milliseconds)
+{ impl->frameTimeTarget = milliseconds; }
 
 /* ---------------------------------------------------------------- *
  * ---------------------------------------------------------------- */
@@ -532,80 +847,69 @@ void Controller::viewPbrSphereScene()
     dlg.show();
     QApplication::processEvents(QEventLoop::ExcludeUserInputEvents);
 
-    std::future<std::map<QString, QImage>> loadFuture =
-        std::async(std::launch::async,
-                   [&](const std::array<PbrSphere, 6>& spheres)
+    // Queue all the textures first so that they are decoded in
+    // parallel.
+    using Format = TextureManager::Format;
+    struct PbrSphereMaps
     {
-        std::map<QString, QImage> out;
-        for (const PbrSphere& sphere : spheres)
-        {
-            QImage albedo(sphere.dir.absoluteFilePath(sphere.albedo));
-            out[sphere.albedo] = albedo;
-
-            QImage roughness(sphere.dir.absoluteFilePath(sphere.roughness));
-            if (roughness.format() != QImage::Format_Grayscale8)
-                roughness = roughness.convertToFormat(QImage::Format_Grayscale8);
-            out[sphere.roughness] = roughness;
-
-            QImage metalness(sphere.dir.absoluteFilePath(sphere.metal));
-            if (metalness.format() != QImage::Format_Grayscale8)
-                metalness = metalness.convertToFormat(QImage::Format_Grayscale8);
-            out[sphere.metal] = metalness;
-
-            QImage ao(sphere.dir.absoluteFilePath(sphere.ao));
-            if (ao.format() != QImage::Format_Grayscale8)
-                ao = metalness.convertToFormat(QImage::Format_Grayscale8);
-            out[sphere.ao] = ao;
-
-            QImage normal(sphere.dir.absoluteFilePath(sphere.normal));
-            if (normal.format() != QImage::Format_RGB32)
-                normal = normal.convertToFormat(QImage::Format_RGB32);
-            out[sphere.normal] = normal;
-        }
-        return out;
-    },  spheres);
-
-    auto status = loadFuture.wait_for(std::chrono::milliseconds(0));
-    while (status != std::future_status::ready)
+        TextureManager::Handle albedo;
+        TextureManager::Handle roughness;
+        TextureManager::Handle metal;
+        TextureManager::Handle ao;
+        TextureManager::Handle normal;
+    };
+    auto load = [&](const QDir& dir, const QString& filename, Format format)
     {
-        QApplication::processEvents(QEventLoop::ExcludeUserInputEvents);
-        status = loadFuture.wait_for(std::chrono::milliseconds(10));
-    }
+        if (filename.isEmpty())
+            return TextureManager::Handle();
+        return impl->textures.load(dir.absoluteFilePath(filename), format);
+    };
 
-    std::map<QString, QImage> images;
-    try
-    {
-        images = loadFuture.get();
-    }
-    catch(const std::exception& ex)
+    std::array<PbrSphereMaps, 6> maps;
+    for (size_t i = 0; i < spheres.size(); ++i)
     {
-        std::cerr << __FUNCTION__
-                  << ": failed to load models "
-                  << ex.what()
-                  << std::endl;
+        const PbrSphere& sphere = spheres[i];
+        maps[i].albedo    = load(sphere.dir, sphere.albedo,    Format::Rgba);
+        maps[i].roughness = load(sphere.dir, sphere.roughness, Format::Grayscale);
+        maps[i].metal     = load(sphere.dir, sphere.metal,     Format::Grayscale);
+        maps[i].ao        = load(sphere.dir, sphere.ao,        Format::Grayscale);
+        maps[i].normal    = load(sphere.dir, sphere.normal,    Format::Rgba);
     }
 
-    dlg.hide();
-    dlg.reset();
+    auto image = [](const TextureManager::Handle& handle)
+    {
+        if (!handle.valid())
+            return QImage();
+        while (handle.wait_for(std::chrono::milliseconds(10)) !=
+               std::future_status::ready)
+        {
+            QApplication::processEvents(QEventLoop::ExcludeUserInputEvents);
+        }
+        return handle.get();
+    };
 
     std::vector<Model> models;
-    for (const PbrSphere& sphere : spheres)
+    for (size_t i = 0; i < spheres.size(); ++i)
     {
+        const PbrSphere& sphere = spheres[i];
         Model m;
         m.mesh = std::make_shared<Sphere>(0.5, 32, 32);
         m.material = std::make_shared<Material>();
         m.material->model = Material::Model::Pbr;
-        m.material->pbr.albedoSampler.setMap(images[sphere.albedo]);
+        m.material->pbr.albedoSampler.setMap(image(maps[i].albedo));
         m.material->pbr.albedoSampler.setLinearizeGamma(true);
-        m.material->pbr.roughnessSampler.setMap(images[sphere.roughness]);
-        m.material->pbr.metalnessSampler.setMap(images[sphere.metal]);
-        m.material->pbr.aoSampler.setMap(images[sphere.ao]);
-        m.material->normalSampler.setMap(images[sphere.normal]);
+        m.material->pbr.roughnessSampler.setMap(image(maps[i].roughness));
+        m.material->pbr.metalnessSampler.setMap(image(maps[i].metal));
+        m.material->pbr.aoSampler.setMap(image(maps[i].ao));
+        m.material->normalSampler.setMap(image(maps[i].normal));
         m.transform = std::make_shared<Transform>();
         m.transform->position = sphere.position;
         models.push_back(m);
     }
 
+    dlg.hide();
+    dlg.reset();
+
     importModels(models, false);
 }
 
@@ -614,7 +918,7 @@ void Controller::viewPbrSphereScene()
 bool Controller::importModel(const QString& filepath)
 {
     std::vector<Model> models =
-        ModelImporter().import(filepath);
+        ModelImporter(impl->textures).import(filepath);
     if (models.empty())
         return false;
 
@@ -681,14 +985,35 @@ bool Controller::importModels(const std::vector<Model>& models,
     impl->camera->farPlane = distance * 2;
 
     impl->models = models;
-    impl->rasterize(true);
+    impl->rasterize(true, false);
+    return true;
+}
+
+/* ---------------------------------------------------------------- *
+   The map is loaded in the background, a map that fails to decode
+   is reported when the load is done. The previous maps light the
+   frames until the preview maps of the new environment have been
+   baked.
+ * ---------------------------------------------------------------- */
+bool Controller::loadEnvironmentMap(const QString& filepath)
+{
+    if (!QFileInfo(filepath).isReadable())
+        return false;
+
+    impl->loadEnvironmentMap(filepath);
     return true;
 }
 
 /* ---------------------------------------------------------------- *
  * ---------------------------------------------------------------- */
 bool Controller::saveImage(const QString& filepath)
-{ return impl->image.save(filepath); }
+{
+    if (impl->image.isNull())
+        return false;
+
+    impl->imageWriter.write(impl->image, filepath);
+    return true;
+}
 
 } // namespace rasperi
 } // namespace kuu
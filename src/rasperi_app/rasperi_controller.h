@@ -32,13 +32,23 @@ public:
     MainWindow& mainWindow() const;
 
     void setImageSize(int w, int h);
-    void rasterize(bool filled);
+    // Interactive frames are rendered at a reduced resolution with
+    // the preview shading. The full quality frame follows once the
+    // interactive frames have stopped for a moment.
+    void rasterize(bool filled, bool interactive = false);
+    // The resolution of the interactive frames is scaled so that
+    // they render within the target time.
+    void setFrameTimeTarget(double milliseconds);
     void showUi();
     void viewPbrSphereScene();
     bool importModel(const QString& filepath);
     bool importModels(const std::vector<Model>& models,
                       bool moveRelatedToOrigo = true);
     bool saveImage(const QString& filepath);
+    // Loads the equirectangular Radiance .hdr map that lights the
+    // PBR materials. The map is loaded and the IBL maps are baked in
+    // the background, returns false if the file cannot be read.
+    bool loadEnvironmentMap(const QString& filepath);
 
 private:
     struct Impl;
@@ -41,6 +41,7 @@ struct ImageWidget::Impl
 
     Controller* controller;
     QImage image;
+    QSize imageSize;
     QImage bgImage;
 };
 
@@ -57,10 +58,11 @@ ImageWidget::ImageWidget(Controller* controller, QWidget* parent)
 
 /* ---------------------------------------------------------------- *
  * ---------------------------------------------------------------- */
-void ImageWidget::setImage(const QImage& image)
+void ImageWidget::setImage(const QImage& image, const QSize& size)
 {
-    impl->image = image;
-    repaint();
+    impl->image     = image;
+    impl->imageSize = size.isValid() ? size : image.size();
+    update();
 }
 
 /* ---------------------------------------------------------------- *
@@ -87,10 +89,11 @@ void ImageWidget::paintEvent(QPaintEvent* e)
     p.setBrush(QColor::fromRgbF(0.2, 0.2, 0.2, 1.0));
     p.drawRect(rect());
     p.setCompositionMode(QPainter::CompositionMode_SourceOver);
-    p.drawImage(0, 0, impl->image);
+    const QRect imageRect(QPoint(0, 0), impl->imageSize);
+    p.drawImage(imageRect, impl->image);
     p.setPen(QPen(Qt::gray, 1, Qt::DashLine));
     p.setBrush(Qt::transparent);
-    p.drawRect(impl->image.rect());
+    p.drawRect(imageRect);
 }
 
 /* ---------------------------------------------------------------- *
@@ -24,7 +24,8 @@ public:
     explicit ImageWidget(
         Controller* controller,
         QWidget* parent = nullptr);
-    void setImage(const QImage& image);
+    // The image is stretched to the size if the size is valid.
+    void setImage(const QImage& image, const QSize& size = QSize());
 
     QImage bgImage() const;
 
@@ -160,6 +160,24 @@ void MainWindow::on_actionImportModelsPbr_triggered()
     showImportPbrModelsDialog();
 }
 
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+void MainWindow::on_actionOpenEnvironmentMap_triggered()
+{
+    const QString filepath =
+        QFileDialog::getOpenFileName(this, "Select Environment Map",
+                                     QDir::currentPath(),
+                                     "*.hdr");
+    if (filepath.isEmpty())
+        return;
+
+    if (!impl->controller->loadEnvironmentMap(filepath))
+    {
+        QMessageBox::critical(this, "Environment Map Load Failed",
+                              "Failed to load environment map from " + filepath);
+    }
+}
+
 /* ---------------------------------------------------------------- *
  * ---------------------------------------------------------------- */
 void MainWindow::on_actionSaveImage_triggered()
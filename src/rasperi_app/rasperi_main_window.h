@@ -44,6 +44,7 @@ public slots:
     void on_actionViewPBRSphere_triggered();
     void on_actionImportModelsPhong_triggered();
     void on_actionImportModelsPbr_triggered();
+    void on_actionOpenEnvironmentMap_triggered();
     void on_actionSaveImage_triggered();
 
     void on_actionOpenGLReference_toggled(bool show);
@@ -0,0 +1,374 @@
+/* ---------------------------------------------------------------- *
+   Antti Jumpponen <kuumies@gmail.com>
+   The main entry point of Rasperi command-line renderer.
+ * ---------------------------------------------------------------- */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstdio>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <QtCore/QString>
+#include <QtCore/QStringList>
+#include <QtGui/QImage>
+#include <glm/gtc/matrix_transform.hpp>
+#include "rasperi_lib/rasperi_batch_renderer.h"
+#include "rasperi_lib/rasperi_image_sequence_writer.h"
+#include "rasperi_lib/rasperi_model.h"
+#include "rasperi_lib/rasperi_model_importer.h"
+
+namespace
+{
+
+using namespace kuu::rasperi;
+
+/* ---------------------------------------------------------------- *
+   Output file pattern split around the frame number.
+ * ---------------------------------------------------------------- */
+struct OutputPattern
+{
+    std::string prefix;
+    std::string suffix;
+    bool hasNumber = false;
+    int width      = 0;
+    char fill      = ' ';
+};
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+struct Options
+{
+    std::string input;
+    std::string output = "frame_%04d.png";
+    OutputPattern outputPattern;
+    int width  = 720;
+    int height = 576;
+    bool hasEye    = false;
+    bool hasTarget = false;
+    glm::dvec3 eye;
+    glm::dvec3 target;
+    glm::dvec3 up = glm::dvec3(0.0, 1.0, 0.0);
+    double fieldOfView = 45.0;
+    double nearPlane   = 0.0; // zero fits to the model
+    double farPlane    = 0.0; // zero fits to the model
+    int frames   = 1;
+    double orbit = 360.0;
+    int jobs     = 0; // zero uses a job per core
+    int writers  = 2;
+    int pngCompression = -1; // -1 uses the default
+    bool hdr     = false;
+    bool edges   = false;
+};
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+void printUsage()
+{
+    std::cout
+        << "Usage: rasperi_cli [options] <model file>\n"
+        << "\n"
+        << "Renders the model into image files without a display.\n"
+        << "\n"
+        << "Options:\n"
+        << "  -o, --output <pattern>  Output file, %d or e.g. %04d is replaced\n"
+        << "                          with the frame number and %% with %\n"
+        << "                          (default frame_%04d.png)\n"
+        << "  --size <w>x<h>          Image size (default 720x576)\n"
+        << "  --eye <x,y,z>           Camera position (default fits the model)\n"
+        << "  --target <x,y,z>        Camera target (default model center)\n"
+        << "  --up <x,y,z>            Camera up (default 0,1,0)\n"
+        << "  --fov <degrees>         Vertical field of view (default 45)\n"
+        << "  --near <distance>       Near plane (default fits the model)\n"
+        << "  --far <distance>        Far plane (default fits the model)\n"
+        << "  --frames <count>        Frames orbiting the target (default 1)\n"
+        << "  --orbit <degrees>       Orbit angle of all frames (default 360)\n"
+        << "  -j, --jobs <count>      Frames rendered in parallel (default\n"
+        << "                          one per core)\n"
+        << "  --writers <count>       Threads writing the files (default 2)\n"
+        << "  --png-compression <0-9> PNG compression level, 0 is the fastest\n"
+        << "                          (default 6)\n"
+        << "  --hdr                   Write the linear color before the tone\n"
+        << "                          mapping into .pfm and .raw files\n"
+        << "  --edges                 Draw triangle edges instead of filled\n"
+        << "  -h, --help              Show this help\n";
+}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+bool parseVec3(const char* str, glm::dvec3& out)
+{
+    return std::sscanf(str, "%lf,%lf,%lf", &out.x, &out.y, &out.z) == 3;
+}
+
+/* ---------------------------------------------------------------- *
+   Splits the output file around the frame number conversion. Only
+   a single %d with an optional zero flag and width is accepted.
+ * ---------------------------------------------------------------- */
+bool parseOutputPattern(const std::string& str, OutputPattern& out)
+{
+    out = OutputPattern();
+    for (size_t i = 0; i < str.size(); ++i)
+    {
+        std::string& text = out.hasNumber ? out.suffix : out.prefix;
+        if (str[i] != '%')
+        {
+            text += str[i];
+            continue;
+        }
+
+        if (++i < str.size() && str[i] == '%')
+        {
+            text += '%';
+            continue;
+        }
+
+        if (out.hasNumber)
+            return false;
+
+        if (i < str.size() && str[i] == '0')
+        {
+            out.fill = '0';
+            ++i;
+        }
+        while (i < str.size() && str[i] >= '0' && str[i] <= '9' && out.width < 100)
+            out.width = out.width * 10 + (str[i++] - '0');
+
+        if (i >= str.size() || str[i] != 'd')
+            return false;
+        out.hasNumber = true;
+    }
+    return true;
+}
+
+/* ---------------------------------------------------------------- *
+   Parses the options, returns false and prints the error if the
+   options are not valid.
+ * ---------------------------------------------------------------- */
+bool parseOptions(int argc, char** argv, Options& o, bool& help)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+        auto needsValue = [&]()
+        {
+            if (value)
+            {
+                ++i;
+                return true;
+            }
+            std::cerr << "missing value of " << arg << std::endl;
+            return false;
+        };
+
+        bool ok = true;
+        if (arg == "-h" || arg == "--help")
+            help = true;
+        else if (arg == "--edges")
+            o.edges = true;
+        else if (arg == "--hdr")
+            o.hdr = true;
+        else if (arg == "-o" || arg == "--output")
+            ok = needsValue() && (o.output = value, true);
+        else if (arg == "--size")
+            ok = needsValue() && std::sscanf(value, "%dx%d", &o.width, &o.height) == 2 &&
+                 o.width > 0 && o.height > 0;
+        else if (arg == "--eye")
+            ok = needsValue() && (o.hasEye = parseVec3(value, o.eye));
+        else if (arg == "--target")
+            ok = needsValue() && (o.hasTarget = parseVec3(value, o.target));
+        else if (arg == "--up")
+            ok = needsValue() && parseVec3(value, o.up);
+        else if (arg == "--fov")
+            ok = needsValue() && (o.fieldOfView = std::atof(value)) > 0.0;
+        else if (arg == "--near")
+            ok = needsValue() && (o.nearPlane = std::atof(value)) > 0.0;
+        else if (arg == "--far")
+            ok = needsValue() && (o.farPlane = std::atof(value)) > 0.0;
+        else if (arg == "--frames")
+            ok = needsValue() && (o.frames = std::atoi(value)) > 0;
+        else if (arg == "--orbit")
+            ok = needsValue() && (o.orbit = std::atof(value), true);
+        else if (arg == "-j" || arg == "--jobs")
+            ok = needsValue() && (o.jobs = std::atoi(value)) > 0;
+        else if (arg == "--writers")
+            ok = needsValue() && (o.writers = std::atoi(value)) > 0;
+        else if (arg == "--png-compression")
+            ok = needsValue() && (o.pngCompression = std::atoi(value)) >= 0 &&
+                 o.pngCompression <= 9;
+        else if (!arg.empty() && arg[0] == '-')
+        {
+            std::cerr << "unknown option " << arg << std::endl;
+            return false;
+        }
+        else
+            o.input = arg;
+
+        if (!ok)
+        {
+            std::cerr << "invalid value of " << arg << std::endl;
+            return false;
+        }
+    }
+
+    if (help)
+        return true;
+
+    if (o.input.empty())
+    {
+        std::cerr << "model file is missing" << std::endl;
+        return false;
+    }
+
+    if (!parseOutputPattern(o.output, o.outputPattern))
+    {
+        std::cerr << "invalid output pattern " << o.output << std::endl;
+        return false;
+    }
+
+    if (o.frames > 1 && !o.outputPattern.hasNumber)
+    {
+        std::cerr << "output needs a frame number pattern "
+                  << "when rendering multiple frames" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/* ---------------------------------------------------------------- *
+   Fits the unset camera parameters to the world space bounding box
+   of the models.
+ * ---------------------------------------------------------------- */
+void fitCamera(const std::vector<Model>& models, Options& o)
+{
+    glm::dvec3 min( std::numeric_limits<double>::max());
+    glm::dvec3 max(-std::numeric_limits<double>::max());
+    for (const Model& model : models)
+    {
+        const glm::dmat4 m = model.transform ? model.transform->matrix()
+                                             : glm::dmat4(1.0);
+        for (const Vertex& v : model.mesh->vertices)
+        {
+            const glm::dvec3 p = glm::dvec3(m * glm::dvec4(v.position, 1.0));
+            min = glm::min(min, p);
+            max = glm::max(max, p);
+        }
+    }
+    if (min.x > max.x)
+        min = max = glm::dvec3(0.0);
+
+    const glm::dvec3 center = (min + max) * 0.5;
+    const double radius = std::max(glm::length(max - min) * 0.5, 1e-3);
+
+    if (!o.hasTarget)
+        o.target = center;
+
+    if (!o.hasEye)
+    {
+        // Distance where the bounding sphere fits into the smaller
+        // field of view.
+        const double aspect = double(o.width) / double(o.height);
+        double fov = 0.5 * glm::radians(o.fieldOfView);
+        if (aspect < 1.0)
+            fov = std::atan(aspect * std::tan(fov));
+        o.eye = o.target + glm::dvec3(0.0, 0.0, radius / std::sin(fov));
+    }
+
+    const double distance = glm::length(o.eye - center);
+    if (o.farPlane <= 0.0)
+        o.farPlane = distance + radius * 2.0;
+    if (o.nearPlane <= 0.0)
+        o.nearPlane = std::max(distance - radius * 2.0, o.farPlane * 1e-3);
+}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+QString framePath(const Options& o, int frame)
+{
+    const OutputPattern& p = o.outputPattern;
+    if (!p.hasNumber)
+        return QString::fromStdString(p.prefix);
+
+    std::string number = std::to_string(frame);
+    if (int(number.size()) < p.width)
+        number.insert(0, size_t(p.width) - number.size(), p.fill);
+    return QString::fromStdString(p.prefix + number + p.suffix);
+}
+
+} // anonymous namespace
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+int main(int argc, char** argv)
+{
+    Options o;
+    bool help = false;
+    if (!parseOptions(argc, argv, o, help))
+    {
+        printUsage();
+        return EXIT_FAILURE;
+    }
+    if (help)
+    {
+        printUsage();
+        return EXIT_SUCCESS;
+    }
+
+    ModelImporter importer;
+    const std::vector<Model> models =
+        importer.import(QString::fromStdString(o.input));
+    for (const QString& error : importer.errors())
+        std::cerr << error.toStdString() << std::endl;
+    if (models.empty())
+    {
+        std::cerr << "no models in " << o.input << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    fitCamera(models, o);
+
+    BatchRenderer::Settings settings;
+    settings.width   = o.width;
+    settings.height  = o.height;
+    settings.filled  = !o.edges;
+    settings.workers = o.jobs;
+    settings.writers = o.writers;
+    settings.hdr     = o.hdr;
+    settings.projectionMatrix =
+        glm::perspective(glm::radians(o.fieldOfView),
+                         double(o.width) / double(o.height),
+                         o.nearPlane, o.farPlane);
+
+    const std::vector<glm::dmat4> views =
+        BatchRenderer::orbit(o.eye, o.target, o.up, o.frames,
+                             o.frames > 1 ? o.orbit : 0.0);
+
+    // The images are encoded and written on the writer threads of
+    // the renderer, its bounded queue limits the frames in memory.
+    std::mutex outputMutex;
+    ImageSequenceWriter writer(0);
+    writer.setPngCompression(o.pngCompression);
+    writer.setCallback([&](const QString& filepath, bool ok)
+    {
+        std::lock_guard<std::mutex> lock(outputMutex);
+        if (ok)
+            std::cout << filepath.toStdString() << std::endl;
+        else
+            std::cerr << "failed to write " << filepath.toStdString() << std::endl;
+    });
+
+    BatchRenderer renderer(models, settings);
+    renderer.render(views, [&](int frame,
+                               const QImage& image,
+                               const Texture2D<float, 4>& hdr)
+    {
+        writer.save({ image, hdr }, framePath(o, frame));
+    });
+
+    return writer.takeErrors().isEmpty() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
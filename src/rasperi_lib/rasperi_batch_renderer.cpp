@@ -0,0 +1,266 @@
+/* ---------------------------------------------------------------- *
+   Antti Jumpponen <kuumies@gmail.com>
+   The implementation of kuu::rasperi::BatchRenderer class.
+ * ---------------------------------------------------------------- */
+ 
+#include "rasperi_batch_renderer.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include <glm/gtc/matrix_transform.hpp>
+#include "rasperi_material.h"
+#include "rasperi_model.h"
+#include "rasperi_rasterizer.h"
+
+namespace kuu
+{
+namespace rasperi
+{
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+struct BatchRenderer::Impl
+{
+    struct Draw
+    {
+        std::shared_ptr<Mesh> mesh;
+        glm::dmat4 modelMatrix;
+        std::shared_ptr<const Material> material;
+    };
+
+    struct Frame
+    {
+        int index;
+        QImage image;
+        Texture2D<float, 4> hdr;
+    };
+
+    /* ------------------------------------------------------------ *
+       The draws are resolved once, the rasterizer state carries over
+       from the previous model when the model does not have a
+       transform or a material.
+     * ------------------------------------------------------------ */
+    Impl(const std::vector<Model>& models, const Settings& settings)
+        : settings(settings)
+        , cancelled(false)
+    {
+        glm::dmat4 modelMatrix(1.0);
+        std::shared_ptr<const Material> material;
+        for (const Model& model : models)
+        {
+            if (!model.mesh)
+                continue;
+            if (model.transform)
+                modelMatrix = model.transform->matrix();
+            if (model.material)
+            {
+                auto m = std::make_shared<Material>(*model.material);
+                if (m->model == Material::Model::Pbr && settings.pbrIbl)
+                {
+                    m->pbr.irradiance      = &settings.pbrIbl->irradiance;
+                    m->pbr.prefilter       = &settings.pbrIbl->prefilter;
+                    m->pbr.brdfIntegration = &settings.pbrIbl->brdfIntegration;
+                }
+                material = m;
+            }
+            draws.push_back({ model.mesh, modelMatrix, material });
+        }
+    }
+
+    /* ------------------------------------------------------------ *
+       Worker thread. Renders the frames taken from the shared
+       counter and queues them to the writers.
+     * ------------------------------------------------------------ */
+    void renderLoop(const std::vector<glm::dmat4>& viewMatrices,
+                    int threadsPerWorker)
+    {
+#ifdef _OPENMP
+        omp_set_num_threads(threadsPerWorker);
+#else
+        (void) threadsPerWorker;
+#endif
+
+        // The frames in the queue hold their color buffers, a new
+        // one is taken into use if no spare is free.
+        Rasterizer rasterizer(settings.width, settings.height);
+        rasterizer.setSwapChainLength(3);
+        rasterizer.setCancelFlag(&cancelled);
+        rasterizer.setNormalMode(Rasterizer::NormalMode::Smooth);
+        rasterizer.setHdrEnabled(settings.hdr);
+        rasterizer.setProjectionMatrix(settings.projectionMatrix);
+
+        const int frameCount = int(viewMatrices.size());
+        for (int f = nextFrame++; f < frameCount; f = nextFrame++)
+        {
+            rasterizer.clear();
+            rasterizer.setViewMatrix(viewMatrices[size_t(f)]);
+            for (const Draw& draw : draws)
+            {
+                if (rasterizer.isCancelled())
+                    break;
+
+                rasterizer.setModelMatrix(draw.modelMatrix);
+                if (draw.material)
+                    rasterizer.setMaterial(*draw.material);
+                if (settings.filled)
+                    rasterizer.drawFilledTriangleMesh(draw.mesh.get());
+                else
+                    rasterizer.drawEdgeLineTriangleMesh(draw.mesh.get());
+            }
+            if (settings.sky && !rasterizer.isCancelled())
+                rasterizer.drawSky(*settings.sky);
+            if (rasterizer.isCancelled())
+                break;
+
+            Frame frame;
+            frame.index = f;
+            frame.image = rasterizer.present();
+            if (settings.hdr)
+                frame.hdr = rasterizer.takeHdr();
+
+            std::unique_lock<std::mutex> lock(queueMutex);
+            queueNotFull.wait(lock, [this]()
+            {
+                return queue.size() < queueCapacity || cancelled;
+            });
+            if (cancelled)
+                break;
+            queue.push_back(std::move(frame));
+            queueNotEmpty.notify_one();
+        }
+
+        std::lock_guard<std::mutex> lock(queueMutex);
+        --workersRunning;
+        queueNotEmpty.notify_all();
+    }
+
+    /* ------------------------------------------------------------ *
+       Writer thread. Hands the queued frames to the callback until
+       the workers are done and the queue is empty.
+     * ------------------------------------------------------------ */
+    void writeLoop(const FrameCallback& callback)
+    {
+        for (;;)
+        {
+            Frame frame;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                queueNotEmpty.wait(lock, [this]()
+                {
+                    return !queue.empty() || workersRunning == 0 || cancelled;
+                });
+                if (cancelled || queue.empty())
+                    return;
+
+                frame = std::move(queue.front());
+                queue.pop_front();
+                queueNotFull.notify_one();
+            }
+
+            callback(frame.index, frame.image, frame.hdr);
+            ++framesHanded;
+        }
+    }
+
+    Settings settings;
+    std::vector<Draw> draws;
+    std::atomic<bool> cancelled;
+    std::atomic<int> nextFrame;
+    std::atomic<int> framesHanded;
+
+    std::mutex queueMutex;
+    std::condition_variable queueNotFull;
+    std::condition_variable queueNotEmpty;
+    std::deque<Frame> queue;
+    size_t queueCapacity = 0;
+    int workersRunning = 0;
+};
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+BatchRenderer::BatchRenderer(const std::vector<Model>& models,
+                             const Settings& settings)
+    : impl(std::make_shared<Impl>(models, settings))
+{}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+int BatchRenderer::render(const std::vector<glm::dmat4>& viewMatrices,
+                          const FrameCallback& callback)
+{
+    const int frameCount = int(viewMatrices.size());
+    if (frameCount == 0)
+        return 0;
+
+    const int cores = int(std::max(1u, std::thread::hardware_concurrency()));
+    int workers = impl->settings.workers > 0 ? impl->settings.workers : cores;
+    workers = std::min(workers, frameCount);
+    const int writers = std::max(1, impl->settings.writers);
+    const int threadsPerWorker = std::max(1, cores / workers);
+
+    impl->cancelled      = false;
+    impl->nextFrame      = 0;
+    impl->framesHanded   = 0;
+    impl->queue.clear();
+    impl->queueCapacity  = size_t(workers * 2);
+    impl->workersRunning = workers;
+
+    std::vector<std::thread> threads;
+    for (int w = 0; w < workers; ++w)
+        threads.emplace_back([this, &viewMatrices, threadsPerWorker]()
+        {
+            impl->renderLoop(viewMatrices, threadsPerWorker);
+        });
+    for (int w = 0; w < writers; ++w)
+        threads.emplace_back([this, &callback]()
+        {
+            impl->writeLoop(callback);
+        });
+    for (std::thread& t : threads)
+        t.join();
+
+    impl->queue.clear();
+    return impl->framesHanded;
+}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+void BatchRenderer::cancel()
+{
+    {
+        std::lock_guard<std::mutex> lock(impl->queueMutex);
+        impl->cancelled = true;
+    }
+    impl->queueNotFull.notify_all();
+    impl->queueNotEmpty.notify_all();
+}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+std::vector<glm::dmat4> BatchRenderer::orbit(const glm::dvec3& eye,
+                                             const glm::dvec3& target,
+                                             const glm::dvec3& up,
+                                             int frames,
+                                             double degrees)
+{
+    std::vector<glm::dmat4> out;
+    for (int f = 0; f < frames; ++f)
+    {
+        const double angle = degrees * f / frames;
+        const glm::dmat4 r = glm::rotate(glm::dmat4(1.0),
+                                         glm::radians(angle), up);
+        const glm::dvec3 e = target +
+            glm::dvec3(r * glm::dvec4(eye - target, 0.0));
+        out.push_back(glm::lookAt(e, target, up));
+    }
+    return out;
+}
+
+} // namespace rasperi
+} // namespace kuu
@@ -0,0 +1,90 @@
+/* ---------------------------------------------------------------- *
+   Antti Jumpponen <kuumies@gmail.com>
+   The definition of kuu::rasperi::BatchRenderer class.
+ * ---------------------------------------------------------------- */
+ 
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <vector>
+#include <QtGui/QImage>
+#include <glm/mat4x4.hpp>
+#include "rasperi_pbr_ibl_baker.h"
+#include "rasperi_texture_2d.h"
+#include "rasperi_texture_cube.h"
+
+namespace kuu
+{
+namespace rasperi
+{
+
+class Model;
+
+/* ---------------------------------------------------------------- *
+   Renders many views of the same scene, e.g. a turntable or a
+   camera path. Frames are rendered in parallel, each worker thread
+   has its own rasterizer and the scene is shared read-only by all
+   of them. The rendered frames are queued to the writer threads
+   that hand them to the frame callback, the encoding and writing
+   of a frame does not block the rendering of the next one.
+
+   The queue is bounded, the workers wait if the writers fall
+   behind so that the frames in memory stay limited.
+ * ---------------------------------------------------------------- */
+class BatchRenderer
+{
+public:
+    struct Settings
+    {
+        int width  = 720;
+        int height = 576;
+        glm::dmat4 projectionMatrix = glm::dmat4(1.0);
+        bool filled = true;
+        // Zero uses a worker per core. The cores are shared between
+        // the workers for the per-frame parallelism.
+        int workers = 0;
+        int writers = 1;
+        // Keeps the linear color before the tone mapping.
+        bool hdr = false;
+        // Sky drawn behind the models, may be null.
+        std::shared_ptr<const TextureCube<double, 4>> sky;
+        // IBL maps of the PBR materials, may be null.
+        std::shared_ptr<const PbrIblBaker::Maps> pbrIbl;
+    };
+
+    // Called from a writer thread, the frames can arrive out of
+    // order. The images are owned by the callback, the HDR buffer
+    // is null if it is not enabled in the settings.
+    using FrameCallback = std::function<void(int frame,
+                                             const QImage& image,
+                                             const Texture2D<float, 4>& hdr)>;
+
+    BatchRenderer(const std::vector<Model>& models,
+                  const Settings& settings);
+
+    // Renders a frame of each view matrix and returns when all the
+    // frames have been handed to the callback or the rendering was
+    // cancelled. Returns the count of the frames handed.
+    int render(const std::vector<glm::dmat4>& viewMatrices,
+               const FrameCallback& callback);
+
+    // Stops the render at the next tile, can be called from any
+    // thread. Frames not yet handed to the callback are dropped.
+    void cancel();
+
+    // View matrices of the eye orbiting the target around the up
+    // axis, the frames are spread evenly over the angle in degrees.
+    static std::vector<glm::dmat4> orbit(const glm::dvec3& eye,
+                                         const glm::dvec3& target,
+                                         const glm::dvec3& up,
+                                         int frames,
+                                         double degrees = 360.0);
+
+private:
+    struct Impl;
+    std::shared_ptr<Impl> impl;
+};
+
+} // namespace rasperi
+} // namespace kuu
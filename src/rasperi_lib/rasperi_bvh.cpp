@@ -0,0 +1,823 @@
+/* ---------------------------------------------------------------- *
+   Antti Jumpponen <kuumies@gmail.com>
+   The implementation of kuu::rasperi::Bvh class.
+ * ---------------------------------------------------------------- */
+ 
+#include "rasperi_bvh.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <future>
+#include <numeric>
+#include <glm/common.hpp>
+#include <glm/geometric.hpp>
+#include "rasperi_mesh.h"
+#include "rasperi_simd.h"
+
+namespace kuu
+{
+namespace rasperi
+{
+namespace
+{
+
+const int    BIN_COUNT           = 16;
+const size_t MAX_LEAF_SIZE       = 8;
+const int    MAX_SAH_DEPTH       = 32; // then median splits, see Impl::split
+const int    STACK_SIZE          = 64;
+const size_t PARALLEL_BUILD_SIZE = 16384;
+const double TRAVERSAL_COST      = 1.0; // relative to a triangle test
+// Widens the slab exit distance by its rounding error (Ize 2013),
+// a ray through a vertex on the face of a box still enters it.
+const float  SLAB_TOLERANCE      = 1.0f + 3.0f * std::numeric_limits<float>::epsilon();
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+struct Box
+{
+    Box()
+        : min( std::numeric_limits<double>::max())
+        , max(-std::numeric_limits<double>::max())
+    {}
+
+    void grow(const glm::dvec3& p)
+    {
+        min = glm::min(min, p);
+        max = glm::max(max, p);
+    }
+
+    void grow(const Box& b)
+    {
+        min = glm::min(min, b.min);
+        max = glm::max(max, b.max);
+    }
+
+    double area() const
+    {
+        if (min.x > max.x)
+            return 0.0;
+        const glm::dvec3 d = max - min;
+        return 2.0 * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    glm::dvec3 min;
+    glm::dvec3 max;
+};
+
+/* ---------------------------------------------------------------- *
+   Rounds outwards when narrowing the bounds into floats.
+ * ---------------------------------------------------------------- */
+float roundDown(double v)
+{
+    const float f = float(v);
+    return double(f) > v ? std::nextafter(f, -std::numeric_limits<float>::max()) : f;
+}
+
+float roundUp(double v)
+{
+    const float f = float(v);
+    return double(f) < v ? std::nextafter(f, std::numeric_limits<float>::max()) : f;
+}
+
+} // anonymous namespace
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+struct Bvh::Impl
+{
+    /* ------------------------------------------------------------ *
+       32 bytes. Nodes are in the depth-first order, the left child
+       of an inner node is the next node.
+     * ------------------------------------------------------------ */
+    struct Node
+    {
+        float min[3];
+        float max[3];
+        uint32_t offset; // right child or the first block of a leaf
+        uint32_t count;  // triangle count of a leaf, 0 if inner node
+    };
+
+    /* ------------------------------------------------------------ *
+       Four triangles of a leaf in the structure of arrays layout.
+       The vertices are stored instead of the edges so that the
+       triangles sharing a vertex see the same float position, see
+       Impl::intersect. Unused lanes have zero vertices and never hit.
+     * ------------------------------------------------------------ */
+    struct TriangleBlock
+    {
+        float v0[3][4];
+        float v1[3][4];
+        float v2[3][4];
+        int32_t id[4];
+    };
+
+    /* ------------------------------------------------------------ *
+       A ray prepared for the triangle test. The axis where the
+       direction is the largest becomes z and the shear maps the
+       direction into (0, 0, 1).
+     * ------------------------------------------------------------ */
+    struct TriangleRay
+    {
+        TriangleRay() {}
+        TriangleRay(const glm::vec3& origin, const glm::vec3& dir)
+        {
+            kz = 0;
+            if (std::abs(dir.y) > std::abs(dir[kz])) kz = 1;
+            if (std::abs(dir.z) > std::abs(dir[kz])) kz = 2;
+            kx = (kz + 1) % 3;
+            ky = (kx + 1) % 3;
+
+            for (int a = 0; a < 3; ++a)
+                this->origin[a] = Float4(origin[a]);
+            shear[0] = Float4(dir[kx] / dir[kz]);
+            shear[1] = Float4(dir[ky] / dir[kz]);
+            shear[2] = Float4(1.0f   / dir[kz]);
+        }
+
+        int kx = 0, ky = 1, kz = 2;
+        Float4 origin[3];
+        Float4 shear[3];
+    };
+
+    /* ------------------------------------------------------------ *
+       Four rays in the structure of arrays layout.
+     * ------------------------------------------------------------ */
+    struct Packet
+    {
+        Float4 origin[3];
+        Float4 dir[3];
+        Float4 invDir[3];
+        Float4 tMin;
+        Float4 tMax;
+    };
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    void build(const Mesh& mesh)
+    {
+        nodes.clear();
+        blocks.clear();
+        triangleIds.clear();
+
+        const std::vector<unsigned>& indices = mesh.indices;
+        const size_t vertexCount = mesh.vertices.size();
+        for (size_t i = 0; i + 2 < indices.size(); i += 3)
+            if (indices[i + 0] < vertexCount &&
+                indices[i + 1] < vertexCount &&
+                indices[i + 2] < vertexCount)
+            {
+                triangleIds.push_back(unsigned(i / 3));
+            }
+
+        const int count = int(triangleIds.size());
+        if (count == 0)
+            return;
+
+        boxes.resize(triangleIds.size());
+        centroids.resize(triangleIds.size());
+        #pragma omp parallel for
+        for (int i = 0; i < count; ++i)
+        {
+            const unsigned* tri = &indices[size_t(triangleIds[size_t(i)]) * 3];
+            Box& b = boxes[size_t(i)];
+            for (int c = 0; c < 3; ++c)
+                b.grow(mesh.vertices[tri[c]].position);
+            centroids[size_t(i)] = (b.min + b.max) * 0.5;
+        }
+
+        prims.resize(triangleIds.size());
+        std::iota(prims.begin(), prims.end(), 0u);
+        nodes.reserve(triangleIds.size() / MAX_LEAF_SIZE * 4);
+        buildNode(0, prims.size(), 0, nodes);
+
+        // Triangles into the blocks in the leaf order.
+        blocks.clear();
+        blocks.reserve(triangleIds.size() / 2);
+        for (Node& n : nodes)
+        {
+            if (n.count == 0)
+                continue;
+
+            const uint32_t first = n.offset;
+            n.offset = uint32_t(blocks.size());
+            for (uint32_t i = 0; i < n.count; i += 4)
+            {
+                TriangleBlock b = {};
+                for (uint32_t lane = 0; lane < 4; ++lane)
+                {
+                    b.id[lane] = -1;
+                    if (i + lane >= n.count)
+                        continue;
+
+                    const unsigned id = triangleIds[prims[first + i + lane]];
+                    const unsigned* tri = &indices[size_t(id) * 3];
+                    const glm::dvec3& p0 = mesh.vertices[tri[0]].position;
+                    const glm::dvec3& p1 = mesh.vertices[tri[1]].position;
+                    const glm::dvec3& p2 = mesh.vertices[tri[2]].position;
+                    for (int a = 0; a < 3; ++a)
+                    {
+                        b.v0[a][lane] = float(p0[a]);
+                        b.v1[a][lane] = float(p1[a]);
+                        b.v2[a][lane] = float(p2[a]);
+                    }
+                    b.id[lane] = int32_t(id);
+                }
+                blocks.push_back(b);
+            }
+        }
+
+        triangleIds = std::vector<unsigned>();
+        boxes     = std::vector<Box>();
+        centroids = std::vector<glm::dvec3>();
+        prims     = std::vector<unsigned>();
+    }
+
+    /* ------------------------------------------------------------ *
+       Builds the subtree of the primitives [first, last) into the
+       end of the output. Large subtrees are built in parallel into
+       own arrays and then appended.
+     * ------------------------------------------------------------ */
+    void buildNode(size_t first, size_t last, int depth, std::vector<Node>& out)
+    {
+        Box bounds;
+        Box centroidBounds;
+        for (size_t i = first; i < last; ++i)
+        {
+            bounds.grow(boxes[prims[i]]);
+            centroidBounds.grow(centroids[prims[i]]);
+        }
+
+        const size_t index = out.size();
+        Node node;
+        for (int a = 0; a < 3; ++a)
+        {
+            node.min[a] = roundDown(bounds.min[a]);
+            node.max[a] = roundUp(bounds.max[a]);
+        }
+        node.offset = uint32_t(first);
+        node.count  = uint32_t(last - first);
+        out.push_back(node);
+
+        size_t mid = 0;
+        if (!split(first, last, depth, bounds, centroidBounds, mid))
+            return;
+
+        if (last - first >= PARALLEL_BUILD_SIZE)
+        {
+            std::vector<Node> left;
+            std::vector<Node> right;
+            std::future<void> future = std::async(std::launch::async, [&]()
+            {
+                buildNode(first, mid, depth + 1, left);
+            });
+            buildNode(mid, last, depth + 1, right);
+            future.get();
+
+            append(left,  out);
+            out[index].offset = uint32_t(out.size());
+            append(right, out);
+        }
+        else
+        {
+            buildNode(first, mid, depth + 1, out);
+            out[index].offset = uint32_t(out.size());
+            buildNode(mid, last, depth + 1, out);
+        }
+        out[index].count = 0;
+    }
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    void append(const std::vector<Node>& subtree, std::vector<Node>& out)
+    {
+        const uint32_t base = uint32_t(out.size());
+        for (Node n : subtree)
+        {
+            if (n.count == 0)
+                n.offset += base;
+            out.push_back(n);
+        }
+    }
+
+    /* ------------------------------------------------------------ *
+       Finds the cheapest of the binned splits over all the axes and
+       partitions the primitives. Returns false if a leaf is cheaper.
+       Deep nodes are split at the median to keep the depth of the
+       tree within the traversal stack.
+     * ------------------------------------------------------------ */
+    bool split(size_t first, size_t last, int depth,
+               const Box& bounds, const Box& centroidBounds,
+               size_t& mid)
+    {
+        const size_t count = last - first;
+        if (count <= 1)
+            return false;
+
+        const glm::dvec3 extent = centroidBounds.max - centroidBounds.min;
+        if (depth >= MAX_SAH_DEPTH || glm::max(extent.x, glm::max(extent.y, extent.z)) <= 0.0)
+        {
+            if (count <= MAX_LEAF_SIZE)
+                return false;
+
+            const int axis = extent.x >= extent.y && extent.x >= extent.z ? 0
+                           : extent.y >= extent.z ? 1 : 2;
+            mid = first + count / 2;
+            std::nth_element(prims.begin() + long(first),
+                             prims.begin() + long(mid),
+                             prims.begin() + long(last),
+                             [&](unsigned a, unsigned b)
+            { return centroids[a][axis] < centroids[b][axis]; });
+            return true;
+        }
+
+        double bestCost = std::numeric_limits<double>::max();
+        int bestAxis = -1;
+        int bestBin  = 0;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            if (extent[axis] <= 0.0)
+                continue;
+
+            Box binBox[BIN_COUNT];
+            size_t binCount[BIN_COUNT] = {};
+            const double scale = BIN_COUNT / extent[axis] * (1.0 - 1e-9);
+            for (size_t i = first; i < last; ++i)
+            {
+                const unsigned p = prims[i];
+                const int b = std::min(BIN_COUNT - 1,
+                    int((centroids[p][axis] - centroidBounds.min[axis]) * scale));
+                binCount[b]++;
+                binBox[b].grow(boxes[p]);
+            }
+
+            double rightArea[BIN_COUNT];
+            size_t rightCount[BIN_COUNT];
+            Box box;
+            size_t n = 0;
+            for (int b = BIN_COUNT - 1; b > 0; --b)
+            {
+                box.grow(binBox[b]);
+                n += binCount[b];
+                rightArea[b]  = box.area();
+                rightCount[b] = n;
+            }
+
+            box = Box();
+            n = 0;
+            for (int b = 1; b < BIN_COUNT; ++b)
+            {
+                box.grow(binBox[b - 1]);
+                n += binCount[b - 1];
+                if (n == 0 || rightCount[b] == 0)
+                    continue;
+
+                const double cost = double(n) * box.area() +
+                                    double(rightCount[b]) * rightArea[b];
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin  = b;
+                }
+            }
+        }
+
+        const double area = bounds.area();
+        const double leafCost = double(count);
+        bestCost = TRAVERSAL_COST + (area > 0.0 ? bestCost / area : 0.0);
+        if (bestAxis < 0 || (bestCost >= leafCost && count <= MAX_LEAF_SIZE))
+        {
+            if (count <= MAX_LEAF_SIZE)
+                return false;
+            return split(first, last, MAX_SAH_DEPTH, bounds, centroidBounds, mid);
+        }
+
+        const double scale = BIN_COUNT / extent[bestAxis] * (1.0 - 1e-9);
+        const double min   = centroidBounds.min[bestAxis];
+        auto it = std::partition(prims.begin() + long(first),
+                                 prims.begin() + long(last),
+                                 [&](unsigned p)
+        {
+            const int b = std::min(BIN_COUNT - 1,
+                                   int((centroids[p][bestAxis] - min) * scale));
+            return b < bestBin;
+        });
+        mid = size_t(it - prims.begin());
+        return true;
+    }
+
+    /* ------------------------------------------------------------ *
+       Returns the entry distance of the ray into the node box or
+       a negative value if the ray misses the box.
+     * ------------------------------------------------------------ */
+    static float intersect(const Node& n,
+                           const glm::vec3& origin,
+                           const glm::vec3& invDir,
+                           float tMin, float tMax)
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            float t0 = (n.min[a] - origin[a]) * invDir[a];
+            float t1 = (n.max[a] - origin[a]) * invDir[a];
+            if (t0 > t1)
+                std::swap(t0, t1);
+            t1 *= SLAB_TOLERANCE;
+            // NaN from 0 * inf of a ray in the slab plane is skipped.
+            tMin = t0 > tMin ? t0 : tMin;
+            tMax = t1 < tMax ? t1 : tMax;
+            if (tMin > tMax)
+                return -1.0f;
+        }
+        return tMin;
+    }
+
+    /* ------------------------------------------------------------ *
+       Four rays against a node box. Returns the lanes that hit and
+       the entry distances.
+     * ------------------------------------------------------------ */
+    static int intersect(const Node& n, const Packet& p, Float4& tEntry)
+    {
+        Float4 tNear = p.tMin;
+        Float4 tFar  = p.tMax;
+        for (int a = 0; a < 3; ++a)
+        {
+            const Float4 t0 = (Float4(n.min[a]) - p.origin[a]) * p.invDir[a];
+            const Float4 t1 = (Float4(n.max[a]) - p.origin[a]) * p.invDir[a];
+            tNear = max(min(t0, t1), tNear);
+            tFar  = min(max(t0, t1) * Float4(SLAB_TOLERANCE), tFar);
+        }
+        tEntry = tNear;
+        return movemask(tNear <= tFar);
+    }
+
+    /* ------------------------------------------------------------ *
+       Watertight test of one ray against four triangles (Woop,
+       Benthin and Wald 2013). Returns the lane of the closest hit
+       within (tMin, tMax) or -1.
+
+       The vertices are moved into the space of the ray where the
+       ray is the z axis and the hit is decided by the signs of the
+       2D edge functions. A vertex is transformed the same way in
+       every triangle that shares it, and the edge function of a
+       shared edge is then exactly negated in the neighbour, so a
+       ray through the edge cannot pass between the triangles. An
+       edge function of exactly zero counts as inside, both
+       triangles hit and the closer one wins.
+     * ------------------------------------------------------------ */
+    static int intersect(const TriangleBlock& b,
+                         const TriangleRay& r,
+                         float tMin, float tMax,
+                         float& t, float& u, float& v)
+    {
+        const Float4 p0[3] = { Float4::load(b.v0[0]) - r.origin[0],
+                               Float4::load(b.v0[1]) - r.origin[1],
+                               Float4::load(b.v0[2]) - r.origin[2] };
+        const Float4 p1[3] = { Float4::load(b.v1[0]) - r.origin[0],
+                               Float4::load(b.v1[1]) - r.origin[1],
+                               Float4::load(b.v1[2]) - r.origin[2] };
+        const Float4 p2[3] = { Float4::load(b.v2[0]) - r.origin[0],
+                               Float4::load(b.v2[1]) - r.origin[1],
+                               Float4::load(b.v2[2]) - r.origin[2] };
+
+        const Float4 x0 = p0[r.kx] - r.shear[0] * p0[r.kz];
+        const Float4 y0 = p0[r.ky] - r.shear[1] * p0[r.kz];
+        const Float4 x1 = p1[r.kx] - r.shear[0] * p1[r.kz];
+        const Float4 y1 = p1[r.ky] - r.shear[1] * p1[r.kz];
+        const Float4 x2 = p2[r.kx] - r.shear[0] * p2[r.kz];
+        const Float4 y2 = p2[r.ky] - r.shear[1] * p2[r.kz];
+
+        // Edge functions, the unnormalized weights of the vertices.
+        const Float4 w0 = x2 * y1 - y2 * x1;
+        const Float4 w1 = x0 * y2 - y0 * x2;
+        const Float4 w2 = x1 * y0 - y1 * x0;
+
+        const Float4 zero(0.0f);
+        const Float4 inside = ((w0 >= zero) & (w1 >= zero) & (w2 >= zero)) |
+                              ((w0 <= zero) & (w1 <= zero) & (w2 <= zero));
+        const Float4 det = w0 + w1 + w2;
+        const Float4 invDet = Float4(1.0f) / det;
+
+        const Float4 z0 = r.shear[2] * p0[r.kz];
+        const Float4 z1 = r.shear[2] * p1[r.kz];
+        const Float4 z2 = r.shear[2] * p2[r.kz];
+        const Float4 t4 = (w0 * z0 + w1 * z1 + w2 * z2) * invDet;
+        const Float4 u4 = w1 * invDet;
+        const Float4 v4 = w2 * invDet;
+
+        const Float4 mask = inside & (det != zero) &
+                            (t4 > Float4(tMin)) & (t4 < Float4(tMax));
+        int bits = movemask(mask);
+        if (bits == 0)
+            return -1;
+
+        float ts[4], us[4], vs[4];
+        t4.store(ts);
+        u4.store(us);
+        v4.store(vs);
+
+        int lane = -1;
+        for (int i = 0; i < 4; ++i, bits >>= 1)
+        {
+            if (!(bits & 1) || (lane >= 0 && ts[i] >= ts[lane]))
+                continue;
+            lane = i;
+        }
+        t = ts[lane];
+        u = us[lane];
+        v = vs[lane];
+        return lane;
+    }
+
+    /* ------------------------------------------------------------ *
+       Tests the ray against the triangles of a leaf and updates the
+       hit. Returns true if the ray hit a triangle.
+     * ------------------------------------------------------------ */
+    bool intersectLeaf(const Node& n,
+                       const TriangleRay& r,
+                       float tMin, float& tMax,
+                       Hit& hit) const
+    {
+        bool out = false;
+        const uint32_t blockCount = (n.count + 3) / 4;
+        for (uint32_t i = n.offset; i < n.offset + blockCount; ++i)
+        {
+            float t, u, v;
+            const int lane = intersect(blocks[i], r, tMin, tMax, t, u, v);
+            if (lane < 0)
+                continue;
+
+            tMax = t;
+            hit.triangle = blocks[i].id[lane];
+            hit.t = t;
+            hit.u = u;
+            hit.v = v;
+            out = true;
+        }
+        return out;
+    }
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    Hit trace(const Ray& ray, double tMinD, double tMaxD, bool any) const
+    {
+        Hit hit;
+        if (nodes.empty())
+            return hit;
+
+        float tMin = float(tMinD);
+        float tMax = float(std::min(tMaxD, double(std::numeric_limits<float>::max())));
+
+        const glm::vec3 origin = ray.start;
+        const glm::vec3 invDir = 1.0f / ray.direction;
+        const TriangleRay triangleRay(origin, ray.direction);
+
+        if (intersect(nodes[0], origin, invDir, tMin, tMax) < 0.0f)
+            return hit;
+
+        struct Entry { uint32_t node; float t; };
+        Entry stack[STACK_SIZE];
+        int size = 0;
+        uint32_t current = 0;
+        for (;;)
+        {
+            const Node& n = nodes[current];
+            if (n.count > 0)
+            {
+                if (intersectLeaf(n, triangleRay, tMin, tMax, hit) && any)
+                    return hit;
+            }
+            else
+            {
+                uint32_t left  = current + 1;
+                uint32_t right = n.offset;
+                float tl = intersect(nodes[left],  origin, invDir, tMin, tMax);
+                float tr = intersect(nodes[right], origin, invDir, tMin, tMax);
+                if (tl >= 0.0f && tr >= 0.0f)
+                {
+                    if (tr < tl)
+                    {
+                        std::swap(left, right);
+                        std::swap(tl, tr);
+                    }
+                    stack[size++] = { right, tr };
+                    current = left;
+                    continue;
+                }
+                if (tl >= 0.0f) { current = left;  continue; }
+                if (tr >= 0.0f) { current = right; continue; }
+            }
+
+            // Next node that is still closer than the closest hit.
+            for (;;)
+            {
+                if (size == 0)
+                    return hit;
+                const Entry& e = stack[--size];
+                if (e.t <= tMax)
+                {
+                    current = e.node;
+                    break;
+                }
+            }
+        }
+    }
+
+    /* ------------------------------------------------------------ *
+       Traces up to four rays together. A node is visited if any of
+       the rays hits it, the children are visited in the order of
+       the nearest entry. Efficient when the rays are coherent, e.g.
+       neighbouring pixels or shadow rays from nearby points.
+     * ------------------------------------------------------------ */
+    void trace(const Ray* rays, int count, double tMaxD, bool any, Hit* hits) const
+    {
+        for (int i = 0; i < count; ++i)
+            hits[i] = Hit();
+        if (nodes.empty())
+            return;
+
+        const float tMax = float(std::min(tMaxD, double(std::numeric_limits<float>::max())));
+
+        // Missing lanes have a negative range and never hit.
+        float o[3][4] = {}, d[3][4] = {}, id[3][4] = {}, tFar[4];
+        for (int lane = 0; lane < 4; ++lane)
+        {
+            const bool active = lane < count;
+            for (int a = 0; a < 3; ++a)
+            {
+                o[a][lane]  = active ? rays[lane].start[a]     : 0.0f;
+                d[a][lane]  = active ? rays[lane].direction[a] : 1.0f;
+                id[a][lane] = 1.0f / d[a][lane];
+            }
+            tFar[lane] = active ? tMax : -1.0f;
+        }
+
+        TriangleRay triangleRays[4];
+        for (int lane = 0; lane < count; ++lane)
+            triangleRays[lane] = TriangleRay(rays[lane].start, rays[lane].direction);
+
+        Packet p;
+        for (int a = 0; a < 3; ++a)
+        {
+            p.origin[a] = Float4::load(o[a]);
+            p.dir[a]    = Float4::load(d[a]);
+            p.invDir[a] = Float4::load(id[a]);
+        }
+        p.tMin = Float4(0.0f);
+        p.tMax = Float4::load(tFar);
+
+        Float4 tEntry;
+        if (intersect(nodes[0], p, tEntry) == 0)
+            return;
+
+        uint32_t stack[STACK_SIZE];
+        int size = 0;
+        uint32_t current = 0;
+        for (;;)
+        {
+            const Node& n = nodes[current];
+            if (n.count > 0)
+            {
+                int lanes = intersect(n, p, tEntry);
+                for (int lane = 0; lane < 4; ++lane)
+                {
+                    if (!(lanes & (1 << lane)))
+                        continue;
+
+                    if (!intersectLeaf(n, triangleRays[lane], 0.0f, tFar[lane], hits[lane]))
+                        continue;
+
+                    // An any hit query is done for the ray.
+                    if (any)
+                        tFar[lane] = -1.0f;
+                }
+                p.tMax = Float4::load(tFar);
+            }
+            else
+            {
+                uint32_t left  = current + 1;
+                uint32_t right = n.offset;
+                Float4 tl, tr;
+                const int hl = intersect(nodes[left],  p, tl);
+                const int hr = intersect(nodes[right], p, tr);
+                if (hl && hr)
+                {
+                    // Nearest entry of the rays that hit the child.
+                    float tls[4], trs[4];
+                    tl.store(tls);
+                    tr.store(trs);
+                    float nl = std::numeric_limits<float>::max();
+                    float nr = std::numeric_limits<float>::max();
+                    for (int lane = 0; lane < 4; ++lane)
+                    {
+                        if (hl & (1 << lane)) nl = std::min(nl, tls[lane]);
+                        if (hr & (1 << lane)) nr = std::min(nr, trs[lane]);
+                    }
+                    if (nr < nl)
+                        std::swap(left, right);
+                    stack[size++] = right;
+                    current = left;
+                    continue;
+                }
+                if (hl) { current = left;  continue; }
+                if (hr) { current = right; continue; }
+            }
+
+            // Next node that some ray still hits closer than its hit.
+            for (;;)
+            {
+                if (size == 0)
+                    return;
+                current = stack[--size];
+                if (intersect(nodes[current], p, tEntry))
+                    break;
+            }
+        }
+    }
+
+    std::vector<Node> nodes;
+    std::vector<TriangleBlock> blocks;
+
+    // Build time only
+    std::vector<unsigned> triangleIds;
+    std::vector<Box> boxes;
+    std::vector<glm::dvec3> centroids;
+    std::vector<unsigned> prims;
+};
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+Bvh::Bvh()
+    : impl(std::make_shared<Impl>())
+{}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+Bvh::Bvh(const Mesh& mesh)
+    : impl(std::make_shared<Impl>())
+{
+    impl->build(mesh);
+}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+void Bvh::build(const Mesh& mesh)
+{ impl->build(mesh); }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+bool Bvh::isEmpty() const
+{ return impl->nodes.empty(); }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+Bvh::Hit Bvh::closestHit(const Ray& ray, double tMin, double tMax) const
+{ return impl->trace(ray, tMin, tMax, false); }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+bool Bvh::anyHit(const Ray& ray, double tMin, double tMax) const
+{ return impl->trace(ray, tMin, tMax, true); }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+std::vector<Bvh::Hit> Bvh::closestHit(const std::vector<Ray>& rays) const
+{
+    std::vector<Hit> hits(rays.size());
+    const int packetCount = int((rays.size() + 3) / 4);
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int i = 0; i < packetCount; ++i)
+    {
+        const size_t first = size_t(i) * 4;
+        const int count = int(std::min(size_t(4), rays.size() - first));
+        impl->trace(&rays[first], count, std::numeric_limits<double>::max(),
+                    false, &hits[first]);
+    }
+    return hits;
+}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+std::vector<char> Bvh::anyHit(const std::vector<Ray>& rays, double tMax) const
+{
+    std::vector<char> out(rays.size());
+    const int packetCount = int((rays.size() + 3) / 4);
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int i = 0; i < packetCount; ++i)
+    {
+        const size_t first = size_t(i) * 4;
+        const int count = int(std::min(size_t(4), rays.size() - first));
+        Hit hits[4];
+        impl->trace(&rays[first], count, tMax, true, hits);
+        for (int j = 0; j < count; ++j)
+            out[first + size_t(j)] = hits[j] ? 1 : 0;
+    }
+    return out;
+}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+size_t Bvh::nodeCount() const
+{ return impl->nodes.size(); }
+
+} // namespace rasperi
+} // namespace kuu
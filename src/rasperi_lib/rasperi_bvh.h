@@ -0,0 +1,77 @@
+/* ---------------------------------------------------------------- *
+   Antti Jumpponen <kuumies@gmail.com>
+   The definition of kuu::rasperi::Bvh class.
+ * ---------------------------------------------------------------- */
+ 
+#pragma once
+
+#include <limits>
+#include <memory>
+#include <vector>
+#include "rasperi_ext/ray.h"
+
+namespace kuu
+{
+namespace rasperi
+{
+
+struct Mesh;
+
+/* ---------------------------------------------------------------- *
+   A bounding volume hierarchy over the triangles of a mesh for ray
+   queries. The hierarchy is built with binned surface area
+   heuristic, large subtrees are built in parallel. The hierarchy
+   holds a copy of the triangle positions so the mesh can change
+   or be released after the build.
+
+   The leaves store the triangles in blocks of four in single
+   precision and a ray is tested against a block at once with SIMD.
+
+   Queries are thread-safe. Triangles are hit from both sides.
+ * ---------------------------------------------------------------- */
+class Bvh
+{
+public:
+    struct Hit
+    {
+        operator bool() const { return triangle >= 0; }
+
+        int triangle = -1; // index / 3 of the triangle in the mesh
+        double t = 0.0;    // distance along the ray direction
+        double u = 0.0;    // barycentric weight of the second vertex
+        double v = 0.0;    // barycentric weight of the third vertex
+    };
+
+    Bvh();
+    explicit Bvh(const Mesh& mesh);
+
+    void build(const Mesh& mesh);
+    bool isEmpty() const;
+
+    // Closest hit within (tMin, tMax).
+    Hit closestHit(const Ray& ray,
+                   double tMin = 0.0,
+                   double tMax = std::numeric_limits<double>::max()) const;
+
+    // Returns true if any triangle is hit within (tMin, tMax). Faster
+    // than the closest hit, e.g. for the shadow rays.
+    bool anyHit(const Ray& ray,
+                double tMin = 0.0,
+                double tMax = std::numeric_limits<double>::max()) const;
+
+    // Batch queries, the rays are traced in parallel in packets of
+    // four consecutive rays. Order the rays so that the neighbours
+    // are coherent, e.g. by the pixel tiles.
+    std::vector<Hit> closestHit(const std::vector<Ray>& rays) const;
+    std::vector<char> anyHit(const std::vector<Ray>& rays,
+                             double tMax = std::numeric_limits<double>::max()) const;
+
+    size_t nodeCount() const;
+
+private:
+    struct Impl;
+    std::shared_ptr<Impl> impl;
+};
+
+} // namespace rasperi
+} // namespace kuu
@@ -4,10 +4,9 @@
  * ---------------------------------------------------------------- */
  
 #include "rasperi_equirectangular_to_cubemap.h"
-#include <functional>
+#include <cmath>
 #include <iostream>
-#include <QtCore/QDir>
-#include "rasperi_cube_camera.h"
+#include <glm/geometric.hpp>
 #include "rasperi_texture_cube.h"
 #include "rasperi_texture_cube_mapping.h"
 
@@ -18,263 +17,220 @@ namespace rasperi
 
 /* ---------------------------------------------------------------- *
  * ---------------------------------------------------------------- */
-class CubeRasterizer
+struct EquirectangularToCubemap::Impl
 {
-public:
     /* ------------------------------------------------------------ *
+       A cube texel and its position in the equirectangular map.
      * ------------------------------------------------------------ */
-    class BoundingBox
+    struct Texel
     {
-    public:
-        BoundingBox()
-        {
-            min.x =  std::numeric_limits<double>::max();
-            min.y =  std::numeric_limits<double>::max();
-            max.x = -std::numeric_limits<double>::max();
-            max.y = -std::numeric_limits<double>::max();
-        }
-
-        void update(const glm::dvec2& p)
-        {
-            if (p.x < min.x) min.x = p.x;
-            if (p.y < min.y) min.y = p.y;
-            if (p.x > max.x) max.x = p.x;
-            if (p.y > max.y) max.y = p.y;
-        }
-
-        glm::dvec2 min;
-        glm::dvec2 max;
+        int index;
+        float x;
+        float y;
     };
 
-    using Callback = std::function<void(glm::dvec3)>;
-
-    int w;
-    int h;
-    Callback callback;
-    CubeCamera cubeCamera;
-
     /* ------------------------------------------------------------ *
      * ------------------------------------------------------------ */
-    CubeRasterizer(int w, int h, Callback callback)
-        : w(w)
-        , h(h)
-        , callback(callback)
-        , cubeCamera(w / double(h))
+    Impl(EquirectangularToCubemap* self, int size, bool mipmaps)
+        : self(self)
+        , size(size)
+        , mipmaps(mipmaps)
     {}
 
     /* ------------------------------------------------------------ *
      * ------------------------------------------------------------ */
-    void run() const
+    TextureCube<double, 4> run(const Texture2D<double, 4>& e)
     {
-        // --------------------------------------------------------
-        // Create NDC cube
-
-        std::vector<glm::dvec3> vertexData =
-        {
-            { -1,-1,-1 },
-            {  1, 1,-1 },
-            {  1,-1,-1 },
-            { -1, 1,-1 },
-            { -1,-1, 1 },
-            {  1,-1, 1 },
-            {  1, 1, 1 },
-            { -1, 1, 1 },
-        };
+        begin(e.width(), e.height());
+        addBand(e);
+        return end();
+    }
 
-        std::vector<unsigned> indexData
+    /* ------------------------------------------------------------ *
+       Maps every cube texel into the map and buckets the texels by
+       the lower row of their bilinear footprint. A texel can be
+       filled when the band containing that row arrives.
+     * ------------------------------------------------------------ */
+    void begin(int width, int height)
+    {
+        out = TextureCube<double, 4>(size, size);
+        mapWidth  = width;
+        mapHeight = height;
+        nextRow   = 0;
+        carry.clear();
+        texels.clear();
+        rowOffsets.assign(1, 0);
+        if (width <= 0 || height <= 0)
         {
-            2,1,0, 3,0,1,
-            6,5,4, 4,7,6,
-            0,3,7, 7,4,0,
-            1,2,6, 5,6,2,
-            5,2,0, 0,4,5,
-            1,6,3, 7,3,6,
-        };
+            std::cerr << __FUNCTION__
+                      << ": invalid map size "
+                      << width << "x" << height
+                      << std::endl;
+            return;
+        }
 
-        // --------------------------------------------------------
-        // Rasterize
+        const int faceTexels = size * size;
+        const int texelCount = 6 * faceTexels;
+        std::vector<glm::vec2> coords(static_cast<size_t>(texelCount));
+        std::vector<int> rows(static_cast<size_t>(texelCount));
 
-        for (int face = 0; face < 6; ++face)
+        #pragma omp parallel for
+        for (int i = 0; i < texelCount; ++i)
         {
-            std::cout << "Process face " << face << std::endl;
+            const int f = i / faceTexels;
+            const int x = (i % faceTexels) % size;
+            const int y = (i % faceTexels) / size;
+
+            const glm::dvec3 n = glm::normalize(
+                texture_cube_mapping::mapTexel(f, x, y, size));
+            const glm::dvec2 uv = sampleSphericalMap(n);
+
+            // Texel space, the texel centers are at half-integers.
+            const double ex = uv.x * mapWidth  - 0.5;
+            const double ey = uv.y * mapHeight - 0.5;
+            coords[size_t(i)] = glm::vec2(float(ex), float(ey));
+            rows[size_t(i)] = clampRow(int(std::floor(ey)) + 1);
+        }
 
-            glm::dmat4 camera = cubeCamera.cameraMatrix(size_t(face));
+        // Counting sort by row
+        rowOffsets.assign(size_t(mapHeight + 1), 0);
+        for (int r : rows)
+            rowOffsets[size_t(r + 1)]++;
+        for (int r = 0; r < mapHeight; ++r)
+            rowOffsets[size_t(r + 1)] += rowOffsets[size_t(r)];
 
-            //#pragma omp parallel for
-            for (int i = 0; i < indexData.size(); i += 3)
-            {
-                glm::dvec3 v1 = vertexData[indexData[i+0]];
-                glm::dvec3 v2 = vertexData[indexData[i+1]];
-                glm::dvec3 v3 = vertexData[indexData[i+2]];
-
-                glm::dvec3 proj1 = project(camera, v1);
-                glm::dvec3 proj2 = project(camera, v2);
-                glm::dvec3 proj3 = project(camera, v3);
-
-                glm::dvec2 vp1 = viewportTransform(proj1);
-                glm::dvec2 vp2 = viewportTransform(proj2);
-                glm::dvec2 vp3 = viewportTransform(proj3);
-
-                BoundingBox bb;
-                bb.update(vp1);
-                bb.update(vp2);
-                bb.update(vp3);
-
-                int xmin = std::max(0, std::min(w - 1, int(std::floor(bb.min.x))));
-                int ymin = std::max(0, std::min(h - 1, int(std::floor(bb.min.y))));
-                int xmax = std::max(0, std::min(w - 1, int(std::floor(bb.max.x))));
-                int ymax = std::max(0, std::min(h - 1, int(std::floor(bb.max.y))));
-
-                for (int y = ymin; y <= ymax; ++y)
-                for (int x = xmin; x <= xmax; ++x)
-                {
-                    glm::dvec2 screen(x + 0.5, y + 0.5);
-
-                    // Barycentric weights
-                    double w1 = edgeFunction(vp2, vp3, screen);
-                    double w2 = edgeFunction(vp3, vp1, screen);
-                    double w3 = edgeFunction(vp1, vp2, screen);
-                    if (w1 < 0.0 || w2 < 0.0 || w3 < 0.0)
-                        continue;
-
-                    // Top-left edge rule
-                    glm::dvec2 edge1 = vp2 - vp3;
-                    glm::dvec2 edge2 = vp3 - vp1;
-                    glm::dvec2 edge3 = vp1 - vp2;
-                    bool overlaps = true;
-                    overlaps &= (w1 == 0.0 ? ((edge1.y == 0.0 && edge1.x < 0.0) ||  edge1.y < 0.0) : (w1 > 0.0));
-                    overlaps &= (w2 == 0.0 ? ((edge2.y == 0.0 && edge2.x < 0.0) ||  edge2.y < 0.0) : (w2 > 0.0));
-                    overlaps &= (w3 == 0.0 ? ((edge3.y == 0.0 && edge3.x < 0.0) ||  edge3.y < 0.0) : (w3 > 0.0));
-                    if (!overlaps)
-                        continue;
-
-                    double area = edgeFunction(vp1, vp2, vp3);
-                    w1 /= area;
-                    w2 /= area;
-                    w3 /= area;
-
-                    double z  = 1.0 / (w1 * 1.0 / proj1.z +
-                                       w2 * 1.0 / proj2.z +
-                                       w3 * 1.0 / proj3.z);
-
-                    glm::dvec3 p1 = v1 / proj1.z;
-                    glm::dvec3 p2 = v2 / proj2.z;
-                    glm::dvec3 p3 = v3 / proj3.z;
-                    glm::dvec3 p = p1  * w1 * z +
-                                   p2  * w2 * z +
-                                   p3  * w3 * z;
-
-                    callback(p);
-                }
-            }
+        texels.resize(size_t(texelCount));
+        std::vector<int> fill(rowOffsets.begin(), rowOffsets.end() - 1);
+        for (int i = 0; i < texelCount; ++i)
+        {
+            const glm::vec2& c = coords[size_t(i)];
+            texels[size_t(fill[size_t(rows[size_t(i)])]++)] = { i, c.x, c.y };
         }
     }
 
     /* ------------------------------------------------------------ *
      * ------------------------------------------------------------ */
-    glm::dvec3 project(const glm::dmat4& m, const glm::dvec3& p) const
+    bool addBand(const Texture2D<double, 4>& band)
     {
-        const glm::dvec4 v = m * glm::dvec4(p, 1.0);
-        if (v.w == 0.0)
+        if (band.width() != mapWidth || nextRow + band.height() > mapHeight)
         {
-            std::cerr << "proj err" << std::endl;
-            return glm::dvec3(0.0);
+            std::cerr << __FUNCTION__
+                      << ": band does not fit into the map"
+                      << std::endl;
+            return false;
         }
-        return glm::dvec3(v.x / v.w, v.y / v.w, v.z / v.w);
-    }
+        if (band.height() == 0)
+            return true;
 
-    /* ------------------------------------------------------------ *
-     * ------------------------------------------------------------ */
-    glm::dvec2 viewportTransform(const glm::dvec3& p) const
-    {
-        const glm::ivec2 vp(w - 1, h - 1);
-        const glm::dvec2 halfViewport = glm::dvec2(vp) * 0.5;
+        const int bandStart = nextRow;
+        const int bandEnd   = nextRow + band.height();
+        const double* bandPixels = band.pixels().data();
+        const double* carryPixels = carry.data();
+        const int rowLength = mapWidth * 4;
+
+        auto row = [&](int r)
+        {
+            if (r < bandStart)
+                return carryPixels;
+            return bandPixels + (r - bandStart) * rowLength;
+        };
+
+        const int faceTexels = size * size;
+        const int first = rowOffsets[size_t(bandStart)];
+        const int last  = rowOffsets[size_t(bandEnd)];
 
-        glm::dvec2 out;
-        out.x =        (p.x + 1.0) * halfViewport.x;
-        out.y = vp.y - (p.y + 1.0) * halfViewport.y;
+        #pragma omp parallel for
+        for (int i = first; i < last; ++i)
+        {
+            const Texel& t = texels[size_t(i)];
+
+            const int x0 = int(std::floor(t.x));
+            const int y0 = int(std::floor(t.y));
+            const double tx = t.x - x0;
+            const double ty = t.y - y0;
+
+            // Wrap horizontally, clamp vertically
+            const int xa = (x0 % mapWidth + mapWidth) % mapWidth;
+            const int xb = (xa + 1) % mapWidth;
+            const double* r0 = row(clampRow(y0));
+            const double* r1 = row(clampRow(y0 + 1));
+
+            const int f  = t.index / faceTexels;
+            const int ti = t.index % faceTexels;
+            double* dst = out.face(size_t(f)).pixels().data() + ti * 4;
+            for (int c = 0; c < 4; ++c)
+            {
+                const double a = r0[xa * 4 + c] * (1.0 - tx) + r0[xb * 4 + c] * tx;
+                const double b = r1[xa * 4 + c] * (1.0 - tx) + r1[xb * 4 + c] * tx;
+                dst[c] = a * (1.0 - ty) + b * ty;
+            }
+        }
 
-        return out;
+        // Keep the last row for the footprints of the next band.
+        const double* lastRow = row(bandEnd - 1);
+        carry.assign(lastRow, lastRow + rowLength);
+        nextRow = bandEnd;
+        return true;
     }
 
     /* ------------------------------------------------------------ *
      * ------------------------------------------------------------ */
-    double edgeFunction(const glm::dvec2& a,
-                        const glm::dvec2& b,
-                        const glm::dvec2& c) const
+    TextureCube<double, 4> end()
     {
-        return ((c.x - a.x) * (b.y - a.y) - (c.y - a.y) * (b.x - a.x));
+        if (nextRow != mapHeight)
+            std::cerr << __FUNCTION__
+                      << ": map was not fully converted, "
+                      << nextRow << "/" << mapHeight << " rows"
+                      << std::endl;
+
+        if (mipmaps && !out.generateMipmaps())
+            std::cerr << __FUNCTION__
+                      << ": failed to generate mipmaps"
+                      << std::endl;
+
+        texels.clear();
+        texels.shrink_to_fit();
+        rowOffsets.clear();
+        carry.clear();
+
+        TextureCube<double, 4> result = out;
+        out = TextureCube<double, 4>();
+        return result;
     }
-};
 
-/* ---------------------------------------------------------------- *
- * ---------------------------------------------------------------- */
-struct EquirectangularToCubemap::Impl
-{
     /* ------------------------------------------------------------ *
      * ------------------------------------------------------------ */
-    Impl(EquirectangularToCubemap* self, int size)
-        : self(self)
-        , size(size)
-    {}
+    int clampRow(int r) const
+    { return r < 0 ? 0 : (r >= mapHeight ? mapHeight - 1 : r); }
 
     /* ------------------------------------------------------------ *
      * ------------------------------------------------------------ */
-    TextureCube<double, 4> run(const Texture2D<double, 4>& e)
+    glm::dvec2 sampleSphericalMap(const glm::dvec3& v) const
     {
-        TextureCube<double, 4> out(size, size);
-
-        auto callback = [&](const glm::dvec3& p)
-        {
-            glm::dvec3 n = glm::normalize(p);
-            glm::dvec2 uv = sampleSphericalMap(n);
-            std::array<double, 4> c = e.pixel(uv.x, uv.y);
-
-            const texture_cube_mapping::TextureCoordinate texCoord =
-                texture_cube_mapping::mapPoint(n);
-
-            glm::ivec2 sc = mapCoord(texCoord.uv);
-            size_t face = size_t(texCoord.faceIndex);
-            if (texCoord.faceIndex < 0 || texCoord.faceIndex > 5)
-                qDebug() << texCoord.faceIndex << sc.x << sc.y << texCoord.uv.x << texCoord.uv.y;
-            out.face(face).setPixel(sc.x, sc.y, c);
-        };
-
-        CubeRasterizer rasterizer(size, size, callback);
-        rasterizer.run();
-
-        return out;
-    }
-
-    /* ------------------------------------------------------------ *
-     * ------------------------------------------------------------ */
-    glm::dvec2 sampleSphericalMap(const glm::dvec3& v)
-    {
-        const glm::dvec2 invAtan = glm::dvec2(0.1591, 0.3183);
+        const glm::dvec2 invAtan = glm::dvec2(0.5 / M_PI, 1.0 / M_PI);
         glm::dvec2 uv = glm::dvec2(std::atan2(v.z, v.x), std::asin(v.y));
         uv *= invAtan;
         uv += 0.5;
         return uv;
     }
 
-    /* ------------------------------------------------------------ *
-     * ------------------------------------------------------------ */
-    glm::ivec2 mapCoord(glm::dvec2 texCoord) const
-    {
-        texCoord.y = 1.0 - texCoord.y;
-        int px = int(std::floor(texCoord.x * double(size - 1)));
-        int py = int(std::floor(texCoord.y * double(size - 1)));
-        return glm::ivec2(px, py);
-    }
-
     EquirectangularToCubemap* self;
     int size;
+    bool mipmaps;
+
+    TextureCube<double, 4> out;
+    int mapWidth  = 0;
+    int mapHeight = 0;
+    int nextRow   = 0;
+    std::vector<Texel> texels;
+    std::vector<int> rowOffsets;
+    std::vector<double> carry;
 };
 
 /* ---------------------------------------------------------------- *
  * ---------------------------------------------------------------- */
-EquirectangularToCubemap::EquirectangularToCubemap(int size)
-    : impl(std::make_shared<Impl>(this, size))
+EquirectangularToCubemap::EquirectangularToCubemap(int size, bool mipmaps)
+    : impl(std::make_shared<Impl>(this, size, mipmaps))
 {}
 
 /* ---------------------------------------------------------------- *
@@ -282,5 +238,20 @@ EquirectangularToCubemap::EquirectangularToCubemap(int size)
 TextureCube<double, 4> EquirectangularToCubemap::run(const Texture2D<double, 4>& e)
 { return impl->run(e); }
 
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+void EquirectangularToCubemap::begin(int width, int height)
+{ impl->begin(width, height); }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+bool EquirectangularToCubemap::addBand(const Texture2D<double, 4>& band)
+{ return impl->addBand(band); }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+TextureCube<double, 4> EquirectangularToCubemap::end()
+{ return impl->end(); }
+
 } // namespace rasperi
 } // namespace kuu
@@ -14,14 +14,27 @@ namespace rasperi
 {
 
 /* ---------------------------------------------------------------- *
+   Converts an equirectangular map into a cube map. Cube texels
+   are filled in parallel with a bilinear sample of the map.
+
+   Large maps can be converted in horizontal bands from top to
+   bottom with begin(), addBand() and end(). Only the current band
+   needs to be in the memory.
  * ---------------------------------------------------------------- */
 class EquirectangularToCubemap
 {
 public:
-    EquirectangularToCubemap(int size = 128);
+    EquirectangularToCubemap(int size = 128, bool mipmaps = false);
 
+    // Converts the whole map.
     TextureCube<double, 4> run(const Texture2D<double, 4>& e);
 
+    // Converts the map in bands. Band width must match to the map
+    // width and bands must be given in order.
+    void begin(int width, int height);
+    bool addBand(const Texture2D<double, 4>& band);
+    TextureCube<double, 4> end();
+
 private:
     struct Impl;
     std::shared_ptr<Impl> impl;
@@ -5,7 +5,13 @@
  
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+#include <QtCore/QtGlobal>
 #include "rasperi_texture_2d.h"
 
 namespace kuu
@@ -14,34 +20,496 @@ namespace rasperi
 {
 
 /* ---------------------------------------------------------------- *
+   The color pixels are stored in the memory layout of the
+   QImage::Format_ARGB32_Premultiplied so that a frame is displayed
+   without converting it. Use the channel offsets to access the
+   bytes of a color pixel.
+
+   The color buffer is a swap chain so that the next frame can be
+   rendered while the previous one is displayed. Only one depth
+   buffer is needed.
+
+   Clears are lazy. The buffers are divided into tiles and a clear
+   only marks the tiles pending, a tile is filled with the clear
+   values when it is first drawn into. The rasterizers materialize
+   the tiles they touch, other code accessing the textures directly
+   must call materialize first.
+
+   The depth is stored normalized into [0, 1] in one of the depth
+   formats, only the texture of the current format is allocated.
+
+   The linear color before the tone mapping can be kept in a float
+   buffer for the HDR image files, it is not allocated by default.
  * ---------------------------------------------------------------- */
 class Framebuffer
 {
 public:
+#if Q_BYTE_ORDER == Q_BIG_ENDIAN
+    enum Channel { Alpha = 0, Red = 1, Green = 2, Blue = 3 };
+#else
+    enum Channel { Blue = 0, Green = 1, Red = 2, Alpha = 3 };
+#endif
+
+    static const int TileSize = 64;
+
+    /* ------------------------------------------------------------ *
+       Depth formats. With the reverse-Z the near plane is at one and
+       the far plane at zero which puts the far range, where the
+       perspective depth values crowd, to the dense end of the
+       floats. The unorm formats have an even precision over the
+       range, the 24-bit one is stored in 32 bits.
+     * ------------------------------------------------------------ */
+    enum class DepthFormat
+    {
+        Float64,
+        Float32,
+        Unorm24,
+        Unorm16
+    };
+
+    /* ------------------------------------------------------------ *
+       Depth compare functions. The fragment passes if its distance
+       compares true against the distance in the buffer, e.g. Less
+       passes the nearer fragments also with the reverse-Z.
+     * ------------------------------------------------------------ */
+    enum class DepthCompare
+    {
+        Less,
+        LessEqual,
+        Greater,
+        GreaterEqual,
+        Equal,
+        Always
+    };
+
+    /* ------------------------------------------------------------ *
+       Stored types of the depth formats. The rasterizers are
+       specialized with these so that the depth test of the inner
+       loop is made in the stored type.
+     * ------------------------------------------------------------ */
+    struct DepthFloat64
+    {
+        typedef double Type;
+        static Type encode(double d) { return d; }
+    };
+
+    struct DepthFloat32
+    {
+        typedef float Type;
+        static Type encode(double d) { return Type(d); }
+    };
+
+    struct DepthUnorm24
+    {
+        typedef uint32_t Type;
+        static Type encode(double d) { return Type(d * 16777215.0 + 0.5); }
+    };
+
+    struct DepthUnorm16
+    {
+        typedef uint16_t Type;
+        static Type encode(double d) { return Type(d * 65535.0 + 0.5); }
+    };
+
     /* ------------------------------------------------------------ *
      * ------------------------------------------------------------ */
     Framebuffer(int width, int height)
         : colorTex(width, height)
         , depthTex(width, height)
+        , spareColorTex(1)
+    {
+        clearColor.fill(0);
+        clear();
+    }
+
+    /* ------------------------------------------------------------ *
+       Resizes the buffers, the memory is reused if the new size
+       fits into it. The buffers are cleared.
+     * ------------------------------------------------------------ */
+    void resize(int width, int height)
     {
+        colorTex.resize(width, height);
+        switch (format)
+        {
+            case DepthFormat::Float64: depthTex.resize(width, height);   break;
+            case DepthFormat::Float32: depthTex32.resize(width, height); break;
+            case DepthFormat::Unorm24: depthTex24.resize(width, height); break;
+            case DepthFormat::Unorm16: depthTex16.resize(width, height); break;
+        }
+        if (hdrEnabled)
+            hdrTex.resize(width, height);
         clear();
     }
 
     /* ------------------------------------------------------------ *
+       Enables the HDR color buffer, it is cleared to zero.
+     * ------------------------------------------------------------ */
+    void setHdrEnabled(bool enabled)
+    {
+        hdrEnabled = enabled;
+        hdrTex = Texture2D<float, 4>();
+        if (enabled)
+            hdrTex.resize(colorTex.width(), colorTex.height());
+        for (uchar& pending : pendingTiles)
+            pending |= HdrPending;
+    }
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    bool isHdrEnabled() const
+    { return hdrEnabled; }
+
+    /* ------------------------------------------------------------ *
+       Returns the HDR color buffer and takes a new one into use for
+       the next frame. Null if the buffer is not enabled.
+     * ------------------------------------------------------------ */
+    Texture2D<float, 4> takeHdr()
+    {
+        if (!hdrEnabled)
+            return Texture2D<float, 4>();
+
+        materialize(HdrPending);
+
+        Texture2D<float, 4> out = std::move(hdrTex);
+        hdrTex = Texture2D<float, 4>();
+        hdrTex.resize(out.width(), out.height());
+        for (uchar& pending : pendingTiles)
+            pending |= HdrPending;
+        return out;
+    }
+
+    /* ------------------------------------------------------------ *
+       Sets the depth format, the texture of the previous format is
+       released. The buffers are cleared.
+     * ------------------------------------------------------------ */
+    void setDepthFormat(DepthFormat depthFormat, bool reverse = false)
+    {
+        format   = depthFormat;
+        reverseZ = reverse;
+
+        depthTex   = Texture2D<double,   1>();
+        depthTex32 = Texture2D<float,    1>();
+        depthTex24 = Texture2D<uint32_t, 1>();
+        depthTex16 = Texture2D<uint16_t, 1>();
+        resize(colorTex.width(), colorTex.height());
+    }
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    DepthFormat depthFormat() const
+    { return format; }
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    bool isReverseZ() const
+    { return reverseZ; }
+
+    /* ------------------------------------------------------------ *
+       Maps the NDC z into the stored depth range. The depth outside
+       of the near and far planes is clamped.
+     * ------------------------------------------------------------ */
+    double normalizedDepth(double ndcZ) const
+    {
+        const double d = std::min(1.0, std::max(0.0, ndcZ * 0.5 + 0.5));
+        return reverseZ ? 1.0 - d : d;
+    }
+
+    /* ------------------------------------------------------------ *
+       Returns true if the fragment depth z passes the compare
+       against the buffer depth d. Both are in the stored form.
+     * ------------------------------------------------------------ */
+    template<typename T>
+    bool depthTest(DepthCompare compare, T z, T d) const
+    {
+        // With the reverse-Z a nearer fragment has a larger value.
+        if (reverseZ)
+            std::swap(z, d);
+
+        switch (compare)
+        {
+            case DepthCompare::Less:         return z <  d;
+            case DepthCompare::LessEqual:    return z <= d;
+            case DepthCompare::Greater:      return z >  d;
+            case DepthCompare::GreaterEqual: return z >= d;
+            case DepthCompare::Equal:        return z == d;
+            case DepthCompare::Always:       return true;
+        }
+        return false;
+    }
+
+    /* ------------------------------------------------------------ *
+       Returns the depth pixels of the format given as a depth type,
+       the format must be the current one.
+     * ------------------------------------------------------------ */
+    template<typename Depth>
+    typename Depth::Type* depthPixels()
+    { return depthTexture(typename Depth::Type()).pixels().data(); }
+
+    /* ------------------------------------------------------------ *
+       Returns the clear depth in the stored form.
+     * ------------------------------------------------------------ */
+    template<typename Depth>
+    typename Depth::Type clearDepth() const
+    { return Depth::encode(reverseZ ? 0.0 : 1.0); }
+
+    /* ------------------------------------------------------------ *
+       Returns true if nothing has been drawn into the pixel since
+       the clear. The pixel must be materialized.
+     * ------------------------------------------------------------ */
+    bool isDepthClear(size_t index)
+    {
+        switch (format)
+        {
+            case DepthFormat::Float64: return isDepthClear<DepthFloat64>(index);
+            case DepthFormat::Float32: return isDepthClear<DepthFloat32>(index);
+            case DepthFormat::Unorm24: return isDepthClear<DepthUnorm24>(index);
+            case DepthFormat::Unorm16: return isDepthClear<DepthUnorm16>(index);
+        }
+        return false;
+    }
+
+    /* ------------------------------------------------------------ *
+       Marks all the tiles to be cleared.
      * ------------------------------------------------------------ */
     void clear()
     {
-        std::array<uchar, 4> colorPix = { 0, 0, 0, 0 };
-        colorTex.clear(colorPix);
+        tileCountX = (colorTex.width()  + TileSize - 1) / TileSize;
+        tileCountY = (colorTex.height() + TileSize - 1) / TileSize;
+        pendingTiles.assign(size_t(tileCountX * tileCountY),
+                            ColorPending | DepthPending | HdrPending);
+    }
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    int tileCount() const
+    { return tileCountX * tileCountY; }
+
+    /* ------------------------------------------------------------ *
+       Returns the index of the tile that contains the pixel.
+     * ------------------------------------------------------------ */
+    int tileIndex(int x, int y) const
+    { return (y / TileSize) * tileCountX + x / TileSize; }
+
+    /* ------------------------------------------------------------ *
+       Returns the pixel area of the tile as min x, min y, max x and
+       max y, the max is inclusive.
+     * ------------------------------------------------------------ */
+    std::array<int, 4> tileRect(int tile) const
+    {
+        const int x0 = (tile % tileCountX) * TileSize;
+        const int y0 = (tile / tileCountX) * TileSize;
+        return { x0, y0,
+                 std::min(colorTex.width(),  x0 + TileSize) - 1,
+                 std::min(colorTex.height(), y0 + TileSize) - 1 };
+    }
+
+    /* ------------------------------------------------------------ *
+       Fills the tile with the clear values if it is pending. Tiles
+       can be materialized in parallel as long as each tile is
+       materialized by a single thread.
+     * ------------------------------------------------------------ */
+    void materializeTile(int tile)
+    {
+        const uchar pending = pendingTiles[size_t(tile)];
+        if (!pending)
+            return;
+        pendingTiles[size_t(tile)] = 0;
+
+        const std::array<int, 4> r = tileRect(tile);
+        const size_t w     = size_t(colorTex.width());
+        const size_t count = size_t(r[2] - r[0] + 1);
+
+        if (pending & ColorPending)
+        {
+            // The first row is filled pixel by pixel and copied to
+            // the other rows.
+            uchar* color = colorTex.pixels().data();
+            uchar* first = color + (size_t(r[1]) * w + size_t(r[0])) * 4;
+            for (size_t x = 0; x < count; ++x)
+                std::memcpy(first + x * 4, clearColor.data(), 4);
+            for (int y = r[1] + 1; y <= r[3]; ++y)
+                std::memcpy(color + (size_t(y) * w + size_t(r[0])) * 4,
+                            first, count * 4);
+        }
+
+        if (pending & DepthPending)
+        {
+            switch (format)
+            {
+                case DepthFormat::Float64: fillDepth<DepthFloat64>(r); break;
+                case DepthFormat::Float32: fillDepth<DepthFloat32>(r); break;
+                case DepthFormat::Unorm24: fillDepth<DepthUnorm24>(r); break;
+                case DepthFormat::Unorm16: fillDepth<DepthUnorm16>(r); break;
+            }
+        }
+
+        if ((pending & HdrPending) && hdrEnabled)
+        {
+            float* hdr = hdrTex.pixels().data();
+            for (int y = r[1]; y <= r[3]; ++y)
+                std::fill_n(hdr + (size_t(y) * w + size_t(r[0])) * 4,
+                            count * 4, 0.0f);
+        }
+    }
+
+    /* ------------------------------------------------------------ *
+       Materializes the tile of the pixel.
+     * ------------------------------------------------------------ */
+    void materializePixel(int x, int y)
+    {
+        if (x >= 0 && y >= 0 && x < colorTex.width() && y < colorTex.height())
+            materializeTile(tileIndex(x, y));
+    }
+
+    /* ------------------------------------------------------------ *
+       Materializes all the pending tiles.
+     * ------------------------------------------------------------ */
+    void materialize()
+    {
+        const int count = tileCount();
+        #pragma omp parallel for
+        for (int t = 0; t < count; ++t)
+            materializeTile(t);
+    }
+
+    /* ------------------------------------------------------------ *
+       Returns the color buffer as an image that shares the pixels
+       with the framebuffer. The image keeps the buffer alive, call
+       swapColorBuffers before rendering the next frame so that the
+       image is not drawn over.
+     * ------------------------------------------------------------ */
+    QImage toQImage()
+    {
+        materialize(ColorPending);
+
+        auto buffer = new Texture2D<uchar, 4>(colorTex);
+        return QImage(buffer->pixels().data(),
+                      buffer->width(),
+                      buffer->height(),
+                      buffer->width() * 4,
+                      QImage::Format_ARGB32_Premultiplied,
+                      [](void* info)
+                      {
+                          delete static_cast<Texture2D<uchar, 4>*>(info);
+                      },
+                      buffer);
+    }
 
-        std::array<double, 1> depthPix = { std::numeric_limits<double>::max() };
-        depthTex.clear(depthPix);
+    /* ------------------------------------------------------------ *
+       Sets the count of the color buffers, two for double and three
+       for triple buffering. The spare buffers are allocated when
+       they are first swapped in.
+     * ------------------------------------------------------------ */
+    void setSwapChainLength(int length)
+    {
+        spareColorTex.resize(size_t(std::max(1, length) - 1));
     }
 
     /* ------------------------------------------------------------ *
+       Swaps the next color buffer in. The oldest spare that nothing
+       refers to anymore, e.g. its image has been replaced in the
+       display, is taken into the use. If all the spares are still
+       referred the oldest one is let go and a new buffer allocated.
+       The pixels of the buffer are stale, the swap marks all its
+       tiles pending so that they are cleared when first touched.
      * ------------------------------------------------------------ */
-    Texture2D<uchar,  4> colorTex;
-    Texture2D<double, 1> depthTex;
+    void swapColorBuffers()
+    {
+        if (spareColorTex.empty())
+            return;
+
+        size_t i = 0;
+        while (i < spareColorTex.size() && !spareColorTex[i].isDetached())
+            ++i;
+
+        Texture2D<uchar, 4> next;
+        if (i < spareColorTex.size())
+            next = std::move(spareColorTex[i]);
+        else
+            i = 0;
+        spareColorTex.erase(spareColorTex.begin() + i);
+
+        next.resize(colorTex.width(), colorTex.height());
+        spareColorTex.push_back(std::move(colorTex));
+        colorTex = std::move(next);
+
+        for (uchar& pending : pendingTiles)
+            pending |= ColorPending;
+    }
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    Texture2D<uchar,    4> colorTex;
+    Texture2D<double,   1> depthTex;   // DepthFormat::Float64
+    Texture2D<float,    1> depthTex32; // DepthFormat::Float32
+    Texture2D<uint32_t, 1> depthTex24; // DepthFormat::Unorm24
+    Texture2D<uint16_t, 1> depthTex16; // DepthFormat::Unorm16
+    Texture2D<float,    4> hdrTex;     // RGBA, if enabled
+
+private:
+    enum Pending : uchar
+    {
+        ColorPending = 1,
+        DepthPending = 2,
+        HdrPending   = 4,
+    };
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    Texture2D<double,   1>& depthTexture(double)   { return depthTex;   }
+    Texture2D<float,    1>& depthTexture(float)    { return depthTex32; }
+    Texture2D<uint32_t, 1>& depthTexture(uint32_t) { return depthTex24; }
+    Texture2D<uint16_t, 1>& depthTexture(uint16_t) { return depthTex16; }
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    template<typename Depth>
+    bool isDepthClear(size_t index)
+    { return depthPixels<Depth>()[index] == clearDepth<Depth>(); }
+
+    /* ------------------------------------------------------------ *
+       Fills the depth of the tile area with the clear depth.
+     * ------------------------------------------------------------ */
+    template<typename Depth>
+    void fillDepth(const std::array<int, 4>& r)
+    {
+        const size_t w     = size_t(colorTex.width());
+        const size_t count = size_t(r[2] - r[0] + 1);
+        const typename Depth::Type clear = clearDepth<Depth>();
+
+        typename Depth::Type* depth = depthPixels<Depth>();
+        for (int y = r[1]; y <= r[3]; ++y)
+            std::fill_n(depth + size_t(y) * w + size_t(r[0]), count, clear);
+    }
+
+    /* ------------------------------------------------------------ *
+       Fills the buffers of the pending flags, the other buffers are
+       left pending.
+     * ------------------------------------------------------------ */
+    void materialize(uchar flags)
+    {
+        const int count = tileCount();
+        #pragma omp parallel for
+        for (int t = 0; t < count; ++t)
+        {
+            const uchar pending = pendingTiles[size_t(t)];
+            if (!(pending & flags))
+                continue;
+            pendingTiles[size_t(t)] = pending & flags;
+            materializeTile(t);
+            pendingTiles[size_t(t)] = uchar(pending & ~flags);
+        }
+    }
+
+    std::array<uchar, 4> clearColor;
+    bool hdrEnabled = false;
+    DepthFormat format = DepthFormat::Float64;
+    bool reverseZ = false;
+    int tileCountX = 0;
+    int tileCountY = 0;
+    std::vector<uchar> pendingTiles;
+    // Oldest first.
+    std::vector<Texture2D<uchar, 4>> spareColorTex;
 };
 
 } // namespace rasperi
@@ -0,0 +1,342 @@
+/* ---------------------------------------------------------------- *
+   Antti Jumpponen <kuumies@gmail.com>
+   The implementation of kuu::rasperi::ImageSequenceWriter class.
+ * ---------------------------------------------------------------- */
+ 
+#include "rasperi_image_sequence_writer.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+
+namespace kuu
+{
+namespace rasperi
+{
+
+namespace
+{
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+bool writePpm(const ImageSequenceWriter::Frame& frame, QIODevice& file)
+{
+    if (frame.image.isNull())
+        return false;
+
+    const QImage rgb = frame.image.convertToFormat(QImage::Format_RGB888);
+    const QByteArray header = "P6\n" + QByteArray::number(rgb.width())  + " " +
+                                       QByteArray::number(rgb.height()) + "\n255\n";
+    if (file.write(header) != header.size())
+        return false;
+
+    const qint64 rowSize = qint64(rgb.width()) * 3;
+    for (int y = 0; y < rgb.height(); ++y)
+    {
+        const char* row = reinterpret_cast<const char*>(rgb.constScanLine(y));
+        if (file.write(row, rowSize) != rowSize)
+            return false;
+    }
+    return true;
+}
+
+/* ---------------------------------------------------------------- *
+   Rows are written from the bottom to the top, the negative scale
+   marks the little-endian floats.
+ * ---------------------------------------------------------------- */
+bool writePfm(const ImageSequenceWriter::Frame& frame, QIODevice& file)
+{
+    const bool hdr = !frame.hdr.isNull();
+    if (!hdr && frame.image.isNull())
+        return false;
+
+    const int w = hdr ? frame.hdr.width()  : frame.image.width();
+    const int h = hdr ? frame.hdr.height() : frame.image.height();
+#if Q_BYTE_ORDER == Q_BIG_ENDIAN
+    const char* scale = "\n1.0\n";
+#else
+    const char* scale = "\n-1.0\n";
+#endif
+    const QByteArray header = "PF\n" + QByteArray::number(w) + " " +
+                                       QByteArray::number(h) + scale;
+    if (file.write(header) != header.size())
+        return false;
+
+    // Without the HDR buffer the display color is written.
+    QImage rgb;
+    if (!hdr)
+        rgb = frame.image.convertToFormat(QImage::Format_RGB888);
+
+    std::vector<float> row(size_t(w) * 3);
+    const qint64 rowSize = qint64(row.size() * sizeof(float));
+    for (int y = h - 1; y >= 0; --y)
+    {
+        if (hdr)
+        {
+            const float* src = frame.hdr.pixels().data() + size_t(y) * size_t(w) * 4;
+            for (int x = 0; x < w; ++x)
+                std::copy_n(src + x * 4, 3, row.data() + x * 3);
+        }
+        else
+        {
+            const uchar* src = rgb.constScanLine(y);
+            for (size_t i = 0; i < row.size(); ++i)
+                row[i] = src[i] / 255.0f;
+        }
+
+        if (file.write(reinterpret_cast<const char*>(row.data()), rowSize) != rowSize)
+            return false;
+    }
+    return true;
+}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+bool writeRaw(const ImageSequenceWriter::Frame& frame, QIODevice& file)
+{
+    if (!frame.hdr.isNull())
+    {
+        const std::vector<float>& pixels = frame.hdr.pixels();
+        const qint64 size = qint64(pixels.size() * sizeof(float));
+        return file.write(reinterpret_cast<const char*>(pixels.data()), size) == size;
+    }
+
+    if (frame.image.isNull())
+        return false;
+
+    const QImage rgba = frame.image.convertToFormat(QImage::Format_RGBA8888);
+    const qint64 rowSize = qint64(rgba.width()) * 4;
+    for (int y = 0; y < rgba.height(); ++y)
+    {
+        const char* row = reinterpret_cast<const char*>(rgba.constScanLine(y));
+        if (file.write(row, rowSize) != rowSize)
+            return false;
+    }
+    return true;
+}
+
+} // anonymous namespace
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+struct ImageSequenceWriter::Impl
+{
+    struct Job
+    {
+        Frame frame;
+        QString filepath;
+    };
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    Impl(int threadCount, int capacity)
+        : capacity(size_t(std::max(1, capacity)))
+        , pngCompression(-1)
+    {
+        encoders["ppm"] = writePpm;
+        encoders["pfm"] = writePfm;
+        encoders["raw"] = writeRaw;
+        encoders["png"] = [this](const Frame& frame, QIODevice& file)
+        {
+            // Qt maps the quality [0, 100] into the zlib level [9, 0].
+            const int level = pngCompression;
+            const int quality = level < 0 ? -1 : 100 - (91 * level + 8) / 9;
+            return frame.image.save(&file, "PNG", quality);
+        };
+
+        for (int i = 0; i < threadCount; ++i)
+            threads.emplace_back([this]() { writeLoop(); });
+    }
+
+    /* ------------------------------------------------------------ *
+       The queued frames are written before the threads quit.
+     * ------------------------------------------------------------ */
+    ~Impl()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        jobAdded.notify_all();
+        for (std::thread& t : threads)
+            t.join();
+    }
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    void writeLoop()
+    {
+        for (;;)
+        {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                jobAdded.wait(lock, [this]() { return !jobs.empty() || quit; });
+                if (jobs.empty())
+                    return;
+
+                job = std::move(jobs.front());
+                jobs.pop_front();
+                ++busy;
+            }
+            jobTaken.notify_one();
+
+            save(job.frame, job.filepath);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            --busy;
+            jobDone.notify_all();
+        }
+    }
+
+    /* ------------------------------------------------------------ *
+       Encodes and writes the frame on the calling thread.
+     * ------------------------------------------------------------ */
+    bool save(const Frame& frame, const QString& filepath)
+    {
+        const QString suffix = QFileInfo(filepath).suffix();
+        Encoder encoder;
+        Callback done;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = encoders.find(suffix.toLower());
+            if (it != encoders.end())
+                encoder = it->second;
+            done = callback;
+        }
+
+        // Other formats are written by the image plugins of Qt.
+        if (!encoder)
+        {
+            const QByteArray format = suffix.toLatin1();
+            encoder = [format](const Frame& frame, QIODevice& file)
+            {
+                return frame.image.save(&file, format.constData());
+            };
+        }
+
+        QString error;
+        QFile file(filepath);
+        if (!file.open(QIODevice::WriteOnly))
+            error = "Failed to open " + filepath;
+        else if (!encoder(frame, file))
+            error = "Failed to write " + filepath;
+        if (!error.isEmpty() && file.isOpen())
+            file.remove();
+
+        if (done)
+            done(filepath, error.isEmpty());
+
+        if (!error.isEmpty())
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            errors.push_back(error);
+        }
+        return error.isEmpty();
+    }
+
+    /* ------------------------------------------------------------ *
+       Without threads the frame is written on the calling thread.
+     * ------------------------------------------------------------ */
+    void write(const Frame& frame, const QString& filepath)
+    {
+        if (threads.empty())
+        {
+            save(frame, filepath);
+            return;
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            jobTaken.wait(lock, [this]() { return jobs.size() < capacity; });
+            jobs.push_back({ frame, filepath });
+        }
+        jobAdded.notify_one();
+    }
+
+    std::mutex mutex;
+    std::condition_variable jobAdded;
+    std::condition_variable jobTaken;
+    std::condition_variable jobDone;
+    std::deque<Job> jobs;
+    size_t capacity;
+    std::map<QString, Encoder> encoders;
+    Callback callback;
+    QStringList errors;
+    std::atomic<int> pngCompression;
+    int busy = 0;
+    bool quit = false;
+    std::vector<std::thread> threads;
+};
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+ImageSequenceWriter::ImageSequenceWriter(int threads, int capacity)
+    : impl(std::make_shared<Impl>(threads, capacity))
+{}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+void ImageSequenceWriter::setEncoder(const QString& suffix, const Encoder& encoder)
+{
+    std::lock_guard<std::mutex> lock(impl->mutex);
+    impl->encoders[suffix.toLower()] = encoder;
+}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+void ImageSequenceWriter::setPngCompression(int level)
+{ impl->pngCompression = std::min(level, 9); }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+void ImageSequenceWriter::setCallback(const Callback& callback)
+{
+    std::lock_guard<std::mutex> lock(impl->mutex);
+    impl->callback = callback;
+}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+void ImageSequenceWriter::write(const Frame& frame, const QString& filepath)
+{ impl->write(frame, filepath); }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+void ImageSequenceWriter::write(const QImage& image, const QString& filepath)
+{ impl->write({ image, Texture2D<float, 4>() }, filepath); }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+bool ImageSequenceWriter::save(const Frame& frame, const QString& filepath)
+{ return impl->save(frame, filepath); }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+void ImageSequenceWriter::finish()
+{
+    std::unique_lock<std::mutex> lock(impl->mutex);
+    impl->jobDone.wait(lock, [this]()
+    {
+        return impl->jobs.empty() && impl->busy == 0;
+    });
+}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+QStringList ImageSequenceWriter::takeErrors()
+{
+    std::lock_guard<std::mutex> lock(impl->mutex);
+    QStringList out = impl->errors;
+    impl->errors.clear();
+    return out;
+}
+
+} // namespace rasperi
+} // namespace kuu
@@ -0,0 +1,84 @@
+/* ---------------------------------------------------------------- *
+   Antti Jumpponen <kuumies@gmail.com>
+   The definition of kuu::rasperi::ImageSequenceWriter class.
+ * ---------------------------------------------------------------- */
+ 
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <QtCore/QString>
+#include <QtCore/QStringList>
+#include <QtGui/QImage>
+#include "rasperi_texture_2d.h"
+
+class QIODevice;
+
+namespace kuu
+{
+namespace rasperi
+{
+
+/* ---------------------------------------------------------------- *
+   Writes frames into image files in a pool of background threads.
+   The write call only queues the frame, the encoding and the disk
+   access are done by the threads. The queue is bounded so that
+   the frames in memory stay limited, write waits if the queue is
+   full. A caller that already has its own writer threads can use
+   save that writes on the calling thread.
+
+   The encoder is chosen by the file suffix:
+     ppm  8-bit binary RGB (P6)
+     pfm  32-bit float RGB, the HDR buffer if the frame has it
+     raw  no header, 32-bit float RGBA of the HDR buffer if the
+          frame has it, otherwise 8-bit RGBA
+     png  with the PNG compression level
+   Other suffixes are written with the image formats of Qt. The
+   encoders can be replaced and new ones added.
+ * ---------------------------------------------------------------- */
+class ImageSequenceWriter
+{
+public:
+    struct Frame
+    {
+        QImage image;
+        // Linear color before the tone mapping, may be null.
+        Texture2D<float, 4> hdr;
+    };
+
+    // Writes the frame into the opened file, returns false on error.
+    using Encoder = std::function<bool(const Frame& frame, QIODevice& file)>;
+    // Called from a writer thread after a file has been written.
+    using Callback = std::function<void(const QString& filepath, bool ok)>;
+
+    // Zero threads writes on the calling thread.
+    explicit ImageSequenceWriter(int threads = 2, int capacity = 4);
+
+    // Encoder of the lower case suffix without the dot, replaces
+    // the existing encoder of the suffix.
+    void setEncoder(const QString& suffix, const Encoder& encoder);
+    // Level 0 (none) to 9 (smallest file), -1 uses the default.
+    void setPngCompression(int level);
+    void setCallback(const Callback& callback);
+
+    // Queues the frame, waits if the queue is full.
+    void write(const Frame& frame, const QString& filepath);
+    void write(const QImage& image, const QString& filepath);
+
+    // Writes the frame on the calling thread, returns false on
+    // error. Can be called from many threads at once.
+    bool save(const Frame& frame, const QString& filepath);
+
+    // Waits until all the queued frames have been written.
+    void finish();
+
+    // Errors of the files written since the previous call.
+    QStringList takeErrors();
+
+private:
+    struct Impl;
+    std::shared_ptr<Impl> impl;
+};
+
+} // namespace rasperi
+} // namespace kuu
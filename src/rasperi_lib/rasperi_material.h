@@ -51,9 +51,9 @@ struct Material
         Sampler metalnessSampler;
         Sampler aoSampler;
 
-        TextureCube<double, 4>* irradiance = nullptr;
-        TextureCube<double, 4>* prefilter = nullptr;
-        Texture2D<double, 2>* brdfIntegration = nullptr;
+        const TextureCube<double, 4>* irradiance = nullptr;
+        const TextureCube<double, 4>* prefilter = nullptr;
+        const Texture2D<double, 2>* brdfIntegration = nullptr;
     };
 
     Model model = Model::Phong;
@@ -5,6 +5,7 @@
  
 #pragma once
 
+#include <memory>
 #include <vector>
 #include <glm/vec2.hpp>
 #include <glm/vec3.hpp>
@@ -15,6 +16,8 @@ namespace kuu
 namespace rasperi
 {
 
+struct Mesh;
+
 /* ---------------------------------------------------------------- *
  * ---------------------------------------------------------------- */
 struct Vertex
@@ -52,12 +55,44 @@ struct Triangle
     Vertex p3;
 };
 
+/* ---------------------------------------------------------------- *
+   A contiguous range of mesh triangles with bounds for culling the
+   whole range at once. The range is back-facing when seen from the
+   camera position e if
+
+     dot(center - e, coneAxis) >= coneCutoff * length(center - e) + radius
+
+   A cone cutoff of 1.0 disables the back-face test.
+ * ---------------------------------------------------------------- */
+struct Meshlet
+{
+    unsigned indexOffset;
+    unsigned triangleCount;
+    glm::dvec3 center;
+    double radius;
+    glm::dvec3 coneAxis;
+    double coneCutoff;
+};
+
+/* ---------------------------------------------------------------- *
+   A simplified version of a mesh. The error is the largest model
+   space distance of a vertex of the full mesh from the simplified
+   surface around the vertex it was collapsed into.
+ * ---------------------------------------------------------------- */
+struct MeshLod
+{
+    double error;
+    std::shared_ptr<Mesh> mesh;
+};
+
 /* ---------------------------------------------------------------- *
  * ---------------------------------------------------------------- */
 struct Mesh
 {
     std::vector<unsigned> indices;
     std::vector<Vertex> vertices;
+    std::vector<Meshlet> meshlets; // optional, see mesh_optimizer
+    std::vector<MeshLod> lods;     // optional, see mesh_simplifier
 };
 
 } // namespace rasperi
@@ -0,0 +1,391 @@
+/* ---------------------------------------------------------------- *
+   Antti Jumpponen <kuumies@gmail.com>
+   The implementation of kuu::rasperi::mesh_optimizer namespace.
+ * ---------------------------------------------------------------- */
+ 
+#include "rasperi_mesh_optimizer.h"
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <limits>
+#include <vector>
+#include <glm/common.hpp>
+#include <glm/geometric.hpp>
+#include "rasperi_mesh.h"
+
+namespace kuu
+{
+namespace rasperi
+{
+namespace mesh_optimizer
+{
+namespace
+{
+
+const int MAX_CACHE_SIZE = 64;
+
+/* ---------------------------------------------------------------- *
+   Vertex score of Forsyth's algorithm. Vertices in the cache score
+   higher, the three most recent ones get a fixed score so that the
+   next triangle does not simply reuse the previous one. Vertices
+   with few remaining triangles are boosted to get rid of them.
+ * ---------------------------------------------------------------- */
+float vertexScore(int cachePosition, unsigned remaining, int cacheSize)
+{
+    if (remaining == 0)
+        return -1.0f;
+
+    float score = 0.0f;
+    if (cachePosition >= 0)
+    {
+        if (cachePosition < 3)
+        {
+            score = 0.75f;
+        }
+        else
+        {
+            const float scale = 1.0f / float(cacheSize - 3);
+            score = 1.0f - float(cachePosition - 3) * scale;
+            score = std::pow(score, 1.5f);
+        }
+    }
+
+    score += 2.0f / std::sqrt(float(remaining));
+    return score;
+}
+
+} // anonymous namespace
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+size_t removeDegenerateTriangles(Mesh& mesh)
+{
+    const size_t vertexCount = mesh.vertices.size();
+    const size_t indexCount  = mesh.indices.size() - mesh.indices.size() % 3;
+
+    size_t out = 0;
+    for (size_t i = 0; i < indexCount; i += 3)
+    {
+        const unsigned a = mesh.indices[i + 0];
+        const unsigned b = mesh.indices[i + 1];
+        const unsigned c = mesh.indices[i + 2];
+        if (a >= vertexCount || b >= vertexCount || c >= vertexCount ||
+            a == b || b == c || c == a)
+        {
+            continue;
+        }
+
+        const glm::dvec3& pa = mesh.vertices[a].position;
+        const glm::dvec3& pb = mesh.vertices[b].position;
+        const glm::dvec3& pc = mesh.vertices[c].position;
+        const glm::dvec3 n = glm::cross(pb - pa, pc - pa);
+        if (n.x == 0.0 && n.y == 0.0 && n.z == 0.0)
+            continue;
+
+        mesh.indices[out++] = a;
+        mesh.indices[out++] = b;
+        mesh.indices[out++] = c;
+    }
+
+    const size_t removed = (mesh.indices.size() - out) / 3;
+    mesh.indices.resize(out);
+    mesh.meshlets.clear();
+    return removed;
+}
+
+/* ---------------------------------------------------------------- *
+   See https://tomforsyth1000.github.io/papers/fast_vert_cache_opt.html
+
+   Indices must be valid, see removeDegenerateTriangles.
+ * ---------------------------------------------------------------- */
+void optimizeVertexCache(Mesh& mesh, int cacheSize)
+{
+    cacheSize = std::max(4, std::min(cacheSize, MAX_CACHE_SIZE));
+
+    const std::vector<unsigned>& indices = mesh.indices;
+    const size_t vertexCount   = mesh.vertices.size();
+    const size_t triangleCount = indices.size() / 3;
+    if (triangleCount == 0)
+        return;
+
+    // Vertex to triangle adjacency. The first remaining[v] entries of
+    // the vertex are the triangles that are not added yet.
+    std::vector<unsigned> offsets(vertexCount + 1, 0);
+    for (size_t i = 0; i < triangleCount * 3; ++i)
+        offsets[indices[i] + 1]++;
+    for (size_t v = 0; v < vertexCount; ++v)
+        offsets[v + 1] += offsets[v];
+
+    std::vector<unsigned> remaining(vertexCount, 0);
+    std::vector<unsigned> adjacency(triangleCount * 3);
+    for (size_t t = 0; t < triangleCount; ++t)
+        for (int c = 0; c < 3; ++c)
+        {
+            const unsigned v = indices[t * 3 + size_t(c)];
+            adjacency[offsets[v] + remaining[v]++] = unsigned(t);
+        }
+
+    std::vector<int> cachePosition(vertexCount, -1);
+    std::vector<float> score(vertexCount);
+    for (size_t v = 0; v < vertexCount; ++v)
+        score[v] = vertexScore(-1, remaining[v], cacheSize);
+
+    std::vector<float> triangleScore(triangleCount);
+    std::vector<char> added(triangleCount, 0);
+    for (size_t t = 0; t < triangleCount; ++t)
+        triangleScore[t] = score[indices[t * 3 + 0]] +
+                           score[indices[t * 3 + 1]] +
+                           score[indices[t * 3 + 2]];
+
+    std::vector<unsigned> out;
+    out.reserve(triangleCount * 3);
+
+    std::vector<unsigned> cache;
+    std::vector<unsigned> nextCache;
+    cache.reserve(size_t(cacheSize) + 3);
+    nextCache.reserve(size_t(cacheSize) + 3);
+
+    size_t scan = 0;
+    long best = long(std::max_element(triangleScore.begin(),
+                                      triangleScore.end()) -
+                     triangleScore.begin());
+
+    while (out.size() < triangleCount * 3)
+    {
+        if (best < 0)
+        {
+            // Nothing adjacent to the cache, continue from the first
+            // triangle that is not added yet.
+            while (added[scan])
+                ++scan;
+            best = long(scan);
+        }
+
+        const size_t t = size_t(best);
+        added[t] = 1;
+
+        const unsigned* tri = &indices[t * 3];
+        for (int c = 0; c < 3; ++c)
+        {
+            const unsigned v = tri[c];
+            out.push_back(v);
+
+            // Remove the triangle from the remaining triangles
+            unsigned* first = &adjacency[offsets[v]];
+            unsigned* last  = first + remaining[v];
+            std::swap(*std::find(first, last, unsigned(t)), *(last - 1));
+            remaining[v]--;
+        }
+
+        // Triangle vertices to the front of the cache
+        nextCache.assign(tri, tri + 3);
+        for (unsigned v : cache)
+            if (v != tri[0] && v != tri[1] && v != tri[2])
+                nextCache.push_back(v);
+
+        for (size_t i = 0; i < nextCache.size(); ++i)
+        {
+            const unsigned v = nextCache[i];
+            cachePosition[v] = i < size_t(cacheSize) ? int(i) : -1;
+            score[v] = vertexScore(cachePosition[v], remaining[v], cacheSize);
+        }
+
+        // Rescore the triangles of the touched vertices and pick the
+        // best one for the next round.
+        best = -1;
+        float bestScore = -std::numeric_limits<float>::max();
+        for (unsigned v : nextCache)
+        {
+            for (unsigned a = 0; a < remaining[v]; ++a)
+            {
+                const unsigned n = adjacency[offsets[v] + a];
+                const unsigned* nt = &indices[size_t(n) * 3];
+                const float s = score[nt[0]] + score[nt[1]] + score[nt[2]];
+                triangleScore[n] = s;
+                if (s > bestScore)
+                {
+                    bestScore = s;
+                    best = long(n);
+                }
+            }
+        }
+
+        if (nextCache.size() > size_t(cacheSize))
+            nextCache.resize(size_t(cacheSize));
+        std::swap(cache, nextCache);
+    }
+
+    mesh.indices = out;
+    mesh.meshlets.clear();
+}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+size_t optimizeVertexFetch(Mesh& mesh)
+{
+    const unsigned unused = std::numeric_limits<unsigned>::max();
+    std::vector<unsigned> remap(mesh.vertices.size(), unused);
+
+    std::vector<Vertex> vertices;
+    vertices.reserve(mesh.vertices.size());
+    for (unsigned& i : mesh.indices)
+    {
+        if (remap[i] == unused)
+        {
+            remap[i] = unsigned(vertices.size());
+            vertices.push_back(mesh.vertices[i]);
+        }
+        i = remap[i];
+    }
+
+    const size_t removed = mesh.vertices.size() - vertices.size();
+    mesh.vertices.swap(vertices);
+    return removed;
+}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+double averageCacheMissRatio(const Mesh& mesh, int cacheSize)
+{
+    const size_t triangleCount = mesh.indices.size() / 3;
+    if (triangleCount == 0)
+        return 0.0;
+
+    std::deque<unsigned> cache;
+    size_t misses = 0;
+    for (size_t i = 0; i < triangleCount * 3; ++i)
+    {
+        const unsigned v = mesh.indices[i];
+        if (std::find(cache.begin(), cache.end(), v) != cache.end())
+            continue;
+
+        misses++;
+        cache.push_back(v);
+        if (cache.size() > size_t(cacheSize))
+            cache.pop_front();
+    }
+    return double(misses) / double(triangleCount);
+}
+
+/* ---------------------------------------------------------------- *
+   The bounds and the cone follow meshoptimizer's meshopt_computeMeshletBounds.
+ * ---------------------------------------------------------------- */
+void buildMeshlets(Mesh& mesh, int maxVertices, int maxTriangles)
+{
+    maxVertices  = std::max(3, maxVertices);
+    maxTriangles = std::max(1, maxTriangles);
+
+    mesh.meshlets.clear();
+
+    const size_t triangleCount = mesh.indices.size() / 3;
+    std::vector<unsigned> stamp(mesh.vertices.size(), 0);
+    std::vector<unsigned> meshletVertices;
+    meshletVertices.reserve(size_t(maxVertices));
+
+    auto finish = [&](size_t first, size_t last)
+    {
+        Meshlet m;
+        m.indexOffset   = unsigned(first * 3);
+        m.triangleCount = unsigned(last - first);
+
+        // Bounding sphere around the center of the bounding box.
+        glm::dvec3 min( std::numeric_limits<double>::max());
+        glm::dvec3 max(-std::numeric_limits<double>::max());
+        for (unsigned v : meshletVertices)
+        {
+            min = glm::min(min, mesh.vertices[v].position);
+            max = glm::max(max, mesh.vertices[v].position);
+        }
+        m.center = (min + max) * 0.5;
+        m.radius = 0.0;
+        for (unsigned v : meshletVertices)
+            m.radius = std::max(m.radius,
+                glm::length(mesh.vertices[v].position - m.center));
+
+        // Normal cone of the face normals.
+        std::vector<glm::dvec3> normals;
+        normals.reserve(last - first);
+        glm::dvec3 axis(0.0);
+        for (size_t t = first; t < last; ++t)
+        {
+            const glm::dvec3& a = mesh.vertices[mesh.indices[t * 3 + 0]].position;
+            const glm::dvec3& b = mesh.vertices[mesh.indices[t * 3 + 1]].position;
+            const glm::dvec3& c = mesh.vertices[mesh.indices[t * 3 + 2]].position;
+            const glm::dvec3 n = glm::cross(b - a, c - a);
+            const double length = glm::length(n);
+            if (length == 0.0)
+                continue;
+            normals.push_back(n / length);
+            axis += normals.back();
+        }
+
+        m.coneAxis   = glm::dvec3(0.0, 0.0, 1.0);
+        m.coneCutoff = 1.0;
+        const double axisLength = glm::length(axis);
+        if (axisLength > 0.0)
+        {
+            m.coneAxis = axis / axisLength;
+            double minDot = 1.0;
+            for (const glm::dvec3& n : normals)
+                minDot = std::min(minDot, glm::dot(n, m.coneAxis));
+
+            // A cone wider than about 84 degrees is never back-facing
+            // as a whole.
+            if (minDot > 0.1)
+                m.coneCutoff = std::sqrt(1.0 - minDot * minDot);
+        }
+
+        mesh.meshlets.push_back(m);
+        meshletVertices.clear();
+    };
+
+    size_t first = 0;
+    for (size_t t = 0; t < triangleCount; ++t)
+    {
+        const unsigned* tri = &mesh.indices[t * 3];
+        const unsigned id = unsigned(mesh.meshlets.size() + 1);
+
+        int newVertices = 0;
+        for (int c = 0; c < 3; ++c)
+            newVertices += stamp[tri[c]] != id &&
+                           (c < 1 || tri[c] != tri[0]) &&
+                           (c < 2 || tri[c] != tri[1]);
+
+        if (int(meshletVertices.size()) + newVertices > maxVertices ||
+            int(t - first) == maxTriangles)
+        {
+            finish(first, t);
+            first = t;
+        }
+
+        const unsigned current = unsigned(mesh.meshlets.size() + 1);
+        for (int c = 0; c < 3; ++c)
+        {
+            if (stamp[tri[c]] == current)
+                continue;
+            stamp[tri[c]] = current;
+            meshletVertices.push_back(tri[c]);
+        }
+    }
+
+    if (first < triangleCount)
+        finish(first, triangleCount);
+}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+Stats optimize(Mesh& mesh, int cacheSize)
+{
+    Stats stats;
+    stats.degenerateTriangles = removeDegenerateTriangles(mesh);
+    stats.acmrBefore = averageCacheMissRatio(mesh, cacheSize);
+    optimizeVertexCache(mesh, cacheSize);
+    stats.unusedVertices = optimizeVertexFetch(mesh);
+    stats.acmrAfter = averageCacheMissRatio(mesh, cacheSize);
+    buildMeshlets(mesh);
+    return stats;
+}
+
+} // namespace mesh_optimizer
+} // namespace rasperi
+} // namespace kuu
@@ -0,0 +1,73 @@
+/* ---------------------------------------------------------------- *
+   Antti Jumpponen <kuumies@gmail.com>
+   The definition of kuu::rasperi::mesh_optimizer namespace.
+ * ---------------------------------------------------------------- */
+ 
+#pragma once
+
+#include <cstddef>
+
+namespace kuu
+{
+namespace rasperi
+{
+
+struct Mesh;
+
+namespace mesh_optimizer
+{
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+struct Stats
+{
+    size_t degenerateTriangles = 0;
+    size_t unusedVertices      = 0;
+    double acmrBefore          = 0.0; // average cache miss ratio
+    double acmrAfter           = 0.0;
+};
+
+/* ---------------------------------------------------------------- *
+   Removes the triangles that have a repeated index, an index out
+   of range or a zero area. Returns the count of removed triangles.
+ * ---------------------------------------------------------------- */
+size_t removeDegenerateTriangles(Mesh& mesh);
+
+/* ---------------------------------------------------------------- *
+   Reorders the triangles for the vertex reuse with Tom Forsyth's
+   "Linear-Speed Vertex Cache Optimisation" algorithm.
+ * ---------------------------------------------------------------- */
+void optimizeVertexCache(Mesh& mesh, int cacheSize = 32);
+
+/* ---------------------------------------------------------------- *
+   Reorders the vertices into the order of the first use in the
+   index array and removes the vertices that are not used. Returns
+   the count of removed vertices.
+ * ---------------------------------------------------------------- */
+size_t optimizeVertexFetch(Mesh& mesh);
+
+/* ---------------------------------------------------------------- *
+   Average count of vertex transforms per triangle with a FIFO
+   post-transform cache of the given size. 3.0 is the worst case,
+   0.5 is about the best a regular grid can get.
+ * ---------------------------------------------------------------- */
+double averageCacheMissRatio(const Mesh& mesh, int cacheSize = 32);
+
+/* ---------------------------------------------------------------- *
+   Splits the triangles into meshlets in the index order, a meshlet
+   ends when either of the limits would be exceeded. Run after the
+   vertex cache optimization so that the meshlets are compact.
+   Passes that change the indices clear the meshlets.
+ * ---------------------------------------------------------------- */
+void buildMeshlets(Mesh& mesh,
+                   int maxVertices  = 64,
+                   int maxTriangles = 124);
+
+/* ---------------------------------------------------------------- *
+   Runs all the passes above.
+ * ---------------------------------------------------------------- */
+Stats optimize(Mesh& mesh, int cacheSize = 32);
+
+} // namespace mesh_optimizer
+} // namespace rasperi
+} // namespace kuu
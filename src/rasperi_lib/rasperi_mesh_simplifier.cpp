@@ -0,0 +1,558 @@
+/* ---------------------------------------------------------------- *
+   Antti Jumpponen <kuumies@gmail.com>
+   The implementation of kuu::rasperi::mesh_simplifier namespace.
+ * ---------------------------------------------------------------- */
+ 
+#include "rasperi_mesh_simplifier.h"
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <utility>
+#include <vector>
+#include <glm/geometric.hpp>
+#include "rasperi_mesh.h"
+#include "rasperi_mesh_optimizer.h"
+
+namespace kuu
+{
+namespace rasperi
+{
+namespace mesh_simplifier
+{
+namespace
+{
+
+// Weight of the planes that keep the open borders in place, relative
+// to the planes of the faces.
+const double BORDER_WEIGHT = 10.0;
+
+/* ---------------------------------------------------------------- *
+   Sum of squared distances to a set of weighted planes.
+ * ---------------------------------------------------------------- */
+struct Quadric
+{
+    void addPlane(const glm::dvec3& n, double d, double weight)
+    {
+        a00 += weight * n.x * n.x;
+        a01 += weight * n.x * n.y;
+        a02 += weight * n.x * n.z;
+        a11 += weight * n.y * n.y;
+        a12 += weight * n.y * n.z;
+        a22 += weight * n.z * n.z;
+        b0  += weight * n.x * d;
+        b1  += weight * n.y * d;
+        b2  += weight * n.z * d;
+        c   += weight * d * d;
+        w   += weight;
+    }
+
+    Quadric& operator+=(const Quadric& q)
+    {
+        a00 += q.a00; a01 += q.a01; a02 += q.a02;
+        a11 += q.a11; a12 += q.a12; a22 += q.a22;
+        b0  += q.b0;  b1  += q.b1;  b2  += q.b2;
+        c   += q.c;
+        w   += q.w;
+        return *this;
+    }
+
+    // Mean squared distance of the point to the planes.
+    double error(const glm::dvec3& p) const
+    {
+        const double e =
+            p.x * (a00 * p.x + a01 * p.y + a02 * p.z) +
+            p.y * (a01 * p.x + a11 * p.y + a12 * p.z) +
+            p.z * (a02 * p.x + a12 * p.y + a22 * p.z) +
+            2.0 * (b0 * p.x + b1 * p.y + b2 * p.z) + c;
+        return std::abs(e) / (w > 0.0 ? w : 1.0);
+    }
+
+    double a00 = 0.0, a01 = 0.0, a02 = 0.0;
+    double a11 = 0.0, a12 = 0.0, a22 = 0.0;
+    double b0  = 0.0, b1  = 0.0, b2  = 0.0;
+    double c   = 0.0;
+    double w   = 0.0;
+};
+
+/* ---------------------------------------------------------------- *
+   An edge between two positions and one of its triangles.
+ * ---------------------------------------------------------------- */
+struct Edge
+{
+    unsigned a;
+    unsigned b;
+    unsigned triangle;
+
+    bool operator<(const Edge& e) const
+    { return a < e.a || (a == e.a && b < e.b); }
+};
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+struct Collapse
+{
+    unsigned from;
+    unsigned to;
+    double cost;
+
+    bool operator<(const Collapse& c) const
+    { return cost < c.cost; }
+};
+
+/* ---------------------------------------------------------------- *
+   Assigns the vertices with the same position into the same group.
+ * ---------------------------------------------------------------- */
+size_t groupPositions(const std::vector<Vertex>& vertices,
+                      std::vector<unsigned>& group,
+                      std::vector<glm::dvec3>& groupPosition)
+{
+    auto less = [](const glm::dvec3& a, const glm::dvec3& b)
+    {
+        if (a.x != b.x) return a.x < b.x;
+        if (a.y != b.y) return a.y < b.y;
+        return a.z < b.z;
+    };
+
+    std::vector<unsigned> order(vertices.size());
+    std::iota(order.begin(), order.end(), 0u);
+    std::sort(order.begin(), order.end(), [&](unsigned a, unsigned b)
+    { return less(vertices[a].position, vertices[b].position); });
+
+    group.resize(vertices.size());
+    groupPosition.clear();
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+        const glm::dvec3& p = vertices[order[i]].position;
+        if (i == 0 || less(groupPosition.back(), p))
+            groupPosition.push_back(p);
+        group[order[i]] = unsigned(groupPosition.size() - 1);
+    }
+    return groupPosition.size();
+}
+
+/* ---------------------------------------------------------------- *
+   Closest point of the triangle to the point (Ericson, Real-Time
+   Collision Detection 5.1.5).
+ * ---------------------------------------------------------------- */
+glm::dvec3 closestPoint(const glm::dvec3& p,
+                        const glm::dvec3& a,
+                        const glm::dvec3& b,
+                        const glm::dvec3& c)
+{
+    const glm::dvec3 ab = b - a;
+    const glm::dvec3 ac = c - a;
+    const glm::dvec3 ap = p - a;
+    const double d1 = glm::dot(ab, ap);
+    const double d2 = glm::dot(ac, ap);
+    if (d1 <= 0.0 && d2 <= 0.0)
+        return a;
+
+    const glm::dvec3 bp = p - b;
+    const double d3 = glm::dot(ab, bp);
+    const double d4 = glm::dot(ac, bp);
+    if (d3 >= 0.0 && d4 <= d3)
+        return b;
+
+    const double vc = d1 * d4 - d3 * d2;
+    if (vc <= 0.0 && d1 >= 0.0 && d3 <= 0.0)
+        return a + ab * (d1 / (d1 - d3));
+
+    const glm::dvec3 cp = p - c;
+    const double d5 = glm::dot(ab, cp);
+    const double d6 = glm::dot(ac, cp);
+    if (d6 >= 0.0 && d5 <= d6)
+        return c;
+
+    const double vb = d5 * d2 - d1 * d6;
+    if (vb <= 0.0 && d2 >= 0.0 && d6 <= 0.0)
+        return a + ac * (d2 / (d2 - d6));
+
+    const double va = d3 * d6 - d5 * d4;
+    if (va <= 0.0 && d4 - d3 >= 0.0 && d5 - d6 >= 0.0)
+        return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+
+    const double denom = 1.0 / (va + vb + vc);
+    return a + ab * (vb * denom) + ac * (vc * denom);
+}
+
+/* ---------------------------------------------------------------- *
+   Largest distance of a source vertex from the triangles around the
+   position of the vertex it has been collapsed into.
+ * ---------------------------------------------------------------- */
+double deviation(const Mesh& mesh,
+                 const std::vector<unsigned>& sourceIndices,
+                 const std::vector<unsigned>& representative)
+{
+    const std::vector<Vertex>& vertices = mesh.vertices;
+    const std::vector<unsigned>& indices = mesh.indices;
+
+    std::vector<unsigned> group;
+    std::vector<glm::dvec3> groupPosition;
+    const size_t groupCount = groupPositions(vertices, group, groupPosition);
+
+    // Triangles around each position.
+    std::vector<unsigned> offsets(groupCount + 1);
+    for (unsigned i : indices)
+        offsets[group[i] + 1]++;
+    for (size_t g = 0; g < groupCount; ++g)
+        offsets[g + 1] += offsets[g];
+    std::vector<unsigned> triangles(indices.size());
+    {
+        std::vector<unsigned> fill(offsets.begin(), offsets.end() - 1);
+        for (size_t i = 0; i < indices.size(); ++i)
+            triangles[fill[group[indices[i]]]++] = unsigned(i / 3);
+    }
+
+    double error = 0.0;
+    std::vector<char> measured(vertices.size());
+    for (unsigned v : sourceIndices)
+    {
+        if (measured[v])
+            continue;
+        measured[v] = 1;
+
+        const glm::dvec3& p = vertices[v].position;
+        const unsigned g = group[representative[v]];
+        double d = glm::length(p - groupPosition[g]);
+        for (unsigned a = offsets[g]; a < offsets[g + 1]; ++a)
+        {
+            const unsigned* tri = &indices[size_t(triangles[a]) * 3];
+            const glm::dvec3 q = closestPoint(p, vertices[tri[0]].position,
+                                                 vertices[tri[1]].position,
+                                                 vertices[tri[2]].position);
+            d = std::min(d, glm::length(p - q));
+        }
+        error = std::max(error, d);
+    }
+    return error;
+}
+
+/* ---------------------------------------------------------------- *
+   Collapses the edges, the representative of each vertex is updated
+   to the vertex it has been collapsed into.
+ * ---------------------------------------------------------------- */
+void collapseEdges(Mesh& mesh,
+                   size_t targetTriangleCount,
+                   double maxError,
+                   std::vector<unsigned>& representative)
+{
+    mesh_optimizer::removeDegenerateTriangles(mesh);
+
+    std::vector<unsigned>& indices = mesh.indices;
+    const std::vector<Vertex>& vertices = mesh.vertices;
+    size_t triangleCount = indices.size() / 3;
+    if (triangleCount <= targetTriangleCount)
+        return;
+
+    std::vector<unsigned> group;
+    std::vector<glm::dvec3> groupPosition;
+    const size_t groupCount = groupPositions(vertices, group, groupPosition);
+
+    auto collectEdges = [&](std::vector<Edge>& edges)
+    {
+        edges.clear();
+        edges.reserve(indices.size());
+        for (size_t t = 0; t < triangleCount; ++t)
+            for (int c = 0; c < 3; ++c)
+            {
+                const unsigned a = group[indices[t * 3 + size_t(c)]];
+                const unsigned b = group[indices[t * 3 + size_t(c + 1) % 3]];
+                edges.push_back({ std::min(a, b), std::max(a, b), unsigned(t) });
+            }
+        std::sort(edges.begin(), edges.end());
+    };
+
+    auto faceNormal = [&](size_t t)
+    {
+        const glm::dvec3& a = groupPosition[group[indices[t * 3 + 0]]];
+        const glm::dvec3& b = groupPosition[group[indices[t * 3 + 1]]];
+        const glm::dvec3& c = groupPosition[group[indices[t * 3 + 2]]];
+        return glm::cross(b - a, c - a);
+    };
+
+    // Face quadrics weighted by the area and the border quadrics
+    // of the planes perpendicular to the faces through the borders.
+    std::vector<Quadric> quadrics(groupCount);
+    for (size_t t = 0; t < triangleCount; ++t)
+    {
+        glm::dvec3 n = faceNormal(t);
+        const double length = glm::length(n);
+        if (length == 0.0)
+            continue;
+        n /= length;
+
+        const glm::dvec3& p = groupPosition[group[indices[t * 3]]];
+        for (int c = 0; c < 3; ++c)
+            quadrics[group[indices[t * 3 + size_t(c)]]].addPlane(
+                n, -glm::dot(n, p), length * 0.5);
+    }
+
+    std::vector<Edge> edges;
+    collectEdges(edges);
+    for (size_t i = 0; i < edges.size(); ++i)
+    {
+        const bool first = i == 0 || edges[i - 1] < edges[i];
+        const bool last  = i + 1 == edges.size() || edges[i] < edges[i + 1];
+        if (!first || !last)
+            continue;
+
+        const Edge& e = edges[i];
+        const glm::dvec3& pa = groupPosition[e.a];
+        const glm::dvec3  d  = groupPosition[e.b] - pa;
+        const glm::dvec3  n  = glm::cross(d, glm::normalize(faceNormal(e.triangle)));
+        const double length = glm::length(n);
+        if (length == 0.0)
+            continue;
+
+        const glm::dvec3 bn = n / length;
+        const double weight = glm::dot(d, d) * BORDER_WEIGHT;
+        quadrics[e.a].addPlane(bn, -glm::dot(bn, pa), weight);
+        quadrics[e.b].addPlane(bn, -glm::dot(bn, pa), weight);
+    }
+
+    const double maxCost = maxError < std::sqrt(std::numeric_limits<double>::max())
+                         ? maxError * maxError
+                         : std::numeric_limits<double>::max();
+
+    std::vector<unsigned> remap(vertices.size());
+    std::iota(remap.begin(), remap.end(), 0u);
+
+    std::vector<char> locked(groupCount);
+    std::vector<char> manifold(groupCount, 1);
+    std::vector<unsigned> borderCount(groupCount);
+    std::vector<unsigned> offsets(groupCount + 1);
+    std::vector<unsigned> triangles;
+    std::vector<Collapse> collapses;
+    std::vector<std::pair<unsigned, unsigned>> wedges;
+    std::vector<unsigned> wedgesSeen;
+
+    while (triangleCount > targetTriangleCount)
+    {
+        // Position edges, the borders and non-manifold edges.
+        collectEdges(edges);
+        std::fill(borderCount.begin(), borderCount.end(), 0u);
+        collapses.clear();
+        for (size_t i = 0; i < edges.size();)
+        {
+            size_t j = i + 1;
+            while (j < edges.size() && !(edges[i] < edges[j]))
+                ++j;
+
+            const Edge& e = edges[i];
+            if (j - i == 1)
+            {
+                borderCount[e.a]++;
+                borderCount[e.b]++;
+            }
+            else if (j - i > 2)
+            {
+                manifold[e.a] = 0;
+                manifold[e.b] = 0;
+            }
+            i = j;
+        }
+
+        for (size_t i = 0; i < edges.size();)
+        {
+            size_t j = i + 1;
+            while (j < edges.size() && !(edges[i] < edges[j]))
+                ++j;
+
+            const Edge& e = edges[i];
+            const bool border = j - i == 1;
+            i = j;
+
+            const unsigned ends[2][2] = { { e.a, e.b }, { e.b, e.a } };
+            for (const auto& end : ends)
+            {
+                const unsigned from = end[0];
+                const unsigned to   = end[1];
+                if (!manifold[from] || !manifold[to])
+                    continue;
+
+                // A border vertex slides only along a simple border.
+                if (borderCount[from] > 0 && (!border || borderCount[from] != 2))
+                    continue;
+
+                Quadric q = quadrics[from];
+                q += quadrics[to];
+                collapses.push_back({ from, to, q.error(groupPosition[to]) });
+            }
+        }
+        std::sort(collapses.begin(), collapses.end());
+
+        // Triangles around each position.
+        std::fill(offsets.begin(), offsets.end(), 0u);
+        for (size_t i = 0; i < triangleCount * 3; ++i)
+            offsets[group[indices[i]] + 1]++;
+        for (size_t g = 0; g < groupCount; ++g)
+            offsets[g + 1] += offsets[g];
+        triangles.resize(triangleCount * 3);
+        {
+            std::vector<unsigned> fill(offsets.begin(), offsets.end() - 1);
+            for (size_t i = 0; i < triangleCount * 3; ++i)
+                triangles[fill[group[indices[i]]]++] = unsigned(i / 3);
+        }
+
+        // Collapse in the order of the cost. The positions around a
+        // collapse are locked for the rest of the pass, so that the
+        // triangle lists above stay valid.
+        std::fill(locked.begin(), locked.end(), 0);
+        size_t collapseCount = 0;
+        for (const Collapse& c : collapses)
+        {
+            if (triangleCount <= targetTriangleCount || c.cost > maxCost)
+                break;
+            if (locked[c.from] || locked[c.to])
+                continue;
+
+            // Every attribute wedge of the removed position must have
+            // exactly one wedge on the target position to move into.
+            bool valid = true;
+            size_t removedTriangles = 0;
+            wedges.clear();
+            wedgesSeen.clear();
+            for (unsigned a = offsets[c.from]; a < offsets[c.from + 1] && valid; ++a)
+            {
+                const unsigned* tri = &indices[size_t(triangles[a]) * 3];
+                int k = -1;
+                int j = -1;
+                for (int corner = 0; corner < 3; ++corner)
+                {
+                    if (group[tri[corner]] == c.from) k = corner;
+                    if (group[tri[corner]] == c.to)   j = corner;
+                }
+
+                wedgesSeen.push_back(tri[k]);
+                if (j >= 0)
+                {
+                    removedTriangles++;
+                    bool found = false;
+                    for (const auto& w : wedges)
+                    {
+                        if (w.first != tri[k])
+                            continue;
+                        found = true;
+                        valid &= w.second == tri[j];
+                    }
+                    if (!found)
+                        wedges.push_back({ tri[k], tri[j] });
+                    continue;
+                }
+
+                // The triangle must not flip or get degenerate.
+                glm::dvec3 p[3] = { groupPosition[group[tri[0]]],
+                                    groupPosition[group[tri[1]]],
+                                    groupPosition[group[tri[2]]] };
+                const glm::dvec3 n1 = glm::cross(p[1] - p[0], p[2] - p[0]);
+                p[k] = groupPosition[c.to];
+                const glm::dvec3 n2 = glm::cross(p[1] - p[0], p[2] - p[0]);
+                valid &= glm::dot(n1, n2) > 0.25 * glm::length(n1) * glm::length(n2);
+            }
+
+            for (unsigned w : wedgesSeen)
+            {
+                bool found = false;
+                for (const auto& m : wedges)
+                    found |= m.first == w;
+                valid &= found;
+            }
+
+            if (!valid)
+                continue;
+
+            for (const auto& w : wedges)
+                remap[w.first] = w.second;
+
+            for (unsigned a = offsets[c.from]; a < offsets[c.from + 1]; ++a)
+            {
+                const unsigned* tri = &indices[size_t(triangles[a]) * 3];
+                for (int corner = 0; corner < 3; ++corner)
+                    locked[group[tri[corner]]] = 1;
+            }
+
+            quadrics[c.to] += quadrics[c.from];
+            triangleCount -= removedTriangles;
+            collapseCount++;
+        }
+
+        if (collapseCount == 0)
+            break;
+
+        // Apply the collapses and drop the collapsed triangles.
+        size_t out = 0;
+        for (size_t i = 0; i + 2 < indices.size(); i += 3)
+        {
+            const unsigned a = remap[indices[i + 0]];
+            const unsigned b = remap[indices[i + 1]];
+            const unsigned c = remap[indices[i + 2]];
+            if (group[a] == group[b] || group[b] == group[c] || group[c] == group[a])
+                continue;
+
+            indices[out++] = a;
+            indices[out++] = b;
+            indices[out++] = c;
+        }
+        indices.resize(out);
+        triangleCount = out / 3;
+        for (unsigned& r : representative)
+            r = remap[r];
+        std::iota(remap.begin(), remap.end(), 0u);
+    }
+
+    mesh.meshlets.clear();
+}
+
+} // anonymous namespace
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+double simplify(Mesh& mesh, size_t targetTriangleCount, double maxError)
+{
+    const std::vector<unsigned> sourceIndices = mesh.indices;
+    std::vector<unsigned> representative(mesh.vertices.size());
+    std::iota(representative.begin(), representative.end(), 0u);
+
+    collapseEdges(mesh, targetTriangleCount, maxError, representative);
+    return deviation(mesh, sourceIndices, representative);
+}
+
+/* ---------------------------------------------------------------- *
+   The levels are simplified one from another, but the error of each
+   level is measured from the vertices of the full mesh. The levels
+   are optimized as copies so that the vertex order of the working
+   mesh stays the same as in the full mesh.
+ * ---------------------------------------------------------------- */
+void buildLods(Mesh& mesh, int maxLevelCount, size_t minTriangleCount)
+{
+    mesh.lods.clear();
+
+    Mesh level;
+    level.indices  = mesh.indices;
+    level.vertices = mesh.vertices;
+
+    std::vector<unsigned> representative(level.vertices.size());
+    std::iota(representative.begin(), representative.end(), 0u);
+
+    for (int i = 0; i < maxLevelCount; ++i)
+    {
+        const size_t triangleCount = level.indices.size() / 3;
+        const size_t targetCount   = triangleCount / 2;
+        if (targetCount < minTriangleCount)
+            break;
+
+        collapseEdges(level, targetCount,
+                      std::numeric_limits<double>::max(),
+                      representative);
+        if (level.indices.size() / 3 > triangleCount - triangleCount / 4)
+            break;
+
+        auto lod = std::make_shared<Mesh>(level);
+        mesh_optimizer::optimize(*lod);
+        mesh.lods.push_back({ deviation(level, mesh.indices, representative), lod });
+    }
+}
+
+} // namespace mesh_simplifier
+} // namespace rasperi
+} // namespace kuu
@@ -0,0 +1,53 @@
+/* ---------------------------------------------------------------- *
+   Antti Jumpponen <kuumies@gmail.com>
+   The definition of kuu::rasperi::mesh_simplifier namespace.
+ * ---------------------------------------------------------------- */
+ 
+#pragma once
+
+#include <cstddef>
+#include <limits>
+
+namespace kuu
+{
+namespace rasperi
+{
+
+struct Mesh;
+
+namespace mesh_simplifier
+{
+
+/* ---------------------------------------------------------------- *
+   Reduces the triangle count towards the target by collapsing
+   edges in the order of the quadric error (Garland & Heckbert).
+   A vertex is collapsed onto an existing neighbour, so positions,
+   normals and texture coordinates are never interpolated. Vertices
+   that share a position but not the attributes (UV and normal
+   seams) are collapsed together only along the seam and open
+   borders are collapsed only along the border.
+
+   Stops early if the quadric error of the next collapse, the root
+   mean square distance to the planes of the merged triangles, is
+   more than the max error. Returns the largest distance of an
+   original vertex from the simplified triangles around the vertex
+   it was collapsed into. Unused vertices are left into the mesh.
+ * ---------------------------------------------------------------- */
+double simplify(Mesh& mesh,
+                size_t targetTriangleCount,
+                double maxError = std::numeric_limits<double>::max());
+
+/* ---------------------------------------------------------------- *
+   Builds the LOD chain of the mesh, each level having about half
+   of the triangles of the previous one. Levels are optimized with
+   mesh_optimizer::optimize. The chain ends when the level would
+   have less than the min triangle count or when the simplification
+   does not make progress.
+ * ---------------------------------------------------------------- */
+void buildLods(Mesh& mesh,
+               int maxLevelCount       = 8,
+               size_t minTriangleCount = 256);
+
+} // namespace mesh_simplifier
+} // namespace rasperi
+} // namespace kuu
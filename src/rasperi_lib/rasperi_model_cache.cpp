@@ -0,0 +1,499 @@
+/* ---------------------------------------------------------------- *
+   Antti Jumpponen <kuumies@gmail.com>
+   The implementation of kuu::rasperi::ModelCache class.
+ * ---------------------------------------------------------------- */
+ 
+#include "rasperi_model_cache.h"
+#include <cstring>
+#include <type_traits>
+#include <QtCore/QDateTime>
+#include <QtCore/QDebug>
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+
+namespace kuu
+{
+namespace rasperi
+{
+namespace
+{
+
+/* ---------------------------------------------------------------- *
+   Increase the version when the file layout or the import of the
+   source files changes.
+ * ---------------------------------------------------------------- */
+const char     CACHE_MAGIC[8] = { 'R', 'A', 'S', 'P', 'C', 'A', 'C', 'H' };
+const uint32_t CACHE_VERSION  = 5;
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+struct Header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t vertexSize;
+    uint64_t sourceSize;
+    int64_t  sourceTime;
+    uint64_t sourceHash;
+    uint32_t materialCount;
+    uint32_t modelCount;
+};
+
+// Vertices are written as raw bytes, glm vectors are plain doubles.
+static_assert(std::is_standard_layout<Vertex>::value &&
+              sizeof(Vertex) == 18 * sizeof(double),
+              "Vertex is not a plain array of doubles");
+static_assert(std::is_standard_layout<Meshlet>::value &&
+              sizeof(Meshlet) == 2 * sizeof(unsigned) + 8 * sizeof(double),
+              "Meshlet has padding");
+
+/* ---------------------------------------------------------------- *
+   64-bit FNV-1a
+ * ---------------------------------------------------------------- */
+uint64_t hash(const uchar* data, size_t size)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i)
+    {
+        h ^= data[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+bool hashFile(const QString& path, uint64_t& out)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    if (file.size() == 0)
+    {
+        out = hash(nullptr, 0);
+        return true;
+    }
+
+    if (const uchar* data = file.map(0, file.size()))
+    {
+        out = hash(data, size_t(file.size()));
+        return true;
+    }
+
+    const QByteArray bytes = file.readAll();
+    out = hash(reinterpret_cast<const uchar*>(bytes.constData()),
+               size_t(bytes.size()));
+    return true;
+}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+class Writer
+{
+public:
+    explicit Writer(QFile& file) : file(file) {}
+
+    void bytes(const void* data, size_t size)
+    {
+        if (ok && size > 0)
+            ok = file.write(static_cast<const char*>(data), qint64(size)) == qint64(size);
+    }
+
+    template<typename T>
+    void value(const T& v)
+    { bytes(&v, sizeof(T)); }
+
+    void vec3(const glm::dvec3& v)
+    {
+        value(v.x);
+        value(v.y);
+        value(v.z);
+    }
+
+    void string(const QByteArray& s)
+    {
+        value(uint32_t(s.size()));
+        bytes(s.constData(), size_t(s.size()));
+    }
+
+    QFile& file;
+    bool ok = true;
+};
+
+/* ---------------------------------------------------------------- *
+   Reads from the mapped file, every read is bounds checked.
+ * ---------------------------------------------------------------- */
+class Reader
+{
+public:
+    Reader(const uchar* data, size_t size) : data(data), size(size) {}
+
+    bool bytes(void* out, size_t count)
+    {
+        if (count > size - pos)
+            return false;
+        if (count > 0)
+            std::memcpy(out, data + pos, count);
+        pos += count;
+        return true;
+    }
+
+    template<typename T>
+    bool value(T& v)
+    { return bytes(&v, sizeof(T)); }
+
+    bool vec3(glm::dvec3& v)
+    { return value(v.x) && value(v.y) && value(v.z); }
+
+    bool string(QString& s)
+    {
+        uint32_t length = 0;
+        if (!value(length) || length > size - pos)
+            return false;
+        s = QString::fromUtf8(reinterpret_cast<const char*>(data + pos), int(length));
+        pos += length;
+        return true;
+    }
+
+    bool string(std::string& s)
+    {
+        uint32_t length = 0;
+        if (!value(length) || length > size - pos)
+            return false;
+        s.assign(reinterpret_cast<const char*>(data + pos), length);
+        pos += length;
+        return true;
+    }
+
+    const uchar* data;
+    size_t size;
+    size_t pos = 0;
+};
+
+/* ---------------------------------------------------------------- *
+   Vertices, indices and meshlets of a mesh without the LODs.
+ * ---------------------------------------------------------------- */
+void writeMesh(Writer& writer, const Mesh& mesh)
+{
+    writer.value(uint64_t(mesh.vertices.size()));
+    writer.value(uint64_t(mesh.indices.size()));
+    writer.value(uint64_t(mesh.meshlets.size()));
+    writer.bytes(mesh.vertices.data(), mesh.vertices.size() * sizeof(Vertex));
+    writer.bytes(mesh.indices.data(),  mesh.indices.size()  * sizeof(unsigned));
+    writer.bytes(mesh.meshlets.data(), mesh.meshlets.size() * sizeof(Meshlet));
+}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+bool readMesh(Reader& reader, Mesh& mesh)
+{
+    uint64_t vertexCount  = 0;
+    uint64_t indexCount   = 0;
+    uint64_t meshletCount = 0;
+    if (!reader.value(vertexCount) ||
+        !reader.value(indexCount)  ||
+        !reader.value(meshletCount))
+    {
+        return false;
+    }
+
+    if (vertexCount  > (reader.size - reader.pos) / sizeof(Vertex)   ||
+        indexCount   > (reader.size - reader.pos) / sizeof(unsigned) ||
+        meshletCount > (reader.size - reader.pos) / sizeof(Meshlet))
+    {
+        return false;
+    }
+
+    mesh.vertices.resize(size_t(vertexCount));
+    mesh.indices.resize(size_t(indexCount));
+    mesh.meshlets.resize(size_t(meshletCount));
+    if (!reader.bytes(mesh.vertices.data(), size_t(vertexCount)  * sizeof(Vertex))   ||
+        !reader.bytes(mesh.indices.data(),  size_t(indexCount)   * sizeof(unsigned)) ||
+        !reader.bytes(mesh.meshlets.data(), size_t(meshletCount) * sizeof(Meshlet)))
+    {
+        return false;
+    }
+
+    for (unsigned i : mesh.indices)
+        if (i >= vertexCount)
+            return false;
+
+    for (const Meshlet& meshlet : mesh.meshlets)
+        if (meshlet.indexOffset > indexCount ||
+            meshlet.triangleCount > (indexCount - meshlet.indexOffset) / 3)
+            return false;
+
+    return true;
+}
+
+} // anonymous namespace
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+struct ModelCache::Impl
+{
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    Impl(const QString& cacheDir)
+        : cacheDir(cacheDir)
+    {}
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    QString cachePath(const QString& sourcePath) const
+    {
+        QString path = QFileInfo(sourcePath).canonicalFilePath();
+        if (path.isEmpty())
+            return QString();
+
+        const QByteArray utf8 = path.toUtf8();
+        const uint64_t h = hash(reinterpret_cast<const uchar*>(utf8.constData()),
+                                size_t(utf8.size()));
+        const QString name = QString::number(qulonglong(h), 16) + ".rmc";
+        return QDir(cacheDir).absoluteFilePath(name);
+    }
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    bool read(const QString& sourcePath, Scene& scene) const
+    {
+        const QString path = cachePath(sourcePath);
+        if (path.isEmpty() || !QFile::exists(path))
+            return false;
+
+        QFile file(path);
+        if (!file.open(QIODevice::ReadOnly))
+            return false;
+
+        const uchar* data = file.map(0, file.size());
+        QByteArray buffer;
+        if (!data)
+        {
+            buffer = file.readAll();
+            data = reinterpret_cast<const uchar*>(buffer.constData());
+        }
+
+        Reader reader(data, size_t(file.size()));
+        Header header;
+        if (!reader.value(header) || !isValid(header, sourcePath))
+            return false;
+
+        // Every record takes at least a byte
+        if (uint64_t(header.materialCount) + header.modelCount >
+            reader.size - reader.pos)
+        {
+            return invalid(path);
+        }
+
+        Scene out;
+        out.materials.resize(header.materialCount);
+        for (Material& m : out.materials)
+        {
+            if (!reader.vec3(m.ambient)          ||
+                !reader.vec3(m.diffuse)          ||
+                !reader.vec3(m.specular)         ||
+                !reader.value(m.specularPower)   ||
+                !reader.string(m.ambientMap)     ||
+                !reader.string(m.diffuseMap)     ||
+                !reader.string(m.specularMap)    ||
+                !reader.string(m.specularPowerMap) ||
+                !reader.string(m.normalMap))
+            {
+                return invalid(path);
+            }
+        }
+
+        out.models.resize(header.modelCount);
+        for (Model& m : out.models)
+        {
+            int32_t material = -1;
+            uint32_t lodCount = 0;
+            Transform& t = m.transform;
+            if (!reader.string(m.name)         ||
+                !reader.value(material)        ||
+                !reader.vec3(t.position)       ||
+                !reader.value(t.rotation.x)    ||
+                !reader.value(t.rotation.y)    ||
+                !reader.value(t.rotation.z)    ||
+                !reader.value(t.rotation.w)    ||
+                !reader.vec3(t.scale)          ||
+                material >= int32_t(header.materialCount))
+            {
+                return invalid(path);
+            }
+
+            m.material = material;
+            m.mesh = std::make_shared<Mesh>();
+            if (!readMesh(reader, *m.mesh) ||
+                !reader.value(lodCount)    ||
+                lodCount > reader.size - reader.pos)
+            {
+                return invalid(path);
+            }
+
+            m.mesh->lods.resize(lodCount);
+            for (MeshLod& lod : m.mesh->lods)
+            {
+                lod.mesh = std::make_shared<Mesh>();
+                if (!reader.value(lod.error) || !readMesh(reader, *lod.mesh))
+                    return invalid(path);
+            }
+        }
+
+        scene = std::move(out);
+        return true;
+    }
+
+    /* ------------------------------------------------------------ *
+       Writes into a temporary file that replaces the cache file so
+       that a reader never sees a partially written cache.
+     * ------------------------------------------------------------ */
+    bool write(const QString& sourcePath, const Scene& scene) const
+    {
+        const QString path = cachePath(sourcePath);
+        if (path.isEmpty())
+            return false;
+
+        const QFileInfo sourceInfo(sourcePath);
+        Header header;
+        std::memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+        header.version       = CACHE_VERSION;
+        header.vertexSize    = uint32_t(sizeof(Vertex));
+        header.sourceSize    = uint64_t(sourceInfo.size());
+        header.sourceTime    = int64_t(sourceInfo.lastModified().toMSecsSinceEpoch());
+        header.materialCount = uint32_t(scene.materials.size());
+        header.modelCount    = uint32_t(scene.models.size());
+        if (!hashFile(sourcePath, header.sourceHash))
+            return false;
+
+        if (!QDir(cacheDir).mkpath("."))
+        {
+            qDebug() << __FUNCTION__ << "failed to create cache dir" << cacheDir;
+            return false;
+        }
+
+        const QString tempPath = path + ".tmp";
+        QFile file(tempPath);
+        if (!file.open(QIODevice::WriteOnly))
+        {
+            qDebug() << __FUNCTION__ << "failed to open" << tempPath;
+            return false;
+        }
+
+        Writer writer(file);
+        writer.value(header);
+        for (const Material& m : scene.materials)
+        {
+            writer.vec3(m.ambient);
+            writer.vec3(m.diffuse);
+            writer.vec3(m.specular);
+            writer.value(m.specularPower);
+            writer.string(m.ambientMap.toUtf8());
+            writer.string(m.diffuseMap.toUtf8());
+            writer.string(m.specularMap.toUtf8());
+            writer.string(m.specularPowerMap.toUtf8());
+            writer.string(m.normalMap.toUtf8());
+        }
+
+        for (const Model& m : scene.models)
+        {
+            const Transform& t = m.transform;
+            writer.string(QByteArray(m.name.data(), int(m.name.size())));
+            writer.value(int32_t(m.material));
+            writer.vec3(t.position);
+            writer.value(t.rotation.x);
+            writer.value(t.rotation.y);
+            writer.value(t.rotation.z);
+            writer.value(t.rotation.w);
+            writer.vec3(t.scale);
+            writeMesh(writer, *m.mesh);
+            writer.value(uint32_t(m.mesh->lods.size()));
+            for (const MeshLod& lod : m.mesh->lods)
+            {
+                writer.value(lod.error);
+                writeMesh(writer, *lod.mesh);
+            }
+        }
+        file.close();
+
+        if (!writer.ok)
+        {
+            qDebug() << __FUNCTION__ << "failed to write" << tempPath;
+            QFile::remove(tempPath);
+            return false;
+        }
+
+        QFile::remove(path);
+        if (!QFile::rename(tempPath, path))
+        {
+            qDebug() << __FUNCTION__ << "failed to rename" << tempPath;
+            QFile::remove(tempPath);
+            return false;
+        }
+        return true;
+    }
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    bool isValid(const Header& header, const QString& sourcePath) const
+    {
+        if (std::memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version    != CACHE_VERSION ||
+            header.vertexSize != sizeof(Vertex))
+        {
+            return false;
+        }
+
+        const QFileInfo sourceInfo(sourcePath);
+        if (header.sourceSize != uint64_t(sourceInfo.size()))
+            return false;
+        if (header.sourceTime == int64_t(sourceInfo.lastModified().toMSecsSinceEpoch()))
+            return true;
+
+        // Touched or copied, compare the content.
+        uint64_t sourceHash = 0;
+        return hashFile(sourcePath, sourceHash) && sourceHash == header.sourceHash;
+    }
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    bool invalid(const QString& path) const
+    {
+        qDebug() << "ModelCache::read: invalid cache file" << path;
+        return false;
+    }
+
+    QString cacheDir;
+};
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+ModelCache::ModelCache()
+    : ModelCache(QDir(QDir::tempPath()).absoluteFilePath("rasperi_cache"))
+{}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+ModelCache::ModelCache(const QString& cacheDir)
+    : impl(std::make_shared<Impl>(cacheDir))
+{}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+bool ModelCache::read(const QString& sourcePath, Scene& scene) const
+{ return impl->read(sourcePath, scene); }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+bool ModelCache::write(const QString& sourcePath, const Scene& scene) const
+{ return impl->write(sourcePath, scene); }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+QString ModelCache::cachePath(const QString& sourcePath) const
+{ return impl->cachePath(sourcePath); }
+
+} // namespace rasperi
+} // namespace kuu
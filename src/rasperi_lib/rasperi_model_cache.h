@@ -0,0 +1,80 @@
+/* ---------------------------------------------------------------- *
+   Antti Jumpponen <kuumies@gmail.com>
+   The definition of kuu::rasperi::ModelCache class.
+ * ---------------------------------------------------------------- */
+ 
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <QtCore/QString>
+#include <glm/vec3.hpp>
+#include "rasperi_mesh.h"
+#include "rasperi_transform.h"
+
+namespace kuu
+{
+namespace rasperi
+{
+
+/* ---------------------------------------------------------------- *
+   Binary cache of imported scenes. The cache of a source file is
+   valid when the size and the modification time of the source
+   match, or if only the time differs, when the content hash of
+   the source matches. The cache file is memory mapped when read.
+
+   Caches are written into a directory in the temporary path, the
+   file name is derived from the canonical source file path.
+ * ---------------------------------------------------------------- */
+class ModelCache
+{
+public:
+    // Material parameters and absolute texture file paths. An
+    // empty path means that the material has no texture.
+    struct Material
+    {
+        glm::dvec3 ambient;
+        glm::dvec3 diffuse;
+        glm::dvec3 specular;
+        double specularPower = 1.0;
+        QString ambientMap;
+        QString diffuseMap;
+        QString specularMap;
+        QString specularPowerMap;
+        QString normalMap;
+    };
+
+    // Material index is -1 if the model has no material.
+    struct Model
+    {
+        std::string name;
+        int material = -1;
+        Transform transform;
+        std::shared_ptr<Mesh> mesh;
+    };
+
+    struct Scene
+    {
+        std::vector<Material> materials;
+        std::vector<Model> models;
+    };
+
+    ModelCache();
+    explicit ModelCache(const QString& cacheDir);
+
+    // Reads the cached scene of the source file. Returns false if
+    // the cache does not exist, is out of date or is invalid.
+    bool read(const QString& sourcePath, Scene& scene) const;
+    // Writes the scene into the cache of the source file.
+    bool write(const QString& sourcePath, const Scene& scene) const;
+
+    QString cachePath(const QString& sourcePath) const;
+
+private:
+    struct Impl;
+    std::shared_ptr<Impl> impl;
+};
+
+} // namespace rasperi
+} // namespace kuu
@@ -12,6 +12,10 @@
 #include <QtCore/QDebug>
 #include <QtCore/QDir>
 #include "rasperi_model.h"
+#include "rasperi_model_cache.h"
+#include "rasperi_mesh_optimizer.h"
+#include "rasperi_mesh_simplifier.h"
+#include "rasperi_texture_manager.h"
 
 namespace kuu
 {
@@ -24,122 +28,129 @@ struct ModelImporter::Impl
 {
     /* ------------------------------------------------------------ *
      * ------------------------------------------------------------ */
-    Impl()
+    Impl(const TextureManager& textures)
+        : textures(textures)
     {}
 
     /* ------------------------------------------------------------ *
      * ------------------------------------------------------------ */
-    glm::dvec3 toVec3(const aiColor3D& c)
+    void error(const QString& message)
+    {
+        qDebug() << "ModelImporter::import:" << message;
+        errors.push_back(message);
+    }
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    glm::dvec3 toVec3(const aiColor3D& c) const
     { return glm::dvec3(c.r, c.g, c.b); }
 
     /* ------------------------------------------------------------ *
      * ------------------------------------------------------------ */
-    glm::dvec3 toVec3(const aiVector3D& v)
+    glm::dvec3 toVec3(const aiVector3D& v) const
     { return glm::dvec3(v.x, v.y, v.z); }
 
     /* ------------------------------------------------------------ *
+       Converts the mesh into preallocated arrays. Faces that are not
+       triangles (points and lines left by triangulation) are skipped.
+       Returns null and sets the error if the mesh is not usable.
      * ------------------------------------------------------------ */
-    std::shared_ptr<Mesh> importMesh(const aiMesh* const mesh)
+    std::shared_ptr<Mesh> importMesh(const aiMesh* const mesh,
+                                     QString& error) const
     {
+        if (!mesh->HasPositions())
+        {
+            error = "mesh has no positions";
+            return nullptr;
+        }
+
+        size_t triangleCount = 0;
+        for (unsigned f = 0; f < mesh->mNumFaces; ++f)
+            if (mesh->mFaces[f].mNumIndices == 3)
+                triangleCount++;
+        if (triangleCount == 0)
+        {
+            error = "mesh has no triangles";
+            return nullptr;
+        }
+
         std::shared_ptr<Mesh> out = std::make_shared<Mesh>();
+        out->vertices.resize(mesh->mNumVertices);
+        out->indices.resize(triangleCount * 3);
+
+        const bool hasTexCoords = mesh->HasTextureCoords(0);
+        const bool hasNormals   = mesh->HasNormals();
+        const bool hasTangents  = mesh->HasTangentsAndBitangents();
+        const bool hasColors    = mesh->HasVertexColors(0);
 
         for (size_t v = 0; v < mesh->mNumVertices; ++v)
         {
-            Vertex vertex;
-
-            if (mesh->HasPositions())
-            {
-                const aiVector3D* p = &mesh->mVertices[v];
-                vertex.position.x = double(p->x);
-                vertex.position.y = double(p->y);
-                vertex.position.z = double(p->z);
-            }
+            Vertex& vertex = out->vertices[v];
+            vertex.position = toVec3(mesh->mVertices[v]);
 
-            if (mesh->HasTextureCoords(0))
+            if (hasTexCoords)
             {
-                const aiVector3D* tc = &mesh->mTextureCoords[0][v];
-                vertex.texCoord.x = double(tc->x);
-                vertex.texCoord.y = double(tc->y);
+                const aiVector3D& tc = mesh->mTextureCoords[0][v];
+                vertex.texCoord.x = double(tc.x);
+                vertex.texCoord.y = double(tc.y);
             }
 
-            if (mesh->HasNormals())
-            {
-                const aiVector3D* n = &mesh->mNormals[v];
-                vertex.normal.x = double(n->x);
-                vertex.normal.y = double(n->y);
-                vertex.normal.z = double(n->z);
-            }
+            if (hasNormals)
+                vertex.normal = toVec3(mesh->mNormals[v]);
 
-            if (mesh->HasTangentsAndBitangents())
+            if (hasTangents)
             {
-                const aiVector3D* t = &mesh->mTangents[v];
-                vertex.tangent.x = double(t->x);
-                vertex.tangent.y = double(t->y);
-                vertex.tangent.z = double(t->z);
-
-                const aiVector3D* b = &mesh->mBitangents[v];
-                vertex.bitangent.x = double(b->x);
-                vertex.bitangent.y = double(b->y);
-                vertex.bitangent.z = double(b->z);
+                vertex.tangent   = toVec3(mesh->mTangents[v]);
+                vertex.bitangent = toVec3(mesh->mBitangents[v]);
             }
 
-            if (mesh->HasVertexColors(0))
+            if (hasColors)
             {
-                const aiColor4D* c = &mesh->mColors[0][v];
-                vertex.color.r = double(c->r);
-                vertex.color.g = double(c->g);
-                vertex.color.b = double(c->b);
-                vertex.color.a = double(c->a);
+                const aiColor4D& c = mesh->mColors[0][v];
+                vertex.color.r = double(c.r);
+                vertex.color.g = double(c.g);
+                vertex.color.b = double(c.b);
+                vertex.color.a = double(c.a);
             }
-
-            out->vertices.push_back(vertex);
         }
 
-        for (size_t i = 0 ; i < mesh->mNumFaces ; i++)
+        unsigned* index = out->indices.data();
+        for (unsigned f = 0; f < mesh->mNumFaces; ++f)
         {
-            const aiFace& face = mesh->mFaces[i];
-            assert(face.mNumIndices == 3);
+            const aiFace& face = mesh->mFaces[f];
+            if (face.mNumIndices != 3)
+                continue;
 
-            out->indices.push_back(face.mIndices[0]);
-            out->indices.push_back(face.mIndices[1]);
-            out->indices.push_back(face.mIndices[2]);
+            *index++ = face.mIndices[0];
+            *index++ = face.mIndices[1];
+            *index++ = face.mIndices[2];
         }
 
         return out;
     }
 
     /* ------------------------------------------------------------ *
+       Returns the absolute path of the texture or an empty string if
+       the material does not have the texture.
      * ------------------------------------------------------------ */
-    QImage loadTexture(const aiMaterial* const material,
-                       const aiTextureType textureType,
-                       const QDir& dir)
+    QString texturePath(const aiMaterial* const material,
+                        const aiTextureType textureType,
+                        const QDir& dir) const
     {
         if (material->GetTextureCount(textureType) <= 0)
-            return {};
+            return QString();
 
         aiString path;
         if (material->GetTexture(textureType, 0, &path) != aiReturn_SUCCESS)
-            return {};
+            return QString();
 
-        QString qpath = QString::fromLatin1(path.C_Str());
-        qpath = dir.absoluteFilePath(qpath);
-        QImage image(qpath);
-        if (image.isNull())
-        {
-            qDebug() << __FUNCTION__
-                     << ": image file is not valid"
-                     << qpath;
-
-            return QImage();
-        }
-
-        return image;
+        return dir.absoluteFilePath(QString::fromLatin1(path.C_Str()));
     }
 
     /* ------------------------------------------------------------ *
      * ------------------------------------------------------------ */
-    std::shared_ptr<Material> importMaterial(const aiMaterial* const material,
-                                             const QDir& dir)
+    ModelCache::Material importMaterial(const aiMaterial* const material,
+                                        const QDir& dir) const
     {
         aiColor3D ambient(0.0f, 0.0f, 0.0f);
         aiColor3D diffuse(1.0f, 1.0f, 1.0f);
@@ -150,37 +161,79 @@ struct ModelImporter::Impl
         material->Get(AI_MATKEY_COLOR_SPECULAR, specular);
         material->Get(AI_MATKEY_SHININESS,      specularPower);
 
-        std::shared_ptr<Material> out = std::make_shared<Material>();
-        out->phong.ambient       = toVec3(ambient);
-        out->phong.diffuse       = toVec3(diffuse);
-        out->phong.specular      = toVec3(specular);
-        out->phong.specularPower = double(specularPower);
+        ModelCache::Material out;
+        out.ambient          = toVec3(ambient);
+        out.diffuse          = toVec3(diffuse);
+        out.specular         = toVec3(specular);
+        out.specularPower    = double(specularPower);
+        out.ambientMap       = texturePath(material, aiTextureType_AMBIENT,   dir);
+        out.diffuseMap       = texturePath(material, aiTextureType_DIFFUSE,   dir);
+        out.specularMap      = texturePath(material, aiTextureType_SPECULAR,  dir);
+        out.specularPowerMap = texturePath(material, aiTextureType_SHININESS, dir);
+        out.normalMap        = texturePath(material, aiTextureType_HEIGHT,    dir); // Note "typo", it really needs to be aiTextureType_HEIGHT for OBJs
+        return out;
+    }
 
-        out->phong.ambientSampler.setMap(loadTexture(material, aiTextureType_AMBIENT, dir));
-        out->phong.diffuseSampler.setMap(loadTexture(material, aiTextureType_DIFFUSE, dir));
-        out->phong.diffuseSampler.setLinearizeGamma(true);
-        out->phong.specularSampler.setMap(loadTexture(material, aiTextureType_SPECULAR, dir));
-        out->phong.specularPowerSampler.setMap(loadTexture(material, aiTextureType_SHININESS, dir));
-        out->normalSampler.setMap(loadTexture(material, aiTextureType_HEIGHT, dir)); // Note "typo", it really needs to be aiTextureType_HEIGHT for OBJs
+    /* ------------------------------------------------------------ *
+       Queues the texture for loading. Returns an invalid handle if
+       the path is empty.
+     * ------------------------------------------------------------ */
+    TextureManager::Handle loadTexture(const QString& path,
+                                       TextureManager::Format format) const
+    {
+        if (path.isEmpty())
+            return {};
+        return textures.load(path, format);
+    }
 
-        qDebug() << __FUNCTION__
-                 << material->GetTextureCount(aiTextureType_AMBIENT)
-                 << material->GetTextureCount(aiTextureType_DIFFUSE)
-                 << material->GetTextureCount(aiTextureType_SPECULAR)
-                 << material->GetTextureCount(aiTextureType_SHININESS)
-                 << material->GetTextureCount(aiTextureType_NORMALS)
-                 << material->GetTextureCount(aiTextureType_HEIGHT);
+    /* ------------------------------------------------------------ *
+       Queues all the textures of the material. Called for every
+       material before the models are created so that the textures
+       are decoded while the meshes are converted.
+     * ------------------------------------------------------------ */
+    void loadTextures(const ModelCache::Material& m) const
+    {
+        loadTexture(m.ambientMap,       TextureManager::Format::Rgba);
+        loadTexture(m.diffuseMap,       TextureManager::Format::Rgba);
+        loadTexture(m.specularMap,      TextureManager::Format::Any);
+        loadTexture(m.specularPowerMap, TextureManager::Format::Rgba);
+        loadTexture(m.normalMap,        TextureManager::Format::Rgba);
+    }
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    QImage texture(const QString& path, TextureManager::Format format) const
+    {
+        TextureManager::Handle handle = loadTexture(path, format);
+        return handle.valid() ? handle.get() : QImage();
+    }
 
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    std::shared_ptr<Material> createMaterial(const ModelCache::Material& m) const
+    {
+        std::shared_ptr<Material> out = std::make_shared<Material>();
+        out->phong.ambient       = m.ambient;
+        out->phong.diffuse       = m.diffuse;
+        out->phong.specular      = m.specular;
+        out->phong.specularPower = m.specularPower;
+
+        out->phong.ambientSampler.setMap(texture(m.ambientMap, TextureManager::Format::Rgba));
+        out->phong.diffuseSampler.setMap(texture(m.diffuseMap, TextureManager::Format::Rgba));
+        out->phong.diffuseSampler.setLinearizeGamma(true);
+        out->phong.specularSampler.setMap(texture(m.specularMap, TextureManager::Format::Any));
+        out->phong.specularPowerSampler.setMap(texture(m.specularPowerMap, TextureManager::Format::Rgba));
+        out->normalSampler.setMap(texture(m.normalMap, TextureManager::Format::Rgba));
         return out;
     }
 
     /* ------------------------------------------------------------ *
      * ------------------------------------------------------------ */
-    std::shared_ptr<Transform> importTransform(
+    Transform importTransform(
         const aiString& name,
-        const aiScene* const scene)
+        const aiScene* const scene) const
     {
-        std::shared_ptr<Transform> t = std::make_shared<Transform>();
+        Transform t;
         if (const aiNode* n = scene->mRootNode->FindNode(name))
         {
             glm::dmat4 outMat(1.0);
@@ -198,7 +251,7 @@ struct ModelImporter::Impl
 
             glm::dvec3 skew;
             glm::dvec4 perspective;
-            if (!glm::decompose(outMat, t->scale, t->rotation, t->position,
+            if (!glm::decompose(outMat, t.scale, t.rotation, t.position,
                                 skew, perspective))
             {
                 std::cerr << __FUNCTION__
@@ -206,78 +259,200 @@ struct ModelImporter::Impl
                           << std::endl;
             }
 
-            t->rotation = glm::inverse(t->rotation);
-            t->position *= 0.01;
-            t->scale    *= 0.01;
+            t.rotation = glm::inverse(t.rotation);
+            t.position *= 0.01;
+            t.scale    *= 0.01;
         }
 
         return t;
     }
+
+    /* ------------------------------------------------------------ *
+       Imports the scene with Assimp. Meshes of the root children are
+       converted in parallel. Missing nodes and meshes and meshes that
+       cannot be converted are reported and skipped.
+     * ------------------------------------------------------------ */
+    bool importScene(const QString& filepath, ModelCache::Scene& out)
+    {
+        Assimp::Importer importer;
+        const aiScene* scene =
+            importer.ReadFile(
+                filepath.toStdString().c_str(),
+                aiProcess_Triangulate |
+                aiProcess_JoinIdenticalVertices |
+                aiProcess_CalcTangentSpace);
+
+        if (!scene)
+        {
+            error(QString::fromLatin1(importer.GetErrorString()));
+            return false;
+        }
+
+        qDebug() << __FUNCTION__
+                 << scene->mNumMeshes
+                 << scene->mNumMaterials
+                 << scene->mNumTextures;
+
+        const QDir dir = QFileInfo(filepath).absoluteDir();
+
+        struct Job
+        {
+            const aiNode* node;
+            const aiMesh* mesh;
+        };
+        std::vector<Job> jobs;
+        for (unsigned int c = 0; c < scene->mRootNode->mNumChildren; ++c)
+        {
+            const aiNode* child = scene->mRootNode->mChildren[c];
+            if (!child)
+            {
+                error(QString("node %1: null node").arg(int(c)));
+                continue;
+            }
+
+            for (unsigned int m = 0; m < child->mNumMeshes; ++m)
+            {
+                const unsigned meshIndex = child->mMeshes[m];
+                const aiMesh* const mesh = meshIndex < scene->mNumMeshes
+                    ? scene->mMeshes[meshIndex]
+                    : nullptr;
+                if (!mesh)
+                {
+                    error(QString("node %1: invalid mesh %2")
+                              .arg(int(c))
+                              .arg(int(meshIndex)));
+                    continue;
+                }
+
+                qDebug() << __FUNCTION__
+                         << c
+                         << mesh->mNumVertices
+                         << mesh->mNumFaces
+                         << mesh->HasPositions()
+                         << mesh->HasNormals()
+                         << mesh->HasVertexColors(0)
+                         << mesh->HasTextureCoords(0)
+                         << mesh->HasTangentsAndBitangents();
+
+                jobs.push_back({ child, mesh });
+            }
+        }
+
+        // Start decoding the textures already while the meshes are
+        // converted.
+        out.materials.resize(scene->mNumMaterials);
+        for (unsigned int m = 0; m < scene->mNumMaterials; ++m)
+        {
+            out.materials[m] = importMaterial(scene->mMaterials[m], dir);
+            loadTextures(out.materials[m]);
+        }
+
+        const int jobCount = int(jobs.size());
+        std::vector<ModelCache::Model> models(jobs.size());
+        std::vector<QString> errors(jobs.size());
+        #pragma omp parallel for schedule(dynamic)
+        for (int j = 0; j < jobCount; ++j)
+        {
+            const Job& job = jobs[size_t(j)];
+            ModelCache::Model& model = models[size_t(j)];
+            model.name = std::string(job.mesh->mName.C_Str());
+            model.mesh = importMesh(job.mesh, errors[size_t(j)]);
+            if (!model.mesh)
+                continue;
+
+            // Reorder for the vertex reuse and the memory locality
+            // of the vertex stage and split into culled meshlets.
+            mesh_optimizer::optimize(*model.mesh);
+            mesh_simplifier::buildLods(*model.mesh);
+
+            model.transform = importTransform(job.node->mName, scene);
+            if (job.mesh->mMaterialIndex < scene->mNumMaterials)
+                model.material = int(job.mesh->mMaterialIndex);
+        }
+
+        out.models.clear();
+        out.models.reserve(models.size());
+        for (size_t j = 0; j < models.size(); ++j)
+        {
+            if (models[j].mesh)
+                out.models.push_back(models[j]);
+            else
+                error(QString("mesh %1: %2")
+                          .arg(QString::fromStdString(models[j].name))
+                          .arg(errors[j]));
+        }
+        return true;
+    }
+
+    /* ------------------------------------------------------------ *
+       Each model gets an own material so that editing the material
+       of one model does not affect the others, the meshes and the
+       texture images are shared.
+     * ------------------------------------------------------------ */
+    std::vector<Model> createModels(const ModelCache::Scene& scene) const
+    {
+        for (const ModelCache::Material& m : scene.materials)
+            loadTextures(m);
+
+        std::vector<Model> out(scene.models.size());
+        for (size_t i = 0; i < scene.models.size(); ++i)
+        {
+            const ModelCache::Model& in = scene.models[i];
+            Model& model = out[i];
+            model.name      = in.name;
+            model.mesh      = in.mesh;
+            model.transform = std::make_shared<Transform>(in.transform);
+            if (in.material >= 0)
+                model.material = createMaterial(scene.materials[size_t(in.material)]);
+        }
+        return out;
+    }
+
+    mutable TextureManager textures;
+    ModelCache cache;
+    bool cacheEnabled = true;
+    QStringList errors;
 };
 
 /* ---------------------------------------------------------------- *
  * ---------------------------------------------------------------- */
-ModelImporter::ModelImporter()
-    : impl(std::make_shared<Impl>())
+ModelImporter::ModelImporter(const TextureManager& textures)
+    : impl(std::make_shared<Impl>(textures))
 {}
 
 /* ---------------------------------------------------------------- *
  * ---------------------------------------------------------------- */
 std::vector<Model> ModelImporter::import(const QString& filepath) const
 {
-    Assimp::Importer importer;
-    const aiScene* scene =
-        importer.ReadFile(
-            filepath.toStdString().c_str(),
-            aiProcess_Triangulate |
-            aiProcess_JoinIdenticalVertices |
-            aiProcess_CalcTangentSpace);
-
-    if (!scene)
-        return {};
+    impl->errors.clear();
 
-    qDebug() << __FUNCTION__
-             << scene->mNumMeshes
-             << scene->mNumMaterials
-             << scene->mNumTextures;
+    ModelCache::Scene scene;
+    if (impl->cacheEnabled && impl->cache.read(filepath, scene))
+        return impl->createModels(scene);
 
-    const QDir dir = QFileInfo(filepath).absoluteDir();
+    if (!impl->importScene(filepath, scene))
+        return {};
 
-    std::vector<Model> out;
-    for (unsigned int c = 0; c < scene->mRootNode->mNumChildren; ++c)
-    {
-        aiNode* child = scene->mRootNode->mChildren[c];
-        if (!child)
-            return {};
+    if (impl->cacheEnabled && !impl->cache.write(filepath, scene))
+        qDebug() << __FUNCTION__ << "failed to write the cache of" << filepath;
 
-        for (unsigned int m = 0; m < child->mNumMeshes; ++m)
-        {
-            const aiMesh* const mesh =
-                scene->mMeshes[child->mMeshes[m]];
-            if (!mesh)
-                return {};
-
-            qDebug() << __FUNCTION__
-                     << c
-                     << mesh->mNumVertices
-                     << mesh->mNumFaces
-                     << mesh->HasPositions()
-                     << mesh->HasNormals()
-                     << mesh->HasVertexColors(0)
-                     << mesh->HasTextureCoords(0)
-                     << mesh->HasTangentsAndBitangents();
-
-            Model model;
-            model.name = std::string(mesh->mName.C_Str());
-            model.mesh = impl->importMesh(mesh);
-            model.transform = impl->importTransform(child->mName, scene);
-            if (scene->HasMaterials())
-                model.material = impl->importMaterial(scene->mMaterials[mesh->mMaterialIndex], dir);
-            out.push_back(model);
-        }
-    }
-    return out;
+    return impl->createModels(scene);
 }
 
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+void ModelImporter::setCacheEnabled(bool enabled)
+{ impl->cacheEnabled = enabled; }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+bool ModelImporter::isCacheEnabled() const
+{ return impl->cacheEnabled; }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+QStringList ModelImporter::errors() const
+{ return impl->errors; }
+
 } // namespace rasperi
 } // namespace kuu
@@ -7,8 +7,10 @@
 
 #include <memory>
 #include <vector>
+#include "rasperi_texture_manager.h"
 
 class QString;
+class QStringList;
 
 namespace kuu
 {
@@ -18,13 +20,26 @@ namespace rasperi
 class Model;
 
 /* ---------------------------------------------------------------- *
+   Imports the models of a scene file. Meshes are converted in
+   parallel while the texture manager decodes the textures. A mesh
+   that cannot be converted is skipped and reported in the errors
+   of the import, the other meshes are still imported.
+
+   The imported scene is written into a ModelCache and read from
+   there on the next import of the same file.
  * ---------------------------------------------------------------- */
 class ModelImporter
 {
 public:
-    ModelImporter();
+    ModelImporter(const TextureManager& textures = TextureManager());
     std::vector<Model> import(const QString& filepath) const;
 
+    void setCacheEnabled(bool enabled);
+    bool isCacheEnabled() const;
+
+    // Errors of the latest import.
+    QStringList errors() const;
+
 private:
     struct Impl;
     std::shared_ptr<Impl> impl;
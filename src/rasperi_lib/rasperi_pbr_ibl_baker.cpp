@@ -0,0 +1,151 @@
+/* ---------------------------------------------------------------- *
+   Antti Jumpponen <kuumies@gmail.com>
+   The implementation of kuu::rasperi::PbrIblBaker class.
+ * ---------------------------------------------------------------- */
+ 
+#include "rasperi_pbr_ibl_baker.h"
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "rasperi_pbr_ibl_brdf_integration.h"
+#include "rasperi_pbr_ibl_irradiance.h"
+#include "rasperi_pbr_ibl_prefilter.h"
+
+namespace kuu
+{
+namespace rasperi
+{
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+struct PbrIblBaker::Impl
+{
+    /* ------------------------------------------------------------ *
+       Resolution and sample counts of a single bake pass.
+     * ------------------------------------------------------------ */
+    struct Pass
+    {
+        int irradianceSize;
+        double irradianceSampleDelta;
+        int prefilterSize;
+        int prefilterSampleCount;
+    };
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    Impl(int irradianceSize, int prefilterSize)
+        : irradianceSize(irradianceSize)
+        , prefilterSize(prefilterSize)
+        , cancelled(false)
+        , running(false)
+    {}
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    ~Impl()
+    { cancel(); }
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    void start(const TextureCube<double, 4>& bgCube,
+               const Callback& published)
+    {
+        cancel();
+
+        cancelled = false;
+        running   = true;
+        thread = std::thread([this, bgCube, published]()
+        {
+            run(bgCube, published);
+            running = false;
+        });
+    }
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    void cancel()
+    {
+        cancelled = true;
+        if (thread.joinable())
+            thread.join();
+    }
+
+    /* ------------------------------------------------------------ *
+       The BRDF integration map does not depend on the background
+       so it is shared by the passes.
+     * ------------------------------------------------------------ */
+    void run(const TextureCube<double, 4>& bgCube,
+             const Callback& published)
+    {
+        PbrIblBrdfIntegration brdfIntegration;
+        brdfIntegration.run();
+
+        const std::vector<Pass> passes =
+        {
+            { 8,              0.2,   64,            32   },
+            { irradianceSize, 0.025, prefilterSize, 1024 },
+        };
+
+        for (size_t i = 0; i < passes.size(); ++i)
+        {
+            const Pass& pass = passes[i];
+
+            PbrIblIrradiance irradiance(pass.irradianceSize,
+                                        pass.irradianceSampleDelta);
+            if (!irradiance.run(bgCube, &cancelled))
+                return;
+
+            PbrIblPrefilter prefilter(pass.prefilterSize,
+                                      pass.prefilterSampleCount);
+            if (!prefilter.run(bgCube, &cancelled))
+                return;
+
+            std::shared_ptr<Maps> out = std::make_shared<Maps>();
+            out->irradiance      = irradiance.irradianceCubemap;
+            out->prefilter       = prefilter.prefilterCubemap;
+            out->brdfIntegration = brdfIntegration.brdfIntegration2dMap;
+            out->preview         = i + 1 < passes.size();
+            std::atomic_store(&maps, std::shared_ptr<const Maps>(out));
+
+            if (published)
+                published();
+        }
+    }
+
+    int irradianceSize;
+    int prefilterSize;
+    std::atomic<bool> cancelled;
+    std::atomic<bool> running;
+    std::thread thread;
+    std::shared_ptr<const Maps> maps;
+};
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+PbrIblBaker::PbrIblBaker(int irradianceSize, int prefilterSize)
+    : impl(std::make_shared<Impl>(irradianceSize, prefilterSize))
+{}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+void PbrIblBaker::start(const TextureCube<double, 4>& bgCube,
+                        const Callback& published)
+{ impl->start(bgCube, published); }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+void PbrIblBaker::cancel()
+{ impl->cancel(); }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+bool PbrIblBaker::isRunning() const
+{ return impl->running; }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+std::shared_ptr<const PbrIblBaker::Maps> PbrIblBaker::maps() const
+{ return std::atomic_load(&impl->maps); }
+
+} // namespace rasperi
+} // namespace kuu
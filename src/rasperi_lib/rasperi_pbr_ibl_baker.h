@@ -0,0 +1,55 @@
+/* ---------------------------------------------------------------- *
+   Antti Jumpponen <kuumies@gmail.com>
+   The definition of kuu::rasperi::PbrIblBaker class.
+ * ---------------------------------------------------------------- */
+ 
+#pragma once
+
+#include <functional>
+#include <memory>
+#include "rasperi_texture_cube.h"
+
+namespace kuu
+{
+namespace rasperi
+{
+
+/* ---------------------------------------------------------------- *
+   Bakes the PBR IBL maps in a background thread. A low resolution
+   preview set is baked first, then the full resolution set. Each
+   set is published atomically when it is complete, the maps of a
+   published set are never modified.
+
+   The published callback is called from the bake thread.
+ * ---------------------------------------------------------------- */
+class PbrIblBaker
+{
+public:
+    struct Maps
+    {
+        TextureCube<double, 4> irradiance;
+        TextureCube<double, 4> prefilter;
+        Texture2D<double, 2> brdfIntegration;
+        bool preview = true;
+    };
+
+    using Callback = std::function<void()>;
+
+    PbrIblBaker(int irradianceSize = 32, int prefilterSize = 128);
+
+    // Cancels the current bake and starts a new one.
+    void start(const TextureCube<double, 4>& bgCube,
+               const Callback& published = Callback());
+    void cancel();
+    bool isRunning() const;
+
+    // Returns the latest published set or null.
+    std::shared_ptr<const Maps> maps() const;
+
+private:
+    struct Impl;
+    std::shared_ptr<Impl> impl;
+};
+
+} // namespace rasperi
+} // namespace kuu
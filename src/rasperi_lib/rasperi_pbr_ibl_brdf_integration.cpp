@@ -4,13 +4,15 @@
  * ---------------------------------------------------------------- */
  
 #include "rasperi_pbr_ibl_brdf_integration.h"
-#include <array>
-#include <functional>
+#include <cmath>
+#include <glm/common.hpp>
 #include <glm/geometric.hpp>
 #include <glm/trigonometric.hpp>
 #include <glm/mat4x4.hpp>
 #include <glm/vec2.hpp>
 #include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+#include "rasperi_pbr_ibl_brdf_integration_table.h"
 
 namespace kuu
 {
@@ -19,135 +21,89 @@ namespace rasperi
 
 /* ---------------------------------------------------------------- *
  * ---------------------------------------------------------------- */
-class BrdfIntegrationRasterizer
+struct PbrIblBrdfIntegration::Impl
 {
-public:
-    /* ------------------------------------------------------------ *
-     * ------------------------------------------------------------ */
-    class BoundingBox
-    {
-    public:
-        BoundingBox()
-        {
-            min.x =  std::numeric_limits<double>::max();
-            min.y =  std::numeric_limits<double>::max();
-            max.x = -std::numeric_limits<double>::max();
-            max.y = -std::numeric_limits<double>::max();
-        }
-
-        void update(const glm::dvec2& p)
-        {
-            if (p.x < min.x) min.x = p.x;
-            if (p.y < min.y) min.y = p.y;
-            if (p.x > max.x) max.x = p.x;
-            if (p.y > max.y) max.y = p.y;
-        }
-
-        glm::dvec2 min;
-        glm::dvec2 max;
-    };
-
-    using Callback = std::function<void(glm::dvec2)>;
-
-    int w;
-    int h;
-    Callback callback;
-
     /* ------------------------------------------------------------ *
      * ------------------------------------------------------------ */
-    BrdfIntegrationRasterizer(int w, int h, Callback callback)
-        : w(w)
-        , h(h)
-        , callback(callback)
+    Impl(PbrIblBrdfIntegration* self, int size)
+        : self(self)
+        , size(size)
     {}
 
     /* ------------------------------------------------------------ *
+       Texel x is the n dot v and texel y is one minus the roughness,
+       both are evaluated at the texel center.
      * ------------------------------------------------------------ */
-    void run() const
+    void run(Mode mode)
     {
-        double xStep = 1.0 / double(w);
-        double yStep = 1.0 / double(h);
-        for (double y = 0.0; y <= 1.0; y += yStep)
-        for (double x = 0.0; x <= 1.0; x += xStep)
-                callback(glm::dvec2(x, y));
-    }
+        Texture2D<double, 2>& map = self->brdfIntegration2dMap;
+        double* pixels = map.pixels().data();
 
-    /* ---------------------------------------------------------------- *
-     * ---------------------------------------------------------------- */
-    glm::dvec3 project(const glm::dmat4& m, const glm::dvec3& p) const
-    {
-        const glm::dvec4 v = m * glm::dvec4(p, 1.0);
-        if (v.w == 0.0)
+        #pragma omp parallel for
+        for (int y = 0; y < size; ++y)
+        for (int x = 0; x < size; ++x)
         {
-            std::cerr << "proj err" << std::endl;
-            return glm::dvec3(0.0);
-        }
-        return glm::dvec3(v.x / v.w, v.y / v.w, v.z / v.w);
-    }
-
-    /* ---------------------------------------------------------------- *
-     * ---------------------------------------------------------------- */
-    glm::dvec2 viewportTransform(const glm::dvec3& p) const
-    {
-        const glm::ivec2 vp(w - 1, h - 1);
-        const glm::dvec2 halfViewport = glm::dvec2(vp) * 0.5;
+            const double nDotV     = (x + 0.5) / double(size);
+            const double roughness = 1.0 - (y + 0.5) / double(size);
 
-        glm::dvec2 out;
-        out.x =        (p.x + 1.0) * halfViewport.x;
-        out.y = vp.y - (p.y + 1.0) * halfViewport.y;
+            glm::dvec2 integratedBRDF;
+            switch(mode)
+            {
+                case Mode::Integrate:
+                    integratedBRDF = integrateBRDF(nDotV, roughness);
+                    break;
+                case Mode::Table:
+                    integratedBRDF = sampleTable(nDotV, roughness);
+                    break;
+                case Mode::Analytic:
+                    integratedBRDF = approximateBRDF(nDotV, roughness);
+                    break;
+            }
 
-        return out;
+            double* pix = pixels + (y * size + x) * 2;
+            pix[0] = integratedBRDF.x;
+            pix[1] = integratedBRDF.y;
+        }
     }
 
     /* ------------------------------------------------------------ *
+       Bilinear sample of the precomputed table.
      * ------------------------------------------------------------ */
-    double edgeFunction(const glm::dvec2& a,
-                        const glm::dvec2& b,
-                        const glm::dvec2& c) const
+    glm::dvec2 sampleTable(double nDotV, double roughness) const
     {
-        return ((c.x - a.x) * (b.y - a.y) - (c.y - a.y) * (b.x - a.x));
-    }
-};
+        const int n = BRDF_INTEGRATION_TABLE_SIZE;
+        const double tx = glm::clamp(nDotV * n - 0.5,               0.0, n - 1.0);
+        const double ty = glm::clamp((1.0 - roughness) * n - 0.5,   0.0, n - 1.0);
+        const int x0 = int(tx);
+        const int y0 = int(ty);
+        const int x1 = glm::min(x0 + 1, n - 1);
+        const int y1 = glm::min(y0 + 1, n - 1);
+        const double fx = tx - x0;
+        const double fy = ty - y0;
+
+        auto texel = [&](int x, int y)
+        {
+            const uint16_t* p = brdfIntegrationTable + (y * n + x) * 2;
+            return glm::dvec2(p[0], p[1]) / 65535.0;
+        };
 
-/* ---------------------------------------------------------------- *
- * ---------------------------------------------------------------- */
-struct PbrIblBrdfIntegration::Impl
-{
-    /* ------------------------------------------------------------ *
-     * ------------------------------------------------------------ */
-    Impl(PbrIblBrdfIntegration* self, int size)
-        : self(self)
-        , size(size)
-    {}
+        const glm::dvec2 a = glm::mix(texel(x0, y0), texel(x1, y0), fx);
+        const glm::dvec2 b = glm::mix(texel(x0, y1), texel(x1, y1), fx);
+        return glm::mix(a, b, fy);
+    }
 
     /* ------------------------------------------------------------ *
+       See "Physically Based Shading on Mobile" by Brian Karis
+       https://www.unrealengine.com/en-US/blog/physically-based-shading-on-mobile
      * ------------------------------------------------------------ */
-    void run()
+    glm::dvec2 approximateBRDF(double nDotV, double roughness) const
     {
-        // --------------------------------------------------------
-        // Render BRDF integration map
-
-        auto brdfIntegrationCallback = [&](const glm::dvec2& texCoord)
-        {
-            //std::cout << __FUNCTION__  << ": " << glm::to_string(texCoord) <<  std::endl;
-            glm::dvec2 integratedBRDF = integrateBRDF(texCoord.x, 1.0 - texCoord.y);
-
-            std::array<double, 2> pix = { integratedBRDF.x, integratedBRDF.y };
-            //std::array<double, 2> pix = { texCoord.x, texCoord.y };
-            self->brdfIntegration2dMap.setPixel(texCoord.x, texCoord.y, pix);
-
-//            Texture2D<double, 4>& tex =
-//                self->prefilterCubemap.face(size_t(faceIndex)).mipmap(size_t(mipmap));
-//            tex.setPixel(tc.uv.x, tc.uv.y, pix);
-
-
-        };
-
-        BrdfIntegrationRasterizer rasterizer(size, size,
-                                             brdfIntegrationCallback);
-        rasterizer.run();
-
-        self->brdfIntegration2dMap.toQImage().save("/temp/00_brdg.bmp");
+        const glm::dvec4 c0(-1.0, -0.0275, -0.572,  0.022);
+        const glm::dvec4 c1( 1.0,  0.0425,  1.04,  -0.04);
+        const glm::dvec4 r = roughness * c0 + c1;
+        const double a004 = glm::min(r.x * r.x, std::exp2(-9.28 * nDotV)) * r.x + r.y;
+        const glm::dvec2 ab = glm::dvec2(-1.04, 1.04) * a004 + glm::dvec2(r.z, r.w);
+        return glm::clamp(ab, glm::dvec2(0.0), glm::dvec2(1.0));
     }
 
     /* ------------------------------------------------------------ *
@@ -301,8 +257,8 @@ bool PbrIblBrdfIntegration::write(const QDir& dir)
 
 /* ---------------------------------------------------------------- *
  * ---------------------------------------------------------------- */
-void PbrIblBrdfIntegration::run()
-{ impl->run(); }
+void PbrIblBrdfIntegration::run(Mode mode)
+{ impl->run(mode); }
 
 } // namespace rasperi
 } // namespace kuu
@@ -15,16 +15,26 @@ namespace rasperi
 {
 
 /* ---------------------------------------------------------------- *
+   Split-sum BRDF integration map. The map can be integrated, or it
+   can be resampled from a table that was integrated beforehand or
+   it can be evaluated from an analytic approximation.
  * ---------------------------------------------------------------- */
 class PbrIblBrdfIntegration
 {
 public:
+    enum class Mode
+    {
+        Integrate, // Monte Carlo integration, slow
+        Table,     // Precomputed table embedded into the binary
+        Analytic,  // Fitted approximation by Karis
+    };
+
     PbrIblBrdfIntegration(int size = 128);
 
     bool read(const QDir& dir);
     bool write(const QDir& dir);
 
-    void run();
+    void run(Mode mode = Mode::Table);
 
     Texture2D<double, 2> brdfIntegration2dMap;
 
@@ -0,0 +1,711 @@
+/* ---------------------------------------------------------------- *
+   Antti Jumpponen <kuumies@gmail.com>
+   The precomputed BRDF integration table.
+ * ---------------------------------------------------------------- */
+ 
+#pragma once
+
+#include <cstdint>
+
+namespace kuu
+{
+namespace rasperi
+{
+
+/* ---------------------------------------------------------------- *
+   Split-sum BRDF integration of PbrIblBrdfIntegration, integrated
+   with 1024 samples per texel at the texel centers. Texel x is the
+   n dot v and texel y is one minus the roughness. Each texel has
+   the scale and the bias to f0 normalized into 16-bit integers.
+ * ---------------------------------------------------------------- */
+const int BRDF_INTEGRATION_TABLE_SIZE = 64;
+const uint16_t brdfIntegrationTable[BRDF_INTEGRATION_TABLE_SIZE *
+                                    BRDF_INTEGRATION_TABLE_SIZE * 2] =
+{
+    38854,  1292, 38389,  1222, 37911,  1153, 37423,  1087, 36926,  1025, 36425,   966,
+    35922,   909, 35428,   857, 34977,   806, 34572,   759, 34158,   714, 33738,   671,
+    33323,   631, 32921,   593, 32542,   557, 32168,   523, 31797,   491, 31437,   461,
+    31099,   432, 30760,   404, 30419,   377, 30080,   352, 29755,   329, 29425,   307,
+    29117,   287, 28825,   268, 28542,   251, 28272,   234, 28002,   217, 27719,   201,
+    27425,   186, 27132,   172, 26860,   159, 26605,   147, 26357,   136, 26116,   126,
+    25878,   116, 25645,   107, 25413,    98, 25183,    90, 24958,    82, 24728,    75,
+    24503,    68, 24299,    62, 24099,    57, 23894,    51, 23688,    46, 23479,    41,
+    23281,    37, 23084,    33, 22892,    30, 22715,    26, 22539,    23, 22354,    20,
+    22171,    17, 21991,    15, 21825,    13, 21662,    11, 21495,     9, 21321,     8,
+    21160,     6, 21004,     5, 20849,     4, 20697,     3, 39416,  1364, 38947,  1290,
+    38467,  1218, 37978,  1149, 37481,  1084, 36980,  1022, 36478,   963, 35981,   908,
+    35515,   855, 35116,   805, 34712,   758, 34298,   713, 33889,   670, 33486,   630,
+    33106,   592, 32745,   557, 32380,   523, 32027,   490, 31684,   459, 31362,   430,
+    31033,   402, 30706,   376, 30383,   351, 30071,   328, 29754,   307, 29467,   287,
+    29187,   268, 28921,   249, 28664,   231, 28405,   214, 28136,   199, 27857,   184,
+    27580,   171, 27323,   158, 27083,   146, 26851,   135, 26624,   124, 26400,   114,
+    26179,   105, 25958,    96, 25741,    88, 25534,    80, 25319,    73, 25100,    67,
+    24904,    60, 24715,    54, 24526,    49, 24336,    44, 24142,    39, 23955,    35,
+    23771,    31, 23587,    28, 23419,    24, 23258,    21, 23090,    19, 22925,    16,
+    22751,    14, 22590,    12, 22432,    10, 22291,     8, 22134,     6, 21979,     5,
+    21832,     4, 21685,     3, 39966,  1440, 39493,  1363, 39010,  1288, 38519,  1216,
+    38022,  1148, 37520,  1083, 37021,  1021, 36521,   963, 36047,   908, 35644,   855,
+    35250,   805, 34847,   757, 34442,   712, 34044,   670, 33665,   630, 33306,   592,
+    32954,   556, 32604,   522, 32264,   489, 31946,   458, 31634,   429, 31321,   401,
+    31007,   375, 30704,   351, 30404,   328, 30105,   306, 29833,   285, 29564,   265,
+    29315,   246, 29074,   228, 28832,   212, 28579,   197, 28315,   182, 28056,   169,
+    27817,   157, 27593,   145, 27372,   133, 27159,   122, 26947,   112, 26741,   103,
+    26538,    94, 26335,    86, 26141,    78, 25938,    71, 25731,    64, 25549,    58,
+    25374,    52, 25198,    47, 25024,    42, 24849,    38, 24671,    33, 24495,    29,
+    24325,    26, 24172,    23, 24026,    20, 23868,    17, 23713,    14, 23550,    12,
+    23411,    10, 23268,     8, 23130,     7, 22984,     5, 22843,     4, 22710,     3,
+    40504,  1521, 40024,  1441, 39538,  1362, 39045,  1287, 38548,  1215, 38045,  1147,
+    37549,  1082, 37051,  1021, 36574,   963, 36153,   908, 35768,   855, 35376,   805,
+    34979,   758, 34589,   713, 34207,   670, 33849,   630, 33510,   592, 33167,   555,
+    32837,   520, 32514,   488, 32220,   457, 31920,   428, 31623,   401, 31324,   375,
+    31040,   350, 30751,   327, 30470,   304, 30213,   282, 29961,   262, 29732,   244,
+    29509,   227, 29284,   210, 29050,   196, 28804,   181, 28560,   167, 28335,   154,
+    28127,   142, 27921,   130, 27723,   120, 27529,   110, 27336,   100, 27146,    91,
+    26958,    83, 26779,    75, 26593,    68, 26400,    62, 26229,    55, 26074,    50,
+    25916,    45, 25754,    40, 25591,    35, 25435,    31, 25275,    27, 25118,    24,
+    24974,    21, 24837,    18, 24694,    15, 24558,    13, 24411,    11, 24276,     9,
+    24144,     7, 24018,     6, 23893,     4, 23768,     3, 41027,  1608, 40541,  1524,
+    40050,  1442, 39555,  1363, 39056,  1287, 38554,  1215, 38058,  1148, 37562,  1083,
+    37082,  1022, 36642,   964, 36265,   908, 35886,   856, 35500,   806, 35115,   759,
+    34738,   713, 34383,   671, 34049,   630, 33720,   591, 33397,   555, 33084,   520,
+    32786,   487, 32507,   457, 32222,   428, 31940,   400, 31659,   373, 31390,   348,
+    31114,   323, 30854,   300, 30615,   280, 30384,   260, 30173,   242, 29972,   225,
+    29765,   209, 29546,   193, 29317,   178, 29090,   165, 28880,   151, 28688,   139,
+    28500,   128, 28315,   117, 28137,   107, 27962,    97, 27788,    88, 27615,    80,
+    27452,    72, 27285,    66, 27111,    59, 26954,    53, 26810,    47, 26667,    42,
+    26528,    37, 26386,    33, 26247,    29, 26098,    25, 25949,    22, 25820,    19,
+    25706,    16, 25582,    14, 25458,    11, 25322,     9, 25202,     7, 25091,     6,
+    24976,     4, 24867,     3, 41535,  1700, 41041,  1612, 40545,  1526, 40046,  1443,
+    39545,  1364, 39044,  1289, 38548,  1218, 38054,  1150, 37570,  1085, 37112,  1024,
+    36741,   966, 36373,   910, 36000,   858, 35625,   807, 35257,   759, 34900,   714,
+    34566,   670, 34255,   630, 33941,   591, 33638,   555, 33343,   520, 33074,   487,
+    32809,   456, 32541,   427, 32273,   398, 32012,   370, 31758,   344, 31501,   321,
+    31265,   299, 31044,   278, 30834,   259, 30643,   240, 30457,   223, 30267,   206,
+    30067,   190, 29855,   175, 29648,   161, 29453,   148, 29279,   136, 29110,   124,
+    28942,   113, 28779,   103, 28621,    94, 28467,    85, 28314,    77, 28174,    70,
+    28025,    63, 27863,    56, 27720,    50, 27595,    45, 27469,    40, 27345,    35,
+    27220,    31, 27098,    27, 26971,    23, 26842,    20, 26728,    17, 26624,    14,
+    26515,    12, 26414,    10, 26309,     8, 26196,     6, 26097,     4, 25997,     3,
+    42027,  1798, 41523,  1706, 41020,  1616, 40517,  1529, 40014,  1445, 39513,  1367,
+    39016,  1292, 38526,  1221, 38041,  1153, 37586,  1088, 37193,  1026, 36836,   968,
+    36477,   912, 36113,   859, 35754,   808, 35403,   760, 35074,   714, 34768,   671,
+    34471,   630, 34177,   592, 33894,   555, 33622,   521, 33376,   487, 33126,   455,
+    32876,   424, 32626,   395, 32387,   368, 32154,   343, 31918,   320, 31705,   298,
+    31500,   276, 31308,   256, 31135,   237, 30968,   219, 30796,   202, 30615,   186,
+    30426,   171, 30239,   157, 30064,   144, 29905,   132, 29754,   120, 29606,   110,
+    29463,   100, 29328,    91, 29196,    82, 29065,    74, 28937,    67, 28810,    60,
+    28669,    53, 28538,    47, 28428,    42, 28313,    37, 28207,    32, 28105,    28,
+    28010,    24, 27904,    21, 27786,    18, 27683,    15, 27598,    12, 27516,    10,
+    27421,     8, 27333,     6, 27244,     5, 27165,     3, 42500,  1903, 41986,  1807,
+    41475,  1712, 40967,  1620, 40460,  1532, 39959,  1450, 39461,  1371, 38976,  1296,
+    38494,  1224, 38036,  1156, 37620,  1091, 37274,  1030, 36929,   971, 36580,   914,
+    36231,   861, 35892,   809, 35563,   761, 35259,   715, 34980,   672, 34701,   631,
+    34430,   592, 34167,   555, 33920,   519, 33694,   485, 33463,   452, 33236,   422,
+    33007,   394, 32791,   367, 32579,   342, 32363,   318, 32169,   295, 31981,   273,
+    31806,   252, 31654,   233, 31508,   215, 31362,   198, 31205,   183, 31039,   168,
+    30872,   154, 30713,   140, 30573,   128, 30445,   117, 30322,   107, 30201,    97,
+    30081,    88, 29968,    79, 29859,    71, 29753,    63, 29648,    57, 29529,    50,
+    29410,    44, 29314,    39, 29220,    34, 29133,    30, 29047,    26, 28964,    22,
+    28880,    18, 28792,    16, 28709,    13, 28627,    10, 28561,     8, 28491,     6,
+    28426,     5, 28358,     3, 42954,  2015, 42427,  1914, 41907,  1815, 41393,  1718,
+    40883,  1626, 40381,  1539, 39883,  1456, 39401,  1377, 38923,  1301, 38460,  1229,
+    38028,  1161, 37684,  1095, 37352,  1032, 37021,   973, 36685,   916, 36357,   862,
+    36039,   811, 35739,   762, 35463,   717, 35206,   673, 34945,   631, 34697,   591,
+    34456,   553, 34238,   517, 34034,   483, 33826,   451, 33623,   421, 33418,   393,
+    33225,   366, 33031,   339, 32835,   314, 32662,   291, 32495,   269, 32340,   249,
+    32211,   230, 32086,   212, 31962,   195, 31828,   178, 31685,   164, 31545,   150,
+    31412,   137, 31295,   125, 31184,   114, 31075,   103, 30971,    93, 30874,    84,
+    30783,    75, 30694,    67, 30605,    60, 30523,    53, 30428,    47, 30331,    41,
+    30260,    36, 30185,    31, 30107,    27, 30045,    23, 29996,    19, 29934,    16,
+    29857,    13, 29795,    11, 29742,     9, 29693,     7, 29637,     5, 29593,     3,
+    43387,  2134, 42845,  2028, 42315,  1924, 41794,  1823, 41281,  1725, 40777,  1633,
+    40280,  1546, 39799,  1463, 39325,  1383, 38863,  1307, 38436,  1234, 38067,  1165,
+    37748,  1098, 37433,  1036, 37116,   975, 36800,   918, 36496,   864, 36199,   813,
+    35930,   764, 35684,   718, 35446,   673, 35206,   630, 34983,   589, 34765,   551,
+    34580,   516, 34400,   482, 34216,   450, 34039,   420, 33855,   390, 33685,   362,
+    33513,   336, 33340,   311, 33191,   287, 33050,   266, 32917,   245, 32808,   226,
+    32704,   208, 32605,   191, 32500,   175, 32386,   160, 32271,   147, 32155,   133,
+    32055,   121, 31963,   109, 31876,    99, 31793,    89, 31713,    79, 31641,    71,
+    31571,    63, 31509,    56, 31459,    49, 31396,    44, 31314,    38, 31260,    33,
+    31216,    28, 31166,    24, 31111,    20, 31073,    17, 31037,    14, 30996,    11,
+    30956,     9, 30914,     7, 30885,     5, 30848,     3, 43797,  2262, 43239,  2150,
+    42697,  2041, 42168,  1934, 41651,  1832, 41145,  1734, 40650,  1642, 40168,  1554,
+    39702,  1470, 39246,  1390, 38815,  1313, 38417,  1239, 38114,  1169, 37814,  1102,
+    37517,  1039, 37219,   979, 36927,   921, 36648,   867, 36383,   815, 36137,   764,
+    35921,   717, 35705,   672, 35492,   629, 35294,   589, 35104,   551, 34950,   516,
+    34796,   481, 34634,   448, 34480,   416, 34322,   387, 34180,   359, 34034,   332,
+    33887,   308, 33762,   284, 33643,   262, 33531,   241, 33447,   222, 33372,   204,
+    33299,   187, 33221,   171, 33130,   156, 33034,   141, 32941,   128, 32862,   116,
+    32796,   105, 32729,    94, 32668,    84, 32606,    75, 32567,    67, 32529,    59,
+    32484,    52, 32452,    46, 32414,    40, 32359,    35, 32318,    30, 32288,    25,
+    32256,    21, 32231,    18, 32220,    15, 32201,    12, 32179,     9, 32154,     7,
+    32144,     5, 32139,     4, 44182,  2398, 43606,  2281, 43051,  2166, 42513,  2053,
+    41991,  1945, 41483,  1842, 40989,  1745, 40507,  1651, 40049,  1563, 39598,  1478,
+    39165,  1397, 38770,  1319, 38449,  1244, 38165,  1173, 37887,  1107, 37612,  1043,
+    37334,   982, 37070,   924, 36816,   868, 36584,   815, 36369,   764, 36178,   716,
+    35989,   671, 35808,   629, 35637,   589, 35476,   551, 35346,   513, 35215,   477,
+    35080,   444, 34954,   412, 34823,   383, 34712,   355, 34596,   329, 34474,   304,
+    34374,   280, 34277,   258, 34192,   237, 34126,   218, 34074,   199, 34024,   182,
+    33969,   165, 33911,   150, 33845,   136, 33777,   123, 33720,   111, 33678,    99,
+    33635,    89, 33609,    80, 33571,    71, 33541,    63, 33522,    55, 33507,    48,
+    33498,    42, 33486,    36, 33453,    31, 33431,    26, 33429,    22, 33423,    18,
+    33413,    15, 33416,    12, 33422,     9, 33434,     7, 33437,     5, 33438,     4,
+    44541,  2544, 43945,  2420, 43375,  2299, 42827,  2180, 42299,  2066, 41788,  1957,
+    41297,  1855, 40818,  1756, 40364,  1662, 39921,  1573, 39494,  1486, 39103,  1404,
+    38750,  1325, 38485,  1250, 38226,  1179, 37972,  1112, 37720,  1047, 37469,   985,
+    37233,   926, 37006,   870, 36807,   815, 36628,   765, 36465,   717, 36303,   672,
+    36152,   629, 36006,   587, 35872,   547, 35770,   509, 35668,   473, 35563,   440,
+    35467,   409, 35366,   379, 35282,   351, 35193,   324, 35102,   299, 35032,   275,
+    34955,   253, 34890,   232, 34840,   211, 34810,   193, 34791,   175, 34766,   159,
+    34735,   144, 34698,   130, 34665,   118, 34636,   106, 34620,    95, 34602,    84,
+    34587,    75, 34575,    66, 34562,    58, 34562,    50, 34575,    44, 34589,    38,
+    34607,    32, 34614,    28, 34619,    23, 34634,    19, 34646,    15, 34666,    12,
+    34698,    10, 34715,     7, 34743,     5, 34779,     4, 44873,  2700, 44254,  2569,
+    43668,  2441, 43109,  2316, 42574,  2196, 42061,  2081, 41571,  1972, 41096,  1867,
+    40645,  1768, 40214,  1673, 39796,  1582, 39403,  1496, 39046,  1412, 38772,  1333,
+    38532,  1257, 38299,  1185, 38073,  1117, 37846,  1051, 37626,   988, 37419,   927,
+    37228,   871, 37059,   817, 36916,   766, 36781,   717, 36644,   670, 36520,   625,
+    36403,   582, 36303,   543, 36231,   505, 36163,   470, 36089,   437, 36020,   404,
+    35946,   374, 35892,   345, 35835,   318, 35769,   293, 35722,   269, 35673,   245,
+    35630,   224, 35604,   205, 35596,   186, 35606,   169, 35612,   153, 35614,   138,
+    35610,   125, 35602,   112, 35596,   100, 35599,    89, 35616,    79, 35625,    69,
+    35643,    61, 35650,    53, 35671,    46, 35708,    40, 35753,    34, 35796,    29,
+    35821,    24, 35849,    20, 35902,    16, 35946,    13, 35977,    10, 36026,     8,
+    36069,     5, 36114,     4, 45175,  2867, 44531,  2729, 43926,  2593, 43355,  2461,
+    42814,  2334, 42299,  2213, 41808,  2097, 41340,  1987, 40891,  1881, 40472,  1781,
+    40064,  1685, 39677,  1594, 39333,  1507, 39024,  1423, 38807,  1342, 38596,  1265,
+    38393,  1192, 38195,  1122, 37996,  1054, 37809,   990, 37635,   930, 37482,   873,
+    37343,   818, 37232,   765, 37124,   714, 37017,   666, 36927,   622, 36844,   580,
+    36776,   540, 36733,   502, 36694,   465, 36648,   430, 36610,   398, 36568,   367,
+    36536,   338, 36511,   311, 36476,   285, 36457,   261, 36449,   239, 36436,   218,
+    36435,   198, 36446,   180, 36478,   163, 36515,   147, 36543,   132, 36571,   118,
+    36591,   105, 36612,    94, 36641,    83, 36688,    73, 36723,    64, 36765,    55,
+    36803,    48, 36844,    41, 36888,    35, 36947,    30, 37026,    25, 37089,    20,
+    37140,    17, 37199,    13, 37265,    10, 37334,     8, 37408,     6, 37483,     4,
+    45445,  3046, 44774,  2899, 44149,  2756, 43565,  2617, 43016,  2482, 42498,  2354,
+    42008,  2230, 41546,  2114, 41104,  2002, 40694,  1897, 40302,  1795, 39929,  1699,
+    39584,  1607, 39275,  1518, 39046,  1432, 38860,  1350, 38681,  1272, 38510,  1197,
+    38343,  1126, 38177,  1058, 38026,   994, 37885,   933, 37768,   873, 37660,   816,
+    37586,   763, 37514,   713, 37440,   665, 37383,   620, 37333,   577, 37291,   535,
+    37276,   496, 37269,   459, 37257,   424, 37249,   391, 37241,   360, 37235,   331,
+    37247,   304, 37256,   279, 37260,   255, 37284,   232, 37301,   211, 37326,   191,
+    37363,   173, 37413,   156, 37475,   139, 37530,   124, 37584,   111, 37636,    99,
+    37685,    87, 37736,    76, 37800,    67, 37873,    58, 37942,    50, 38006,    43,
+    38069,    37, 38146,    31, 38224,    26, 38314,    21, 38384,    17, 38469,    13,
+    38573,    10, 38658,     8, 38747,     6, 38837,     4, 45682,  3238, 44980,  3082,
+    44334,  2930, 43735,  2783, 43178,  2640, 42657,  2504, 42169,  2374, 41713,  2250,
+    41281,  2132, 40877,  2019, 40503,  1913, 40143,  1811, 39807,  1714, 39515,  1619,
+    39248,  1528, 39088,  1441, 38935,  1358, 38790,  1277, 38654,  1202, 38524,  1131,
+    38395,  1062, 38278,   996, 38170,   933, 38095,   873, 38025,   817, 37991,   763,
+    37956,   712, 37915,   663, 37882,   615, 37862,   571, 37850,   529, 37869,   490,
+    37895,   453, 37921,   418, 37945,   384, 37977,   354, 38006,   325, 38045,   297,
+    38083,   271, 38115,   247, 38168,   224, 38221,   203, 38266,   183, 38328,   164,
+    38402,   147, 38493,   132, 38581,   117, 38660,   104, 38731,    91, 38819,    80,
+    38902,    70, 38988,    61, 39090,    52, 39189,    45, 39286,    38, 39368,    32,
+    39458,    26, 39555,    22, 39686,    18, 39792,    14, 39884,    11, 39999,     8,
+    40110,     6, 40228,     4, 45884,  3443, 45149,  3277, 44478,  3116, 43864,  2960,
+    43298,  2810, 42775,  2665, 42289,  2527, 41838,  2396, 41418,  2271, 41021,  2151,
+    40665,  2039, 40327,  1931, 40008,  1827, 39718,  1727, 39469,  1631, 39281,  1539,
+    39157,  1449, 39041,  1365, 38935,  1285, 38838,  1209, 38745,  1136, 38654,  1065,
+    38576,   999, 38510,   936, 38475,   875, 38443,   818, 38443,   762, 38441,   709,
+    38436,   658, 38439,   611, 38453,   566, 38472,   524, 38524,   484, 38587,   446,
+    38649,   411, 38706,   378, 38770,   346, 38827,   316, 38895,   288, 38967,   262,
+    39030,   237, 39102,   215, 39182,   193, 39264,   174, 39351,   156, 39448,   139,
+    39554,   123, 39674,   109, 39794,    96, 39905,    84, 40005,    73, 40110,    64,
+    40228,    55, 40353,    47, 40472,    39, 40593,    33, 40709,    27, 40835,    22,
+    40951,    18, 41084,    14, 41214,    11, 41334,     8, 41474,     6, 41594,     4,
+    46048,  3662, 45277,  3486, 44580,  3315, 43949,  3150, 43375,  2991, 42849,  2838,
+    42366,  2692, 41921,  2552, 41513,  2419, 41132,  2293, 40787,  2173, 40472,  2059,
+    40173,  1949, 39898,  1843, 39666,  1741, 39455,  1643, 39344,  1549, 39263,  1460,
+    39189,  1375, 39123,  1293, 39062,  1214, 39010,  1140, 38962,  1069, 38926,  1002,
+    38898,   937, 38899,   874, 38901,   813, 38936,   757, 38978,   704, 39015,   654,
+    39057,   606, 39106,   560, 39161,   518, 39241,   478, 39338,   439, 39432,   403,
+    39520,   368, 39613,   336, 39708,   306, 39807,   278, 39905,   251, 40006,   227,
+    40104,   205, 40213,   183, 40316,   164, 40421,   146, 40550,   130, 40686,   115,
+    40832,   101, 40969,    88, 41107,    76, 41239,    66, 41367,    57, 41499,    48,
+    41637,    40, 41796,    34, 41951,    28, 42083,    23, 42215,    18, 42355,    14,
+    42514,    11, 42665,     8, 42813,     6, 42974,     4, 46173,  3898, 45362,  3709,
+    44638,  3528, 43989,  3353, 43405,  3184, 42876,  3022, 42397,  2868, 41961,  2719,
+    41565,  2579, 41203,  2445, 40868,  2317, 40577,  2196, 40306,  2078, 40053,  1966,
+    39825,  1859, 39648,  1754, 39496,  1656, 39451,  1563, 39413,  1471, 39379,  1383,
+    39355,  1299, 39338,  1220, 39327,  1143, 39320,  1071, 39322,  1000, 39330,   932,
+    39373,   869, 39419,   810, 39490,   753, 39576,   700, 39653,   648, 39732,   600,
+    39822,   553, 39904,   509, 40002,   467, 40126,   427, 40259,   391, 40387,   357,
+    40507,   325, 40637,   294, 40768,   266, 40902,   240, 41032,   216, 41162,   193,
+    41303,   173, 41450,   154, 41580,   136, 41715,   120, 41870,   105, 42032,    92,
+    42199,    79, 42357,    68, 42504,    58, 42664,    50, 42824,    42, 42985,    35,
+    43153,    28, 43322,    23, 43491,    18, 43657,    14, 43822,    11, 43994,     8,
+    44151,     6, 44316,     4, 46256,  4151, 45402,  3949, 44648,  3755, 43980,  3569,
+    43387,  3391, 42856,  3220, 42381,  3056, 41955,  2899, 41573,  2750, 41230,  2609,
+    40917,  2473, 40641,  2342, 40400,  2218, 40176,  2099, 39974,  1983, 39807,  1875,
+    39680,  1771, 39602,  1671, 39601,  1573, 39608,  1480, 39623,  1390, 39641,  1304,
+    39666,  1222, 39696,  1143, 39727,  1067, 39774,   997, 39826,   929, 39912,   866,
+    40002,   805, 40107,   746, 40225,   691, 40343,   638, 40455,   588, 40576,   540,
+    40699,   495, 40825,   454, 40974,   415, 41141,   378, 41304,   343, 41461,   311,
+    41614,   281, 41775,   253, 41946,   228, 42118,   204, 42280,   182, 42443,   161,
+    42611,   142, 42778,   125, 42933,   110, 43094,    95, 43276,    82, 43471,    71,
+    43666,    60, 43849,    51, 44015,    43, 44178,    35, 44357,    29, 44553,    24,
+    44756,    19, 44935,    15, 45110,    11, 45294,     8, 45494,     6, 45678,     4,
+    46295,  4421, 45394,  4205, 44609,  3999, 43921,  3801, 43318,  3613, 42786,  3431,
+    42317,  3257, 41902,  3092, 41534,  2934, 41213,  2784, 40925,  2639, 40666,  2499,
+    40454,  2368, 40264,  2240, 40092,  2119, 39947,  2004, 39843,  1894, 39762,  1785,
+    39755,  1681, 39803,  1582, 39859,  1487, 39920,  1395, 39983,  1306, 40052,  1221,
+    40126,  1141, 40205,  1065, 40297,   994, 40387,   925, 40506,   858, 40638,   796,
+    40775,   735, 40926,   678, 41079,   624, 41235,   574, 41391,   527, 41554,   482,
+    41710,   439, 41883,   400, 42077,   363, 42275,   329, 42473,   297, 42662,   267,
+    42853,   240, 43040,   214, 43236,   190, 43426,   168, 43615,   149, 43812,   130,
+    44012,   114, 44197,    99, 44390,    86, 44586,    73, 44797,    62, 45002,    52,
+    45207,    44, 45411,    36, 45610,    30, 45803,    24, 45991,    19, 46202,    15,
+    46406,    11, 46604,     8, 46796,     6, 46993,     4, 46288,  4712, 45337,  4480,
+    44518,  4259, 43810,  4049, 43196,  3849, 42664,  3658, 42202,  3473, 41799,  3298,
+    41451,  3131, 41150,  2971, 40889,  2817, 40661,  2669, 40467,  2528, 40315,  2393,
+    40184,  2266, 40069,  2143, 39977,  2023, 39935,  1908, 39906,  1798, 39967,  1692,
+    40065,  1590, 40168,  1491, 40276,  1396, 40390,  1306, 40508,  1221, 40632,  1140,
+    40753,  1061, 40881,   986, 41012,   915, 41159,   846, 41329,   781, 41499,   721,
+    41698,   664, 41890,   610, 42084,   559, 42273,   511, 42474,   466, 42670,   424,
+    42871,   385, 43077,   348, 43314,   314, 43541,   282, 43759,   252, 43969,   224,
+    44189,   199, 44410,   176, 44629,   155, 44837,   135, 45054,   118, 45281,   103,
+    45499,    88, 45698,    75, 45908,    64, 46132,    54, 46371,    45, 46602,    37,
+    46811,    30, 47013,    24, 47222,    19, 47437,    15, 47661,    11, 47876,     8,
+    48087,     5, 48296,     3, 46232,  5023, 45228,  4774, 44372,  4538, 43643,  4314,
+    43020,  4102, 42489,  3899, 42034,  3704, 41647,  3519, 41318,  3342, 41039,  3171,
+    40808,  3008, 40614,  2852, 40450,  2701, 40328,  2559, 40239,  2423, 40166,  2291,
+    40110,  2162, 40078,  2041, 40097,  1923, 40121,  1810, 40243,  1700, 40391,  1594,
+    40546,  1494, 40710,  1399, 40877,  1308, 41041,  1218, 41208,  1134, 41376,  1053,
+    41538,   975, 41713,   902, 41892,   834, 42112,   770, 42322,   708, 42548,   649,
+    42780,   595, 43006,   543, 43233,   494, 43458,   449, 43690,   407, 43914,   367,
+    44148,   330, 44383,   295, 44640,   264, 44893,   235, 45131,   208, 45360,   183,
+    45603,   161, 45856,   141, 46092,   122, 46317,   105, 46550,    90, 46805,    77,
+    47042,    65, 47271,    55, 47488,    45, 47718,    37, 47951,    30, 48201,    24,
+    48432,    19, 48657,    15, 48879,    11, 49114,     8, 49349,     5, 49569,     3,
+    46126,  5357, 45063,  5089, 44170,  4836, 43419,  4598, 42788,  4372, 42258,  4157,
+    41814,  3952, 41444,  3756, 41137,  3567, 40885,  3386, 40683,  3213, 40525,  3047,
+    40401,  2889, 40307,  2736, 40255,  2590, 40229,  2448, 40220,  2313, 40225,  2182,
+    40257,  2057, 40332,  1935, 40411,  1817, 40591,  1706, 40799,  1601, 41011,  1499,
+    41222,  1399, 41438,  1304, 41651,  1212, 41862,  1124, 42075,  1042, 42293,   965,
+    42507,   891, 42727,   821, 42968,   755, 43222,   692, 43476,   632, 43746,   577,
+    44006,   524, 44264,   475, 44511,   429, 44765,   386, 45019,   346, 45272,   310,
+    45529,   276, 45786,   244, 46056,   216, 46334,   191, 46596,   167, 46849,   145,
+    47108,   126, 47377,   109, 47630,    93, 47873,    79, 48118,    66, 48369,    55,
+    48606,    45, 48855,    37, 49118,    30, 49373,    24, 49616,    19, 49857,    14,
+    50082,    11, 50317,     8, 50546,     5, 50792,     3, 45967,  5715, 44842,  5425,
+    43910,  5154, 43137,  4901, 42497,  4661, 41970,  4432, 41538,  4216, 41188,  4009,
+    40906,  3809, 40683,  3616, 40513,  3432, 40392,  3257, 40312,  3090, 40263,  2928,
+    40240,  2769, 40259,  2619, 40299,  2474, 40356,  2335, 40423,  2199, 40517,  2069,
+    40654,  1946, 40797,  1829, 41029,  1714, 41283,  1602, 41545,  1496, 41804,  1392,
+    42069,  1294, 42337,  1202, 42607,  1115, 42871,  1031, 43128,   951, 43379,   874,
+    43630,   802, 43887,   734, 44171,   670, 44455,   610, 44752,   554, 45048,   501,
+    45336,   451, 45618,   406, 45890,   363, 46174,   324, 46454,   289, 46743,   256,
+    47024,   226, 47308,   198, 47592,   173, 47872,   150, 48146,   130, 48410,   112,
+    48686,    95, 48947,    80, 49205,    67, 49468,    56, 49743,    47, 50006,    38,
+    50267,    31, 50503,    24, 50780,    19, 51026,    14, 51282,    11, 51523,     8,
+    51767,     5, 51999,     3, 45752,  6099, 44561,  5786, 43588,  5495, 42793,  5224,
+    42147,  4969, 41624,  4727, 41207,  4499, 40879,  4280, 40625,  4067, 40436,  3864,
+    40303,  3669, 40219,  3483, 40182,  3305, 40180,  3132, 40207,  2964, 40263,  2803,
+    40354,  2649, 40462,  2499, 40584,  2354, 40716,  2216, 40876,  2085, 41073,  1956,
+    41268,  1832, 41539,  1712, 41845,  1596, 42161,  1488, 42479,  1385, 42801,  1287,
+    43115,  1190, 43426,  1099, 43731,  1012, 44032,   929, 44324,   851, 44606,   777,
+    44894,   710, 45192,   644, 45499,   583, 45816,   528, 46149,   475, 46472,   427,
+    46791,   382, 47099,   341, 47393,   303, 47697,   267, 47992,   235, 48299,   206,
+    48598,   180, 48894,   155, 49187,   133, 49467,   114, 49745,    97, 50026,    82,
+    50327,    69, 50608,    57, 50865,    47, 51119,    38, 51374,    30, 51626,    24,
+    51879,    18, 52154,    14, 52410,    10, 52675,     7, 52917,     5, 53159,     3,
+    45479,  6511, 44218,  6171, 43203,  5859, 42387,  5570, 41735,  5298, 41219,  5042,
+    40819,  4800, 40516,  4568, 40293,  4344, 40141,  4129, 40050,  3924, 40010,  3727,
+    40015,  3536, 40064,  3352, 40144,  3175, 40251,  3004, 40384,  2837, 40547,  2676,
+    40728,  2523, 40924,  2377, 41122,  2232, 41331,  2093, 41585,  1958, 41840,  1830,
+    42148,  1709, 42515,  1593, 42881,  1481, 43244,  1372, 43603,  1268, 43960,  1169,
+    44313,  1075, 44660,   986, 45005,   903, 45342,   825, 45665,   750, 45980,   681,
+    46292,   617, 46626,   556, 46959,   500, 47299,   448, 47652,   400, 47994,   356,
+    48323,   315, 48636,   277, 48947,   243, 49253,   212, 49561,   184, 49875,   159,
+    50180,   136, 50494,   117, 50802,    99, 51104,    84, 51373,    69, 51648,    57,
+    51931,    46, 52209,    38, 52476,    30, 52736,    24, 52996,    18, 53244,    14,
+    53493,    10, 53755,     7, 54004,     5, 54259,     3, 45146,  6953, 43811,  6584,
+    42752,  6247, 41916,  5938, 41260,  5649, 40755,  5378, 40375,  5122, 40099,  4875,
+    39912,  4639, 39802,  4415, 39755,  4198, 39764,  3990, 39819,  3786, 39915,  3590,
+    40053,  3403, 40219,  3220, 40404,  3041, 40617,  2871, 40860,  2708, 41111,  2547,
+    41367,  2390, 41631,  2240, 41900,  2097, 42214,  1961, 42535,  1831, 42874,  1702,
+    43267,  1578, 43671,  1460, 44075,  1348, 44476,  1241, 44876,  1141, 45277,  1048,
+    45661,   956, 46044,   872, 46420,   793, 46785,   719, 47135,   649, 47470,   584,
+    47805,   524, 48155,   468, 48494,   417, 48842,   369, 49201,   326, 49547,   286,
+    49883,   250, 50204,   218, 50516,   188, 50838,   162, 51153,   139, 51477,   119,
+    51771,   100, 52077,    83, 52369,    69, 52660,    57, 52931,    46, 53220,    37,
+    53508,    30, 53786,    23, 54048,    18, 54309,    13, 54557,    10, 54806,     7,
+    55071,     5, 55315,     3, 44751,  7426, 43337,  7024, 42234,  6662, 41379,  6331,
+    40723,  6023, 40231,  5737, 39875,  5465, 39631,  5204, 39483,  4957, 39418,  4721,
+    39421,  4494, 39482,  4272, 39592,  4057, 39746,  3850, 39935,  3648, 40158,  3450,
+    40410,  3263, 40683,  3082, 40969,  2903, 41283,  2729, 41607,  2562, 41938,  2402,
+    42270,  2248, 42602,  2100, 42949,  1954, 43314,  1814, 43679,  1680, 44102,  1554,
+    44551,  1434, 45002,  1321, 45441,  1212, 45877,  1109, 46312,  1013, 46735,   922,
+    47144,   836, 47545,   756, 47938,   681, 48321,   612, 48683,   548, 49024,   487,
+    49367,   432, 49728,   382, 50069,   336, 50423,   294, 50777,   256, 51128,   223,
+    51463,   192, 51788,   165, 52086,   140, 52392,   118, 52699,    99, 53006,    83,
+    53308,    69, 53625,    56, 53928,    46, 54216,    37, 54484,    29, 54777,    23,
+    55051,    17, 55316,    13, 55578,     9, 55839,     7, 56079,     4, 56324,     3,
+    44290,  7933, 42794,  7494, 41647,  7104, 40775,  6750, 40122,  6423, 39647,  6120,
+    39319,  5830, 39112,  5557, 39009,  5299, 38992,  5050, 39048,  4810, 39165,  4575,
+    39337,  4350, 39551,  4128, 39799,  3909, 40081,  3701, 40396,  3501, 40731,  3304,
+    41082,  3111, 41447,  2926, 41834,  2747, 42234,  2576, 42631,  2408, 43021,  2242,
+    43402,  2084, 43780,  1934, 44197,  1790, 44608,  1655, 45056,  1526, 45527,  1402,
+    46012,  1286, 46488,  1175, 46952,  1070, 47410,   972, 47858,   880, 48299,   795,
+    48720,   714, 49125,   638, 49527,   570, 49913,   507, 50280,   448, 50628,   395,
+    50969,   346, 51328,   303, 51675,   263, 52029,   228, 52378,   195, 52715,   167,
+    53042,   141, 53355,   119, 53658,   100, 53964,    83, 54276,    69, 54580,    56,
+    54860,    45, 55154,    36, 55438,    28, 55697,    22, 55968,    17, 56247,    12,
+    56512,     9, 56755,     6, 57007,     4, 57265,     2, 43762,  8475, 42180,  7996,
+    40990,  7575, 40104,  7196, 39457,  6849, 39004,  6528, 38708,  6222, 38544,  5936,
+    38490,  5665, 38527,  5403, 38640,  5148, 38819,  4902, 39052,  4661, 39328,  4422,
+    39646,  4195, 39999,  3975, 40374,  3756, 40768,  3542, 41186,  3336, 41619,  3138,
+    42063,  2946, 42508,  2755, 42964,  2570, 43421,  2393, 43875,  2224, 44321,  2062,
+    44761,  1910, 45198,  1761, 45649,  1621, 46096,  1488, 46585,  1361, 47084,  1241,
+    47583,  1128, 48076,  1023, 48548,   923, 49009,   830, 49466,   745, 49912,   666,
+    50339,   592, 50753,   525, 51154,   463, 51552,   409, 51925,   358, 52278,   312,
+    52617,   269, 52953,   231, 53284,   198, 53630,   169, 53975,   143, 54319,   121,
+    54643,   101, 54950,    84, 55227,    68, 55506,    55, 55799,    44, 56077,    35,
+    56336,    27, 56610,    21, 56878,    16, 57121,    12, 57372,     8, 57647,     6,
+    57902,     4, 58134,     2, 43164,  9055, 41493,  8531, 40261,  8076, 39364,  7670,
+    38729,  7303, 38303,  6962, 38046,  6642, 37930,  6344, 37929,  6057, 38025,  5780,
+    38200,  5511, 38444,  5251, 38742,  4992, 39089,  4743, 39480,  4504, 39900,  4264,
+    40344,  4029, 40811,  3801, 41296,  3580, 41791,  3364, 42290,  3150, 42792,  2942,
+    43297,  2744, 43813,  2554, 44337,  2374, 44854,  2201, 45354,  2033, 45840,  1873,
+    46304,  1720, 46779,  1574, 47243,  1437, 47729,  1309, 48224,  1186, 48728,  1072,
+    49232,   966, 49731,   869, 50209,   777, 50673,   692, 51123,   614, 51572,   545,
+    51997,   479, 52408,   420, 52794,   366, 53164,   316, 53534,   274, 53879,   235,
+    54223,   202, 54565,   171, 54877,   144, 55196,   121, 55509,   100, 55810,    82,
+    56118,    67, 56406,    54, 56679,    43, 56955,    34, 57254,    27, 57528,    20,
+    57772,    15, 58033,    11, 58269,     8, 58501,     6, 58747,     4, 58999,     2,
+    42494,  9676, 40731,  9101, 39459,  8609, 38556,  8175, 37939,  7786, 37546,  7425,
+    37335,  7092, 37272,  6778, 37332,  6477, 37490,  6184, 37734,  5902, 38045,  5621,
+    38416,  5350, 38840,  5091, 39300,  4829, 39792,  4572, 40311,  4322, 40852,  4079,
+    41405,  3839, 41961,  3599, 42522,  3367, 43091,  3146, 43668,  2936, 44244,  2732,
+    44806,  2533, 45375,  2344, 45935,  2162, 46477,  1987, 47003,  1822, 47512,  1666,
+    47995,  1518, 48487,  1377, 48960,  1247, 49459,  1127, 49955,  1012, 50454,   906,
+    50948,   808, 51439,   720, 51905,   637, 52357,   562, 52785,   491, 53207,   429,
+    53626,   374, 54029,   324, 54416,   279, 54783,   239, 55126,   203, 55449,   171,
+    55752,   143, 56060,   119, 56361,    98, 56660,    81, 56963,    65, 57261,    53,
+    57551,    42, 57825,    33, 58066,    25, 58327,    19, 58612,    15, 58871,    11,
+    59110,     8, 59330,     5, 59541,     3, 59744,     2, 41750, 10338, 39893,  9706,
+    38584,  9175, 37681,  8712, 37087,  8300, 36735,  7921, 36577,  7575, 36575,  7244,
+    36699,  6925, 36929,  6619, 37245,  6317, 37632,  6023, 38083,  5741, 38580,  5457,
+    39116,  5178, 39685,  4904, 40280,  4636, 40890,  4370, 41508,  4105, 42136,  3849,
+    42779,  3608, 43423,  3372, 44065,  3143, 44695,  2919, 45315,  2703, 45923,  2494,
+    46518,  2295, 47109,  2107, 47692,  1930, 48251,  1759, 48795,  1601, 49314,  1452,
+    49796,  1310, 50284,  1178, 50749,  1056, 51245,   946, 51722,   841, 52198,   745,
+    52663,   655, 53134,   577, 53591,   506, 54029,   441, 54449,   382, 54846,   329,
+    55222,   281, 55584,   239, 55923,   201, 56259,   169, 56588,   142, 56902,   118,
+    57190,    97, 57491,    79, 57781,    64, 58053,    51, 58317,    40, 58581,    31,
+    58853,    24, 59095,    18, 59317,    14, 59560,    10, 59804,     7, 60036,     5,
+    60250,     3, 60469,     2, 40930, 11045, 38977, 10350, 37635,  9775, 36739,  9283,
+    36177,  8847, 35873,  8452, 35776,  8088, 35841,  7742, 36039,  7408, 36346,  7084,
+    36740,  6766, 37212,  6460, 37743,  6155, 38320,  5852, 38938,  5554, 39587,  5261,
+    40254,  4967, 40934,  4676, 41632,  4397, 42346,  4130, 43059,  3867, 43765,  3608,
+    44466,  3356, 45154,  3111, 45829,  2876, 46493,  2651, 47144,  2438, 47770,  2232,
+    48379,  2039, 48971,  1856, 49549,  1682, 50108,  1521, 50647,  1371, 51164,  1233,
+    51642,  1102, 52111,   981, 52555,   869, 53030,   770, 53493,   678, 53927,   594,
+    54370,   517, 54794,   448, 55203,   385, 55597,   330, 55978,   281, 56346,   238,
+    56707,   201, 57054,   169, 57383,   140, 57696,   116, 58000,    95, 58279,    77,
+    58526,    61, 58789,    49, 59053,    39, 59296,    30, 59538,    23, 59764,    17,
+    59988,    12, 60196,     9, 60418,     6, 60669,     4, 60914,     3, 61124,     2,
+    40032, 11799, 37981, 11032, 36613, 10411, 35731,  9889, 35210,  9428, 34965,  9019,
+    34936,  8638, 35077,  8274, 35357,  7926, 35747,  7583, 36231,  7254, 36791,  6929,
+    37406,  6601, 38071,  6278, 38772,  5958, 39498,  5636, 40245,  5320, 41015,  5018,
+    41796,  4720, 42579,  4427, 43352,  4134, 44119,  3851, 44875,  3575, 45620,  3309,
+    46354,  3057, 47069,  2813, 47763,  2580, 48435,  2359, 49080,  2147, 49711,  1951,
+    50318,  1766, 50904,  1594, 51454,  1432, 51992,  1281, 52504,  1141, 53004,  1016,
+    53463,   899, 53895,   791, 54319,   694, 54733,   604, 55150,   523, 55550,   451,
+    55932,   387, 56324,   331, 56705,   282, 57080,   239, 57433,   200, 57775,   167,
+    58108,   138, 58413,   113, 58698,    91, 58986,    74, 59257,    59, 59511,    47,
+    59738,    36, 59975,    28, 60216,    21, 60445,    16, 60694,    12, 60918,     9,
+    61118,     6, 61283,     4, 61468,     2, 61676,     1, 39053, 12600, 36906, 11754,
+    35518, 11083, 34661, 10530, 34190, 10048, 34014,  9622, 34063,  9225, 34290,  8847,
+    34658,  8481, 35143,  8126, 35723,  7782, 36373,  7430, 37082,  7082, 37837,  6735,
+    38624,  6387, 39439,  6044, 40281,  5714, 41130,  5383, 41982,  5055, 42827,  4729,
+    43663,  4410, 44489,  4100, 45305,  3803, 46108,  3517, 46883,  3239, 47638,  2973,
+    48373,  2722, 49089,  2484, 49777,  2259, 50444,  2049, 51080,  1849, 51686,  1662,
+    52265,  1489, 52826,  1330, 53355,  1183, 53850,  1047, 54319,   921, 54761,   806,
+    55178,   704, 55561,   611, 55931,   528, 56312,   456, 56717,   391, 57090,   333,
+    57437,   281, 57782,   237, 58118,   198, 58427,   163, 58732,   134, 59041,   110,
+    59336,    89, 59618,    71, 59884,    56, 60147,    44, 60397,    34, 60631,    26,
+    60864,    20, 61075,    15, 61286,    11, 61484,     8, 61699,     5, 61901,     4,
+    62062,     2, 62245,     1, 37992, 13452, 35750, 12516, 34352, 11794, 33530, 11209,
+    33123, 10709, 33025, 10266, 33162,  9852, 33485,  9463, 33953,  9082, 34543,  8717,
+    35219,  8342, 35970,  7970, 36780,  7600, 37630,  7227, 38512,  6854, 39426,  6493,
+    40350,  6129, 41272,  5761, 42192,  5400, 43102,  5043, 44005,  4698, 44896,  4365,
+    45759,  4037, 46604,  3724, 47428,  3425, 48227,  3139, 48998,  2867, 49748,  2612,
+    50461,  2368, 51144,  2139, 51803,  1926, 52437,  1729, 53036,  1545, 53602,  1373,
+    54136,  1215, 54639,  1070, 55122,   939, 55574,   821, 56019,   716, 56439,   622,
+    56830,   537, 57188,   460, 57522,   393, 57844,   333, 58177,   280, 58496,   233,
+    58815,   194, 59110,   160, 59396,   131, 59687,   107, 59964,    86, 60230,    68,
+    60485,    54, 60733,    42, 60976,    33, 61207,    25, 61424,    19, 61638,    14,
+    61831,    10, 62015,     7, 62204,     5, 62409,     3, 62613,     2, 62753,     1,
+    36847, 14354, 34513, 13319, 33116, 12544, 32343, 11926, 32012, 11413, 32004, 10954,
+    32243, 10530, 32672, 10124, 33252,  9736, 33948,  9343, 34735,  8950, 35596,  8558,
+    36508,  8158, 37460,  7756, 38448,  7363, 39450,  6965, 40451,  6559, 41448,  6155,
+    42438,  5759, 43423,  5376, 44385,  4998, 45327,  4632, 46245,  4279, 47136,  3940,
+    47997,  3614, 48834,  3307, 49631,  3011, 50401,  2734, 51140,  2474, 51848,  2230,
+    52517,  2001, 53153,  1789, 53752,  1591, 54324,  1410, 54867,  1244, 55402,  1097,
+    55912,   963, 56399,   842, 56846,   731, 57265,   631, 57664,   542, 58026,   462,
+    58351,   390, 58667,   329, 58961,   277, 59227,   231, 59493,   191, 59782,   156,
+    60062,   127, 60330,   103, 60580,    82, 60824,    66, 61075,    52, 61313,    40,
+    61533,    31, 61740,    23, 61943,    17, 62131,    12, 62318,     9, 62492,     6,
+    62670,     4, 62831,     3, 62982,     2, 63158,     1, 35616, 15309, 33197, 14162,
+    31814, 13333, 31104, 12688, 30863, 12159, 30960, 11689, 31312, 11257, 31859, 10840,
+    32559, 10436, 33374, 10024, 34281,  9611, 35255,  9187, 36278,  8758, 37343,  8334,
+    38426,  7898, 39510,  7451, 40591,  7005, 41673,  6571, 42742,  6143, 43785,  5719,
+    44806,  5308, 45802,  4910, 46767,  4526, 47703,  4160, 48599,  3807, 49461,  3472,
+    50286,  3155, 51076,  2858, 51822,  2576, 52531,  2312, 53198,  2066, 53843,  1843,
+    54475,  1641, 55070,  1454, 55638,  1284, 56168,  1127, 56658,   983, 57128,   854,
+    57568,   738, 57971,   632, 58364,   541, 58739,   461, 59092,   390, 59421,   328,
+    59717,   273, 59998,   226, 60263,   186, 60495,   152, 60707,   123, 60921,   100,
+    61162,    79, 61386,    62, 61598,    48, 61793,    37, 61986,    28, 62189,    21,
+    62386,    15, 62578,    11, 62773,     8, 62945,     6, 63091,     4, 63231,     2,
+    63359,     2, 63515,     1, 34299, 16316, 31802, 15045, 30450, 14162, 29820, 13496,
+    29684, 12955, 29901, 12480, 30379, 12037, 31059, 11619, 31887, 11191, 32833, 10762,
+    33864, 10319, 34959,  9865, 36105,  9412, 37271,  8937, 38445,  8451, 39620,  7963,
+    40799,  7487, 41957,  7009, 43093,  6538, 44202,  6077, 45280,  5629, 46325,  5197,
+    47331,  4779, 48295,  4378, 49219,  3996, 50101,  3634, 50939,  3292, 51731,  2969,
+    52493,  2670, 53226,  2396, 53931,  2144, 54594,  1910, 55223,  1694, 55801,  1493,
+    56344,  1310, 56862,  1145, 57340,   994, 57791,   859, 58224,   740, 58639,   635,
+    59020,   541, 59370,   457, 59708,   385, 60033,   322, 60335,   268, 60622,   221,
+    60898,   182, 61145,   147, 61365,   118, 61564,    93, 61740,    73, 61902,    58,
+    62069,    44, 62259,    34, 62435,    25, 62616,    19, 62788,    14, 62933,    10,
+    63082,     7, 63257,     5, 63423,     3, 63610,     2, 63760,     1, 63878,     1,
+    32894, 17374, 30331, 15967, 29028, 15031, 28498, 14351, 28484, 13803, 28836, 13327,
+    29456, 12888, 30276, 12450, 31248, 12011, 32332, 11556, 33496, 11082, 34725, 10603,
+    35980, 10092, 37249,  9566, 38533,  9044, 39811,  8519, 41066,  7988, 42297,  7462,
+    43499,  6946, 44667,  6443, 45796,  5955, 46878,  5480, 47914,  5025, 48906,  4591,
+    49854,  4180, 50754,  3791, 51619,  3429, 52447,  3093, 53224,  2777, 53967,  2486,
+    54656,  2214, 55294,  1959, 55906,  1730, 56471,  1519, 56998,  1327, 57501,  1156,
+    57986,  1004, 58428,   865, 58835,   741, 59236,   633, 59609,   538, 59953,   453,
+    60280,   380, 60596,   317, 60880,   262, 61138,   214, 61379,   173, 61613,   139,
+    61843,   111, 62050,    88, 62243,    69, 62421,    53, 62602,    41, 62759,    31,
+    62880,    23, 63029,    17, 63174,    12, 63342,     9, 63496,     6, 63647,     5,
+    63754,     3, 63893,     2, 64037,     1, 64204,     1, 31400, 18483, 28787, 16927,
+    27554, 15943, 27145, 15255, 27273, 14714, 27776, 14240, 28554, 13804, 29530, 13357,
+    30655, 12900, 31882, 12410, 33194, 11914, 34545, 11374, 35918, 10812, 37310, 10250,
+    38692,  9671, 40054,  9086, 41392,  8504, 42694,  7927, 43961,  7365, 45176,  6811,
+    46342,  6274, 47470,  5765, 48540,  5274, 49557,  4806, 50531,  4367, 51461,  3957,
+    52336,  3570, 53163,  3209, 53927,  2868, 54650,  2554, 55327,  2266, 55952,  1999,
+    56548,  1759, 57118,  1543, 57638,  1345, 58129,  1168, 58596,  1010, 59026,   868,
+    59423,   741, 59803,   631, 60161,   534, 60485,   447, 60785,   372, 61072,   308,
+    61339,   252, 61599,   206, 61834,   166, 62056,   133, 62270,   106, 62481,    84,
+    62679,    66, 62861,    50, 63033,    38, 63189,    29, 63341,    21, 63479,    16,
+    63595,    11, 63712,     8, 63833,     6, 63956,     4, 64091,     3, 64215,     2,
+    64319,     1, 64406,     1, 29819, 19639, 27175, 17923, 26039, 16901, 25772, 16215,
+    26062, 15687, 26737, 15237, 27684, 14794, 28831, 14342, 30114, 13850, 31507, 13348,
+    32955, 12786, 34437, 12195, 35943, 11591, 37438, 10959, 38915, 10316, 40368,  9675,
+    41783,  9036, 43150,  8402, 44466,  7781, 45739,  7185, 46946,  6603, 48097,  6046,
+    49197,  5519, 50242,  5021, 51234,  4553, 52160,  4108, 53023,  3689, 53838,  3303,
+    54592,  2942, 55303,  2612, 55982,  2314, 56610,  2039, 57199,  1790, 57754,  1565,
+    58266,  1361, 58737,  1177, 59191,  1015, 59608,   870, 59986,   740, 60338,   625,
+    60664,   525, 60970,   439, 61260,   364, 61522,   299, 61771,   244, 62020,   199,
+    62259,   161, 62479,   129, 62681,   102, 62863,    79, 63031,    61, 63197,    46,
+    63370,    35, 63527,    26, 63681,    20, 63817,    14, 63947,    10, 64067,     7,
+    64164,     5, 64237,     3, 64349,     2, 64432,     1, 64511,     1, 64623,     0,
+    28151, 20838, 25502, 18953, 24491, 17907, 24391, 17239, 24864, 16739, 25728, 16306,
+    26864, 15873, 28188, 15397, 29655, 14902, 31198, 14330, 32794, 13717, 34419, 13076,
+    36037, 12393, 37641, 11696, 39214, 10987, 40750, 10279, 42231,  9571, 43665,  8883,
+    45029,  8203, 46333,  7548, 47580,  6924, 48762,  6327, 49885,  5762, 50929,  5220,
+    51909,  4712, 52826,  4236, 53688,  3795, 54511,  3393, 55276,  3020, 55990,  2677,
+    56653,  2363, 57265,  2076, 57831,  1815, 58372,  1583, 58865,  1372, 59320,  1183,
+    59733,  1013, 60117,   863, 60480,   732, 60813,   617, 61119,   516, 61426,   431,
+    61712,   358, 61980,   295, 62218,   240, 62442,   194, 62646,   155, 62835,   122,
+    63027,    96, 63202,    75, 63365,    57, 63522,    44, 63663,    32, 63807,    24,
+    63936,    17, 64054,    12, 64164,     8, 64284,     6, 64388,     4, 64479,     3,
+    64554,     2, 64623,     1, 64745,     1, 64828,     0, 26398, 22076, 23775, 20014,
+    22921, 18963, 23017, 18335, 23699, 17888, 24769, 17474, 26105, 17038, 27631, 16569,
+    29267, 16005, 30978, 15384, 32727, 14712, 34476, 13982, 36217, 13232, 37927, 12460,
+    39589, 11673, 41199, 10891, 42742, 10113, 44217,  9351, 45631,  8620, 46973,  7913,
+    48247,  7239, 49433,  6587, 50555,  5976, 51598,  5397, 52593,  4865, 53525,  4369,
+    54391,  3908, 55197,  3481, 55940,  3087, 56631,  2726, 57285,  2402, 57885,  2105,
+    58431,  1835, 58929,  1590, 59396,  1373, 59831,  1180, 60230,  1009, 60615,   860,
+    60983,   730, 61321,   616, 61625,   515, 61897,   427, 62145,   351, 62370,   286,
+    62593,   232, 62800,   186, 62986,   148, 63167,   117, 63330,    91, 63490,    70,
+    63636,    53, 63769,    39, 63891,    29, 64009,    21, 64132,    15, 64249,    11,
+    64360,     7, 64460,     5, 64565,     3, 64666,     2, 64770,     2, 64863,     1,
+    64930,     1, 64982,     0, 24563, 23342, 22006, 21102, 21346, 20076, 21666, 19516,
+    22579, 19127, 23876, 18752, 25434, 18330, 27154, 17803, 28977, 17193, 30855, 16504,
+    32747, 15742, 34631, 14936, 36486, 14099, 38286, 13232, 40028, 12361, 41696, 11492,
+    43298, 10646, 44826,  9823, 46276,  9029, 47628,  8254, 48903,  7520, 50105,  6829,
+    51242,  6185, 52300,  5579, 53287,  5013, 54198,  4484, 55047,  3998, 55846,  3555,
+    56582,  3146, 57250,  2770, 57864,  2427, 58436,  2120, 58976,  1845, 59485,  1602,
+    59962,  1385, 60392,  1190, 60784,  1016, 61136,   861, 61455,   724, 61744,   605,
+    62022,   504, 62280,   417, 62510,   341, 62728,   277, 62926,   223, 63118,   179,
+    63289,   141, 63448,   110, 63600,    85, 63737,    65, 63877,    49, 64003,    36,
+    64117,    26, 64223,    19, 64321,    13, 64430,     9, 64528,     6, 64628,     4,
+    64726,     3, 64811,     2, 64889,     1, 64981,     1, 65063,     0, 65123,     0,
+    22653, 24626, 20209, 22220, 19783, 21261, 20359, 20811, 21526, 20492, 23070, 20151,
+    24854, 19706, 26782, 19138, 28792, 18454, 30834, 17679, 32872, 16825, 34876, 15912,
+    36831, 14970, 38711, 14000, 40523, 13041, 42262, 12101, 43909, 11174, 45452, 10263,
+    46907,  9393, 48290,  8575, 49587,  7799, 50799,  7067, 51920,  6375, 52965,  5731,
+    53951,  5141, 54857,  4590, 55684,  4078, 56448,  3610, 57175,  3191, 57848,  2809,
+    58476,  2465, 59047,  2151, 59570,  1869, 60042,  1614, 60469,  1386, 60856,  1183,
+    61221,  1006, 61558,   851, 61859,   714, 62140,   596, 62407,   496, 62654,   409,
+    62873,   334, 63069,   270, 63247,   216, 63409,   171, 63570,   135, 63714,   105,
+    63845,    80, 63964,    60, 64074,    44, 64190,    33, 64296,    24, 64393,    17,
+    64500,    12, 64591,     8, 64674,     6, 64762,     4, 64852,     3, 64929,     2,
+    65000,     1, 65066,     1, 65151,     0, 65228,     0, 20676, 25913, 18402, 23378,
+    18252, 22532, 19116, 22219, 20561, 21987, 22370, 21685, 24386, 21197, 26525, 20558,
+    28721, 19786, 30924, 18904, 33090, 17924, 35202, 16891, 37244, 15832, 39213, 14777,
+    41084, 13717, 42845, 12663, 44514, 11649, 46096, 10684, 47579,  9759, 48963,  8878,
+    50251,  8046, 51465,  7275, 52587,  6550, 53619,  5872, 54584,  5250, 55488,  4683,
+    56322,  4160, 57097,  3684, 57803,  3247, 58446,  2849, 59030,  2486, 59560,  2160,
+    60054,  1870, 60515,  1613, 60932,  1384, 61315,  1181, 61669,  1003, 61987,   847,
+    62271,   709, 62527,   589, 62758,   486, 62969,   397, 63173,   324, 63352,   261,
+    63513,   208, 63659,   163, 63794,   127, 63931,    99, 64050,    75, 64167,    57,
+    64279,    42, 64376,    31, 64474,    22, 64571,    16, 64656,    11, 64733,     7,
+    64806,     5, 64874,     3, 64939,     2, 65027,     1, 65096,     1, 65158,     1,
+    65215,     0, 65269,     0, 18643, 27186, 16607, 24575, 16780, 23931, 17965, 23795,
+    19716, 23673, 21790, 23339, 24050, 22804, 26400, 22073, 28773, 21176, 31116, 20147,
+    33401, 19029, 35619, 17881, 37743, 16703, 39748, 15503, 41657, 14336, 43467, 13211,
+    45166, 12122, 46748, 11072, 48240, 10087, 49634,  9159, 50920,  8280, 52123,  7465,
+    53246,  6712, 54288,  6015, 55247,  5370, 56129,  4775, 56932,  4228, 57666,  3728,
+    58351,  3278, 58983,  2873, 59551,  2504, 60074,  2174, 60559,  1881, 60991,  1617,
+    61380,  1383, 61732,  1175, 62049,   993, 62344,   835, 62611,   698, 62849,   578,
+    63063,   476, 63255,   388, 63443,   315, 63607,   253, 63757,   201, 63905,   159,
+    64031,   123, 64163,    96, 64274,    73, 64373,    54, 64463,    40, 64547,    29,
+    64624,    20, 64699,    14, 64787,    10, 64859,     7, 64924,     4, 64985,     3,
+    65043,     2, 65097,     1, 65150,     1, 65200,     0, 65248,     0, 65337,     0,
+    16571, 28424, 14848, 25829, 15393, 25479, 16931, 25551, 19000, 25495, 21357, 25151,
+    23857, 24521, 26405, 23645, 28937, 22584, 31414, 21399, 33815, 20148, 36094, 18821,
+    38271, 17504, 40339, 16212, 42284, 14944, 44105, 13715, 45831, 12559, 47427, 11445,
+    48921, 10400, 50316,  9422, 51616,  8511, 52814,  7659, 53917,  6866, 54935,  6135,
+    55872,  5463, 56738,  4850, 57526,  4287, 58254,  3778, 58923,  3318, 59526,  2899,
+    60071,  2521, 60566,  2183, 61013,  1881, 61431,  1615, 61802,  1379, 62136,  1170,
+    62435,   986, 62717,   829, 62968,   691, 63194,   572, 63407,   471, 63608,   386,
+    63779,   312, 63931,   250, 64066,   198, 64188,   155, 64298,   120, 64402,    92,
+    64511,    70, 64601,    52, 64682,    38, 64756,    27, 64824,    19, 64888,    13,
+    64947,     9, 65003,     6, 65056,     3, 65106,     2, 65154,     1, 65200,     1,
+    65263,     1, 65326,     1, 65375,     0, 65420,     0, 14482, 29605, 13158, 27177,
+    14123, 27227, 16045, 27536, 18443, 27514, 21077, 27085, 23803, 26296, 26531, 25234,
+    29209, 23995, 31788, 22608, 34258, 21166, 36614, 19717, 38837, 18267, 40934, 16855,
+    42909, 15497, 44747, 14184, 46476, 12949, 48090, 11785, 49584, 10685, 50971,  9658,
+    52244,  8694, 53428,  7807, 54515,  6986, 55519,  6232, 56445,  5543, 57286,  4909,
+    58051,  4331, 58747,  3805, 59389,  3334, 59972,  2909, 60498,  2526, 60973,  2183,
+    61412,  1881, 61806,  1611, 62166,  1374, 62507,  1169, 62802,   986, 63063,   826,
+    63296,   687, 63504,   567, 63690,   464, 63869,   379, 64028,   306, 64166,   244,
+    64289,   193, 64399,   150, 64497,   116, 64586,    88, 64667,    66, 64740,    48,
+    64807,    35, 64869,    24, 64926,    17, 64980,    11, 65029,     7, 65076,     4,
+    65134,     3, 65195,     2, 65242,     1, 65285,     1, 65325,     0, 65364,     0,
+    65401,     0, 65437,     0, 12404, 30709, 11573, 28674, 13006, 29232, 15328, 29744,
+    18060, 29701, 20960, 29117, 23890, 28107, 26783, 26837, 29564, 25338, 32239, 23775,
+    34775, 22159, 37183, 20566, 39441, 18987, 41566, 17467, 43559, 16017, 45422, 14637,
+    47147, 13324, 48744, 12086, 50229, 10934, 51598,  9858, 52874,  8869, 54038,  7947,
+    55105,  7096, 56082,  6316, 56986,  5607, 57807,  4959, 58554,  4369, 59241,  3838,
+    59865,  3358, 60446,  2930, 60971,  2546, 61438,  2200, 61857,  1892, 62232,  1618,
+    62570,  1377, 62888,  1168, 63165,   984, 63410,   822, 63628,   683, 63822,   563,
+    63995,   460, 64148,   373, 64285,   300, 64407,   238, 64515,   187, 64612,   146,
+    64699,   112, 64776,    84, 64846,    63, 64910,    46, 64967,    33, 65039,    24,
+    65099,    17, 65148,    11, 65193,     7, 65235,     5, 65274,     3, 65312,     2,
+    65347,     1, 65381,     1, 65414,     0, 65446,     0, 65477,     0, 65507,     0,
+    10377, 31716, 10136, 30417, 12079, 31571, 14812, 32210, 17861, 32026, 20998, 31183,
+    24102, 29888, 27109, 28322, 29990, 26612, 32734, 24854, 35318, 23066, 37758, 21325,
+    40052, 19642, 42190, 18015, 44175, 16459, 46027, 14995, 47750, 13624, 49342, 12338,
+    50808, 11135, 52158, 10018, 53411,  8994, 54556,  8046, 55606,  7176, 56576,  6384,
+    57475,  5667, 58292,  5010, 59028,  4411, 59695,  3869, 60300,  3380, 60861,  2946,
+    61359,  2553, 61805,  2203, 62206,  1891, 62565,  1616, 62887,  1373, 63174,  1160,
+    63429,   974, 63657,   813, 63859,   673, 64038,   554, 64197,   452, 64337,   365,
+    64461,   293, 64571,   232, 64668,   182, 64776,   143, 64859,   110, 64930,    83,
+    64993,    61, 65050,    45, 65100,    32, 65146,    22, 65188,    15, 65227,    10,
+    65263,     6, 65297,     4, 65329,     2, 65359,     1, 65387,     1, 65415,     0,
+    65441,     0, 65467,     0, 65492,     0, 65517,     0,  8449, 32642,  8894, 32531,
+    11372, 34270, 14504, 34873, 17838, 34405, 21166, 33183, 24408, 31569, 27514, 29728,
+    30462, 27777, 33254, 25823, 35885, 23898, 38334, 21999, 40627, 20186, 42769, 18469,
+    44753, 16837, 46590, 15299, 48298, 13870, 49872, 12534, 51329, 11300, 52678, 10164,
+    53928,  9120, 55064,  8152, 56102,  7263, 57061,  6457, 57931,  5719, 58721,  5047,
+    59437,  4438, 60086,  3888, 60673,  3393, 61202,  2949, 61679,  2552, 62107,  2199,
+    62491,  1886, 62834,  1609, 63140,  1366, 63412,  1152, 63654,   966, 63867,   805,
+    64077,   670, 64250,   551, 64400,   449, 64531,   363, 64646,   290, 64747,   230,
+    64836,   180, 64914,   139, 64982,   106, 65043,    80, 65096,    59, 65144,    43,
+    65186,    30, 65224,    21, 65259,    14, 65290,     9, 65319,     6, 65347,     3,
+    65372,     2, 65396,     1, 65419,     0, 65441,     0, 65462,     0, 65483,     0,
+    65503,     0, 65522,     0,  6678, 33551,  7894, 35175, 10912, 37344, 14403, 37656,
+    17962, 36694, 21443, 35062, 24789, 33108, 27971, 31003, 30972, 28835, 33784, 26673,
+    36423, 24584, 38881, 22566, 41168, 20645, 43298, 18839, 45276, 17144, 47122, 15572,
+    48826, 14102, 50392, 12730, 51845, 11468, 53175, 10298, 54394,  9220, 55510,  8231,
+    56531,  7326, 57462,  6500, 58309,  5749, 59080,  5068, 59778,  4452, 60410,  3897,
+    60980,  3398, 61494,  2951, 61957,  2553, 62389,  2203, 62763,  1888, 63095,  1610,
+    63390,  1366, 63651,  1152, 63882,   966, 64086,   804, 64265,   665, 64423,   546,
+    64560,   444, 64681,   358, 64786,   286, 64877,   226, 64956,   177, 65025,   136,
+    65085,   104, 65138,    78, 65184,    57, 65224,    41, 65259,    29, 65291,    20,
+    65319,    13, 65344,     8, 65368,     5, 65389,     3, 65409,     2, 65428,     1,
+    65446,     0, 65463,     0, 65479,     0, 65495,     0, 65511,     0, 65526,     0,
+     5130, 34618,  7177, 38468, 10697, 40637, 14478, 40353, 18217, 38865, 21809, 36793,
+    25227, 34494, 28442, 32086, 31466, 29708, 34288, 27376, 36924, 25144, 39390, 23042,
+    41689, 21060, 43817, 19186, 45794, 17439, 47616, 15804, 49298, 14285, 50849, 12879,
+    52275, 11581, 53585, 10387, 54786,  9290, 55885,  8286, 56888,  7369, 57803,  6534,
+    58653,  5783, 59411,  5096, 60097,  4475, 60717,  3915, 61275,  3412, 61777,  2962,
+    62227,  2560, 62629,  2203, 62987,  1887, 63306,  1608, 63588,  1363, 63838,  1148,
+    64058,   962, 64251,   800, 64420,   661, 64568,   542, 64697,   441, 64808,   355,
+    64904,   283, 64988,   224, 65059,   174, 65121,   134, 65174,   102, 65219,    76,
+    65259,    56, 65292,    40, 65322,    28, 65348,    19, 65370,    13, 65390,     8,
+    65409,     5, 65425,     3, 65441,     2, 65455,     1, 65468,     0, 65481,     0,
+    65494,     0, 65506,     0, 65517,     0, 65529,     0,  3871, 36255,  6766, 42462,
+    10702, 43961, 14697, 42875, 18559, 40799, 22218, 38275, 25667, 35626, 28901, 32983,
+    31942, 30444, 34776, 27988, 37422, 25663, 39877, 23456, 42156, 21384, 44268, 19447,
+    46223, 17644, 48030, 15970, 49696, 14420, 51242, 12999, 52659, 11683, 53956, 10472,
+    55145,  9361, 56231,  8345, 57222,  7417, 58124,  6573, 58944,  5807, 59687,  5114,
+    60359,  4488, 60965,  3924, 61510,  3418, 61999,  2965, 62437,  2562, 62828,  2204,
+    63175,  1886, 63484,  1606, 63756,  1361, 63996,  1146, 64207,   959, 64391,   798,
+    64552,   659, 64691,   540, 64812,   439, 64916,   353, 65005,   282, 65081,   222,
+    65146,   173, 65202,   133, 65249,   101, 65288,    75, 65322,    55, 65351,    40,
+    65375,    28, 65396,    19, 65414,    12, 65430,     8, 65443,     5, 65456,     3,
+    65467,     1, 65478,     1, 65487,     0, 65497,     0, 65506,     0, 65514,     0,
+    65522,     0, 65531,     0,  2962, 39225,  6642, 46831, 10875, 47049, 15008, 45073,
+    18929, 42361, 22627, 39473, 26104, 36587, 29354, 33759, 32385, 31039, 35210, 28459,
+    37839, 26030, 40281, 23752, 42560, 21642, 44662, 19663, 46606, 17824, 48401, 16120,
+    50056, 14545, 51579, 13094, 52978, 11758, 54261, 10532, 55436,  9409, 56508,  8383,
+    57486,  7448, 58376,  6598, 59183,  5826, 59914,  5128, 60574,  4499, 61169,  3932,
+    61704,  3424, 62183,  2970, 62611,  2565, 62992,  2205, 63331,  1887, 63630,  1607,
+    63894,  1361, 64126,  1146, 64329,   959, 64506,   797, 64660,   658, 64793,   539,
+    64907,   438, 65005,   352, 65088,   281, 65159,   221, 65218,   172, 65268,   133,
+    65310,   100, 65345,    75, 65375,    55, 65399,    39, 65419,    28, 65436,    19,
+    65450,    12, 65462,     8, 65472,     5, 65481,     3, 65489,     1, 65496,     1,
+    65503,     0, 65509,     0, 65515,     0, 65521,     0, 65527,     0, 65532,     0,
+     2442, 44424,  6736, 51025, 11147, 49664, 15348, 46834, 19309, 43662, 23019, 40435,
+    26490, 37299, 29739, 34325, 32766, 31494, 35584, 28830, 38204, 26333, 40638, 24003,
+    42894, 21833, 44983, 19818, 46914, 17951, 48696, 16224, 50338, 14631, 51848, 13164,
+    53235, 11815, 54506, 10579, 55669,  9448, 56731,  8414, 57698,  7473, 58577,  6618,
+    59374,  5842, 60095,  5141, 60746,  4509, 61332,  3940, 61858,  3430, 62329,  2974,
+    62749,  2568, 63123,  2208, 63454,  1889, 63747,  1608, 64004,  1361, 64230,  1146,
+    64427,   959, 64598,   797, 64746,   657, 64873,   538, 64982,   437, 65075,   352,
+    65154,   280, 65220,   221, 65276,   172, 65322,   132, 65360,   100, 65391,    75,
+    65416,    55, 65437,    39, 65454,    27, 65468,    19, 65479,    12, 65488,     8,
+    65495,     5, 65501,     3, 65507,     1, 65511,     1, 65516,     0, 65519,     0,
+    65523,     0, 65527,     0, 65530,     0, 65533,     0,  2294, 51767,  6947, 54464,
+    11440, 51658, 15665, 48128, 19634, 44585, 23346, 41129, 26814, 37838, 30050, 34731,
+    33066, 31815, 35874, 29086, 38483, 26541, 40905, 24171, 43150, 21971, 45228, 19931,
+    47148, 18044, 48920, 16300, 50552, 14694, 52052, 13215, 53429, 11858, 54691, 10614,
+    55845,  9476, 56898,  8438, 57856,  7493, 58728,  6634, 59517,  5855, 60231,  5151,
+    60875,  4517, 61454,  3947, 61974,  3435, 62438,  2978, 62853,  2571, 63221,  2210,
+    63546,  1891, 63834,  1609, 64086,  1362, 64307,  1147, 64500,   959, 64666,   797,
+    64810,   658, 64934,   538, 65039,   437, 65128,   352, 65203,   280, 65266,   221,
+    65318,   172, 65361,   132, 65397,   100, 65425,    75, 65448,    55, 65466,    39,
+    65480,    27, 65492,    19, 65500,    12, 65507,     8, 65512,     5, 65517,     3,
+    65520,     1, 65523,     1, 65525,     0, 65527,     0, 65529,     0, 65531,     0,
+    65532,     0, 65534,     0,  2381, 58650,  7171, 56875, 11683, 52968, 15914, 48998,
+    19875, 45182, 23580, 41571, 27040, 38175, 30268, 34995, 33275, 32023, 36074, 29254,
+    38674, 26676, 41088, 24282, 43325, 22061, 45394, 20005, 47307, 18104, 49071, 16351,
+    50695, 14735, 52189, 13250, 53559, 11886, 54815, 10637, 55962,  9496, 57009,  8454,
+    57962,  7506, 58828,  6644, 59612,  5864, 60322,  5159, 60961,  4523, 61535,  3951,
+    62051,  3439, 62511,  2981, 62921,  2574, 63286,  2212, 63608,  1892, 63892,  1610,
+    64141,  1363, 64359,  1147, 64548,   960, 64712,   797, 64853,   658, 64974,   539,
+    65076,   437, 65163,   352, 65236,   280, 65297,   221, 65347,   172, 65388,   132,
+    65421,   100, 65448,    75, 65469,    55, 65485,    39, 65498,    27, 65507,    19,
+    65515,    12, 65520,     8, 65524,     5, 65527,     3, 65529,     1, 65530,     1,
+    65531,     0, 65532,     0, 65533,     0, 65533,     0, 65534,     0, 65535,     0,
+     2501, 62525,  7309, 58058, 11820, 53616, 16047, 49418, 20003, 45478, 23702, 41790,
+    27157, 38342, 30380, 35125, 33382, 32127, 36176, 29336, 38772, 26743, 41181, 24336,
+    43413, 22106, 45478, 20042, 47387, 18135, 49147, 16376, 50767, 14756, 52257, 13267,
+    53625, 11901, 54877, 10649, 56021,  9505, 57065,  8462, 58015,  7512, 58878,  6650,
+    59660,  5868, 60367,  5162, 61003,  4526, 61576,  3954, 62089,  3441, 62547,  2983,
+    62956,  2575, 63318,  2213, 63638,  1893, 63920,  1611, 64168,  1364, 64384,  1148,
+    64572,   960, 64735,   798, 64874,   658, 64994,   539, 65095,   437, 65181,   352,
+    65253,   280, 65312,   221, 65361,   172, 65401,   132, 65433,   100, 65459,    75,
+    65479,    55, 65495,    39, 65507,    27, 65515,    19, 65522,    12, 65526,     8,
+    65530,     5, 65532,     3, 65533,     1, 65534,     1, 65534,     0, 65535,     0,
+    65535,     0, 65535,     0, 65535,     0, 65535,     0,
+};
+
+} // namespace rasperi
+} // namespace kuu
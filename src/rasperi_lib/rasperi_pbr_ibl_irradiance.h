@@ -5,6 +5,7 @@
  
 #pragma once
 
+#include <atomic>
 #include <memory>
 #include "rasperi_texture_cube.h"
 
@@ -17,16 +18,20 @@ namespace rasperi
 {
 
 /* ---------------------------------------------------------------- *
+   Diffuse irradiance map. The sample delta is the angle in radians
+   between the hemisphere samples.
  * ---------------------------------------------------------------- */
 class PbrIblIrradiance
 {
 public:
-    PbrIblIrradiance(int size = 128);
+    PbrIblIrradiance(int size = 128, double sampleDelta = 0.025);
 
     bool read(const QDir& dir);
     bool write(const QDir& dir);
 
-    void run(const TextureCube<double, 4>& bgCube);
+    // Returns false if the run was cancelled.
+    bool run(const TextureCube<double, 4>& bgCube,
+             const std::atomic<bool>* cancel = nullptr);
 
     TextureCube<double, 4> irradianceCubemap;
 
@@ -4,12 +4,14 @@
  * ---------------------------------------------------------------- */
  
 #include "rasperi_pbr_ibl_prefilter.h"
-#include <functional>
+#include <algorithm>
 #include <iostream>
+#include <vector>
 #include <QtCore/QDir>
-#include "rasperi_cube_camera.h"
+#include <glm/geometric.hpp>
 #include "rasperi_texture_cube.h"
 #include "rasperi_texture_cube_mapping.h"
+#include "rasperi_texture_cube_sampler.h"
 
 namespace kuu
 {
@@ -18,311 +20,95 @@ namespace rasperi
 
 /* ---------------------------------------------------------------- *
  * ---------------------------------------------------------------- */
-class PrefilterCubeRasterizer
+struct PbrIblPrefilter::Impl
 {
-public:
-    /* ------------------------------------------------------------ *
-     * ------------------------------------------------------------ */
-    class BoundingBox
-    {
-    public:
-        BoundingBox()
-        {
-            min.x =  std::numeric_limits<double>::max();
-            min.y =  std::numeric_limits<double>::max();
-            max.x = -std::numeric_limits<double>::max();
-            max.y = -std::numeric_limits<double>::max();
-        }
-
-        void update(const glm::dvec2& p)
-        {
-            if (p.x < min.x) min.x = p.x;
-            if (p.y < min.y) min.y = p.y;
-            if (p.x > max.x) max.x = p.x;
-            if (p.y > max.y) max.y = p.y;
-        }
-
-        glm::dvec2 min;
-        glm::dvec2 max;
-    };
-
-    using Callback = std::function<void(glm::dvec3, double, int)>;
-
-    int w;
-    int h;
-    int mipmapCount;
-    Callback callback;
-    CubeCamera cubeCamera;
-
     /* ------------------------------------------------------------ *
      * ------------------------------------------------------------ */
-    PrefilterCubeRasterizer(int w, int h, int mipmapCount, Callback callback)
-        : w(w)
-        , h(h)
-        , mipmapCount(mipmapCount)
-        , callback(callback)
-        , cubeCamera(w / double(h))
+    Impl(PbrIblPrefilter* self, int size, int sampleCount)
+        : self(self)
+        , size(size)
+        , sampleCount(sampleCount)
     {}
 
     /* ------------------------------------------------------------ *
+       Each mipmap level is prefiltered with a roughness from 0.0
+       to 1.0. The GGX half vectors only depend on the roughness so
+       they are generated once per level in tangent space.
      * ------------------------------------------------------------ */
-    void run() const
+    bool run(const TextureCube<double, 4>& bgCubeMap,
+             const std::atomic<bool>* cancel)
     {
         // --------------------------------------------------------
-        // Create NDC cube
-
-        std::vector<glm::dvec3> vertexData =
-        {
-            { -1,-1,-1 },
-            {  1, 1,-1 },
-            {  1,-1,-1 },
-            { -1, 1,-1 },
-            { -1,-1, 1 },
-            {  1,-1, 1 },
-            {  1, 1, 1 },
-            { -1, 1, 1 },
-        };
+        // Render prefilter map
 
-        std::vector<unsigned> indexData
-        {
-            2,1,0, 3,0,1,
-            6,5,4, 4,7,6,
-            0,3,7, 7,4,0,
-            1,2,6, 5,6,2,
-            5,2,0, 0,4,5,
-            1,6,3, 7,3,6,
-        };
+        const TextureCubeSampler bgSampler(bgCubeMap);
 
-        // --------------------------------------------------------
-        // Rasterize
+        if (!self->prefilterCubemap.generateMipmaps())
+            std::cerr << __FUNCTION__
+                      << ": failed to generate mipmaps"
+                      << std::endl;
 
-        for (int mipmap = 0; mipmap < mipmapCount; ++mipmap)
+        const int levels = self->prefilterCubemap.mipmapCount() + 1;
+        for (int mipmap = 0; mipmap < levels; ++mipmap)
         {
-            std::cout << "Processing mipmap " << mipmap << std::endl;
+            const double roughness = levels > 1 ? mipmap / double(levels - 1) : 0.0;
 
-            #pragma omp parallel for
-            for (int face = 0; face < 6; ++face)
-            {
-                std::cout << "Process face " << face << std::endl;
+            std::vector<glm::dvec3> halfVectors;
+            for (uint i = 0u; i < uint(sampleCount); ++i)
+                halfVectors.push_back(importanceSampleGGX(hammersley(i, uint(sampleCount)), roughness));
 
-                double roughness = mipmap / double(mipmapCount - 1);
-                glm::dmat4 camera = cubeCamera.cameraMatrix(size_t(face));
+            Texture2D<double, 4>& level = self->prefilterCubemap.face(0, size_t(mipmap));
+            const int levelSize  = level.width();
+            const int faceTexels = levelSize * levelSize;
 
-                for (size_t i = 0; i < indexData.size(); i += 3)
+            #pragma omp parallel for schedule(dynamic, 16)
+            for (int i = 0; i < 6 * faceTexels; ++i)
+            {
+                if (cancel && cancel->load())
+                    continue;
+
+                const int face = i / faceTexels;
+                const int x    = (i % faceTexels) % levelSize;
+                const int y    = (i % faceTexels) / levelSize;
+
+                const glm::dvec3 n = glm::normalize(
+                    texture_cube_mapping::mapTexel(face, x, y, levelSize));
+                const glm::dvec3 v = n;
+
+                // from tangent-space vector to world-space sample vector
+                const glm::dvec3 up = glm::abs(n.z) < 0.999
+                        ? glm::dvec3(0.0, 0.0, 1.0)
+                        : glm::dvec3(1.0, 0.0, 0.0);
+                const glm::dvec3 tangent   = glm::normalize(glm::cross(up, n));
+                const glm::dvec3 bitangent = glm::cross(n, tangent);
+
+                double totalWeight = 0.0;
+                glm::dvec3 prefilteredColor = glm::dvec3(0.0);
+                for (const glm::dvec3& th : halfVectors)
                 {
-                    glm::dvec3 v1 = vertexData[indexData[i+0]];
-                    glm::dvec3 v2 = vertexData[indexData[i+1]];
-                    glm::dvec3 v3 = vertexData[indexData[i+2]];
+                    const glm::dvec3 h = tangent * th.x + bitangent * th.y + n * th.z;
+                    const glm::dvec3 l = glm::normalize(2.0 * glm::dot(v, h) * h - v);
 
-                    glm::dvec3 proj1 = project(camera, v1);
-                    glm::dvec3 proj2 = project(camera, v2);
-                    glm::dvec3 proj3 = project(camera, v3);
-
-                    glm::dvec2 vp1 = viewportTransform(proj1);
-                    glm::dvec2 vp2 = viewportTransform(proj2);
-                    glm::dvec2 vp3 = viewportTransform(proj3);
-
-                    BoundingBox bb;
-                    bb.update(vp1);
-                    bb.update(vp2);
-                    bb.update(vp3);
-
-                    int xmin = std::max(0, std::min(w - 1, int(std::floor(bb.min.x))));
-                    int ymin = std::max(0, std::min(h - 1, int(std::floor(bb.min.y))));
-                    int xmax = std::max(0, std::min(w - 1, int(std::floor(bb.max.x))));
-                    int ymax = std::max(0, std::min(h - 1, int(std::floor(bb.max.y))));
-
-                    for (int y = ymin; y <= ymax; ++y)
-                    for (int x = xmin; x <= xmax; ++x)
+                    const double nDotL = glm::max(glm::dot(n, l), 0.0);
+                    if (nDotL > 0.0)
                     {
-                        glm::dvec2 screen(x + 0.5, y + 0.5);
-
-                        // Barycentric weights
-                        double w1 = edgeFunction(vp2, vp3, screen);
-                        double w2 = edgeFunction(vp3, vp1, screen);
-                        double w3 = edgeFunction(vp1, vp2, screen);
-                        if (w1 < 0.0 || w2 < 0.0 || w3 < 0.0)
-                            continue;
-
-                        // Top-left edge rule
-                        glm::dvec2 edge1 = vp2 - vp3;
-                        glm::dvec2 edge2 = vp3 - vp1;
-                        glm::dvec2 edge3 = vp1 - vp2;
-                        bool overlaps = true;
-                        overlaps &= (w1 == 0.0 ? ((edge1.y == 0.0 && edge1.x < 0.0) ||  edge1.y < 0.0) : (w1 > 0.0));
-                        overlaps &= (w2 == 0.0 ? ((edge2.y == 0.0 && edge2.x < 0.0) ||  edge2.y < 0.0) : (w2 > 0.0));
-                        overlaps &= (w3 == 0.0 ? ((edge3.y == 0.0 && edge3.x < 0.0) ||  edge3.y < 0.0) : (w3 > 0.0));
-                        if (!overlaps)
-                            continue;
-
-                        double area = edgeFunction(vp1, vp2, vp3);
-                        w1 /= area;
-                        w2 /= area;
-                        w3 /= area;
-
-                        double z  = 1.0 / (w1 * 1.0 / proj1.z +
-                                           w2 * 1.0 / proj2.z +
-                                           w3 * 1.0 / proj3.z);
-
-                        glm::dvec3 p1 = v1 / proj1.z;
-                        glm::dvec3 p2 = v2 / proj2.z;
-                        glm::dvec3 p3 = v3 / proj3.z;
-                        glm::dvec3 p = p1  * w1 * z +
-                                       p2  * w2 * z +
-                                       p3  * w3 * z;
-
-                        callback(p, roughness, mipmap);
+                        // Sample background
+                        prefilteredColor += glm::dvec3(bgSampler.sample(l)) * nDotL;
+                        totalWeight += nDotL;
                     }
                 }
+                prefilteredColor = prefilteredColor / totalWeight;
+
+                double* pix = self->prefilterCubemap.face(size_t(face), size_t(mipmap)).pixels().data() +
+                              (y * levelSize + x) * 4;
+                pix[0] = prefilteredColor.r;
+                pix[1] = prefilteredColor.g;
+                pix[2] = prefilteredColor.b;
+                pix[3] = 1.0;
             }
         }
-    }
 
-    /* ---------------------------------------------------------------- *
-     * ---------------------------------------------------------------- */
-    glm::dvec3 project(const glm::dmat4& m, const glm::dvec3& p) const
-    {
-        const glm::dvec4 v = m * glm::dvec4(p, 1.0);
-        if (v.w == 0.0)
-        {
-            std::cerr << "proj err" << std::endl;
-            return glm::dvec3(0.0);
-        }
-        return glm::dvec3(v.x / v.w, v.y / v.w, v.z / v.w);
-    }
-
-    /* ---------------------------------------------------------------- *
-     * ---------------------------------------------------------------- */
-    glm::dvec2 viewportTransform(const glm::dvec3& p) const
-    {
-        const glm::ivec2 vp(w - 1, h - 1);
-        const glm::dvec2 halfViewport = glm::dvec2(vp) * 0.5;
-
-        glm::dvec2 out;
-        out.x =        (p.x + 1.0) * halfViewport.x;
-        out.y = vp.y - (p.y + 1.0) * halfViewport.y;
-
-        return out;
-    }
-
-    /* ------------------------------------------------------------ *
-     * ------------------------------------------------------------ */
-    double edgeFunction(const glm::dvec2& a,
-                        const glm::dvec2& b,
-                        const glm::dvec2& c) const
-    {
-        return ((c.x - a.x) * (b.y - a.y) - (c.y - a.y) * (b.x - a.x));
-    }
-};
-
-/* ---------------------------------------------------------------- *
- * ---------------------------------------------------------------- */
-struct PbrIblPrefilter::Impl
-{
-    /* ------------------------------------------------------------ *
-     * ------------------------------------------------------------ */
-    class BoundingBox
-    {
-    public:
-        BoundingBox()
-        {
-            min.x =  std::numeric_limits<double>::max();
-            min.y =  std::numeric_limits<double>::max();
-            max.x = -std::numeric_limits<double>::max();
-            max.y = -std::numeric_limits<double>::max();
-        }
-
-        void update(const glm::dvec2& p)
-        {
-            if (p.x < min.x) min.x = p.x;
-            if (p.y < min.y) min.y = p.y;
-            if (p.x > max.x) max.x = p.x;
-            if (p.y > max.y) max.y = p.y;
-        }
-
-        glm::dvec2 min;
-        glm::dvec2 max;
-    };
-
-
-    /* ------------------------------------------------------------ *
-     * ------------------------------------------------------------ */
-    Impl(PbrIblPrefilter* self, int size)
-        : self(self)
-        , size(size)
-    {}
-
-    /* ------------------------------------------------------------ *
-     * ------------------------------------------------------------ */
-    void run(const TextureCube<double, 4>& bgCubeMap)
-    {
-        // --------------------------------------------------------
-        // Render prefilter map
-
-        auto prefilterCallback = [&](
-                const glm::dvec3& p,
-                double roughness,
-                int mipmap)
-        {
-            glm::dvec3 n = normalize(p);
-            glm::dvec3 r = n;
-            glm::dvec3 v = r;
-
-            const uint SAMPLE_COUNT = 1024u;
-            double totalWeight = 0.0;
-            glm::dvec3 prefilteredColor = glm::dvec3(0.0);
-            for(uint i = 0u; i < SAMPLE_COUNT; ++i)
-            {
-                glm::dvec2 xi = hammersley(i, SAMPLE_COUNT);
-                glm::dvec3 h  = importanceSampleGGX(xi, n, roughness);
-                glm::dvec3 l  = normalize(2.0 * dot(v, h) * h - v);
-
-                double nDotL = glm::max(glm::dot(n, l), 0.0);
-                if(nDotL > 0.0)
-                {
-                    // Sample background
-                    const texture_cube_mapping::TextureCoordinate tc =
-                        texture_cube_mapping::mapPoint(l);
-                    const size_t faceIndex = size_t(tc.faceIndex);
-                    const std::array<double, 4> pixel =
-                        bgCubeMap.face(faceIndex).pixel(tc.uv.x, tc.uv.y);
-                    prefilteredColor += glm::dvec3(
-                            pixel[0],
-                            pixel[1],
-                            pixel[2]) * nDotL;
-                    totalWeight += nDotL;
-                }
-            }
-            prefilteredColor = prefilteredColor / totalWeight;
-            std::array<double, 4> pix = { prefilteredColor.r,
-                                          prefilteredColor.g,
-                                          prefilteredColor.b,
-                                          1.0 };
-
-            const texture_cube_mapping::TextureCoordinate tc =
-                texture_cube_mapping::mapPoint(n);
-            const size_t faceIndex = size_t(tc.faceIndex);
-
-            Texture2D<double, 4>& tex =
-                self->prefilterCubemap.face(size_t(faceIndex)).mipmap(size_t(mipmap));
-            tex.setPixel(tc.uv.x, tc.uv.y, pix);
-        };
-
-        if (!self->prefilterCubemap.generateMipmaps())
-            std::cerr << __FUNCTION__
-                      << ": failed to generate mipmaps"
-                      << std::endl;
-
-        const int mipmapCount = self->prefilterCubemap.mipmapCount();
-        std::cout << __FUNCTION__ << ": " << mipmapCount << std::endl;
-
-        PrefilterCubeRasterizer rasterizer(size, size,
-                                           mipmapCount,
-                                           prefilterCallback);
-        rasterizer.run();
-
-        for (int i = 0; i < mipmapCount; ++i)
-            self->prefilterCubemap.toQImage(i).save(QString("/temp/00_prefilter_%1.bmp").arg(i));
+        return !(cancel && cancel->load());
     }
 
     /* ---------------------------------------------------------------- *
@@ -345,8 +131,9 @@ struct PbrIblPrefilter::Impl
     }
 
     /* ------------------------------------------------------------ *
+       Returns a GGX distributed half vector in tangent space.
      * ------------------------------------------------------------ */
-    glm::dvec3 importanceSampleGGX(glm::dvec2 xi, glm::dvec3 n, double roughness)
+    glm::dvec3 importanceSampleGGX(glm::dvec2 xi, double roughness)
     {
         double a = roughness * roughness;
 
@@ -359,16 +146,7 @@ struct PbrIblPrefilter::Impl
         h.x = cos(phi) * sinTheta;
         h.y = sin(phi) * sinTheta;
         h.z = cosTheta;
-
-        // from tangent-space vector to world-space sample vector
-        glm::dvec3 up = glm::abs(n.z) < 0.999
-                ? glm::dvec3(0.0, 0.0, 1.0)
-                : glm::dvec3(1.0, 0.0, 0.0);
-        glm::dvec3 tangent   = glm::normalize(glm::cross(up, n));
-        glm::dvec3 bitangent = glm::cross(n, tangent);
-
-        glm::dvec3 sampleVec = tangent * h.x + bitangent * h.y + n * h.z;
-        return normalize(sampleVec);
+        return h;
     }
 
     /* ---------------------------------------------------------------- *
@@ -398,13 +176,14 @@ struct PbrIblPrefilter::Impl
 
     PbrIblPrefilter* self;
     int size;
+    int sampleCount;
 };
 
 /* ---------------------------------------------------------------- *
  * ---------------------------------------------------------------- */
-PbrIblPrefilter::PbrIblPrefilter(int size)
+PbrIblPrefilter::PbrIblPrefilter(int size, int sampleCount)
     : prefilterCubemap(size, size)
-    , impl(std::make_shared<Impl>(this, size))
+    , impl(std::make_shared<Impl>(this, size, sampleCount))
 {}
 
 /* ---------------------------------------------------------------- *
@@ -419,8 +198,9 @@ bool PbrIblPrefilter::write(const QDir& dir)
 
 /* ---------------------------------------------------------------- *
  * ---------------------------------------------------------------- */
-void PbrIblPrefilter::run(const TextureCube<double, 4>& bgCubeMap)
-{ impl->run(bgCubeMap); }
+bool PbrIblPrefilter::run(const TextureCube<double, 4>& bgCubeMap,
+                          const std::atomic<bool>* cancel)
+{ return impl->run(bgCubeMap, cancel); }
 
 } // namespace rasperi
 } // namespace kuu
@@ -5,6 +5,7 @@
  
 #pragma once
 
+#include <atomic>
 #include <memory>
 #include "rasperi_texture_cube.h"
 
@@ -16,16 +17,21 @@ namespace rasperi
 {
 
 /* ---------------------------------------------------------------- *
+   Specular prefilter map. Mipmap levels from the base level to the
+   smallest level are prefiltered with roughness from 0.0 to 1.0
+   using the given count of GGX samples per texel.
  * ---------------------------------------------------------------- */
 class PbrIblPrefilter
 {
 public:
-    PbrIblPrefilter(int size = 128);
+    PbrIblPrefilter(int size = 128, int sampleCount = 1024);
 
     bool read(const QDir& dir);
     bool write(const QDir& dir);
 
-    void run(const TextureCube<double, 4>& bgCubeMap);
+    // Returns false if the run was cancelled.
+    bool run(const TextureCube<double, 4>& bgCubeMap,
+             const std::atomic<bool>* cancel = nullptr);
 
     TextureCube<double, 4> prefilterCubemap;
 
@@ -16,6 +16,8 @@ namespace rasperi
  * ---------------------------------------------------------------- */
 PrimitiveRasterizer::PrimitiveRasterizer(Framebuffer& framebuffer)
     : framebuffer(framebuffer)
+    , cancel(nullptr)
+    , depthCompare(Framebuffer::DepthCompare::Less)
 {}
 
 /* ---------------------------------------------------------------- *
@@ -61,6 +63,65 @@ glm::dvec2 PrimitiveRasterizer::viewportTransform(const glm::dvec3& p)
     return glm::clamp(out, vpMin, vpMax);
 }
 
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+bool PrimitiveRasterizer::isVisible(const glm::dmat4& m,
+                                    const glm::dvec3& min,
+                                    const glm::dvec3& max)
+{
+    int outside[6] = {};
+    for (int i = 0; i < 8; ++i)
+    {
+        const glm::dvec4 p = m * glm::dvec4(
+            i & 1 ? max.x : min.x,
+            i & 2 ? max.y : min.y,
+            i & 4 ? max.z : min.z,
+            1.0);
+
+        outside[0] += p.x < -p.w;
+        outside[1] += p.x >  p.w;
+        outside[2] += p.y < -p.w;
+        outside[3] += p.y >  p.w;
+        outside[4] += p.z < -p.w;
+        outside[5] += p.z >  p.w;
+    }
+
+    for (int plane = 0; plane < 6; ++plane)
+        if (outside[plane] == 8)
+            return false;
+    return true;
+}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+void PrimitiveRasterizer::setCancelFlag(const std::atomic<bool>* cancel)
+{ this->cancel = cancel; }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+bool PrimitiveRasterizer::isCancelled() const
+{ return cancel && cancel->load(std::memory_order_relaxed); }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+void PrimitiveRasterizer::setDepthCompare(Framebuffer::DepthCompare compare)
+{ depthCompare = compare; }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+void PrimitiveRasterizer::setHdr(int x, int y, const glm::dvec4& c)
+{
+    if (!framebuffer.isHdrEnabled())
+        return;
+
+    const size_t i = size_t(y) * size_t(framebuffer.hdrTex.width()) + size_t(x);
+    float* pix = framebuffer.hdrTex.pixels().data() + i * 4;
+    pix[0] = float(c.r);
+    pix[1] = float(c.g);
+    pix[2] = float(c.b);
+    pix[3] = float(c.a);
+}
+
 /* ---------------------------------------------------------------- *
  * ---------------------------------------------------------------- */
 void PrimitiveRasterizer::setRgba(int x, int y, glm::dvec4 c)
@@ -70,13 +131,17 @@ void PrimitiveRasterizer::setRgba(int x, int y, glm::dvec4 c)
     c.b = glm::clamp(c.b, 0.0, 1.0);
     c.a = glm::clamp(c.a, 0.0, 1.0);
 
-    using uchar = unsigned char;
-    unsigned char r = uchar(std::floor(c.r * 255.0));
-    unsigned char g = uchar(std::floor(c.g * 255.0));
-    unsigned char b = uchar(std::floor(c.b * 255.0));
-    unsigned char a = uchar(std::floor(c.a * 255.0));
+    // Premultiplied alpha
+    c.r *= c.a;
+    c.g *= c.a;
+    c.b *= c.a;
 
-    std::array<uchar, 4> pix = { r, g,b, a };
+    using uchar = unsigned char;
+    std::array<uchar, 4> pix;
+    pix[Framebuffer::Red]   = uchar(std::floor(c.r * 255.0));
+    pix[Framebuffer::Green] = uchar(std::floor(c.g * 255.0));
+    pix[Framebuffer::Blue]  = uchar(std::floor(c.b * 255.0));
+    pix[Framebuffer::Alpha] = uchar(std::floor(c.a * 255.0));
     framebuffer.colorTex.setPixel(x, y, pix);
 }
 
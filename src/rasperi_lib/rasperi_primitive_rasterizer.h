@@ -5,6 +5,7 @@
  
 #pragma once
 
+#include <atomic>
 #include <memory>
 #include <glm/vec3.hpp>
 #include <glm/mat4x4.hpp>
@@ -31,9 +32,26 @@ public:
     glm::dvec3 transform(const glm::dmat4&m, const glm::dvec3& p);
     glm::dvec2 viewportTransform(const glm::dvec3& p);
     void setRgba(int x, int y, glm::dvec4 c);
+    // Writes the linear color into the HDR buffer if it is enabled.
+    void setHdr(int x, int y, const glm::dvec4& c);
+
+    // Drawing is stopped at the next tile or line once the flag is
+    // set. Null disables the cancellation.
+    void setCancelFlag(const std::atomic<bool>* cancel);
+    bool isCancelled() const;
+
+    void setDepthCompare(Framebuffer::DepthCompare compare);
+
+    // Returns false if the box is fully outside of one of the clip
+    // planes of the matrix.
+    static bool isVisible(const glm::dmat4& m,
+                          const glm::dvec3& min,
+                          const glm::dvec3& max);
 
 protected:
     Framebuffer& framebuffer;
+    const std::atomic<bool>* cancel;
+    Framebuffer::DepthCompare depthCompare;
 };
 
 /* ---------------------------------------------------------------- *
@@ -51,12 +69,17 @@ private:
 };
 
 /* ---------------------------------------------------------------- *
+   Rasterizes the triangles tile by tile. The triangles are first
+   binned into the framebuffer tiles they overlap and then the tiles are
+   shaded in parallel, each tile in the submission order.
  * ---------------------------------------------------------------- */
 class TrianglePrimitiveRasterizer : public PrimitiveRasterizer
 {
 public:
     TrianglePrimitiveRasterizer(Framebuffer& framebuffer,
-                                Rasterizer::NormalMode normalMode);
+                                Rasterizer::NormalMode normalMode,
+                                Rasterizer::ShadingQuality shadingQuality =
+                                    Rasterizer::ShadingQuality::Full);
 
     void rasterize(const Mesh& triangleMesh,
                    const glm::dmat4& cameraMatrix,
@@ -4,7 +4,6 @@
  * ---------------------------------------------------------------- */
  
 #include "rasperi_primitive_rasterizer.h"
-#include <array>
 #include <QtCore/QDebug>
 #include <QtCore/QTime>
 #include "rasperi_mesh.h"
@@ -25,7 +24,9 @@ struct LinePrimitiveRasterizer::Impl
     {}
 
     /* ------------------------------------------------------------ *
+       The depth test is specialized for the depth format.
      * ------------------------------------------------------------ */
+    template<typename Depth>
     void rasterize(const Vertex& v1,
                    const Vertex& v2,
                    const glm::dmat4& matrix)
@@ -44,22 +45,34 @@ struct LinePrimitiveRasterizer::Impl
         double a = glm::length(diff);
         double d = glm::length(dir);
 
+        Framebuffer& framebuffer = self->framebuffer;
+        typename Depth::Type* depth = framebuffer.depthPixels<Depth>();
+        const int width  = framebuffer.colorTex.width();
+        const int height = framebuffer.colorTex.height();
+
         for (double r = 0.0; r <= a; r += d)
         {
             double t = r / a;
             glm::dvec2 p = vpP1 + dir * r;
             glm::dvec4 c = glm::mix(v1.color, v2.color, t);
 
+            const int x = int(p.x);
+            const int y = int(p.y);
+            if (x < 0 || y < 0 || x >= width || y >= height)
+                continue;
+            framebuffer.materializePixel(x, y);
+
             // Depth test.
-            double d = self->framebuffer.depthTex.pixel(p.x, p.y)[0];
             double z  = 1.0 / (      t  * 1.0 / p1.z +
                               (1.0 - t) * 1.0 / p2.z);
-            if (z >= d)
+            typename Depth::Type& dst = depth[size_t(y) * size_t(width) + size_t(x)];
+            const typename Depth::Type zs =
+                Depth::encode(framebuffer.normalizedDepth(z));
+            if (!framebuffer.depthTest(self->depthCompare, zs, dst))
                 continue;
 
-            std::array<double, 1> dpix = { z };
-            self->framebuffer.depthTex.setPixel(int(p.x), int(p.y), dpix);
-            self->setRgba(p.x, p.y, c);
+            dst = zs;
+            self->setRgba(x, y, c);
         }
     }
 
@@ -82,12 +95,29 @@ void LinePrimitiveRasterizer::rasterize(const Mesh& m, const glm::dmat4& matrix)
 
     for (size_t i = 0; i < m.indices.size(); i += 2)
     {
+        if (isCancelled())
+            break;
+
         unsigned i1 = m.indices[i + 0];
         unsigned i2 = m.indices[i + 1];
         Vertex v1 = m.vertices[i1];
         Vertex v2 = m.vertices[i2];
 
-        impl->rasterize(v1, v2, matrix);
+        switch (framebuffer.depthFormat())
+        {
+            case Framebuffer::DepthFormat::Float64:
+                impl->rasterize<Framebuffer::DepthFloat64>(v1, v2, matrix);
+                break;
+            case Framebuffer::DepthFormat::Float32:
+                impl->rasterize<Framebuffer::DepthFloat32>(v1, v2, matrix);
+                break;
+            case Framebuffer::DepthFormat::Unorm24:
+                impl->rasterize<Framebuffer::DepthUnorm24>(v1, v2, matrix);
+                break;
+            case Framebuffer::DepthFormat::Unorm16:
+                impl->rasterize<Framebuffer::DepthUnorm16>(v1, v2, matrix);
+                break;
+        }
     }
 
     qDebug() << __FUNCTION__ << timer.elapsed() << "ms";
@@ -4,10 +4,11 @@
  * ---------------------------------------------------------------- */
  
 #include "rasperi_primitive_rasterizer.h"
+#include <glm/matrix.hpp>
 #include "rasperi_material.h"
 #include "rasperi_mesh.h"
 #include "rasperi_sampler.h"
-#include "rasperi_texture_cube_mapping.h"
+#include "rasperi_texture_cube_sampler.h"
 
 namespace kuu
 {
@@ -18,43 +19,63 @@ namespace rasperi
  * ---------------------------------------------------------------- */
 struct TrianglePrimitiveRasterizer::Impl
 {
-    /* ------------------------------------------------------------ *
-     * ------------------------------------------------------------ */
-    class BoundingBox
-    {
-    public:
-        BoundingBox()
-        {
-            min.x =  std::numeric_limits<double>::max();
-            min.y =  std::numeric_limits<double>::max();
-            max.x = -std::numeric_limits<double>::max();
-            max.y = -std::numeric_limits<double>::max();
-        }
-
-        void update(const glm::dvec2& p)
-        {
-            if (p.x < min.x) min.x = p.x;
-            if (p.y < min.y) min.y = p.y;
-            if (p.x > max.x) max.x = p.x;
-            if (p.y > max.y) max.y = p.y;
-        }
-
-        glm::dvec2 min;
-        glm::dvec2 max;
-    };
-
     /* ------------------------------------------------------------ *
      * ------------------------------------------------------------ */
     Impl(Rasterizer::NormalMode normalMode,
+         Rasterizer::ShadingQuality shadingQuality,
          TrianglePrimitiveRasterizer* self)
         : self(self)
         , normalMode(normalMode)
+        , shadingQuality(shadingQuality)
     {}
 
     /* ------------------------------------------------------------ *
+       Rasterizes the triangles of the bin within the tile. The
+       depth test is specialized for the depth format.
      * ------------------------------------------------------------ */
+    template<typename Depth>
+    void rasterizeTile(const std::vector<size_t>& bin,
+                       const glm::ivec4& tile,
+                       const std::vector<unsigned>& indices,
+                       const std::vector<Vertex>& vertices,
+                       const std::vector<glm::dvec3>& projected,
+                       const std::vector<glm::dvec2>& screen,
+                       const glm::dmat4& modelMatrix,
+                       const glm::dmat3& normalMatrix,
+                       const glm::dvec3& lightDir,
+                       const glm::dvec3& cameraPos,
+                       const Material& material)
+    {
+        for (size_t i : bin)
+        {
+            unsigned i1 = indices[i + 0];
+            unsigned i2 = indices[i + 1];
+            unsigned i3 = indices[i + 2];
+
+            Triangle tri;
+            tri.p1 = vertices[i1];
+            tri.p2 = vertices[i2];
+            tri.p3 = vertices[i3];
+
+            rasterize<Depth>(tri,
+                             projected[i1], projected[i2], projected[i3],
+                             screen[i1], screen[i2], screen[i3],
+                             tile,
+                             modelMatrix, normalMatrix, lightDir, cameraPos, material);
+        }
+    }
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    template<typename Depth>
     void rasterize(const Triangle& tri,
-                   const glm::dmat4& cameraMatrix,
+                   const glm::dvec3& p1,
+                   const glm::dvec3& p2,
+                   const glm::dvec3& p3,
+                   const glm::dvec2& vpP1,
+                   const glm::dvec2& vpP2,
+                   const glm::dvec2& vpP3,
+                   const glm::ivec4& tile,
                    const glm::dmat4& modelMatrix,
                    const glm::dmat3& normalMatrix,
                    const glm::dvec3& lightDir,
@@ -65,32 +86,20 @@ struct TrianglePrimitiveRasterizer::Impl
             glm::normalize(glm::cross(tri.p2.position - tri.p1.position,
                                       tri.p3.position - tri.p1.position));
 
-        // Projection
-        glm::dvec3 p1 = self->project(cameraMatrix, tri.p1.position);
-        glm::dvec3 p2 = self->project(cameraMatrix, tri.p2.position);
-        glm::dvec3 p3 = self->project(cameraMatrix, tri.p3.position);
-
-        // Viewport transform
-        glm::dvec2 vpP1 = self->viewportTransform(p1);
-        glm::dvec2 vpP2 = self->viewportTransform(p2);
-        glm::dvec2 vpP3 = self->viewportTransform(p3);
-
-        // Shade the triangle area on the viewport
-        BoundingBox bb;
-        bb.update(vpP1);
-        bb.update(vpP2);
-        bb.update(vpP3);
-
-        int w = self->framebuffer.colorTex.width();
-        int h = self->framebuffer.colorTex.height();
-        int xmin = std::max(0, std::min(w - 1, int(std::floor(bb.min.x))));
-        int ymin = std::max(0, std::min(h - 1, int(std::floor(bb.min.y))));
-        int xmax = std::max(0, std::min(w - 1, int(std::floor(bb.max.x))));
-        int ymax = std::max(0, std::min(h - 1, int(std::floor(bb.max.y))));
-
-        #pragma omp parallel for
-        //for (int y = bb.min.y; y <= bb.max.y; ++y)
-        //for (int x = bb.min.x; x <= bb.max.x; ++x)
+        // Shade the triangle area within the tile, the tile is given
+        // as min x, min y, max x and max y.
+        const glm::dvec2 bbMin = glm::min(vpP1, glm::min(vpP2, vpP3));
+        const glm::dvec2 bbMax = glm::max(vpP1, glm::max(vpP2, vpP3));
+
+        int xmin = std::max(tile.x, int(std::floor(bbMin.x)));
+        int ymin = std::max(tile.y, int(std::floor(bbMin.y)));
+        int xmax = std::min(tile.z, int(std::floor(bbMax.x)));
+        int ymax = std::min(tile.w, int(std::floor(bbMax.y)));
+
+        Framebuffer& framebuffer = self->framebuffer;
+        typename Depth::Type* depth = framebuffer.depthPixels<Depth>();
+        const size_t width = size_t(framebuffer.colorTex.width());
+
         for (int y = ymin; y <= ymax; ++y)
         for (int x = xmin; x <= xmax; ++x)
         {
@@ -120,15 +129,15 @@ struct TrianglePrimitiveRasterizer::Impl
             w3 /= area;
 
             // Depth test.
-            double d = self->framebuffer.depthTex.pixel(x, y)[0];
             double z  = 1.0 / (w1 * 1.0 / p1.z +
                                w2 * 1.0 / p2.z +
                                w3 * 1.0 / p3.z);
-            if (z >= d)
+            typename Depth::Type& d = depth[size_t(y) * width + size_t(x)];
+            const typename Depth::Type zs =
+                Depth::encode(framebuffer.normalizedDepth(z));
+            if (!framebuffer.depthTest(self->depthCompare, zs, d))
                 continue;
-
-            std::array<double, 1> pix = { z };
-            self->framebuffer.depthTex.setPixel(x, y, pix);
+            d = zs;
 
             Vertex vertex = interpolatedVertex(tri,
                                                w1, w2, w3,
@@ -142,7 +151,8 @@ struct TrianglePrimitiveRasterizer::Impl
                 vertex.normal = triNormal;
             vertex.normal = glm::normalize(vertex.normal);
 
-            if (material.normalSampler.isValid())
+            const bool preview = shadingQuality == Rasterizer::ShadingQuality::Preview;
+            if (material.normalSampler.isValid() && !preview)
             {
                 glm::dmat3 tbn = glm::dmat3(vertex.tangent,
                                             vertex.bitangent,
@@ -159,22 +169,47 @@ struct TrianglePrimitiveRasterizer::Impl
             glm::dvec3 v = glm::normalize(cameraPos - vertex.position);
             glm::dvec3 h = glm::normalize(v + l);
 
+            // Linear color, the PBR lighting is tone mapped into the
+            // display range.
             glm::dvec4 color;
-            switch(material.model)
+            bool toneMap = false;
+            if (preview)
             {
-                case Material::Model::Phong:
-                    color = litVertexPhong(vertex, material, n, v, l, h);
-                    break;
-
-                case Material::Model::Pbr:
-                    color = litVertexPbr(vertex, material, n, v, l, h);
-                    break;
+                color = litVertexPreview(vertex, material, n, l);
+            }
+            else
+            {
+                switch(material.model)
+                {
+                    case Material::Model::Phong:
+                        color = litVertexPhong(vertex, material, n, v, l, h);
+                        break;
+
+                    case Material::Model::Pbr:
+                        color = litVertexPbr(vertex, material, n, v, l, h);
+                        toneMap = true;
+                        break;
+                }
             }
 
-            self->setRgba(x, y, color);
+            self->setHdr(x, y, color);
+            self->setRgba(x, y, displayColor(color, toneMap));
         }
     }
 
+    /* ------------------------------------------------------------ *
+       Maps the linear color into the gamma corrected display color,
+       the tone mapping is the Reinhard operator.
+     * ------------------------------------------------------------ */
+    static glm::dvec4 displayColor(const glm::dvec4& linear, bool toneMap)
+    {
+        glm::dvec3 c(linear);
+        if (toneMap)
+            c = c / (c + glm::dvec3(1.0));
+        c = glm::pow(c, glm::dvec3(1.0 / 2.2));
+        return glm::dvec4(c, linear.a);
+    }
+
     /* ------------------------------------------------------------ *
      * ------------------------------------------------------------ */
     double edgeFunction(const glm::dvec2& a,
@@ -293,11 +328,42 @@ struct TrianglePrimitiveRasterizer::Impl
         specular = specular * std::pow(vDotR, specularPower);
 
         glm::dvec3 c = diffuse + specular;
-        c = glm::pow(c, glm::dvec3(1.0 / 2.2));
-
         return glm::dvec4(c, 1.0);
     }
 
+    /* ------------------------------------------------------------ *
+       Cheap shading for the interactive frames. The base color of
+       the material is lit with a constant ambient and the diffuse
+       term of the light.
+     * ------------------------------------------------------------ */
+    glm::dvec4 litVertexPreview(const Vertex& vertex,
+                                const Material& material,
+                                const glm::dvec3& n,
+                                const glm::dvec3& l) const
+    {
+        glm::dvec3 color;
+        switch(material.model)
+        {
+            case Material::Model::Phong:
+                color = material.phong.diffuse;
+                if (material.phong.diffuseFromVertex)
+                    color = vertex.color;
+                if (material.phong.diffuseSampler.isValid())
+                    color = material.phong.diffuseSampler.sampleRgba(vertex.texCoord);
+                break;
+
+            case Material::Model::Pbr:
+                color = material.pbr.albedo;
+                if (material.pbr.albedoSampler.isValid())
+                    color = material.pbr.albedoSampler.sampleRgba(vertex.texCoord);
+                break;
+        }
+
+        const double nDotL = glm::clamp(glm::dot(n, l), 0.0, 1.0);
+        color *= 0.2 + 0.8 * nDotL;
+        return glm::dvec4(color, 1.0);
+    }
+
     /* ------------------------------------------------------------ *
      * ------------------------------------------------------------ */
     glm::dvec4 litVertexPbr(const Vertex& vertex,
@@ -387,48 +453,17 @@ struct TrianglePrimitiveRasterizer::Impl
         if (!material.pbr.irradiance ||
             !material.pbr.prefilter ||
             !material.pbr.brdfIntegration)
-        {
-            glm::dvec3 color = radiance;
-            color = color / (color + glm::dvec3(1.0));
-            color = pow(color, glm::dvec3(1.0/2.2));
-            return glm::dvec4(color, 1.0);
-        }
+            return glm::dvec4(radiance, 1.0);
 
         // Sample diffuse irradiance.
-        texture_cube_mapping::TextureCoordinate tc =
-            texture_cube_mapping::mapPoint(n);
-        size_t face = size_t(tc.faceIndex);
-
-        const std::array<double, 4> irradiancePix =
-            material.pbr.irradiance->face(face).pixel(tc.uv.x, tc.uv.y);
-
         const glm::dvec3 irradianceDiffuse =
-            glm::dvec3(irradiancePix[0],
-                       irradiancePix[1],
-                       irradiancePix[2]) * albedo;
-
-        // Sample specular irradiance
-        tc = texture_cube_mapping::mapPoint(r);
-        face = size_t(tc.faceIndex);
-
-        // Sample prefilter value
-        int levelCount = material.pbr.prefilter->mipmapCount();
-        double level = roughness * levelCount;
-        int levelMin = glm::clamp(int(std::floor(level)), 0, levelCount);
-        int levelMax = glm::clamp(int(std::ceil(level)),  0, levelCount);
-        const std::array<double, 4> prefilterPixMin = material.pbr.prefilter->face(face).mipmap(levelMin).pixel(tc.uv.x, tc.uv.y);
-        const std::array<double, 4> prefilterPixMax = material.pbr.prefilter->face(face).mipmap(levelMax).pixel(tc.uv.x, tc.uv.y);
-        glm::dvec3 prefilterer =
-            glm::dvec3((prefilterPixMin[0] + prefilterPixMax[0]) * 0.5,
-                       (prefilterPixMin[1] + prefilterPixMax[0]) * 0.5,
-                       (prefilterPixMin[2] + prefilterPixMax[0]) * 0.5);
-
-        texture_cube_mapping::TextureCoordinate tc2 =
-            texture_cube_mapping::mapPoint(r);
-        size_t face2 = size_t(tc2.faceIndex);
-        const std::array<double, 4> prefilterPix =
-            material.pbr.prefilter->face(face2).pixel(tc2.uv.x, tc2.uv.y);
-        prefilterer = glm::dvec3(prefilterPix[0], prefilterPix[1], prefilterPix[2]);
+            glm::dvec3(irradianceSampler.sample(n)) * albedo;
+
+        // Sample prefilter value, the smallest level matches to the
+        // roughness of 1.0.
+        const double lod = roughness * material.pbr.prefilter->mipmapCount();
+        const glm::dvec3 prefilterer =
+            glm::dvec3(prefilterSampler.sampleLod(r, lod));
 
         // Sample BRDF integration.
         const std::array<double, 2> brdfIntegrationPix = material.pbr.brdfIntegration->pixel(nDotV, 1.0 - roughness);
@@ -444,23 +479,23 @@ struct TrianglePrimitiveRasterizer::Impl
 
         //double exposure = 0.1;
         //color = 1.0 - exp(-exposure * color);
-        glm::dvec3 color = radiance + irradiance;
-        color = color / (color + glm::dvec3(1.0));
-        color = pow(color, glm::dvec3(1.0 / 2.2));
-
-        return glm::dvec4(color, 1.0);
+        return glm::dvec4(radiance + irradiance, 1.0);
     }
 
     TrianglePrimitiveRasterizer* self;
     Rasterizer::NormalMode normalMode;
+    Rasterizer::ShadingQuality shadingQuality;
+    TextureCubeSampler irradianceSampler;
+    TextureCubeSampler prefilterSampler;
 };
 
 /* ---------------------------------------------------------------- *
  * ---------------------------------------------------------------- */
 TrianglePrimitiveRasterizer::TrianglePrimitiveRasterizer(Framebuffer &framebuffer,
-        Rasterizer::NormalMode normalMode)
+        Rasterizer::NormalMode normalMode,
+        Rasterizer::ShadingQuality shadingQuality)
     : PrimitiveRasterizer(framebuffer)
-    , impl(std::make_shared<Impl>(normalMode, this))
+    , impl(std::make_shared<Impl>(normalMode, shadingQuality, this))
 {}
 
 /* ---------------------------------------------------------------- *
@@ -474,24 +509,157 @@ void TrianglePrimitiveRasterizer::rasterize(
         const glm::dvec3& cameraPos,
         const Material& material)
 {
-    for (size_t i = 0; i < triangleMesh.indices.size(); i += 3)
+    if (isCancelled())
+        return;
+
+    // Samplers are created once per mesh, not per fragment.
+    impl->irradianceSampler = TextureCubeSampler();
+    impl->prefilterSampler  = TextureCubeSampler();
+    if (material.pbr.irradiance)
+        impl->irradianceSampler = TextureCubeSampler(*material.pbr.irradiance);
+    if (material.pbr.prefilter)
+        impl->prefilterSampler = TextureCubeSampler(*material.pbr.prefilter);
+
+    const std::vector<unsigned>& indices = triangleMesh.indices;
+    const std::vector<Vertex>& vertices  = triangleMesh.vertices;
+
+    bool meshletsValid = !triangleMesh.meshlets.empty();
+    for (const Meshlet& m : triangleMesh.meshlets)
+        meshletsValid &= m.indexOffset + size_t(m.triangleCount) * 3 <= indices.size();
+
+    // Meshlet culling. Meshlets outside of the view or facing away
+    // from the camera are skipped before any per-triangle work. The
+    // back-face test is done in the model space which keeps the sign
+    // only if the model matrix does not mirror.
+    std::vector<std::pair<size_t, size_t>> ranges;
+    if (meshletsValid)
     {
-        unsigned i1 = triangleMesh.indices[i + 0];
-        unsigned i2 = triangleMesh.indices[i + 1];
-        unsigned i3 = triangleMesh.indices[i + 2];
-        if (i1 >= triangleMesh.vertices.size() ||
-            i2 >= triangleMesh.vertices.size() ||
-            i3 >= triangleMesh.vertices.size())
+        const glm::dvec3 eye = glm::dvec3(glm::inverse(modelMatrix) *
+                                          glm::dvec4(cameraPos, 1.0));
+        const bool coneCulling = glm::determinant(glm::dmat3(modelMatrix)) > 0.0;
+
+        for (const Meshlet& m : triangleMesh.meshlets)
+        {
+            if (!isVisible(cameraMatrix,
+                           m.center - glm::dvec3(m.radius),
+                           m.center + glm::dvec3(m.radius)))
+            {
+                continue;
+            }
+
+            const glm::dvec3 d = m.center - eye;
+            if (coneCulling &&
+                glm::dot(d, m.coneAxis) >= m.coneCutoff * glm::length(d) + m.radius)
+            {
+                continue;
+            }
+
+            const size_t first = m.indexOffset;
+            ranges.push_back({ first, first + size_t(m.triangleCount) * 3 });
+        }
+    }
+    else
+    {
+        ranges.push_back({ 0, indices.size() - indices.size() % 3 });
+    }
+
+    // Vertex stage. Each vertex of the visible triangles is projected
+    // once and shared by all of its triangles.
+    std::vector<char> used(vertices.size(), 0);
+    for (const auto& range : ranges)
+        for (size_t i = range.first; i < range.second; ++i)
+            if (indices[i] < vertices.size())
+                used[indices[i]] = 1;
+
+    const int vertexCount = int(vertices.size());
+    std::vector<glm::dvec3> projected(vertices.size());
+    std::vector<glm::dvec2> screen(vertices.size());
+    #pragma omp parallel for
+    for (int v = 0; v < vertexCount; ++v)
+    {
+        if (!used[size_t(v)])
+            continue;
+        projected[size_t(v)] = project(cameraMatrix, vertices[size_t(v)].position);
+        screen[size_t(v)]    = viewportTransform(projected[size_t(v)]);
+    }
+
+    // Binning stage. Each triangle is added into the framebuffer
+    // tiles that its screen bounding box overlaps.
+    const int TileSize = Framebuffer::TileSize;
+    const int w = framebuffer.colorTex.width();
+    const int h = framebuffer.colorTex.height();
+    const int tilesX = (w + TileSize - 1) / TileSize;
+    const int tilesY = (h + TileSize - 1) / TileSize;
+
+    std::vector<std::vector<size_t>> bins(size_t(tilesX * tilesY));
+    for (const auto& range : ranges)
+    for (size_t i = range.first; i < range.second; i += 3)
+    {
+        unsigned i1 = indices[i + 0];
+        unsigned i2 = indices[i + 1];
+        unsigned i3 = indices[i + 2];
+        if (i1 >= vertices.size() ||
+            i2 >= vertices.size() ||
+            i3 >= vertices.size())
         {
             continue;
         }
 
-        Triangle tri;
-        tri.p1 = triangleMesh.vertices[i1];
-        tri.p2 = triangleMesh.vertices[i2];
-        tri.p3 = triangleMesh.vertices[i3];
+        const glm::dvec2 bbMin = glm::min(screen[i1], glm::min(screen[i2], screen[i3]));
+        const glm::dvec2 bbMax = glm::max(screen[i1], glm::max(screen[i2], screen[i3]));
 
-        impl->rasterize(tri, cameraMatrix, modelMatrix, normalMatrix, lightDir, cameraPos, material);
+        const int tx0 = glm::clamp(int(std::floor(bbMin.x)) / TileSize, 0, tilesX - 1);
+        const int ty0 = glm::clamp(int(std::floor(bbMin.y)) / TileSize, 0, tilesY - 1);
+        const int tx1 = glm::clamp(int(std::floor(bbMax.x)) / TileSize, 0, tilesX - 1);
+        const int ty1 = glm::clamp(int(std::floor(bbMax.y)) / TileSize, 0, tilesY - 1);
+        for (int ty = ty0; ty <= ty1; ++ty)
+        for (int tx = tx0; tx <= tx1; ++tx)
+            bins[size_t(ty * tilesX + tx)].push_back(i);
+    }
+
+    // Tile stage. A tile is owned by a single thread so the pixels
+    // are written without synchronization. Cancellation is checked
+    // before each tile. A pending clear of the tile is done before
+    // the first triangle.
+    const int tileCount = int(bins.size());
+    #pragma omp parallel for schedule(dynamic)
+    for (int t = 0; t < tileCount; ++t)
+    {
+        const std::vector<size_t>& bin = bins[size_t(t)];
+        if (bin.empty() || isCancelled())
+            continue;
+
+        framebuffer.materializeTile(t);
+
+        const std::array<int, 4> r = framebuffer.tileRect(t);
+        const glm::ivec4 tile(r[0], r[1], r[2], r[3]);
+
+        switch (framebuffer.depthFormat())
+        {
+            case Framebuffer::DepthFormat::Float64:
+                impl->rasterizeTile<Framebuffer::DepthFloat64>(
+                    bin, tile, indices, vertices, projected, screen,
+                    modelMatrix, normalMatrix, lightDir, cameraPos, material);
+                break;
+
+            case Framebuffer::DepthFormat::Float32:
+                impl->rasterizeTile<Framebuffer::DepthFloat32>(
+                    bin, tile, indices, vertices, projected, screen,
+                    modelMatrix, normalMatrix, lightDir, cameraPos, material);
+                break;
+
+            case Framebuffer::DepthFormat::Unorm24:
+                impl->rasterizeTile<Framebuffer::DepthUnorm24>(
+                    bin, tile, indices, vertices, projected, screen,
+                    modelMatrix, normalMatrix, lightDir, cameraPos, material);
+                break;
+
+            case Framebuffer::DepthFormat::Unorm16:
+                impl->rasterizeTile<Framebuffer::DepthUnorm16>(
+                    bin, tile, indices, vertices, projected, screen,
+                    modelMatrix, normalMatrix, lightDir, cameraPos, material);
+                break;
+        }
     }
 }
 
@@ -4,6 +4,8 @@
  * ---------------------------------------------------------------- */
  
 #include "rasperi_rasterizer.h"
+#include <future>
+#include <limits>
 #include <glm/gtc/matrix_inverse.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include "rasperi_material.h"
@@ -11,6 +13,7 @@
 #include "rasperi_primitive_rasterizer.h"
 #include "rasperi_sampler.h"
 #include "rasperi_sky_box.h"
+#include "rasperi_streamed_mesh.h"
 
 namespace kuu
 {
@@ -26,6 +29,10 @@ struct Rasterizer::Impl
     Impl(int width, int height)
         : framebuffer(width, height)
         , normalMode(NormalMode::Coarse)
+        , shadingQuality(ShadingQuality::Full)
+        , depthCompare(DepthCompare::Less)
+        , lodThreshold(1.0)
+        , cancel(nullptr)
     {
         viewMatrix = glm::translate(glm::dmat4(1.0), glm::dvec3(0, 0, 3.0));
         projectionMatrix = glm::perspective(M_PI * 0.25, width / double(height), 0.1, 150.0);
@@ -56,8 +63,106 @@ struct Rasterizer::Impl
      * ------------------------------------------------------------ */
     void drawFilledTriangleMesh(Mesh* mesh)
     {
-        TrianglePrimitiveRasterizer triRast(framebuffer, normalMode);
-        triRast.rasterize(*mesh, cameraMatrix, modelMatrix, normalMatrix, lightDir, cameraPos, material);
+        TrianglePrimitiveRasterizer triRast(framebuffer, normalMode, shadingQuality);
+        triRast.setCancelFlag(cancel);
+        triRast.setDepthCompare(depthCompare);
+        triRast.rasterize(*selectLod(mesh), cameraMatrix, modelMatrix, normalMatrix, lightDir, cameraPos, material);
+    }
+
+    /* ------------------------------------------------------------ *
+       Returns the coarsest LOD of the mesh whose error projects to
+       at most the LOD threshold in pixels on the closest point of
+       the mesh bounding sphere.
+     * ------------------------------------------------------------ */
+    const Mesh* selectLod(const Mesh* mesh) const
+    {
+        if (mesh->lods.empty() || lodThreshold <= 0.0)
+            return mesh;
+
+        glm::dvec3 min( std::numeric_limits<double>::max());
+        glm::dvec3 max(-std::numeric_limits<double>::max());
+        if (!mesh->meshlets.empty())
+        {
+            for (const Meshlet& m : mesh->meshlets)
+            {
+                min = glm::min(min, m.center - glm::dvec3(m.radius));
+                max = glm::max(max, m.center + glm::dvec3(m.radius));
+            }
+        }
+        else
+        {
+            for (const Vertex& v : mesh->vertices)
+            {
+                min = glm::min(min, v.position);
+                max = glm::max(max, v.position);
+            }
+        }
+        if (min.x > max.x)
+            return mesh;
+
+        const double scale = std::max(glm::length(glm::dvec3(modelMatrix[0])),
+                             std::max(glm::length(glm::dvec3(modelMatrix[1])),
+                                      glm::length(glm::dvec3(modelMatrix[2]))));
+        const glm::dvec3 center =
+            glm::dvec3(modelMatrix * glm::dvec4((min + max) * 0.5, 1.0));
+        const double radius = glm::length(max - min) * 0.5 * scale;
+        const double distance = glm::length(center - cameraPos) - radius;
+        if (distance <= 0.0)
+            return mesh;
+
+        const double pixelsPerUnit = projectionMatrix[1][1] *
+                                     framebuffer.colorTex.height() * 0.5 /
+                                     distance;
+
+        const Mesh* out = mesh;
+        for (const MeshLod& lod : mesh->lods)
+        {
+            if (lod.error * scale * pixelsPerUnit > lodThreshold)
+                break;
+            out = lod.mesh.get();
+        }
+        return out;
+    }
+
+    /* ------------------------------------------------------------ *
+       Streams the clusters that intersect the view frustum through
+       the triangle rasterizer. The next cluster is loaded while the
+       current one is rasterized.
+     * ------------------------------------------------------------ */
+    void drawFilledTriangleMesh(StreamedMesh* mesh)
+    {
+        std::vector<int> visible;
+        for (int i = 0; i < mesh->clusterCount(); ++i)
+        {
+            const StreamedMesh::Cluster& c = mesh->cluster(i);
+            if (PrimitiveRasterizer::isVisible(cameraMatrix, c.min, c.max))
+                visible.push_back(i);
+        }
+        if (visible.empty())
+            return;
+
+        auto load = [mesh](int index)
+        {
+            return std::async(std::launch::async, [mesh, index]()
+            {
+                return mesh->load(index);
+            });
+        };
+
+        TrianglePrimitiveRasterizer triRast(framebuffer, normalMode, shadingQuality);
+        triRast.setCancelFlag(cancel);
+        triRast.setDepthCompare(depthCompare);
+        std::future<std::shared_ptr<const Mesh>> next = load(visible[0]);
+        for (size_t i = 0; i < visible.size(); ++i)
+        {
+            std::shared_ptr<const Mesh> cluster = next.get();
+            if (triRast.isCancelled())
+                break;
+            if (i + 1 < visible.size())
+                next = load(visible[i + 1]);
+            if (cluster)
+                triRast.rasterize(*cluster, cameraMatrix, modelMatrix, normalMatrix, lightDir, cameraPos, material);
+        }
     }
 
     /* ------------------------------------------------------------ *
@@ -108,6 +213,8 @@ struct Rasterizer::Impl
         }
 
         LinePrimitiveRasterizer linRast(framebuffer);
+        linRast.setCancelFlag(cancel);
+        linRast.setDepthCompare(depthCompare);
         linRast.rasterize(lineMesh, cameraMatrix);
     }
 
@@ -116,6 +223,8 @@ struct Rasterizer::Impl
     void drawLineMesh(Mesh* mesh)
     {
         LinePrimitiveRasterizer linRast(framebuffer);
+        linRast.setCancelFlag(cancel);
+        linRast.setDepthCompare(depthCompare);
         linRast.rasterize(*mesh, cameraMatrix);
     }
 
@@ -135,6 +244,10 @@ struct Rasterizer::Impl
 
     Framebuffer framebuffer;
     NormalMode normalMode;
+    ShadingQuality shadingQuality;
+    DepthCompare depthCompare;
+    double lodThreshold;
+    const std::atomic<bool>* cancel;
     glm::dmat4 modelMatrix;
     glm::dmat4 viewMatrix;
     glm::dmat4 projectionMatrix;
@@ -152,6 +265,16 @@ Rasterizer::Rasterizer(int width, int height)
     : impl(std::make_shared<Impl>(width, height))
 {}
 
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+void Rasterizer::resize(int width, int height)
+{ impl->framebuffer.resize(width, height); }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+void Rasterizer::setSwapChainLength(int length)
+{ impl->framebuffer.setSwapChainLength(length); }
+
 /* ---------------------------------------------------------------- *
  * ---------------------------------------------------------------- */
 void Rasterizer::clear()
@@ -189,6 +312,36 @@ void Rasterizer::setMaterial(const Material& material)
 void Rasterizer::setNormalMode(Rasterizer::NormalMode normalMode)
 { impl->normalMode = normalMode; }
 
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+void Rasterizer::setShadingQuality(Rasterizer::ShadingQuality quality)
+{ impl->shadingQuality = quality; }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+void Rasterizer::setDepthFormat(DepthFormat format, bool reverseZ)
+{ impl->framebuffer.setDepthFormat(format, reverseZ); }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+void Rasterizer::setDepthCompare(DepthCompare compare)
+{ impl->depthCompare = compare; }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+void Rasterizer::setLodThreshold(double pixels)
+{ impl->lodThreshold = pixels; }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+void Rasterizer::setCancelFlag(const std::atomic<bool>* cancel)
+{ impl->cancel = cancel; }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+bool Rasterizer::isCancelled() const
+{ return impl->cancel && impl->cancel->load(std::memory_order_relaxed); }
+
 /* ---------------------------------------------------------------- *
  * ---------------------------------------------------------------- */
 void Rasterizer::drawSky(const TextureCube<double, 4>& sky)
@@ -199,6 +352,11 @@ void Rasterizer::drawSky(const TextureCube<double, 4>& sky)
 void Rasterizer::drawFilledTriangleMesh(Mesh* mesh)
 { impl->drawFilledTriangleMesh(mesh); }
 
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+void Rasterizer::drawFilledTriangleMesh(StreamedMesh* mesh)
+{ impl->drawFilledTriangleMesh(mesh); }
+
 /* ---------------------------------------------------------------- *
  * ---------------------------------------------------------------- */
 void Rasterizer::drawEdgeLineTriangleMesh(Mesh* mesh)
@@ -212,7 +370,29 @@ void Rasterizer::drawLineMesh(Mesh* mesh)
 /* ---------------------------------------------------------------- *
  * ---------------------------------------------------------------- */
 Framebuffer &Rasterizer::framebuffer() const
-{ return impl->framebuffer; }
+{
+    impl->framebuffer.materialize();
+    return impl->framebuffer;
+}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+QImage Rasterizer::present()
+{
+    QImage image = impl->framebuffer.toQImage();
+    impl->framebuffer.swapColorBuffers();
+    return image;
+}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+void Rasterizer::setHdrEnabled(bool enabled)
+{ impl->framebuffer.setHdrEnabled(enabled); }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+Texture2D<float, 4> Rasterizer::takeHdr()
+{ return impl->framebuffer.takeHdr(); }
 
 } // namespace rasperi
 } // namespace kuu
@@ -5,6 +5,7 @@
  
 #pragma once
 
+#include <atomic>
 #include <memory>
 #include <glm/mat4x4.hpp>
 #include "rasperi_framebuffer.h"
@@ -17,6 +18,7 @@ namespace rasperi
 
 struct Material;
 struct Mesh;
+class StreamedMesh;
 
 /* ---------------------------------------------------------------- *
    A rasterizer for rendering widgets with three-dimensional
@@ -37,20 +39,64 @@ public:
         Pbr,
     };
 
+    enum class ShadingQuality
+    {
+        Full,
+        Preview, // base color with diffuse light, no normal maps or IBL
+    };
+
+    typedef Framebuffer::DepthFormat  DepthFormat;
+    typedef Framebuffer::DepthCompare DepthCompare;
+
     Rasterizer(int width, int height);
+    // Resizes the framebuffer, the memory is reused if it fits.
+    void resize(int width, int height);
+    // Color buffer count, two for double and three for triple
+    // buffering.
+    void setSwapChainLength(int length);
     void clear();
     void setModelMatrix(const glm::dmat4& view);
     void setViewMatrix(const glm::dmat4& view);
     void setProjectionMatrix(const glm::dmat4& projection);
     void setMaterial(const Material& material);
     void setNormalMode(NormalMode normalMode);
+    void setShadingQuality(ShadingQuality quality);
+    // Float64 without the reverse-Z by default. The framebuffer is
+    // cleared.
+    void setDepthFormat(DepthFormat format, bool reverseZ = false);
+    // Less by default, the compare is made on the distance so the
+    // reverse-Z does not change its meaning.
+    void setDepthCompare(DepthCompare compare);
+    // Largest error of a mesh LOD in pixels, zero draws the full mesh.
+    void setLodThreshold(double pixels);
+    // Draw calls return at the next tile once the flag is set, the
+    // framebuffer is then left partially drawn. Null disables the
+    // cancellation.
+    void setCancelFlag(const std::atomic<bool>* cancel);
+    bool isCancelled() const;
     void drawSky(const TextureCube<double, 4>& sky);
     void drawFilledTriangleMesh(Mesh* mesh);
+    void drawFilledTriangleMesh(StreamedMesh* mesh);
     void drawEdgeLineTriangleMesh(Mesh* mesh);
     void drawLineMesh(Mesh* mesh);
 
+    // The pending clears are done before the framebuffer is
+    // returned.
     Framebuffer& framebuffer() const;
 
+    // Returns the frame as an image that shares the pixels and
+    // moves the rendering into the next color buffer of the swap
+    // chain. The image can be displayed while the next frame is
+    // rendered.
+    QImage present();
+
+    // Keeps the linear color before the tone mapping in a float
+    // buffer, off by default.
+    void setHdrEnabled(bool enabled);
+    // Returns the linear color of the frame and takes a new buffer
+    // into use. Null if the HDR buffer is not enabled.
+    Texture2D<float, 4> takeHdr();
+
 private:
     struct Impl;
     std::shared_ptr<Impl> impl;
@@ -0,0 +1,71 @@
+/* ---------------------------------------------------------------- *
+   Antti Jumpponen <kuumies@gmail.com>
+   The implementation of kuu::rasperi::ResolutionScaler class.
+ * ---------------------------------------------------------------- */
+ 
+#include "rasperi_resolution_scaler.h"
+#include <algorithm>
+#include <cmath>
+
+namespace kuu
+{
+namespace rasperi
+{
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+ResolutionScaler::ResolutionScaler(double targetMilliseconds,
+                                   double minScale)
+    : targetMs(targetMilliseconds)
+    , minScale(minScale)
+    , fullFrameMs(0.0)
+    , currentScale(1.0)
+{}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+void ResolutionScaler::setTarget(double milliseconds)
+{ targetMs = milliseconds; }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+double ResolutionScaler::target() const
+{ return targetMs; }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+void ResolutionScaler::addFrame(double milliseconds, double scale, bool complete)
+{
+    if (scale <= 0.0 || milliseconds <= 0.0 || targetMs <= 0.0)
+        return;
+
+    // Full resolution cost of the frame, the estimate rises at once
+    // so that a slow frame is reacted to on the next one but falls
+    // smoothly so that a single fast frame does not bounce the
+    // resolution back up.
+    const double ms = milliseconds / (scale * scale);
+    if (ms > fullFrameMs)
+        fullFrameMs = ms;
+    else if (complete)
+        fullFrameMs += (ms - fullFrameMs) * 0.25;
+    else
+        return;
+
+    double s = std::sqrt(targetMs / fullFrameMs);
+    s = std::floor(s * 16.0) / 16.0;
+    s = std::max(minScale, std::min(1.0, s));
+
+    // Hysteresis, the scale is raised only when the estimate is
+    // clearly below the target at the higher scale.
+    if (s > currentScale && fullFrameMs * s * s > targetMs * 0.8)
+        return;
+    currentScale = s;
+}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+double ResolutionScaler::scale() const
+{ return currentScale; }
+
+} // namespace rasperi
+} // namespace kuu
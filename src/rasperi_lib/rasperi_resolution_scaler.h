@@ -0,0 +1,49 @@
+/* ---------------------------------------------------------------- *
+   Antti Jumpponen <kuumies@gmail.com>
+   The definition of kuu::rasperi::ResolutionScaler class.
+ * ---------------------------------------------------------------- */
+ 
+#pragma once
+
+namespace kuu
+{
+namespace rasperi
+{
+
+/* ---------------------------------------------------------------- *
+   Chooses the render resolution scale that keeps the frame time
+   within the target. The cost of a frame is assumed to follow the
+   pixel count, the cost of a full resolution frame is estimated
+   from the recent frame times and the scale is set so that the
+   estimate at the scaled resolution meets the target.
+
+   The scale is quantized to steps of 1/16 so that small changes in
+   the timings do not change the framebuffer size every frame.
+ * ---------------------------------------------------------------- */
+class ResolutionScaler
+{
+public:
+    explicit ResolutionScaler(double targetMilliseconds = 33.0,
+                              double minScale = 0.25);
+
+    void setTarget(double milliseconds);
+    double target() const;
+
+    // Adds the time of a frame that was rendered at the scale. The
+    // time of an incomplete (cancelled) frame is a lower bound and
+    // it can only lower the scale.
+    void addFrame(double milliseconds, double scale, bool complete = true);
+
+    // Scale of the width and height of the next frame, in range
+    // [min scale, 1].
+    double scale() const;
+
+private:
+    double targetMs;
+    double minScale;
+    double fullFrameMs;
+    double currentScale;
+};
+
+} // namespace rasperi
+} // namespace kuu
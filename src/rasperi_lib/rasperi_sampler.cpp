@@ -5,6 +5,7 @@
  
 #include "rasperi_sampler.h"
 #include <array>
+#include <cmath>
 #include <iostream>
 #include <glm/gtx/string_cast.hpp>
 #include <glm/geometric.hpp>
@@ -14,6 +15,27 @@ namespace kuu
 {
 namespace rasperi
 {
+namespace
+{
+
+/* ---------------------------------------------------------------- *
+   8-bit values with gamma 2.2 in linear space. Linearization is a
+   table lookup instead of a pow per sample.
+ * ---------------------------------------------------------------- */
+struct GammaTable
+{
+    GammaTable()
+    {
+        for (int i = 0; i < 256; ++i)
+            linear[i] = std::pow(double(i) / 255.0, 2.2);
+    }
+
+    double linear[256];
+};
+
+static const GammaTable gammaTable;
+
+} // anonymous namespace
 
 /* ---------------------------------------------------------------- *
  * ---------------------------------------------------------------- */
@@ -158,20 +180,17 @@ struct Sampler::Impl
         const QRgb* line = reinterpret_cast<const QRgb*>(map.scanLine(y));
         const QRgb pixel = line[x];
 
-        glm::dvec4 out(
+        if (linearizeGamma)
+            return glm::dvec4(gammaTable.linear[qRed(pixel)],
+                              gammaTable.linear[qGreen(pixel)],
+                              gammaTable.linear[qBlue(pixel)],
+                              gammaTable.linear[qAlpha(pixel)]);
+
+        return glm::dvec4(
             double(qRed(pixel))   / 255.0,
             double(qGreen(pixel)) / 255.0,
             double(qBlue(pixel))  / 255.0,
             double(qAlpha(pixel)) / 255.0);
-        out = glm::clamp(out, glm::dvec4(0.0), glm::dvec4(1.0));
-
-        if (linearizeGamma)
-        {
-            double gamma = 2.2;
-            out = glm::pow(out, glm::dvec4(gamma));
-        }
-
-        return out;
     }
 
     /* ----------------------------------------------------------- *
@@ -209,16 +228,9 @@ struct Sampler::Impl
         //if (pixel > 0)
         //    std::cout << "jee" << std::endl;
 
-        double out = double(pixel) / 255.0;
-        out = glm::clamp(out, 0.0, 1.0);
-
         if (linearizeGamma)
-        {
-            double gamma = 2.2;
-            out = glm::pow(out, gamma);
-        }
-
-        return out;
+            return gammaTable.linear[pixel];
+        return double(pixel) / 255.0;
     }
 
     /* ------------------------------------------------------------ *
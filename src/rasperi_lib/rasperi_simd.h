@@ -0,0 +1,135 @@
+/* ---------------------------------------------------------------- *
+   Antti Jumpponen <kuumies@gmail.com>
+   The definition and implementation of kuu::rasperi::Float4 struct.
+ * ---------------------------------------------------------------- */
+ 
+#pragma once
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define RASPERI_SSE2
+    #include <emmintrin.h>
+#else
+    #include <cstdint>
+    #include <cstring>
+#endif
+
+namespace kuu
+{
+namespace rasperi
+{
+
+/* ---------------------------------------------------------------- *
+   Four floats processed at once. SSE2 is part of every x86-64 CPU
+   so it is used without extra compiler flags, other targets use a
+   plain array that the compiler may vectorize.
+
+   Comparisons return a mask with all the bits of a true lane set,
+   masks are combined with the bitwise operators and used with
+   select and movemask.
+ * ---------------------------------------------------------------- */
+struct Float4
+{
+#ifdef RASPERI_SSE2
+    Float4() {}
+    Float4(__m128 v) : v(v) {}
+    explicit Float4(float f) : v(_mm_set1_ps(f)) {}
+    Float4(float a, float b, float c, float d) : v(_mm_setr_ps(a, b, c, d)) {}
+
+    static Float4 load(const float* p)  { return _mm_loadu_ps(p); }
+    void store(float* p) const          { _mm_storeu_ps(p, v); }
+
+    friend Float4 operator+(Float4 a, Float4 b)  { return _mm_add_ps(a.v, b.v); }
+    friend Float4 operator-(Float4 a, Float4 b)  { return _mm_sub_ps(a.v, b.v); }
+    friend Float4 operator*(Float4 a, Float4 b)  { return _mm_mul_ps(a.v, b.v); }
+    friend Float4 operator/(Float4 a, Float4 b)  { return _mm_div_ps(a.v, b.v); }
+    friend Float4 operator<(Float4 a, Float4 b)  { return _mm_cmplt_ps(a.v, b.v); }
+    friend Float4 operator<=(Float4 a, Float4 b) { return _mm_cmple_ps(a.v, b.v); }
+    friend Float4 operator>(Float4 a, Float4 b)  { return _mm_cmpgt_ps(a.v, b.v); }
+    friend Float4 operator>=(Float4 a, Float4 b) { return _mm_cmpge_ps(a.v, b.v); }
+    friend Float4 operator!=(Float4 a, Float4 b) { return _mm_cmpneq_ps(a.v, b.v); }
+    friend Float4 operator&(Float4 a, Float4 b)  { return _mm_and_ps(a.v, b.v); }
+    friend Float4 operator|(Float4 a, Float4 b)  { return _mm_or_ps(a.v, b.v); }
+
+    friend Float4 min(Float4 a, Float4 b) { return _mm_min_ps(a.v, b.v); }
+    friend Float4 max(Float4 a, Float4 b) { return _mm_max_ps(a.v, b.v); }
+
+    // Lanes of a where the mask is set, else lanes of b.
+    friend Float4 select(Float4 mask, Float4 a, Float4 b)
+    { return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)); }
+
+    // Bit i is set if the lane i of the mask is set.
+    friend int movemask(Float4 mask) { return _mm_movemask_ps(mask.v); }
+
+    __m128 v;
+#else
+    Float4() {}
+    explicit Float4(float f) { for (int i = 0; i < 4; ++i) v[i] = f; }
+    Float4(float a, float b, float c, float d) { v[0] = a; v[1] = b; v[2] = c; v[3] = d; }
+
+    static Float4 load(const float* p)  { Float4 o; std::memcpy(o.v, p, sizeof(o.v)); return o; }
+    void store(float* p) const          { std::memcpy(p, v, sizeof(v)); }
+
+    template<typename Op>
+    static Float4 map(Float4 a, Float4 b, Op op)
+    { Float4 o; for (int i = 0; i < 4; ++i) o.v[i] = op(a.v[i], b.v[i]); return o; }
+
+    template<typename Op>
+    static Float4 compare(Float4 a, Float4 b, Op op)
+    { Float4 o; for (int i = 0; i < 4; ++i) o.v[i] = op(a.v[i], b.v[i]) ? ones() : 0.0f; return o; }
+
+    template<typename Op>
+    static Float4 bits(Float4 a, Float4 b, Op op)
+    {
+        Float4 o;
+        for (int i = 0; i < 4; ++i)
+        {
+            uint32_t x, y;
+            std::memcpy(&x, &a.v[i], 4);
+            std::memcpy(&y, &b.v[i], 4);
+            x = op(x, y);
+            std::memcpy(&o.v[i], &x, 4);
+        }
+        return o;
+    }
+
+    static float ones() { const uint32_t u = ~0u; float f; std::memcpy(&f, &u, 4); return f; }
+
+    friend Float4 operator+(Float4 a, Float4 b)  { return map(a, b, [](float x, float y) { return x + y; }); }
+    friend Float4 operator-(Float4 a, Float4 b)  { return map(a, b, [](float x, float y) { return x - y; }); }
+    friend Float4 operator*(Float4 a, Float4 b)  { return map(a, b, [](float x, float y) { return x * y; }); }
+    friend Float4 operator/(Float4 a, Float4 b)  { return map(a, b, [](float x, float y) { return x / y; }); }
+    friend Float4 operator<(Float4 a, Float4 b)  { return compare(a, b, [](float x, float y) { return x <  y; }); }
+    friend Float4 operator<=(Float4 a, Float4 b) { return compare(a, b, [](float x, float y) { return x <= y; }); }
+    friend Float4 operator>(Float4 a, Float4 b)  { return compare(a, b, [](float x, float y) { return x >  y; }); }
+    friend Float4 operator>=(Float4 a, Float4 b) { return compare(a, b, [](float x, float y) { return x >= y; }); }
+    friend Float4 operator!=(Float4 a, Float4 b) { return compare(a, b, [](float x, float y) { return x != y; }); }
+    friend Float4 operator&(Float4 a, Float4 b)  { return bits(a, b, [](uint32_t x, uint32_t y) { return x & y; }); }
+    friend Float4 operator|(Float4 a, Float4 b)  { return bits(a, b, [](uint32_t x, uint32_t y) { return x | y; }); }
+
+    // Same NaN behaviour as SSE, the second operand is returned.
+    friend Float4 min(Float4 a, Float4 b) { return map(a, b, [](float x, float y) { return x < y ? x : y; }); }
+    friend Float4 max(Float4 a, Float4 b) { return map(a, b, [](float x, float y) { return x > y ? x : y; }); }
+
+    friend Float4 select(Float4 mask, Float4 a, Float4 b)
+    { return bits(bits(mask, a, [](uint32_t m, uint32_t x) { return m & x; }),
+                  bits(mask, b, [](uint32_t m, uint32_t x) { return ~m & x; }),
+                  [](uint32_t x, uint32_t y) { return x | y; }); }
+
+    friend int movemask(Float4 mask)
+    {
+        int out = 0;
+        for (int i = 0; i < 4; ++i)
+        {
+            uint32_t x;
+            std::memcpy(&x, &mask.v[i], 4);
+            out |= int(x >> 31) << i;
+        }
+        return out;
+    }
+
+    float v[4];
+#endif
+};
+
+} // namespace rasperi
+} // namespace kuu
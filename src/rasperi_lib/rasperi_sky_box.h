@@ -17,6 +17,9 @@ namespace rasperi
 class Framebuffer;
 
 /* ---------------------------------------------------------------- *
+   Draws the sky cube map into the pixels that are not covered by
+   the geometry. Draw the sky after the geometry so that the cost
+   depends only on the count of visible sky pixels.
  * ---------------------------------------------------------------- */
 class SkyBox
 {
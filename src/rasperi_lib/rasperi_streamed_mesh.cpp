@@ -0,0 +1,492 @@
+/* ---------------------------------------------------------------- *
+   Antti Jumpponen <kuumies@gmail.com>
+   The implementation of kuu::rasperi::StreamedMesh and
+   kuu::rasperi::StreamedMeshWriter classes.
+ * ---------------------------------------------------------------- */
+ 
+#include "rasperi_streamed_mesh.h"
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <glm/common.hpp>
+#include <QtCore/QDebug>
+#include <QtCore/QFile>
+
+namespace kuu
+{
+namespace rasperi
+{
+namespace
+{
+
+/* ---------------------------------------------------------------- *
+   File layout:
+
+   [Header]
+   [Cluster data] * clusterCount
+   [Directory entry] * clusterCount (at header.directoryOffset)
+
+   Cluster data is the vertices as floats followed by the 16-bit
+   cluster local indices.
+ * ---------------------------------------------------------------- */
+const char     STREAM_MAGIC[8] = { 'R', 'A', 'S', 'P', 'S', 'T', 'R', 'M' };
+const uint32_t STREAM_VERSION  = 1;
+const int      VERTEX_FLOATS   = 18;
+const int      MAX_CLUSTER_TRIANGLES = 65536 / 3;
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+struct Header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t clusterCount;
+    uint64_t directoryOffset;
+};
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+struct DirectoryEntry
+{
+    uint64_t offset;
+    uint32_t vertexCount;
+    uint32_t indexCount;
+    float min[3];
+    float max[3];
+};
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+size_t clusterBytes(const DirectoryEntry& e)
+{
+    return size_t(e.vertexCount) * VERTEX_FLOATS * sizeof(float) +
+           size_t(e.indexCount)  * sizeof(uint16_t);
+}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+void packVertex(const Vertex& v, float* out)
+{
+    const double in[VERTEX_FLOATS] =
+    {
+        v.position.x,  v.position.y,  v.position.z,
+        v.texCoord.x,  v.texCoord.y,
+        v.normal.x,    v.normal.y,    v.normal.z,
+        v.tangent.x,   v.tangent.y,   v.tangent.z,
+        v.bitangent.x, v.bitangent.y, v.bitangent.z,
+        v.color.r,     v.color.g,     v.color.b,     v.color.a
+    };
+    for (int i = 0; i < VERTEX_FLOATS; ++i)
+        out[i] = float(in[i]);
+}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+void unpackVertex(const float* in, Vertex& v)
+{
+    v.position  = glm::dvec3(in[0],  in[1],  in[2]);
+    v.texCoord  = glm::dvec2(in[3],  in[4]);
+    v.normal    = glm::dvec3(in[5],  in[6],  in[7]);
+    v.tangent   = glm::dvec3(in[8],  in[9],  in[10]);
+    v.bitangent = glm::dvec3(in[11], in[12], in[13]);
+    v.color     = glm::dvec4(in[14], in[15], in[16], in[17]);
+}
+
+} // anonymous namespace
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+struct StreamedMesh::Impl
+{
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    struct Resident
+    {
+        int index;
+        std::shared_ptr<const Mesh> mesh;
+        size_t bytes;
+    };
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    Impl(size_t residentBudget)
+        : residentBudget(residentBudget)
+    {}
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    bool open(const QString& filepath)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        file.close();
+        clusters.clear();
+        entries.clear();
+        resident.clear();
+        residentMap.clear();
+        residentSize = 0;
+
+        file.setFileName(filepath);
+        if (!file.open(QIODevice::ReadOnly))
+        {
+            qDebug() << __FUNCTION__ << "failed to open" << filepath;
+            return false;
+        }
+
+        const uint64_t fileSize = uint64_t(file.size());
+        Header header;
+        if (file.read(reinterpret_cast<char*>(&header), sizeof(Header)) != qint64(sizeof(Header)) ||
+            std::memcmp(header.magic, STREAM_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != STREAM_VERSION ||
+            header.directoryOffset > fileSize ||
+            uint64_t(header.clusterCount) * sizeof(DirectoryEntry) >
+                fileSize - header.directoryOffset)
+        {
+            qDebug() << __FUNCTION__ << "invalid streamed mesh file" << filepath;
+            file.close();
+            return false;
+        }
+
+        entries.resize(header.clusterCount);
+        const qint64 directoryBytes = qint64(entries.size() * sizeof(DirectoryEntry));
+        if (!file.seek(qint64(header.directoryOffset)) ||
+            file.read(reinterpret_cast<char*>(entries.data()), directoryBytes) != directoryBytes)
+        {
+            qDebug() << __FUNCTION__ << "failed to read the cluster directory" << filepath;
+            file.close();
+            entries.clear();
+            return false;
+        }
+
+        for (const DirectoryEntry& e : entries)
+        {
+            if (e.offset > fileSize || clusterBytes(e) > fileSize - e.offset)
+            {
+                qDebug() << __FUNCTION__ << "invalid cluster" << filepath;
+                file.close();
+                entries.clear();
+                clusters.clear();
+                return false;
+            }
+
+            Cluster c;
+            c.min = glm::dvec3(e.min[0], e.min[1], e.min[2]);
+            c.max = glm::dvec3(e.max[0], e.max[1], e.max[2]);
+            c.vertexCount = int(e.vertexCount);
+            c.indexCount  = int(e.indexCount);
+            clusters.push_back(c);
+        }
+        return true;
+    }
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    std::shared_ptr<const Mesh> load(int index)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (index < 0 || index >= int(entries.size()))
+            return nullptr;
+
+        auto it = residentMap.find(index);
+        if (it != residentMap.end())
+        {
+            // Most recently used to the front
+            resident.splice(resident.begin(), resident, it->second);
+            return it->second->mesh;
+        }
+
+        const DirectoryEntry& e = entries[size_t(index)];
+        const size_t bytes = clusterBytes(e);
+        uchar* data = file.map(qint64(e.offset), qint64(bytes));
+        if (!data)
+        {
+            qDebug() << __FUNCTION__ << "failed to map cluster" << index;
+            return nullptr;
+        }
+
+        std::shared_ptr<Mesh> mesh = std::make_shared<Mesh>();
+        mesh->vertices.resize(e.vertexCount);
+        mesh->indices.resize(e.indexCount);
+
+        std::vector<float> vertex(VERTEX_FLOATS);
+        const uchar* p = data;
+        for (Vertex& v : mesh->vertices)
+        {
+            std::memcpy(vertex.data(), p, VERTEX_FLOATS * sizeof(float));
+            unpackVertex(vertex.data(), v);
+            p += VERTEX_FLOATS * sizeof(float);
+        }
+
+        for (unsigned& i : mesh->indices)
+        {
+            uint16_t local;
+            std::memcpy(&local, p, sizeof(uint16_t));
+            i = local;
+            p += sizeof(uint16_t);
+        }
+        file.unmap(data);
+
+        // A corrupted cluster must not make the rasterizer read past
+        // the vertices.
+        for (unsigned i : mesh->indices)
+        {
+            if (i >= e.vertexCount)
+            {
+                qDebug() << __FUNCTION__ << "invalid index in cluster" << index;
+                return nullptr;
+            }
+        }
+
+        const size_t meshBytes = mesh->vertices.size() * sizeof(Vertex) +
+                                 mesh->indices.size()  * sizeof(unsigned);
+        resident.push_front({ index, mesh, meshBytes });
+        residentMap[index] = resident.begin();
+        residentSize += meshBytes;
+
+        // Release the least recently used clusters, the cluster just
+        // loaded is always kept.
+        while (residentSize > residentBudget && resident.size() > 1)
+        {
+            const Resident& r = resident.back();
+            residentSize -= r.bytes;
+            residentMap.erase(r.index);
+            resident.pop_back();
+        }
+
+        return mesh;
+    }
+
+    size_t residentBudget;
+    size_t residentSize = 0;
+    mutable std::mutex mutex;
+    QFile file;
+    std::vector<DirectoryEntry> entries;
+    std::vector<Cluster> clusters;
+    std::list<Resident> resident;
+    std::unordered_map<int, std::list<Resident>::iterator> residentMap;
+};
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+StreamedMesh::StreamedMesh(size_t residentBudget)
+    : impl(std::make_shared<Impl>(residentBudget))
+{}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+bool StreamedMesh::open(const QString& filepath)
+{ return impl->open(filepath); }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+bool StreamedMesh::isOpen() const
+{ return !impl->clusters.empty(); }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+int StreamedMesh::clusterCount() const
+{ return int(impl->clusters.size()); }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+const StreamedMesh::Cluster& StreamedMesh::cluster(int index) const
+{ return impl->clusters[size_t(index)]; }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+std::shared_ptr<const Mesh> StreamedMesh::load(int index) const
+{ return impl->load(index); }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+size_t StreamedMesh::residentSize() const
+{
+    std::lock_guard<std::mutex> lock(impl->mutex);
+    return impl->residentSize;
+}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+struct StreamedMeshWriter::Impl
+{
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    Impl(int clusterTriangles)
+        : clusterTriangles(std::max(1, std::min(clusterTriangles,
+                                                MAX_CLUSTER_TRIANGLES)))
+    {}
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    bool begin(const QString& filepath)
+    {
+        entries.clear();
+        resetCluster();
+        ok = true;
+
+        file.close();
+        file.setFileName(filepath);
+        if (!file.open(QIODevice::WriteOnly))
+        {
+            qDebug() << __FUNCTION__ << "failed to open" << filepath;
+            ok = false;
+            return false;
+        }
+
+        // Placeholder, written again in end()
+        Header header = {};
+        write(&header, sizeof(Header));
+        return ok;
+    }
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    bool add(const Mesh& mesh)
+    {
+        if (!ok || !file.isOpen())
+            return false;
+
+        const size_t vertexCount = mesh.vertices.size();
+        for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3)
+        {
+            const unsigned* tri = &mesh.indices[i];
+            if (tri[0] >= vertexCount ||
+                tri[1] >= vertexCount ||
+                tri[2] >= vertexCount)
+            {
+                continue;
+            }
+
+            for (int c = 0; c < 3; ++c)
+            {
+                auto it = localIndex.find(tri[c]);
+                if (it == localIndex.end())
+                {
+                    const Vertex& v = mesh.vertices[tri[c]];
+                    const uint16_t local = uint16_t(localIndex.size());
+                    it = localIndex.emplace(tri[c], local).first;
+
+                    vertices.resize(vertices.size() + VERTEX_FLOATS);
+                    packVertex(v, vertices.data() + vertices.size() - VERTEX_FLOATS);
+                    bbMin = glm::min(bbMin, v.position);
+                    bbMax = glm::max(bbMax, v.position);
+                }
+                indices.push_back(it->second);
+            }
+
+            if (int(indices.size()) >= clusterTriangles * 3)
+                flush();
+        }
+
+        // Clusters do not span meshes, local indices refer to the
+        // vertices of one mesh.
+        flush();
+        return ok;
+    }
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    bool end()
+    {
+        if (!file.isOpen())
+            return false;
+
+        flush();
+
+        Header header;
+        std::memcpy(header.magic, STREAM_MAGIC, sizeof(header.magic));
+        header.version         = STREAM_VERSION;
+        header.clusterCount    = uint32_t(entries.size());
+        header.directoryOffset = uint64_t(file.pos());
+
+        write(entries.data(), entries.size() * sizeof(DirectoryEntry));
+        if (ok && !file.seek(0))
+            ok = false;
+        write(&header, sizeof(Header));
+        file.close();
+
+        if (!ok)
+            qDebug() << __FUNCTION__ << "failed to write" << file.fileName();
+        entries.clear();
+        return ok;
+    }
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    void flush()
+    {
+        if (indices.empty())
+            return;
+
+        DirectoryEntry e;
+        e.offset      = uint64_t(file.pos());
+        e.vertexCount = uint32_t(vertices.size() / VERTEX_FLOATS);
+        e.indexCount  = uint32_t(indices.size());
+        for (int c = 0; c < 3; ++c)
+        {
+            e.min[c] = float(bbMin[c]);
+            e.max[c] = float(bbMax[c]);
+        }
+
+        write(vertices.data(), vertices.size() * sizeof(float));
+        write(indices.data(),  indices.size()  * sizeof(uint16_t));
+        entries.push_back(e);
+        resetCluster();
+    }
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    void resetCluster()
+    {
+        vertices.clear();
+        indices.clear();
+        localIndex.clear();
+        bbMin = glm::dvec3( std::numeric_limits<double>::max());
+        bbMax = glm::dvec3(-std::numeric_limits<double>::max());
+    }
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    void write(const void* data, size_t bytes)
+    {
+        if (ok && bytes > 0)
+            ok = file.write(static_cast<const char*>(data), qint64(bytes)) == qint64(bytes);
+    }
+
+    int clusterTriangles;
+    bool ok = false;
+    QFile file;
+    std::vector<DirectoryEntry> entries;
+    std::vector<float> vertices;
+    std::vector<uint16_t> indices;
+    std::unordered_map<unsigned, uint16_t> localIndex;
+    glm::dvec3 bbMin;
+    glm::dvec3 bbMax;
+};
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+StreamedMeshWriter::StreamedMeshWriter(int clusterTriangles)
+    : impl(std::make_shared<Impl>(clusterTriangles))
+{}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+bool StreamedMeshWriter::begin(const QString& filepath)
+{ return impl->begin(filepath); }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+bool StreamedMeshWriter::add(const Mesh& mesh)
+{ return impl->add(mesh); }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+bool StreamedMeshWriter::end()
+{ return impl->end(); }
+
+} // namespace rasperi
+} // namespace kuu
@@ -0,0 +1,84 @@
+/* ---------------------------------------------------------------- *
+   Antti Jumpponen <kuumies@gmail.com>
+   The definition of kuu::rasperi::StreamedMesh and
+   kuu::rasperi::StreamedMeshWriter classes.
+ * ---------------------------------------------------------------- */
+ 
+#pragma once
+
+#include <memory>
+#include <glm/vec3.hpp>
+#include "rasperi_mesh.h"
+
+class QString;
+
+namespace kuu
+{
+namespace rasperi
+{
+
+/* ---------------------------------------------------------------- *
+   A triangle mesh that is stored in a file as fixed size clusters
+   and loaded one cluster at a time. Only the bytes of the cluster
+   being loaded are mapped into memory. The vertices are stored as
+   floats and the indices as 16-bit cluster local indices.
+
+   Loaded clusters are kept in a cache until the resident budget
+   is exceeded, then the least recently used clusters are released.
+   A cluster that is still referenced by the caller stays alive
+   until it is released by the caller.
+ * ---------------------------------------------------------------- */
+class StreamedMesh
+{
+public:
+    struct Cluster
+    {
+        glm::dvec3 min;
+        glm::dvec3 max;
+        int vertexCount;
+        int indexCount;
+    };
+
+    StreamedMesh(size_t residentBudget = size_t(64) << 20);
+
+    bool open(const QString& filepath);
+    bool isOpen() const;
+
+    int clusterCount() const;
+    const Cluster& cluster(int index) const;
+
+    // Returns the cluster as a mesh or null if it cannot be read.
+    // Thread-safe.
+    std::shared_ptr<const Mesh> load(int index) const;
+
+    // Bytes of the loaded clusters in the cache.
+    size_t residentSize() const;
+
+private:
+    struct Impl;
+    std::shared_ptr<Impl> impl;
+};
+
+/* ---------------------------------------------------------------- *
+   Writes a streamed mesh file. Meshes are added one after another,
+   only the cluster being built is kept in the memory, so a mesh
+   larger than the memory can be written by adding it in parts.
+ * ---------------------------------------------------------------- */
+class StreamedMeshWriter
+{
+public:
+    // Cluster triangle count is clamped into [1, 21845] so that the
+    // local indices fit into 16 bits.
+    StreamedMeshWriter(int clusterTriangles = 4096);
+
+    bool begin(const QString& filepath);
+    bool add(const Mesh& mesh);
+    bool end();
+
+private:
+    struct Impl;
+    std::shared_ptr<Impl> impl;
+};
+
+} // namespace rasperi
+} // namespace kuu
@@ -4,155 +4,377 @@
  * ---------------------------------------------------------------- */
  
 #include "rasperi_texture_2d.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
 
 namespace kuu
 {
 namespace rasperi
 {
+namespace
+{
 
 /* ------------------------------------------------------------ *
+   Radiance .hdr file. The file is memory mapped (or read with
+   a single call if the mapping fails) and the scanline offsets
+   are indexed so that scanlines can be decoded in parallel.
+
    See "Picture File Format (.pic suffix)" from
    http://radsite.lbl.gov/radiance/refer/filefmts.pdf
    Search google with "adaptive run-length encoded" to find
    "Graphics Gems II" page 89
  * ------------------------------------------------------------ */
-Texture2D<double, 4> readHdr(const QString& filepath)
+class HdrFile
 {
-    if (!QFile::exists(filepath))
+public:
+    /* -------------------------------------------------------- *
+     * -------------------------------------------------------- */
+    bool open(const QString& filepath)
     {
-        qDebug() << __FUNCTION__ << "file does not exits" << filepath;
-        return Texture2D<double, 4>();
+        if (!QFile::exists(filepath))
+        {
+            qDebug() << __FUNCTION__ << "file does not exits" << filepath;
+            return false;
+        }
+
+        file.setFileName(filepath);
+        if (!file.open(QIODevice::ReadOnly))
+        {
+            qDebug() << __FUNCTION__ << "failed to open file" << filepath;
+            return false;
+        }
+
+        size = size_t(file.size());
+        data = file.map(0, file.size());
+        if (!data)
+        {
+            buffer = file.readAll();
+            data = reinterpret_cast<const uchar*>(buffer.constData());
+            size = size_t(buffer.size());
+        }
+
+        if (!readHeader())
+        {
+            qDebug() << __FUNCTION__ << "invalid header" << filepath;
+            return false;
+        }
+
+        if (!indexScanlines())
+        {
+            qDebug() << __FUNCTION__ << "invalid scanline data" << filepath;
+            return false;
+        }
+
+        return true;
     }
 
-    QFile file(filepath);
-    if (!file.open(QIODevice::ReadOnly))
+    /* -------------------------------------------------------- *
+       Decodes the rows [first, last) into RGBE pixels. The RGBE
+       pixel is written to dst with the given callback.
+     * -------------------------------------------------------- */
+    template<typename Write>
+    void decode(int first, int last, Write write) const
     {
-        qDebug() << __FUNCTION__ << "failed to open file" << filepath;
-        return Texture2D<double, 4>();
+        #pragma omp parallel
+        {
+            std::vector<uchar> scanline(size_t(width) * 4);
+
+            #pragma omp for
+            for (int y = first; y < last; ++y)
+            {
+                decodeScanline(y, scanline.data());
+
+                const uchar* r = scanline.data();
+                const uchar* g = r + width;
+                const uchar* b = g + width;
+                const uchar* e = b + width;
+                for (int x = 0; x < width; ++x)
+                    write(y, x, r[x], g[x], b[x], e[x]);
+            }
+        }
     }
 
-    // Read header. An empty line indicates the end of it. Header
-    // always starts with identified "#?RADIANCE"
-    QByteArray id = file.readLine();
-    if (QString::fromLocal8Bit(id) != "#?RADIANCE\n")
+    int width  = 0;
+    int height = 0;
+
+private:
+    /* -------------------------------------------------------- *
+     * -------------------------------------------------------- */
+    bool readLine(QByteArray& line)
     {
-        qDebug() << __FUNCTION__ << "ID is not valid" << filepath;
-        return Texture2D<double, 4>();
+        const uchar* start = data + pos;
+        const void* nl = std::memchr(start, '\n', size - pos);
+        if (!nl)
+            return false;
+
+        const size_t length = size_t(static_cast<const uchar*>(nl) - start);
+        line = QByteArray(reinterpret_cast<const char*>(start), int(length));
+        pos += length + 1;
+        return true;
     }
 
-    while (!file.atEnd())
+    /* -------------------------------------------------------- *
+       Header always starts with identifier "#?RADIANCE" and an
+       empty line indicates the end of it. The resolution line
+       follows the header.
+     * -------------------------------------------------------- */
+    bool readHeader()
     {
-        QByteArray option = file.readLine();
-        QString optionStr = QString::fromLocal8Bit(option);
-        if (optionStr == "\n") // header end
-            break;
-        if (option.at(0) == '#') // comment
-            continue;
-
-        QStringList parts = QString::fromLocal8Bit(option).split("=");
-        if (parts.size() != 2)
-            continue;
-        QString name  = parts[0];
-        QString value = parts[1];
-        //qDebug() << name << value;
-        if (name == "FORMAT")
+        QByteArray line;
+        if (!readLine(line) || line != "#?RADIANCE")
+            return false;
+
+        while (readLine(line))
         {
-            if (value != "32-bit_rle_rgbe\n")
+            if (line.isEmpty()) // header end
+                break;
+            if (line.at(0) == '#') // comment
+                continue;
+
+            const int eq = line.indexOf('=');
+            if (eq < 0)
+                continue;
+            if (line.left(eq) == "FORMAT" &&
+                line.mid(eq + 1) != "32-bit_rle_rgbe")
             {
-                qDebug() << __FUNCTION__ << "Format is not 32-bit RLE RGBE" << filepath;
-                return Texture2D<double, 4>();
+                qDebug() << __FUNCTION__ << "Format is not 32-bit RLE RGBE";
+                return false;
             }
         }
-    }
 
-    // Read coodinate axes
-    QByteArray axes = file.readLine();
-    QString axesStr = QString::fromLocal8Bit(axes);
-
-    // Decode RLE data.
-    // [2][2][run][values][run][values][run][values]...
-    std::vector<std::vector<uchar>> scanlines;
-    while(!file.atEnd())
-    {
-        // Read scanline indicator
-        std::array<uchar, 2> indicator;
-        file.read(reinterpret_cast<char*>(indicator.data()), 2);
-        if (indicator[0] != 2 || indicator[1] != 2)
+        // Only the standard orientation is supported.
+        if (!readLine(line))
+            return false;
+        char yAxis[3] = {};
+        char xAxis[3] = {};
+        if (std::sscanf(line.constData(), "%2s %d %2s %d",
+                        yAxis, &height, xAxis, &width) != 4 ||
+            std::strcmp(yAxis, "-Y") != 0 ||
+            std::strcmp(xAxis, "+X") != 0)
         {
-            qDebug() << __FUNCTION__ << "Invalid scanline"
-                     << QString::number(indicator[0], 16)
-                     << QString::number(indicator[1], 16);
-            return Texture2D<double, 4>();
+            qDebug() << __FUNCTION__ << "Unsupported resolution" << line;
+            return false;
         }
 
-        // Read scanline length
-        std::array<uchar, 2> length;
-        file.read(reinterpret_cast<char*>(length.data()), 2);
-        std::swap(length[0], length[1]);
-        uint16_t width = *reinterpret_cast<uint16_t*>(length.data());
+        return width > 0 && height > 0;
+    }
 
-        // First is whole r scanline, then whole g and then b and then e
-        int read = 0;
-        std::vector<uchar> scanline;
-        while(read < width * 4)
+    /* -------------------------------------------------------- *
+       Walks the run-length encoded data without decoding to find
+       where each scanline starts.
+     * -------------------------------------------------------- */
+    bool indexScanlines()
+    {
+        offsets.resize(size_t(height));
+        for (int y = 0; y < height; ++y)
         {
-            uchar run = 0;
-            file.read(reinterpret_cast<char*>(&run), 1);
-           if (run > 128)
+            offsets[size_t(y)] = pos;
+            if (!isRle(pos))
             {
-                // run
-                int c = run - 128;
-                uchar data;
-                file.read(reinterpret_cast<char*>(&data), 1);
-                for (int j = 0; j < c; ++j)
-                    scanline.push_back(data);
-                read += c;
-
+                // Flat scanline
+                pos += size_t(width) * 4;
+                if (pos > size)
+                    return false;
+                continue;
             }
-            else
+
+            pos += 4;
+            for (int c = 0; c < 4; ++c)
             {
-                // dump
-                uchar l = run;
-                std::vector<uchar> data;
-                data.resize(l);
-                file.read(reinterpret_cast<char*>(data.data()), l);
-                scanline.insert(scanline.end(), data.begin(), data.end());
-                read += l;
+                int read = 0;
+                while (read < width)
+                {
+                    if (pos >= size)
+                        return false;
+                    const uchar run = data[pos++];
+                    if (run > 128)
+                    {
+                        read += run - 128;
+                        pos += 1;
+                    }
+                    else
+                    {
+                        read += run;
+                        pos += run;
+                    }
+                }
+                if (read != width || pos > size)
+                    return false;
             }
         }
+        return true;
+    }
+
+    /* -------------------------------------------------------- *
+     * -------------------------------------------------------- */
+    bool isRle(size_t p) const
+    {
+        if (width < 8 || width > 0x7fff || p + 4 > size)
+            return false;
+        return data[p] == 2 && data[p + 1] == 2 &&
+               ((data[p + 2] << 8) | data[p + 3]) == width;
+    }
+
+    /* -------------------------------------------------------- *
+       Decodes a scanline into planar r, g, b and e components.
+     * -------------------------------------------------------- */
+    void decodeScanline(int y, uchar* out) const
+    {
+        size_t p = offsets[size_t(y)];
+        if (!isRle(p))
+        {
+            for (int x = 0; x < width; ++x, p += 4)
+                for (int c = 0; c < 4; ++c)
+                    out[c * width + x] = data[p + size_t(c)];
+            return;
+        }
 
-        scanlines.push_back(scanline);
+        // [2][2][width][run][values][run][values]...
+        p += 4;
+        for (int c = 0; c < 4; ++c)
+        {
+            uchar* dst = out + c * width;
+            int read = 0;
+            while (read < width)
+            {
+                const uchar run = data[p++];
+                if (run > 128)
+                {
+                    // run
+                    const int count = run - 128;
+                    std::memset(dst + read, data[p++], size_t(count));
+                    read += count;
+                }
+                else
+                {
+                    // dump
+                    std::memcpy(dst + read, data + p, run);
+                    p += run;
+                    read += run;
+                }
+            }
+        }
     }
 
-    if (scanlines.empty())
+    QFile file;
+    QByteArray buffer;
+    const uchar* data = nullptr;
+    size_t size = 0;
+    size_t pos  = 0;
+    std::vector<size_t> offsets;
+};
+
+/* ------------------------------------------------------------ *
+   Exponent scale table. Zero exponent is a black pixel.
+ * ------------------------------------------------------------ */
+struct HdrExponents
+{
+    HdrExponents()
     {
-        std::cerr << "No scanlines" << std::endl;
-        return Texture2D<double, 4>();
+        scale[0] = 0.0;
+        for (int e = 1; e < 256; ++e)
+            scale[e] = std::ldexp(1.0, e - 128 + 8) * 0.0001;
     }
 
-    int imgWidth  = int(scanlines[0].size()) / 4;
-    int imgHeight = int(scanlines.size());
-    std::vector<double> pixels;
+    double scale[256];
+};
+
+static const HdrExponents hdrExponents;
 
-    for (const std::vector<uchar>& scanline : scanlines)
+/* ------------------------------------------------------------ *
+ * ------------------------------------------------------------ */
+template<typename T>
+Texture2D<T, 4> readHdrFloatingPoint(const QString& filepath)
+{
+    HdrFile hdr;
+    if (!hdr.open(filepath))
+        return Texture2D<T, 4>();
+
+    Texture2D<T, 4> out(hdr.width, hdr.height);
+    T* pixels = out.pixels().data();
+    const size_t width = size_t(hdr.width);
+    hdr.decode(0, hdr.height, [&](int y, int x, uchar r, uchar g, uchar b, uchar e)
     {
-        const size_t padding = scanline.size() / 4;
-        for (size_t i = 0; i < padding; ++i)
+        const double s = hdrExponents.scale[e];
+        T* dst = pixels + (size_t(y) * width + size_t(x)) * 4;
+        dst[0] = T((r + 0.5) * s);
+        dst[1] = T((g + 0.5) * s);
+        dst[2] = T((b + 0.5) * s);
+        dst[3] = T(1.0); // alpha
+    });
+    return out;
+}
+
+} // anonymous namespace
+
+/* ------------------------------------------------------------ *
+ * ------------------------------------------------------------ */
+Texture2D<double, 4> readHdr(const QString& filepath)
+{ return readHdrFloatingPoint<double>(filepath); }
+
+/* ------------------------------------------------------------ *
+ * ------------------------------------------------------------ */
+Texture2D<float, 4> readHdrFloat(const QString& filepath)
+{ return readHdrFloatingPoint<float>(filepath); }
+
+/* ------------------------------------------------------------ *
+ * ------------------------------------------------------------ */
+Texture2D<uchar, 4> readHdrRgbe(const QString& filepath)
+{
+    HdrFile hdr;
+    if (!hdr.open(filepath))
+        return Texture2D<uchar, 4>();
+
+    Texture2D<uchar, 4> out(hdr.width, hdr.height);
+    uchar* pixels = out.pixels().data();
+    const size_t width = size_t(hdr.width);
+    hdr.decode(0, hdr.height, [&](int y, int x, uchar r, uchar g, uchar b, uchar e)
+    {
+        uchar* dst = pixels + (size_t(y) * width + size_t(x)) * 4;
+        dst[0] = r;
+        dst[1] = g;
+        dst[2] = b;
+        dst[3] = e;
+    });
+    return out;
+}
+
+/* ------------------------------------------------------------ *
+ * ------------------------------------------------------------ */
+bool readHdr(const QString& filepath,
+             int bandHeight,
+             const HdrBandCallback& callback)
+{
+    HdrFile hdr;
+    if (!hdr.open(filepath))
+        return false;
+
+    bandHeight = std::max(1, std::min(bandHeight, hdr.height));
+    const size_t width = size_t(hdr.width);
+
+    for (int first = 0; first < hdr.height; first += bandHeight)
+    {
+        const int last = std::min(first + bandHeight, hdr.height);
+        Texture2D<double, 4> band(hdr.width, last - first);
+
+        double* pixels = band.pixels().data();
+        hdr.decode(first, last, [&](int y, int x, uchar r, uchar g, uchar b, uchar e)
         {
-            uchar r = scanline[              i];
-            uchar g = scanline[1 * padding + i];
-            uchar b = scanline[2 * padding + i];
-            uchar e = scanline[3 * padding + i];
-
-            double exponent = std::ldexp(1.0, int(e - 128 + 8));
-            pixels.push_back(double((r + 0.5) * exponent) * 0.0001);
-            pixels.push_back(double((g + 0.5) * exponent) * 0.0001);
-            pixels.push_back(double((b + 0.5) * exponent) * 0.0001);
-            pixels.push_back(1.0); // alpha
-        }
+            const double s = hdrExponents.scale[e];
+            double* dst = pixels + (size_t(y - first) * width + size_t(x)) * 4;
+            dst[0] = (r + 0.5) * s;
+            dst[1] = (g + 0.5) * s;
+            dst[2] = (b + 0.5) * s;
+            dst[3] = 1.0; // alpha
+        });
+
+        callback(band, first, hdr.height);
     }
 
-    return Texture2D<double, 4>(imgWidth, imgHeight, pixels);
+    return true;
 }
 
 } // namespace rasperi
@@ -6,6 +6,7 @@
 #pragma once
 
 #include <array>
+#include <functional>
 #include <iostream>
 #include <memory>
 #include <QtCore/QDataStream>
@@ -48,6 +49,12 @@ public:
     bool isNull() const
     { return d->width == 0 || d->height == 0; }
 
+    /* ------------------------------------------------------------ *
+       Returns true if no other texture shares the pixels.
+     * ------------------------------------------------------------ */
+    bool isDetached() const
+    { return d.use_count() == 1; }
+
     /* ------------------------------------------------------------ *
      * ------------------------------------------------------------ */
     int width() const
@@ -116,6 +123,26 @@ public:
         return QImage();
     }
 
+    /* ------------------------------------------------------------ *
+       Resizes the texture, the pixels are undefined afterwards. The
+       memory is reused if the pixels fit into it and extra room is
+       reserved when growing so that e.g. a window being enlarged
+       does not reallocate on every step. Mipmaps are removed.
+     * ------------------------------------------------------------ */
+    void resize(int width, int height)
+    {
+        if (!isDetached())
+            d = std::make_shared<Data>();
+
+        const size_t size = size_t(width) * size_t(height) * C;
+        if (size > d->pixels.capacity())
+            d->pixels.reserve(size + size / 4);
+        d->pixels.resize(size);
+        d->width  = width;
+        d->height = height;
+        d->mipmaps.clear();
+    }
+
     /* ------------------------------------------------------------ *
      * ------------------------------------------------------------ */
     void clear(const std::array<T, C>& value)
@@ -306,8 +333,30 @@ private:
 };
 
 /* ------------------------------------------------------------ *
+   Reads a Radiance .hdr file. Scanlines are decoded in parallel
+   straight into the returned texture.
  * ------------------------------------------------------------ */
 Texture2D<double, 4> readHdr(const QString& filepath);
 
+/* ------------------------------------------------------------ *
+   Reads a Radiance .hdr file into a more compact format, either
+   into 32-bit floats or into the raw RGBE pixels of the file.
+ * ------------------------------------------------------------ */
+Texture2D<float, 4> readHdrFloat(const QString& filepath);
+Texture2D<uchar, 4> readHdrRgbe(const QString& filepath);
+
+/* ------------------------------------------------------------ *
+   Reads a Radiance .hdr file in horizontal bands from top to
+   bottom. The callback gets the band, its first row and the
+   height of the whole image. Only one band is in the memory at
+   a time.
+ * ------------------------------------------------------------ */
+using HdrBandCallback = std::function<void(const Texture2D<double, 4>& band,
+                                           int row,
+                                           int height)>;
+bool readHdr(const QString& filepath,
+             int bandHeight,
+             const HdrBandCallback& callback);
+
 } // namespace rasperi
 } // namespace kuu
@@ -62,12 +62,19 @@ public:
      * ------------------------------------------------------------ */
     bool generateMipmaps() const
     {
-        MipmapGenerator mipmapGenerator;
+        std::array<bool, 6> ok;
 
-        bool ok = true;
-        for (size_t f = 0; f < d->faces.size(); ++f)
-            ok &= mipmapGenerator.generate(d->faces[f]);
-        return ok;
+        #pragma omp parallel for
+        for (int f = 0; f < 6; ++f)
+        {
+            MipmapGenerator mipmapGenerator;
+            ok[size_t(f)] = mipmapGenerator.generate(d->faces[size_t(f)]);
+        }
+
+        for (bool faceOk : ok)
+            if (!faceOk)
+                return false;
+        return true;
     }
 
     /* ------------------------------------------------------------ *
@@ -4,8 +4,7 @@
  * ---------------------------------------------------------------- */
  
 #include "rasperi_texture_cube_mapping.h"
-#include <iostream>
-#include <glm/common.hpp>
+#include <cmath>
 
 namespace kuu
 {
@@ -15,199 +14,94 @@ namespace texture_cube_mapping
 {
 
 /* ---------------------------------------------------------------- *
+   Face layout. Major axis and its sign, and the axes and signs
+   that are mapped into u and v.
+
+    0: +X, u goes from +z to -z, v goes from -y to +y
+    1: -X, u goes from -z to +z, v goes from -y to +y
+    2: -Y, u goes from -x to +x, v goes from -z to +z
+    3: +Y, u goes from -x to +x, v goes from +z to -z
+    4: +Z, u goes from -x to +x, v goes from -y to +y
+    5: -Z, u goes from +x to -x, v goes from -y to +y
  * ---------------------------------------------------------------- */
-glm::dvec3 mapTextureCoordinate(TextureCoordinate tc)
+struct Face
 {
-    // convert range 0 to 1 to -1 to 1
-    double uc = 2.0 * tc.uv.x - 1.0;
-    double vc = 2.0 * tc.uv.y - 1.0;
-
-    glm::dvec3 out;
-    switch (tc.faceIndex)
-    {
-        case 0: out.x =  1.0; out.y =   vc; out.z =  -uc; break;	// POSITIVE X
-        case 1: out.x = -1.0; out.y =   vc; out.z =   uc; break;	// NEGATIVE X
-        case 2: out.x =   uc; out.y =  1.0; out.z =  -vc; break;	// POSITIVE Y
-        case 3: out.x =   uc; out.y = -1.0; out.z =   vc; break;	// NEGATIVE Y
-        case 4: out.x =   uc; out.y =   vc; out.z =  1.0; break;	// POSITIVE Z
-        case 5: out.x =  -uc; out.y =   vc; out.z = -1.0; break;	// NEGATIVE Z
-    }
-    return out;
-}
+    int axis;
+    double sign;
+    int uAxis;
+    double uSign;
+    int vAxis;
+    double vSign;
+};
+
+static const Face faces[6] =
+{
+    { 0,  1.0, 2, -1.0, 1,  1.0 },
+    { 0, -1.0, 2,  1.0, 1,  1.0 },
+    { 1, -1.0, 0,  1.0, 2,  1.0 },
+    { 1,  1.0, 0,  1.0, 2, -1.0 },
+    { 2,  1.0, 0,  1.0, 1,  1.0 },
+    { 2, -1.0, 0, -1.0, 1,  1.0 },
+};
 
 /* ---------------------------------------------------------------- *
+   Face index of major axis [x, y, z] and negative sign [0, 1].
  * ---------------------------------------------------------------- */
-TextureCoordinate doIt(const glm::dvec3& p)
+static const int faceIndices[3][2] =
 {
-    TextureCoordinate out;
+    { 0, 1 },
+    { 3, 2 },
+    { 4, 5 },
+};
 
-    // Find the largest magnitude
-    glm::dvec3 ap = glm::abs(p);
-    if (ap.x > ap.y && ap.x > ap.z)
-    {
-        glm::dvec3 uv = p / ap.x;
-        if (p.x >= 0.0)
-        {
-            out.faceIndex = 0;
-            out.uv.x = 0.5 * (uv.z + 1.0);
-            out.uv.y = 0.5 * (uv.y + 1.0);
-        }
-        else
-        {
-            out.faceIndex = 1;
-            out.uv.x = 0.5 * (uv.z + 1.0);
-            out.uv.y = 0.5 * (uv.y + 1.0);
-        }
-    }
-    if (ap.y > ap.x && ap.y > ap.z)
-    {
-        glm::dvec3 uv = p / ap.y;
-        if (p.y >= 0.0)
-        {
-            out.faceIndex = 2;
-            out.uv.x = 0.5 * (uv.x + 1.0);
-            out.uv.y = 0.5 * (uv.z + 1.0);
-        }
-        else
-        {
-            out.faceIndex = 3;
-            out.uv.x = 0.5 * (uv.x + 1.0);
-            out.uv.y = 0.5 * (uv.z + 1.0);
-        }
-    }
-    if (ap.z > ap.x && ap.z > ap.y)
-    {
-        glm::dvec3 uv = p / ap.z;
-        if (p.z >= 0.0)
-        {
-            out.faceIndex = 4;
-            out.uv.x = 0.5 * (uv.x + 1.0);
-            out.uv.y = 0.5 * (uv.y + 1.0);
-        }
-        else
-        {
-            out.faceIndex = 5;
-            out.uv.x = 0.5 * (uv.x + 1.0);
-            out.uv.y = 0.5 * (uv.y + 1.0);
-        }
-    }
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+glm::dvec3 mapTextureCoordinate(const TextureCoordinate& tc)
+{
+    const Face& face = faces[tc.faceIndex];
 
+    // convert range 0 to 1 to -1 to 1
+    glm::dvec3 out;
+    out[face.axis]  = face.sign;
+    out[face.uAxis] = (2.0 * tc.uv.x - 1.0) * face.uSign;
+    out[face.vAxis] = (2.0 * tc.uv.y - 1.0) * face.vSign;
     return out;
 }
 
-TextureCoordinate sampleCube(const glm::dvec3 v)
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+glm::dvec3 mapTexel(int faceIndex, int x, int y, int size)
 {
-    TextureCoordinate out;
-    glm::dvec3 vAbs = abs(v);
-    double ma;
-    if(vAbs.z >= vAbs.x && vAbs.z >= vAbs.y)
-    {
-        out.faceIndex = v.z < 0.0 ? 5.0 : 4.0;
-        ma = 0.5 / vAbs.z;
-        out.uv = glm::dvec2(v.z < 0.0 ? -v.x : v.x, -v.y);
-    }
-    else if(vAbs.y >= vAbs.x)
-    {
-        out.faceIndex = v.y < 0.0 ? 3.0 : 2.0;
-        ma = 0.5 / vAbs.y;
-        out.uv = glm::dvec2(v.x, v.y < 0.0 ? -v.z : v.z);
-    }
-    else
-    {
-        out.faceIndex = v.x < 0.0 ? 1.0 : 0.0;
-        ma = 0.5 / vAbs.x;
-        out.uv = glm::dvec2(v.x < 0.0 ? v.z : -v.z, -v.y);
-    }
-    out.uv = out.uv * ma + 0.5;
-    return out;
+    TextureCoordinate tc;
+    tc.faceIndex = faceIndex;
+    tc.uv.x = (x + 0.5) / size;
+    tc.uv.y = 1.0 - (y + 0.5) / size;
+    return mapTextureCoordinate(tc);
 }
 
 /* ---------------------------------------------------------------- *
  * ---------------------------------------------------------------- */
 TextureCoordinate mapPoint(const glm::dvec3& p)
 {
-    //return sampleCube(p);
-    double absX = fabs(p.x);
-    double absY = fabs(p.y);
-    double absZ = fabs(p.z);
-
-    int isXPositive = p.x > 0 ? 1 : 0;
-    int isYPositive = p.y > 0 ? 1 : 0;
-    int isZPositive = p.z > 0 ? 1 : 0;
-
-    double maxAxis = 0.0, uc = 0.0, vc = 0.0;
-
-    int index = 0;
-    // POSITIVE X
-    if (isXPositive && absX >= absY && absX >= absZ)
-    {
-
-        // u (0 to 1) goes from +z to -z
-        // v (0 to 1) goes from -y to +y
-        maxAxis = absX;
-        uc = -p.z;
-        vc =  p.y;
-        index = 0;
-    }
+    const double absX = std::fabs(p.x);
+    const double absY = std::fabs(p.y);
+    const double absZ = std::fabs(p.z);
 
-    // NEGATIVE X
-    if (!isXPositive && absX >= absY && absX >= absZ)
-    {
-        //return doIt(p);
+    // Select the major axis, on a tie z wins over y and y over x.
+    const int zMajor = int(absZ >= absX) & int(absZ >= absY);
+    const int yMajor = (1 - zMajor) & int(absY >= absX) & int(absY >= absZ);
+    const int axis   = 2 * zMajor + yMajor;
+    const int negative = int(!(p[axis] > 0.0));
 
-        // u (0 to 1) goes from -z to +z
-        // v (0 to 1) goes from -y to +y
-        maxAxis = absX;
-        uc = p.z;
-        vc = p.y;
-        index = 1;
-    }
-    // POSITIVE Y
-    if (isYPositive && absY >= absX && absY >= absZ)
-    {
-        // u (0 to 1) goes from -x to +x
-        // v (0 to 1) goes from +z to -z
-        maxAxis = absY;
-        uc =  p.x;
-        vc = -p.z;
-        index = 3;
-    }
-    // NEGATIVE Y
-    if (!isYPositive && absY >= absX && absY >= absZ)
-    {
-        // u (0 to 1) goes from -x to +x
-        // v (0 to 1) goes from -z to +z
-        maxAxis = absY;
-        uc = p.x;
-        vc = p.z;
-        index = 2;
-    }
-    // POSITIVE Z
-    if (isZPositive && absZ >= absX && absZ >= absY)
-    {
-        // u (0 to 1) goes from -x to +x
-        // v (0 to 1) goes from -y to +y
-        maxAxis = absZ;
-        uc = p.x;
-        vc = p.y;
-        index = 4;
-    }
-    // NEGATIVE Z
-    if (!isZPositive && absZ >= absX && absZ >= absY)
-    {
-        // u (0 to 1) goes from +x to -x
-        // v (0 to 1) goes from -y to +y
-        maxAxis = absZ;
-        uc = -p.x;
-        vc =  p.y;
-        index = 5;
-    }
+    const int index = faceIndices[axis][negative];
+    const Face& face = faces[index];
+    const double maxAxis = std::fabs(p[axis]);
 
     // Convert range from -1 to 1 to 0 to 1
     TextureCoordinate out;
     out.faceIndex = index;
-    out.uv.x = 0.5 * (uc / maxAxis + 1.0);
-    out.uv.y = 0.5 * (vc / maxAxis + 1.0);
+    out.uv.x = 0.5 * (p[face.uAxis] * face.uSign / maxAxis + 1.0);
+    out.uv.y = 0.5 * (p[face.vAxis] * face.vSign / maxAxis + 1.0);
     return out;
 }
 
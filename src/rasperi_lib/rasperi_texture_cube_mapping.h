@@ -24,10 +24,23 @@ struct TextureCoordinate
 };
 
 /* ---------------------------------------------------------------- *
+   Maps a face texture coordinate back into a point on the cube
+   surface. This is the inverse of mapPoint. The uv does not need
+   to be within [0, 1], coordinates outside of the range are on
+   the face plane beyond the face edges.
  * ---------------------------------------------------------------- */
 glm::dvec3 mapTextureCoordinate(const TextureCoordinate& tc);
 
 /* ---------------------------------------------------------------- *
+   Maps a texel center of a face into a point on the cube surface.
+   Texel rows go from top to bottom. The texel can be outside of
+   the face, see mapTextureCoordinate.
+ * ---------------------------------------------------------------- */
+glm::dvec3 mapTexel(int faceIndex, int x, int y, int size);
+
+/* ---------------------------------------------------------------- *
+   Maps a direction into a face texture coordinate. The face is
+   selected with a table lookup instead of per face branches.
  * ---------------------------------------------------------------- */
 TextureCoordinate mapPoint(const glm::dvec3& point);
 
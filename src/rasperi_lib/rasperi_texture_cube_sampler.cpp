@@ -0,0 +1,152 @@
+/* ---------------------------------------------------------------- *
+   Antti Jumpponen <kuumies@gmail.com>
+   The implementation of kuu::rasperi::TextureCubeSampler class.
+ * ---------------------------------------------------------------- */
+ 
+#include "rasperi_texture_cube_sampler.h"
+#include <algorithm>
+#include <cmath>
+#include <glm/common.hpp>
+#include "rasperi_texture_cube_mapping.h"
+
+namespace kuu
+{
+namespace rasperi
+{
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+TextureCubeSampler::TextureCubeSampler()
+    : filter(Filter::Linear)
+{}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+TextureCubeSampler::TextureCubeSampler(
+        const TextureCube<double, 4>& map,
+        Filter filter)
+    : map(map)
+    , filter(filter)
+{
+    if (map.isNull())
+        return;
+
+    const int count = map.mipmapCount() + 1;
+    for (int l = 0; l < count; ++l)
+    {
+        Level level;
+        level.size = map.face(0, size_t(l)).width();
+        for (size_t f = 0; f < 6; ++f)
+            level.faces[f] = map.face(f, size_t(l)).pixels().data();
+        levels.push_back(level);
+    }
+}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+bool TextureCubeSampler::isValid() const
+{ return !levels.empty(); }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+int TextureCubeSampler::levelCount() const
+{ return int(levels.size()); }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+glm::dvec4 TextureCubeSampler::sample(const glm::dvec3& dir, int level) const
+{
+    if (levels.empty())
+        return glm::dvec4(0.0);
+
+    const Level& l = levels[size_t(glm::clamp(level, 0, levelCount() - 1))];
+    const texture_cube_mapping::TextureCoordinate tc =
+        texture_cube_mapping::mapPoint(dir);
+
+    // Texel space, the texel centers are at half-integers.
+    const double x = tc.uv.x         * l.size;
+    const double y = (1.0 - tc.uv.y) * l.size;
+
+    if (filter == Filter::Nearest)
+    {
+        const int px = glm::clamp(int(x), 0, l.size - 1);
+        const int py = glm::clamp(int(y), 0, l.size - 1);
+        return texel(l, tc.faceIndex, px, py);
+    }
+
+    const double sx = x - 0.5;
+    const double sy = y - 0.5;
+    const int x0 = int(std::floor(sx));
+    const int y0 = int(std::floor(sy));
+    const double tx = sx - x0;
+    const double ty = sy - y0;
+
+    glm::dvec4 c00, c10, c01, c11;
+    if (x0 >= 0 && y0 >= 0 && x0 + 1 < l.size && y0 + 1 < l.size)
+    {
+        c00 = texel(l, tc.faceIndex, x0,     y0);
+        c10 = texel(l, tc.faceIndex, x0 + 1, y0);
+        c01 = texel(l, tc.faceIndex, x0,     y0 + 1);
+        c11 = texel(l, tc.faceIndex, x0 + 1, y0 + 1);
+    }
+    else
+    {
+        // Footprint crosses a face edge.
+        c00 = texelWrapped(l, tc.faceIndex, x0,     y0);
+        c10 = texelWrapped(l, tc.faceIndex, x0 + 1, y0);
+        c01 = texelWrapped(l, tc.faceIndex, x0,     y0 + 1);
+        c11 = texelWrapped(l, tc.faceIndex, x0 + 1, y0 + 1);
+    }
+
+    const glm::dvec4 a = c00 * (1.0 - tx) + c10 * tx;
+    const glm::dvec4 b = c01 * (1.0 - tx) + c11 * tx;
+    return a * (1.0 - ty) + b * ty;
+}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+glm::dvec4 TextureCubeSampler::sampleLod(const glm::dvec3& dir, double lod) const
+{
+    if (levels.empty())
+        return glm::dvec4(0.0);
+
+    lod = glm::clamp(lod, 0.0, double(levelCount() - 1));
+    const int l0 = int(std::floor(lod));
+    const int l1 = std::min(l0 + 1, levelCount() - 1);
+    const double t = lod - l0;
+
+    const glm::dvec4 c0 = sample(dir, l0);
+    if (t == 0.0 || l0 == l1)
+        return c0;
+    return glm::mix(c0, sample(dir, l1), t);
+}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+glm::dvec4 TextureCubeSampler::texel(const Level& level, int face, int x, int y) const
+{
+    const double* p = level.faces[size_t(face)] + (y * level.size + x) * 4;
+    return glm::dvec4(p[0], p[1], p[2], p[3]);
+}
+
+/* ---------------------------------------------------------------- *
+   Fetches a texel that might be outside of the face. The texel
+   center is projected on the face plane and then mapped into
+   the face it belongs to.
+ * ---------------------------------------------------------------- */
+glm::dvec4 TextureCubeSampler::texelWrapped(const Level& level, int face, int x, int y) const
+{
+    if (x >= 0 && y >= 0 && x < level.size && y < level.size)
+        return texel(level, face, x, y);
+
+    const glm::dvec3 p = texture_cube_mapping::mapTexel(face, x, y, level.size);
+    const texture_cube_mapping::TextureCoordinate tc =
+        texture_cube_mapping::mapPoint(p);
+
+    const int px = glm::clamp(int(tc.uv.x         * level.size), 0, level.size - 1);
+    const int py = glm::clamp(int((1.0 - tc.uv.y) * level.size), 0, level.size - 1);
+    return texel(level, tc.faceIndex, px, py);
+}
+
+} // namespace rasperi
+} // namespace kuu
@@ -0,0 +1,69 @@
+/* ---------------------------------------------------------------- *
+   Antti Jumpponen <kuumies@gmail.com>
+   The definition of kuu::rasperi::TextureCubeSampler class.
+ * ---------------------------------------------------------------- */
+ 
+#pragma once
+
+#include <array>
+#include <vector>
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+#include "rasperi_texture_cube.h"
+
+namespace kuu
+{
+namespace rasperi
+{
+
+/* ---------------------------------------------------------------- *
+   Samples a cube map with a direction vector. Linear filter is
+   seamless, the bilinear footprint continues over the face edge
+   into the neighbouring face. Mipmap levels are interpolated
+   linearly with a fractional level of detail.
+
+   Texel rows go from top to bottom, i.e. the face v coordinate
+   1.0 is at the first row. The sampler keeps a reference to the
+   cube map data, it is cheap to sample but should be created
+   once per draw instead of once per sample.
+ * ---------------------------------------------------------------- */
+class TextureCubeSampler
+{
+public:
+    enum class Filter
+    {
+        Nearest,
+        Linear
+    };
+
+    TextureCubeSampler();
+    TextureCubeSampler(const TextureCube<double, 4>& map,
+                       Filter filter = Filter::Linear);
+
+    bool isValid() const;
+
+    // Returns the count of levels, the base level included.
+    int levelCount() const;
+
+    // Samples a single level.
+    glm::dvec4 sample(const glm::dvec3& dir, int level = 0) const;
+    // Samples with a fractional level of detail.
+    glm::dvec4 sampleLod(const glm::dvec3& dir, double lod) const;
+
+private:
+    struct Level
+    {
+        int size;
+        std::array<const double*, 6> faces;
+    };
+
+    glm::dvec4 texel(const Level& level, int face, int x, int y) const;
+    glm::dvec4 texelWrapped(const Level& level, int face, int x, int y) const;
+
+    TextureCube<double, 4> map;
+    Filter filter;
+    std::vector<Level> levels;
+};
+
+} // namespace rasperi
+} // namespace kuu
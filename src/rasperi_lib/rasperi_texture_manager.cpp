@@ -0,0 +1,183 @@
+/* ---------------------------------------------------------------- *
+   Antti Jumpponen <kuumies@gmail.com>
+   The implementation of kuu::rasperi::TextureManager class.
+ * ---------------------------------------------------------------- */
+ 
+#include "rasperi_texture_manager.h"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <QtCore/QDebug>
+#include <QtCore/QFileInfo>
+#include <QtGui/QImage>
+
+namespace kuu
+{
+namespace rasperi
+{
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+struct TextureManager::Impl
+{
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    Impl(int threadCount)
+    {
+        if (threadCount <= 0)
+            threadCount = int(std::thread::hardware_concurrency());
+        threadCount = std::max(1, threadCount);
+
+        for (int i = 0; i < threadCount; ++i)
+            workers.emplace_back([this]() { work(); });
+    }
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    ~Impl()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopped = true;
+        }
+        condition.notify_all();
+        for (std::thread& worker : workers)
+            worker.join();
+    }
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    Handle load(const QString& filepath, Format format)
+    {
+        const QString path = QFileInfo(filepath).canonicalFilePath();
+        if (path.isEmpty())
+        {
+            qDebug() << "TextureManager::load: file does not exist"
+                     << filepath;
+
+            std::promise<QImage> promise;
+            promise.set_value(QImage());
+            return promise.get_future().share();
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        const Key key(path, format);
+        auto it = cache.find(key);
+        if (it != cache.end())
+            return it->second;
+
+        std::packaged_task<QImage()> task([path, format]()
+        {
+            return decode(path, format);
+        });
+        Handle handle = task.get_future().share();
+        cache[key] = handle;
+        tasks.push_back(std::move(task));
+        condition.notify_one();
+        return handle;
+    }
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        cache.clear();
+    }
+
+    /* ------------------------------------------------------------ *
+     * ------------------------------------------------------------ */
+    void work()
+    {
+        for (;;)
+        {
+            std::packaged_task<QImage()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [this]()
+                {
+                    return stopped || !tasks.empty();
+                });
+                if (tasks.empty())
+                    return;
+
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    /* ------------------------------------------------------------ *
+       Decodes the image and converts it into a format the sampler
+       can read directly.
+     * ------------------------------------------------------------ */
+    static QImage decode(const QString& path, Format format)
+    {
+        QImage image(path);
+        if (image.isNull())
+        {
+            qDebug() << "TextureManager::load: image file is not valid"
+                     << path;
+            return image;
+        }
+
+        const QImage::Format f = image.format();
+        const bool isGrayscale = f == QImage::Format_Grayscale8;
+        const bool isRgba      = f == QImage::Format_RGB32 ||
+                                 f == QImage::Format_ARGB32;
+
+        switch (format)
+        {
+            case Format::Any:
+                if (!isGrayscale && !isRgba)
+                    image = image.convertToFormat(QImage::Format_ARGB32);
+                break;
+
+            case Format::Rgba:
+                if (!isRgba)
+                    image = image.convertToFormat(QImage::Format_ARGB32);
+                break;
+
+            case Format::Grayscale:
+                if (!isGrayscale)
+                    image = image.convertToFormat(QImage::Format_Grayscale8);
+                break;
+        }
+
+        return image;
+    }
+
+    using Key = std::pair<QString, Format>;
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<std::packaged_task<QImage()>> tasks;
+    std::map<Key, Handle> cache;
+    std::vector<std::thread> workers;
+    bool stopped = false;
+};
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+TextureManager::TextureManager(int threadCount)
+    : impl(std::make_shared<Impl>(threadCount))
+{}
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+TextureManager::Handle TextureManager::load(const QString& filepath,
+                                            Format format)
+{ return impl->load(filepath, format); }
+
+/* ---------------------------------------------------------------- *
+ * ---------------------------------------------------------------- */
+void TextureManager::clear()
+{ impl->clear(); }
+
+} // namespace rasperi
+} // namespace kuu
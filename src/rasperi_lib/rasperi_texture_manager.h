@@ -0,0 +1,56 @@
+/* ---------------------------------------------------------------- *
+   Antti Jumpponen <kuumies@gmail.com>
+   The definition of kuu::rasperi::TextureManager class.
+ * ---------------------------------------------------------------- */
+ 
+#pragma once
+
+#include <future>
+#include <memory>
+
+class QImage;
+class QString;
+
+namespace kuu
+{
+namespace rasperi
+{
+
+/* ---------------------------------------------------------------- *
+   Loads texture images on a pool of worker threads. Images are
+   deduplicated by the canonical file path and the format, so a file
+   that is used by many materials is decoded and converted only
+   once. The returned images are shared, the samplers must not
+   write into them.
+ * ---------------------------------------------------------------- */
+class TextureManager
+{
+public:
+    enum class Format
+    {
+        Any,       // Grayscale8 as is, others as 32-bit RGB(A)
+        Rgba,      // 32-bit RGB(A)
+        Grayscale  // Grayscale8
+    };
+
+    using Handle = std::shared_future<QImage>;
+
+    // Thread count of zero uses the hardware concurrency.
+    TextureManager(int threadCount = 0);
+
+    // Queues the image for loading. Returns the same handle for the
+    // same file and format. The image of the handle is null if the
+    // file does not exist or cannot be decoded.
+    Handle load(const QString& filepath, Format format = Format::Any);
+
+    // Releases the cached images, handles already given out stay
+    // valid.
+    void clear();
+
+private:
+    struct Impl;
+    std::shared_ptr<Impl> impl;
+};
+
+} // namespace rasperi
+} // namespace kuu